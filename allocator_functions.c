@@ -0,0 +1,372 @@
+#include "allocator_functions.h"
+#include "metrics_functions.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static size_t round_up(size_t value, size_t multiple){
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- HEAP AND CURRENT ALLOCATOR -+-+-+-+-+-+-+-+-+-+-+- */
+
+static void* heap_allocate(Allocator* self, size_t bytes, size_t alignment, AllocatorSubsystem subsystem){
+    (void)self;
+    (void)subsystem;
+    if (alignment <= ALLOCATOR_DEFAULT_ALIGNMENT){
+        return malloc(bytes > 0 ? bytes : 1);
+    }
+    return aligned_alloc(alignment, round_up(bytes > 0 ? bytes : 1, alignment));
+}
+
+static void heap_release(Allocator* self, void* pointer, AllocatorSubsystem subsystem){
+    (void)self;
+    (void)subsystem;
+    free(pointer);
+}
+
+static Allocator heap_allocator = { "heap", heap_allocate, heap_release };
+static _Thread_local Allocator* current_allocator = NULL;
+
+/**
+ * @brief The default allocator (malloc / aligned_alloc / free), thread safe
+ */
+Allocator* allocator_heap(void){
+    return &heap_allocator;
+}
+
+/**
+ * @brief The allocator the library uses on the calling thread, the heap unless allocator_set_current was called
+ */
+Allocator* allocator_get_current(void){
+    return current_allocator != NULL ? current_allocator : &heap_allocator;
+}
+
+/**
+ * @brief Sets the allocator the library uses on the calling thread
+ * @param allocator The new allocator, NULL for the heap
+ * @return Allocator* The previous one, to restore it
+ */
+Allocator* allocator_set_current(Allocator* allocator){
+    Allocator* previous = allocator_get_current();
+    current_allocator = allocator;
+    return previous;
+}
+
+/**
+ * @brief Allocates through an allocator and counts the allocation in the global metrics
+ *
+ * @param allocator The allocator, NULL for the current one
+ * @param bytes Size of the allocation
+ * @param alignment Power of two, 0 for ALLOCATOR_DEFAULT_ALIGNMENT
+ * @param subsystem Who asks for the memory
+ * @return void* or NULL on failure
+ */
+void* allocator_allocate(Allocator* allocator, size_t bytes, size_t alignment, AllocatorSubsystem subsystem){
+    if (allocator == NULL){
+        allocator = allocator_get_current();
+    }
+    void* pointer = allocator->allocate(allocator, bytes, alignment == 0 ? ALLOCATOR_DEFAULT_ALIGNMENT : alignment, subsystem);
+    if (pointer == NULL){
+        fprintf(stderr, "Error in %s: allocator '%s' failed to allocate %zu bytes.\n", __func__, allocator->name, bytes);
+        return NULL;
+    }
+    metrics_count_allocation(bytes);
+    return pointer;
+}
+
+/**
+ * @brief Releases a pointer through the allocator that returned it (NULL for the current one), NULL pointers are ignored
+ */
+void allocator_release(Allocator* allocator, void* pointer, AllocatorSubsystem subsystem){
+    if (pointer == NULL){
+        return;
+    }
+    if (allocator == NULL){
+        allocator = allocator_get_current();
+    }
+    allocator->release(allocator, pointer, subsystem);
+    metrics_count_free();
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- ARENA -+-+-+-+-+-+-+-+-+-+-+- */
+
+#define ARENA_HEADER_SIZE round_up(sizeof(ArenaChunk), ALLOCATOR_CACHE_LINE)
+
+static ArenaChunk* arena_new_chunk(size_t capacity){
+    ArenaChunk* chunk = aligned_alloc(ALLOCATOR_CACHE_LINE, round_up(ARENA_HEADER_SIZE + capacity, ALLOCATOR_CACHE_LINE));
+    if (chunk == NULL){
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void* arena_allocate(Allocator* self, size_t bytes, size_t alignment, AllocatorSubsystem subsystem){
+    (void)subsystem;
+    ArenaAllocator* arena = (ArenaAllocator*)self;
+    ArenaChunk* chunk = arena->chunks;
+    // chunks are cache line aligned, so aligning the offset aligns the address (up to a cache line)
+    size_t offset = (chunk != NULL) ? round_up(chunk->used, alignment) : 0;
+    if (chunk == NULL || alignment > ALLOCATOR_CACHE_LINE || offset + bytes > chunk->capacity){
+        if (alignment > ALLOCATOR_CACHE_LINE){
+            return NULL;
+        }
+        // a request bigger than a chunk gets a chunk of its own
+        ArenaChunk* fresh = arena_new_chunk(bytes > arena->chunk_size ? bytes : arena->chunk_size);
+        if (fresh == NULL){
+            return NULL;
+        }
+        fresh->next = arena->chunks;
+        arena->chunks = fresh;
+        chunk = fresh;
+        offset = 0;
+    }
+    chunk->used = offset + bytes;
+    arena->bytes_allocated += bytes;
+    return (unsigned char*)chunk + ARENA_HEADER_SIZE + offset;
+}
+
+static void arena_release(Allocator* self, void* pointer, AllocatorSubsystem subsystem){
+    // memory is given back all at once by arena_reset / free_arena_allocator
+    (void)self;
+    (void)pointer;
+    (void)subsystem;
+}
+
+/**
+ * @brief Creates a bump arena
+ * @param chunk_size Bytes reserved at a time, 0 for ARENA_DEFAULT_CHUNK_SIZE
+ * @return ArenaAllocator* or NULL on allocation error, pass &arena->base where an Allocator* is expected
+ */
+ArenaAllocator* create_arena_allocator(size_t chunk_size){
+    ArenaAllocator* arena = calloc(1, sizeof(ArenaAllocator));
+    if (arena == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'arena' is NULL.\n", __func__);
+        return NULL;
+    }
+    arena->base.name = "arena";
+    arena->base.allocate = arena_allocate;
+    arena->base.release = arena_release;
+    arena->chunk_size = (chunk_size > 0) ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+    return arena;
+}
+
+/**
+ * @brief Drops every allocation of the arena at once. The most recent chunk is kept for reuse, the others are freed.
+ */
+void arena_reset(ArenaAllocator* arena){
+    if (arena == NULL || arena->chunks == NULL){
+        return;
+    }
+    ArenaChunk* chunk = arena->chunks->next;
+    while (chunk != NULL){
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks->next = NULL;
+    arena->chunks->used = 0;
+    arena->bytes_allocated = 0;
+}
+
+void free_arena_allocator(ArenaAllocator* arena){
+    if (arena == NULL){
+        return;
+    }
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk != NULL){
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- POOL -+-+-+-+-+-+-+-+-+-+-+- */
+
+static PoolSlab* pool_slab_of(PoolAllocator* pool, const void* pointer){
+    const unsigned char* address = pointer;
+    for (PoolSlab* slab = pool->slabs; slab != NULL; slab = slab->next){
+        if (address >= slab->blocks && address < slab->blocks + slab->number_of_blocks * pool->block_size){
+            return slab;
+        }
+    }
+    return NULL;
+}
+
+static void* pool_allocate(Allocator* self, size_t bytes, size_t alignment, AllocatorSubsystem subsystem){
+    PoolAllocator* pool = (PoolAllocator*)self;
+    if (bytes > pool->block_size || alignment > ALLOCATOR_CACHE_LINE){
+        return pool->fallback->allocate(pool->fallback, bytes, alignment, subsystem);
+    }
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_list == NULL){
+        PoolSlab* slab = malloc(sizeof(PoolSlab));
+        unsigned char* blocks = aligned_alloc(ALLOCATOR_CACHE_LINE, pool->blocks_per_slab * pool->block_size);
+        if (slab == NULL || blocks == NULL){
+            pthread_mutex_unlock(&pool->mutex);
+            free(slab);
+            free(blocks);
+            return NULL;
+        }
+        slab->blocks = blocks;
+        slab->number_of_blocks = pool->blocks_per_slab;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        // thread the new blocks in the free list
+        for (size_t b = 0; b < slab->number_of_blocks; b++){
+            void** block = (void**)(blocks + b * pool->block_size);
+            *block = pool->free_list;
+            pool->free_list = block;
+        }
+    }
+    void** block = pool->free_list;
+    pool->free_list = *block;
+    pool->live_blocks++;
+    pthread_mutex_unlock(&pool->mutex);
+    return block;
+}
+
+static void pool_release(Allocator* self, void* pointer, AllocatorSubsystem subsystem){
+    PoolAllocator* pool = (PoolAllocator*)self;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool_slab_of(pool, pointer) == NULL){
+        pthread_mutex_unlock(&pool->mutex);
+        pool->fallback->release(pool->fallback, pointer, subsystem);
+        return;
+    }
+    *(void**)pointer = pool->free_list;
+    pool->free_list = pointer;
+    pool->live_blocks--;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Creates a pool of fixed size blocks, the slabs are allocated on demand and kept until free_pool_allocator
+ *
+ * @param block_size Size of a block (rounded up to a cache line)
+ * @param blocks_per_slab Blocks allocated at a time, 0 for 64
+ * @param fallback Allocator for the requests that don't fit a block, NULL for the heap
+ * @return PoolAllocator* or NULL on error, pass &pool->base where an Allocator* is expected
+ */
+PoolAllocator* create_pool_allocator(size_t block_size, size_t blocks_per_slab, Allocator* fallback){
+    if (block_size == 0){
+        fprintf(stderr, "Error in %s: 'block_size' is 0.\n", __func__);
+        return NULL;
+    }
+    PoolAllocator* pool = calloc(1, sizeof(PoolAllocator));
+    if (pool == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'pool' is NULL.\n", __func__);
+        return NULL;
+    }
+    pool->base.name = "pool";
+    pool->base.allocate = pool_allocate;
+    pool->base.release = pool_release;
+    pool->fallback = (fallback != NULL) ? fallback : &heap_allocator;
+    pool->block_size = round_up(block_size < sizeof(void*) ? sizeof(void*) : block_size, ALLOCATOR_CACHE_LINE);
+    pool->blocks_per_slab = (blocks_per_slab > 0) ? blocks_per_slab : 64;
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+/**
+ * @brief Frees every slab, the blocks still in use become invalid
+ */
+void free_pool_allocator(PoolAllocator* pool){
+    if (pool == NULL){
+        return;
+    }
+    PoolSlab* slab = pool->slabs;
+    while (slab != NULL){
+        PoolSlab* next = slab->next;
+        free(slab->blocks);
+        free(slab);
+        slab = next;
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- TRACKING -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Stored right before every tracked allocation
+ */
+typedef struct TrackingHeader{
+    size_t bytes;
+    size_t offset;      // from the start of the parent allocation to the returned pointer
+} TrackingHeader;
+
+static void* tracking_allocate(Allocator* self, size_t bytes, size_t alignment, AllocatorSubsystem subsystem){
+    TrackingAllocator* tracking = (TrackingAllocator*)self;
+    const size_t offset = round_up(sizeof(TrackingHeader), alignment);
+    unsigned char* base = tracking->parent->allocate(tracking->parent, offset + bytes, alignment, subsystem);
+    if (base == NULL){
+        return NULL;
+    }
+    TrackingHeader* header = (TrackingHeader*)(base + offset) - 1;
+    header->bytes = bytes;
+    header->offset = offset;
+
+    AllocatorSubsystemStats* stats = &tracking->subsystems[subsystem];
+    atomic_fetch_add_explicit(&stats->allocations, 1, memory_order_relaxed);
+    const size_t live = atomic_fetch_add_explicit(&stats->live_bytes, bytes, memory_order_relaxed) + bytes;
+    size_t peak = atomic_load_explicit(&stats->peak_bytes, memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&stats->peak_bytes, &peak, live, memory_order_relaxed, memory_order_relaxed)){
+    }
+    return base + offset;
+}
+
+static void tracking_release(Allocator* self, void* pointer, AllocatorSubsystem subsystem){
+    TrackingAllocator* tracking = (TrackingAllocator*)self;
+    TrackingHeader* header = (TrackingHeader*)pointer - 1;
+    AllocatorSubsystemStats* stats = &tracking->subsystems[subsystem];
+    atomic_fetch_sub_explicit(&stats->live_bytes, header->bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->releases, 1, memory_order_relaxed);
+    tracking->parent->release(tracking->parent, (unsigned char*)pointer - header->offset, subsystem);
+}
+
+/**
+ * @brief Creates an allocator that forwards to parent and keeps per subsystem statistics
+ * @param parent The allocator doing the work, NULL for the heap
+ * @return TrackingAllocator* or NULL on error, pass &tracking->base where an Allocator* is expected
+ */
+TrackingAllocator* create_tracking_allocator(Allocator* parent){
+    TrackingAllocator* tracking = calloc(1, sizeof(TrackingAllocator));
+    if (tracking == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'tracking' is NULL.\n", __func__);
+        return NULL;
+    }
+    tracking->base.name = "tracking";
+    tracking->base.allocate = tracking_allocate;
+    tracking->base.release = tracking_release;
+    tracking->parent = (parent != NULL) ? parent : &heap_allocator;
+    return tracking;
+}
+
+void free_tracking_allocator(TrackingAllocator* tracking){
+    free(tracking);
+}
+
+const char* allocator_subsystem_name(AllocatorSubsystem subsystem){
+    static const char* names[ALLOCATOR_SUBSYSTEM_COUNT] = { "matrix", "layer", "model", "prompt", "output", "other" };
+    return (subsystem < ALLOCATOR_SUBSYSTEM_COUNT) ? names[subsystem] : "unknown";
+}
+
+/**
+ * @brief Prints live bytes, peak bytes, allocations and releases of every subsystem
+ */
+void tracking_allocator_report(TrackingAllocator* tracking, FILE* stream){
+    if (tracking == NULL || stream == NULL){
+        return;
+    }
+    fprintf(stream, "%-8s %12s %12s %12s %12s\n", "subsystem", "live_bytes", "peak_bytes", "allocations", "releases");
+    for (int s = 0; s < ALLOCATOR_SUBSYSTEM_COUNT; s++){
+        AllocatorSubsystemStats* stats = &tracking->subsystems[s];
+        fprintf(stream, "%-8s %12zu %12zu %12zu %12zu\n", allocator_subsystem_name((AllocatorSubsystem)s),
+            atomic_load(&stats->live_bytes), atomic_load(&stats->peak_bytes), atomic_load(&stats->allocations), atomic_load(&stats->releases));
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef ALLOCATOR_FUNCTIONS_H
+#define ALLOCATOR_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * @brief Pluggable allocators for the library.
+ * Matrices, layers, models, prompts and outputs are allocated through the calling thread's current allocator (allocator_set_current),
+ * which defaults to the heap (malloc / aligned_alloc). A Model, a Prompt and an Output remember the allocator they were created with
+ * and are released through it, whatever the current allocator is at that time.
+ * Shipped implementations:
+ *  - ArenaAllocator: bump allocation in big chunks, release is a no-op and arena_reset / free_arena_allocator drops everything at once
+ *    (build a whole model, or every buffer of a request, in one arena). Not thread safe: one arena per thread or per request.
+ *  - PoolAllocator: fixed size blocks carved from slabs with a free list, for the per-request buffers of a server, no fragmentation.
+ *  - TrackingAllocator: wraps another allocator and keeps live, peak and count statistics per subsystem.
+ * allocator_allocate / allocator_release also feed the global allocation counters of metrics_functions.h.
+ */
+
+#define ALLOCATOR_DEFAULT_ALIGNMENT 16
+#define ALLOCATOR_CACHE_LINE 64
+#define ARENA_DEFAULT_CHUNK_SIZE (1u << 20)
+
+/**
+ * @brief Who asked for the memory, used by the tracking allocator
+ */
+typedef enum AllocatorSubsystem{
+    ALLOCATOR_SUBSYSTEM_MATRIX = 0,     // weight matrices
+    ALLOCATOR_SUBSYSTEM_LAYER,          // layer vectors (biases, deltas, outputs)
+    ALLOCATOR_SUBSYSTEM_MODEL,          // model descriptors and names
+    ALLOCATOR_SUBSYSTEM_PROMPT,         // prompt tokens
+    ALLOCATOR_SUBSYSTEM_OUTPUT,         // per request forward pass buffers
+    ALLOCATOR_SUBSYSTEM_OTHER,
+    ALLOCATOR_SUBSYSTEM_COUNT
+} AllocatorSubsystem;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT ALLOCATOR -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief The allocator interface, implementations embed it as their first member
+ *
+ * @param name(const char*): Name used in reports
+ * @param allocate(function): Returns bytes bytes aligned to alignment (a power of two), NULL on failure
+ * @param release(function): Gives back a pointer returned by allocate of the same allocator, NULL is ignored
+ */
+typedef struct Allocator{
+    const char* name;
+    void* (*allocate)(struct Allocator* self, size_t bytes, size_t alignment, AllocatorSubsystem subsystem);
+    void (*release)(struct Allocator* self, void* pointer, AllocatorSubsystem subsystem);
+} Allocator;
+
+/**
+ * @brief Chunk of an arena, the allocations follow the header (padded to a cache line)
+ */
+typedef struct ArenaChunk{
+    struct ArenaChunk* next;
+    size_t capacity;
+    size_t used;
+} ArenaChunk;
+
+typedef struct ArenaAllocator{
+    Allocator base;
+    size_t chunk_size;
+    ArenaChunk* chunks;         // the first one is the chunk currently bumped
+    size_t bytes_allocated;     // sum of the requested sizes since the last reset
+} ArenaAllocator;
+
+typedef struct PoolSlab{
+    struct PoolSlab* next;
+    unsigned char* blocks;
+    size_t number_of_blocks;
+} PoolSlab;
+
+/**
+ * @brief Fixed size block pool, requests bigger than block_size (or more aligned than a cache line) go to the fallback allocator
+ */
+typedef struct PoolAllocator{
+    Allocator base;
+    Allocator* fallback;
+    size_t block_size;          // rounded up to a cache line, every block is cache line aligned
+    size_t blocks_per_slab;
+    PoolSlab* slabs;
+    void* free_list;            // the first bytes of a free block point to the next free block
+    size_t live_blocks;
+    pthread_mutex_t mutex;
+} PoolAllocator;
+
+typedef struct AllocatorSubsystemStats{
+    _Atomic size_t live_bytes;
+    _Atomic size_t peak_bytes;
+    _Atomic size_t allocations;
+    _Atomic size_t releases;
+} AllocatorSubsystemStats;
+
+typedef struct TrackingAllocator{
+    Allocator base;
+    Allocator* parent;
+    AllocatorSubsystemStats subsystems[ALLOCATOR_SUBSYSTEM_COUNT];
+} TrackingAllocator;
+
+//                                          FUNCTION PROTOTYPES
+Allocator* allocator_heap(void);
+Allocator* allocator_get_current(void);
+Allocator* allocator_set_current(Allocator* allocator);
+void* allocator_allocate(Allocator* allocator, size_t bytes, size_t alignment, AllocatorSubsystem subsystem);
+void allocator_release(Allocator* allocator, void* pointer, AllocatorSubsystem subsystem);
+
+ArenaAllocator* create_arena_allocator(size_t chunk_size);
+void arena_reset(ArenaAllocator* arena);
+void free_arena_allocator(ArenaAllocator* arena);
+
+PoolAllocator* create_pool_allocator(size_t block_size, size_t blocks_per_slab, Allocator* fallback);
+void free_pool_allocator(PoolAllocator* pool);
+
+TrackingAllocator* create_tracking_allocator(Allocator* parent);
+void free_tracking_allocator(TrackingAllocator* tracking);
+void tracking_allocator_report(TrackingAllocator* tracking, FILE* stream);
+const char* allocator_subsystem_name(AllocatorSubsystem subsystem);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT ALLOCATOR -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // ALLOCATOR_FUNCTIONS_H
@@ -0,0 +1,393 @@
+#include "settings.h"
+#include "async_functions.h"
+#include "allocator_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/* -+-+-+-+-+-+-+-+-+-+-+- REQUESTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+static void drop_engine_reference(AsyncEngine* engine){
+    if (atomic_fetch_sub(&engine->references, 1) == 1){
+        pthread_cond_destroy(&engine->completed);
+        pthread_cond_destroy(&engine->work_available);
+        pthread_mutex_destroy(&engine->mutex);
+        free(engine->threads);
+        free(engine);
+    }
+}
+
+static void free_request(AsyncRequest* request){
+    AsyncEngine* engine = request->engine;
+    free_prompt(&request->prompt);
+    if (request->output.is_valid == 1){
+        free_output(&request->output);
+    }
+    free(request);
+    drop_engine_reference(engine);
+}
+
+/**
+ * @brief Drops one of the two references of a request, under the engine's mutex so run_batch sees a consistent count
+ */
+static void drop_reference(AsyncRequest* request){
+    AsyncEngine* engine = request->engine;
+    pthread_mutex_lock(&engine->mutex);
+    const int last = (atomic_fetch_sub(&request->references, 1) == 1);
+    pthread_mutex_unlock(&engine->mutex);
+    if (last){
+        free_request(request);
+    }
+}
+
+/**
+ * @brief Current state of a request, without blocking
+ */
+AsyncState async_poll(const AsyncRequest* request){
+    if (request == NULL){
+        return ASYNC_FAILED;
+    }
+    return (AsyncState)atomic_load_explicit(&request->state, memory_order_acquire);
+}
+
+/**
+ * @brief Blocks until the request completed and its callback, if any, returned
+ * @return Output* The output of the request (is_valid != 1 if it failed), owned by the request until async_release, NULL if request is NULL
+ */
+Output* async_wait(AsyncRequest* request){
+    if (request == NULL){
+        fprintf(stderr, "Error in %s: 'request' is NULL.\n", __func__);
+        return NULL;
+    }
+    if (!atomic_load_explicit(&request->notified, memory_order_acquire)){
+        AsyncEngine* engine = request->engine;
+        pthread_mutex_lock(&engine->mutex);
+        while (!atomic_load_explicit(&request->notified, memory_order_acquire)){
+            pthread_cond_wait(&engine->completed, &engine->mutex);
+        }
+        pthread_mutex_unlock(&engine->mutex);
+    }
+    return &request->output;
+}
+
+/**
+ * @brief Moves the output out of a completed request, the caller frees it with free_output
+ * @return Output, empty if the request is not done
+ */
+Output async_take_output(AsyncRequest* request){
+    if (async_poll(request) != ASYNC_DONE){
+        fprintf(stderr, "Error in %s: the request is not done.\n", __func__);
+        return empty_output();
+    }
+    Output output = request->output;
+    request->output = empty_output();
+    return output;
+}
+
+/**
+ * @brief Gives back the caller's handle. The request may still run: it is freed once the engine is done with it too.
+ */
+void async_release(AsyncRequest* request){
+    if (request == NULL){
+        return;
+    }
+    AsyncEngine* engine = request->engine;
+    pthread_mutex_lock(&engine->mutex);
+    if (request->queued_for_polling){
+        // still in the completion queue: unlink it so async_next_completed never returns it
+        AsyncRequest** link = &engine->completed_head;
+        AsyncRequest* previous = NULL;
+        while (*link != request){
+            previous = *link;
+            link = &(*link)->next;
+        }
+        *link = request->next;
+        if (engine->completed_tail == request){
+            engine->completed_tail = previous;
+        }
+        request->queued_for_polling = 0;
+    }
+    const int last = (atomic_fetch_sub(&request->references, 1) == 1);
+    pthread_mutex_unlock(&engine->mutex);
+    if (last){
+        free_request(request);
+    }
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END REQUESTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* -+-+-+-+-+-+-+-+-+-+-+- ENGINE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Runs a batch taken from the queue and reports the completions
+ */
+static void run_batch(AsyncEngine* engine, AsyncRequest** batch, size_t size){
+    Prompt* prompts = malloc(size * sizeof(Prompt));
+    Output* outputs = NULL;
+    if (prompts != NULL){
+        for (size_t b = 0; b < size; b++){
+            prompts[b] = batch[b]->prompt;
+        }
+        outputs = calculate_output_batch(prompts, size, engine->model);
+    } else {
+        fprintf(stderr, "Error in %s: memory allocation error. 'prompts' is NULL.\n", __func__);
+    }
+    if (outputs != NULL){
+        for (size_t b = 0; b < size; b++){
+            batch[b]->output = outputs[b];
+            atomic_store_explicit(&batch[b]->state, ASYNC_DONE, memory_order_release);
+        }
+        // the outputs now belong to their requests, only the array goes back (it comes from this thread's current allocator)
+        allocator_release(NULL, outputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    } else {
+        // the batch failed as a whole: run the requests one by one so only the failing ones fail
+        for (size_t b = 0; b < size; b++){
+            batch[b]->output = calculate_output(&batch[b]->prompt, engine->model);
+            atomic_store_explicit(&batch[b]->state, (batch[b]->output.is_valid == 1) ? ASYNC_DONE : ASYNC_FAILED,
+                memory_order_release);
+        }
+    }
+    free(prompts);
+
+    // the callbacks run before the waiters are woken, so async_wait returns only once the callback is done
+    for (size_t b = 0; b < size; b++){
+        if (batch[b]->callback != NULL){
+            batch[b]->callback(batch[b], batch[b]->user_data);
+        }
+    }
+
+    uint64_t queued = 0;
+    pthread_mutex_lock(&engine->mutex);
+    engine->batches++;
+    engine->requests += size;
+    for (size_t b = 0; b < size; b++){
+        AsyncRequest* request = batch[b];
+        atomic_store_explicit(&request->notified, 1, memory_order_release);
+        if (request->callback == NULL && atomic_load(&request->references) > 1){
+            request->next = NULL;
+            if (engine->completed_tail != NULL){
+                engine->completed_tail->next = request;
+            } else {
+                engine->completed_head = request;
+            }
+            engine->completed_tail = request;
+            request->queued_for_polling = 1;
+            queued++;
+        }
+    }
+    pthread_cond_broadcast(&engine->completed);
+    pthread_mutex_unlock(&engine->mutex);
+#ifdef __linux__
+    if (queued > 0 && engine->event_fd >= 0 && write(engine->event_fd, &queued, sizeof(queued)) != sizeof(queued)){
+        fprintf(stderr, "Error in %s: could not signal the eventfd.\n", __func__);
+    }
+#else
+    (void)queued;
+#endif
+
+    for (size_t b = 0; b < size; b++){
+        drop_reference(batch[b]);
+    }
+}
+
+static void* compute_thread(void* argument){
+    AsyncEngine* engine = argument;
+    AsyncRequest** batch = malloc(engine->max_batch * sizeof(AsyncRequest*));
+    if (batch == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'batch' is NULL.\n", __func__);
+        return NULL;
+    }
+    pthread_mutex_lock(&engine->mutex);
+    for (;;){
+        while (engine->pending_head == NULL && !engine->stopping){
+            pthread_cond_wait(&engine->work_available, &engine->mutex);
+        }
+        if (engine->pending_head == NULL){
+            break;      // stopping and nothing left
+        }
+        // everything queued, up to max_batch, goes into one batch
+        size_t size = 0;
+        while (engine->pending_head != NULL && size < engine->max_batch){
+            AsyncRequest* request = engine->pending_head;
+            engine->pending_head = request->next;
+            atomic_store(&request->state, ASYNC_RUNNING);
+            batch[size++] = request;
+        }
+        if (engine->pending_head == NULL){
+            engine->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&engine->mutex);
+        TRACE_DEBUG(TRACE_CATEGORY_INFERENCE, "async batch of %zu requests", size);
+        run_batch(engine, batch, size);
+        pthread_mutex_lock(&engine->mutex);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    free(batch);
+    return NULL;
+}
+
+/**
+ * @brief Starts the compute threads of an asynchronous engine
+ *
+ * @param model The model served, its weights must not change while the engine runs
+ * @param number_of_threads Number of compute threads, at least 1
+ * @param max_batch Most requests computed together, 0 for ASYNC_DEFAULT_MAX_BATCH
+ * @return AsyncEngine* or NULL on error
+ */
+AsyncEngine* create_async_engine(Model* model, size_t number_of_threads, size_t max_batch){
+    if (model == NULL || number_of_threads == 0){
+        fprintf(stderr, "Error in %s: NULL model or no compute thread.\n", __func__);
+        return NULL;
+    }
+    AsyncEngine* engine = calloc(1, sizeof(AsyncEngine));
+    if (engine == NULL || (engine->threads = calloc(number_of_threads, sizeof(pthread_t))) == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error.\n", __func__);
+        free(engine);
+        return NULL;
+    }
+    engine->model = model;
+    atomic_init(&engine->references, 1);
+    engine->max_batch = (max_batch == 0) ? ASYNC_DEFAULT_MAX_BATCH : max_batch;
+    pthread_mutex_init(&engine->mutex, NULL);
+    pthread_cond_init(&engine->work_available, NULL);
+    pthread_cond_init(&engine->completed, NULL);
+#ifdef __linux__
+    engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (engine->event_fd < 0){
+        TRACE_WARNING(TRACE_CATEGORY_INFERENCE, "eventfd not available, only callbacks and async_wait can report completions");
+    }
+#else
+    engine->event_fd = -1;
+#endif
+    for (size_t i = 0; i < number_of_threads; i++){
+        if (pthread_create(&engine->threads[i], NULL, compute_thread, engine) != 0){
+            fprintf(stderr, "Error in %s: pthread_create failed for compute thread %zu.\n", __func__, i);
+            break;
+        }
+        engine->number_of_threads = i + 1;
+    }
+    if (engine->number_of_threads == 0){
+        free_async_engine(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+/**
+ * @brief Queues a copy of the prompt and returns immediately
+ *
+ * @param engine The engine
+ * @param prompt The input, copied (the caller can reuse it at once)
+ * @param callback Called on a compute thread when the request completes, NULL to be notified through the eventfd or async_wait
+ * @param user_data Given to the callback
+ * @return AsyncRequest* The handle (release it with async_release), NULL on error
+ */
+AsyncRequest* async_submit(AsyncEngine* engine, Prompt* prompt, async_callback callback, void* user_data){
+    if (engine == NULL || prompt == NULL || prompt->data == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return NULL;
+    }
+    // checked here, a prompt of the wrong length would fail the whole batch it is computed with
+    if (prompt->length != engine->model->model_layers[0].number_of_nodes_in_the_layer){
+        fprintf(stderr, "Error in %s: prompt of %zu values, model '%s' takes %zu.\n", __func__, prompt->length,
+            engine->model->model_name, engine->model->model_layers[0].number_of_nodes_in_the_layer);
+        return NULL;
+    }
+    AsyncRequest* request = calloc(1, sizeof(AsyncRequest));
+    if (request == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'request' is NULL.\n", __func__);
+        return NULL;
+    }
+    request->prompt = create_prompt(prompt->length, prompt->data);
+    if (request->prompt.data == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error for the prompt copy.\n", __func__);
+        free(request);
+        return NULL;
+    }
+    request->engine = engine;
+    request->output = empty_output();
+    request->callback = callback;
+    request->user_data = user_data;
+    atomic_init(&request->state, ASYNC_PENDING);
+    atomic_init(&request->notified, 0);
+    atomic_init(&request->references, 2);   // the caller's handle and the engine
+    atomic_fetch_add(&engine->references, 1);
+
+    pthread_mutex_lock(&engine->mutex);
+    if (engine->stopping){
+        pthread_mutex_unlock(&engine->mutex);
+        fprintf(stderr, "Error in %s: the engine is stopping.\n", __func__);
+        free_request(request);
+        return NULL;
+    }
+    if (engine->pending_tail != NULL){
+        engine->pending_tail->next = request;
+    } else {
+        engine->pending_head = request;
+    }
+    engine->pending_tail = request;
+    pthread_cond_signal(&engine->work_available);
+    pthread_mutex_unlock(&engine->mutex);
+    return request;
+}
+
+/**
+ * @brief The eventfd of the engine: readable when completions were queued for async_next_completed (read it to reset it)
+ * @return int The file descriptor, -1 if not available
+ */
+int async_event_fd(const AsyncEngine* engine){
+    return (engine != NULL) ? engine->event_fd : -1;
+}
+
+/**
+ * @brief Takes the oldest completed request submitted without a callback, without blocking
+ * @return AsyncRequest* The caller's handle (still to be released with async_release), NULL if none completed
+ */
+AsyncRequest* async_next_completed(AsyncEngine* engine){
+    if (engine == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&engine->mutex);
+    AsyncRequest* request = engine->completed_head;
+    if (request != NULL){
+        engine->completed_head = request->next;
+        if (engine->completed_head == NULL){
+            engine->completed_tail = NULL;
+        }
+        request->queued_for_polling = 0;
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return request;
+}
+
+/**
+ * @brief Completes the requests still queued and stops the compute threads.
+ * The handles not released yet stay valid, the engine's memory goes with the last of them.
+ */
+void free_async_engine(AsyncEngine* engine){
+    if (engine == NULL){
+        return;
+    }
+    pthread_mutex_lock(&engine->mutex);
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->work_available);
+    pthread_mutex_unlock(&engine->mutex);
+    for (size_t i = 0; i < engine->number_of_threads; i++){
+        pthread_join(engine->threads[i], NULL);
+    }
+#ifdef __linux__
+    if (engine->event_fd >= 0){
+        close(engine->event_fd);
+        engine->event_fd = -1;
+    }
+#endif
+    drop_engine_reference(engine);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END ENGINE -+-+-+-+-+-+-+-+-+-+-+- */
@@ -0,0 +1,101 @@
+#ifndef ASYNC_FUNCTIONS_H
+#define ASYNC_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdatomic.h>
+#include <pthread.h>
+#include "node_functions.h"
+
+/**
+ * @brief Asynchronous inference.
+ * async_submit copies the prompt, queues it and returns a handle at once. Compute threads take the queued requests in batches of up to
+ * max_batch and run them through calculate_output_batch. Completion is reported in one of three ways:
+ *  - callback: given to async_submit, called on the compute thread right after the request completes;
+ *  - eventfd: requests submitted without a callback go to the completion queue and the engine's eventfd (async_event_fd) becomes
+ *    readable, an epoll loop reads it and drains the queue with async_next_completed;
+ *  - wait: async_wait blocks until the request completes, and until its callback returned if it has one.
+ * Every handle returned by async_submit is released exactly once with async_release, whatever the notification used,
+ * before or after free_async_engine.
+ */
+
+#define ASYNC_DEFAULT_MAX_BATCH 32
+
+typedef enum AsyncState{
+    ASYNC_PENDING = 0,      // queued
+    ASYNC_RUNNING,          // taken by a compute thread
+    ASYNC_DONE,             // output is valid
+    ASYNC_FAILED,           // the forward pass failed, output is empty
+} AsyncState;
+
+struct AsyncRequest;
+typedef void (*async_callback)(struct AsyncRequest* request, void* user_data);
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT ASYNC ENGINE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A submitted request, the handle of the caller
+ *
+ * @param prompt(Prompt): Copy of the submitted prompt
+ * @param output(Output): The result once state is ASYNC_DONE (see async_wait, async_take_output)
+ * @param state(AsyncState): Current state, readable without locking
+ * @param notified(int): != 0 once the callback returned or the request was queued for polling, what async_wait waits for
+ * @param references(int): The caller's and the engine's, the request is freed when both are dropped
+ * @param queued_for_polling(int): != 0 while the request is in the completion queue
+ */
+typedef struct AsyncRequest{
+    struct AsyncEngine* engine;
+    Prompt prompt;
+    Output output;
+    _Atomic int state;
+    _Atomic int notified;
+    async_callback callback;
+    void* user_data;
+    _Atomic int references;
+    int queued_for_polling;         // guarded by the engine's mutex
+    struct AsyncRequest* next;      // in the submission queue, then in the completion queue
+} AsyncRequest;
+
+/**
+ * @brief The engine
+ *
+ * @param model(Model*): The model served
+ * @param threads(pthread_t*): The compute threads
+ * @param max_batch(size_t): Most requests given to one calculate_output_batch call
+ * @param event_fd(int): eventfd counting the completions put in the completion queue, -1 if eventfd is not available
+ * @param batches, requests(size_t): Number of calculate_output_batch calls and of requests computed
+ * @param references(int): free_async_engine's and one per request not freed yet, the memory goes with the last one
+ */
+typedef struct AsyncEngine{
+    Model* model;
+    pthread_t* threads;
+    size_t number_of_threads;
+    size_t max_batch;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    pthread_cond_t completed;
+    AsyncRequest* pending_head;
+    AsyncRequest* pending_tail;
+    AsyncRequest* completed_head;
+    AsyncRequest* completed_tail;
+    int stopping;
+    int event_fd;
+    size_t batches;
+    size_t requests;
+    _Atomic int references;
+} AsyncEngine;
+
+//                                          FUNCTION PROTOTYPES
+AsyncEngine* create_async_engine(Model* model, size_t number_of_threads, size_t max_batch);
+AsyncRequest* async_submit(AsyncEngine* engine, Prompt* prompt, async_callback callback, void* user_data);
+AsyncState async_poll(const AsyncRequest* request);
+Output* async_wait(AsyncRequest* request);
+Output async_take_output(AsyncRequest* request);
+void async_release(AsyncRequest* request);
+int async_event_fd(const AsyncEngine* engine);
+AsyncRequest* async_next_completed(AsyncEngine* engine);
+void free_async_engine(AsyncEngine* engine);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT ASYNC ENGINE -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // ASYNC_FUNCTIONS_H
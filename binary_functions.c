@@ -0,0 +1,339 @@
+#include "settings.h"
+#include "binary_functions.h"
+#include "kernel_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BINARY_HAVE_AVX512_POPCOUNT 1
+#else
+#define BINARY_HAVE_AVX512_POPCOUNT 0
+#endif
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- POPCOUNT KERNELS -+-+-+-+-+-+-+-+-+-+-+- */
+
+typedef uint64_t (*and_popcount_function)(const uint64_t* a, const uint64_t* b, size_t words);
+
+static uint64_t and_popcount_portable(const uint64_t* a, const uint64_t* b, size_t words){
+    uint64_t count = 0;
+    for (size_t w = 0; w < words; w++){
+        count += (uint64_t)__builtin_popcountll(a[w] & b[w]);
+    }
+    return count;
+}
+
+#if BINARY_HAVE_AVX512_POPCOUNT
+/**
+ * @brief 8 words per VPOPCNTDQ, the tail with a masked load. Compiled for AVX-512 whatever the flags of the build, only called
+ * once the CPU was checked to have it
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t and_popcount_avx512(const uint64_t* a, const uint64_t* b, size_t words){
+    __m512i counts = _mm512_setzero_si512();
+    size_t w = 0;
+    for (; w + 8 <= words; w += 8){
+        const __m512i bits = _mm512_and_si512(_mm512_loadu_si512((const void*)(a + w)), _mm512_loadu_si512((const void*)(b + w)));
+        counts = _mm512_add_epi64(counts, _mm512_popcnt_epi64(bits));
+    }
+    if (w < words){
+        const __mmask8 tail = (__mmask8)((1u << (words - w)) - 1);
+        const __m512i bits = _mm512_and_si512(_mm512_maskz_loadu_epi64(tail, a + w), _mm512_maskz_loadu_epi64(tail, b + w));
+        counts = _mm512_add_epi64(counts, _mm512_popcnt_epi64(bits));
+    }
+    return (uint64_t)_mm512_reduce_add_epi64(counts);
+}
+#endif
+
+static and_popcount_function and_popcount = and_popcount_portable;
+static pthread_once_t popcount_once = PTHREAD_ONCE_INIT;
+
+static void select_popcount(void){
+    #if BINARY_HAVE_AVX512_POPCOUNT
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")){
+        and_popcount = and_popcount_avx512;
+    }
+    #endif
+}
+
+/**
+ * @brief != 0 if the popcounts run with AVX-512 VPOPCNTDQ on this CPU
+ */
+int binary_uses_avx512_popcount(void){
+    pthread_once(&popcount_once, select_popcount);
+    #if BINARY_HAVE_AVX512_POPCOUNT
+    return and_popcount == and_popcount_avx512;
+    #else
+    return 0;
+    #endif
+}
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END POPCOUNT KERNELS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Converts a model to bits, see binary_functions.h. The model is only read, it can be freed afterwards
+ *
+ * @param model(const Model*): Every layer but the last one must use the threshold activation
+ * @return BinaryModel* The converted model (free it with free_binary_model), NULL if the model is not supported or out of memory
+ */
+BinaryModel* binarize_model(const Model* model){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0
+        || (model->number_of_layers_in_the_model > 1 && model->model_weights == NULL)){
+        fprintf(stderr, "Error in %s: NULL model, layers or weights.\n", __func__);
+        return NULL;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    for (size_t i = 0; i + 1 < number_of_layers; i++){
+        if (model->model_layers[i].activation_kind != ACTIVATION_THRESHOLD){
+            fprintf(stderr, "Error in %s: layer %zu of model '%s' does not use the threshold activation, its outputs are not binary.\n",
+                    __func__, i, model->model_name);
+            return NULL;
+        }
+    }
+    pthread_once(&popcount_once, select_popcount);
+
+    BinaryModel* binary = calloc(1, sizeof(BinaryModel) + number_of_layers * sizeof(BinaryLayer));
+    if (binary == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return NULL;
+    }
+    binary->number_of_layers = number_of_layers;
+    binary->input_length = model->model_layers[0].number_of_nodes_in_the_layer;
+    binary->output_length = model->model_layers[number_of_layers - 1].number_of_nodes_in_the_layer;
+    binary->binary_output = model->model_layers[number_of_layers - 1].activation_kind == ACTIVATION_THRESHOLD;
+
+    const size_t input_words = BINARY_WORDS(binary->input_length);
+    binary->max_words = input_words;
+    binary->input_biases = malloc(binary->input_length * sizeof(double));
+    binary->input_keep = calloc(input_words, sizeof(uint64_t));
+    binary->input_force = calloc(input_words, sizeof(uint64_t));
+    if (binary->input_biases == NULL || binary->input_keep == NULL || binary->input_force == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        free_binary_model(binary);
+        return NULL;
+    }
+    for (size_t r = 0; r < binary->input_length; r++){
+        const double bias = model->model_layers[0].biases[r];
+        binary->input_biases[r] = bias;
+        if (1.0 + bias > 0.5){
+            binary->input_keep[r / BINARY_WORD_BITS] |= (uint64_t)1 << (r % BINARY_WORD_BITS);
+        }
+        if (bias > 0.5){
+            binary->input_force[r / BINARY_WORD_BITS] |= (uint64_t)1 << (r % BINARY_WORD_BITS);
+        }
+    }
+
+    for (size_t i = 1; i < number_of_layers; i++){
+        const Layer* source = &model->model_layers[i];
+        BinaryLayer* layer = &binary->layers[i];
+        double** weights = model->model_weights[i-1];
+        layer->number_of_inputs = model->model_layers[i-1].number_of_nodes_in_the_layer;
+        layer->number_of_nodes = source->number_of_nodes_in_the_layer;
+        layer->input_words = BINARY_WORDS(layer->number_of_inputs);
+        layer->activation_kind = source->activation_kind;
+        layer->activation = source->activation;
+        layer->positive_weights = calloc(layer->number_of_nodes * layer->input_words, sizeof(uint64_t));
+        layer->scales = malloc(layer->number_of_nodes * sizeof(double));
+        layer->biases = malloc(layer->number_of_nodes * sizeof(double));
+        if (weights == NULL || layer->positive_weights == NULL || layer->scales == NULL || layer->biases == NULL){
+            fprintf(stderr, "Error in %s: NULL weight matrix %zu or out of memory.\n", __func__, i - 1);
+            free_binary_model(binary);
+            return NULL;
+        }
+        memcpy(layer->biases, source->biases, layer->number_of_nodes * sizeof(double));
+        for (size_t j = 0; j < layer->number_of_nodes; j++){
+            uint64_t* row = layer->positive_weights + j * layer->input_words;
+            double magnitude = 0.0;
+            for (size_t r = 0; r < layer->number_of_inputs; r++){
+                magnitude += fabs(weights[r][j]);
+                if (weights[r][j] >= 0){
+                    row[r / BINARY_WORD_BITS] |= (uint64_t)1 << (r % BINARY_WORD_BITS);
+                }
+            }
+            const double scale = magnitude / (double)layer->number_of_inputs;
+            layer->scales[j] = scale;
+            for (size_t r = 0; r < layer->number_of_inputs; r++){
+                const double error = fabs(weights[r][j] - (weights[r][j] >= 0 ? scale : -scale));
+                if (error > binary->max_weight_error){
+                    binary->max_weight_error = error;
+                }
+            }
+        }
+        binary->packed_bytes += layer->number_of_nodes * layer->input_words * sizeof(uint64_t);
+        if (BINARY_WORDS(layer->number_of_nodes) > binary->max_words){
+            binary->max_words = BINARY_WORDS(layer->number_of_nodes);
+        }
+    }
+    TRACE_DEBUG(TRACE_CATEGORY_MODEL, "binarized model '%s': %zu bytes of packed weights, max weight error %lf",
+                model->model_name, binary->packed_bytes, binary->max_weight_error);
+    return binary;
+}
+
+/**
+ * @brief Packs 0/1 values into bits (bit r of words is set when values[r] > 0.5), the unused bits of the last word are 0
+ */
+void binary_pack(const double* values, size_t length, uint64_t* words){
+    memset(words, 0, BINARY_WORDS(length) * sizeof(uint64_t));
+    for (size_t r = 0; r < length; r++){
+        words[r / BINARY_WORD_BITS] |= (uint64_t)(values[r] > 0.5) << (r % BINARY_WORD_BITS);
+    }
+}
+
+/**
+ * @brief Runs the layers after the input one on the packed outputs of the input layer (in current, clobbered).
+ * The last layer goes to output_bits if not NULL, else to output_values (through its activation)
+ */
+static void binary_forward(const BinaryModel* binary, uint64_t* current, uint64_t* next, double* output_values, uint64_t* output_bits){
+    for (size_t i = 1; i < binary->number_of_layers; i++){
+        const BinaryLayer* layer = &binary->layers[i];
+        const int last = (i + 1 == binary->number_of_layers);
+        const double ones = (double)and_popcount(current, current, layer->input_words);
+        uint64_t* destination = (last && output_bits != NULL) ? output_bits : next;
+        if (!last || output_bits != NULL){
+            memset(destination, 0, BINARY_WORDS(layer->number_of_nodes) * sizeof(uint64_t));
+        }
+        for (size_t j = 0; j < layer->number_of_nodes; j++){
+            const double positive = (double)and_popcount(current, layer->positive_weights + j * layer->input_words, layer->input_words);
+            const double pre_activation = layer->scales[j] * (2.0 * positive - ones) + layer->biases[j];
+            if (last && output_bits == NULL){
+                output_values[j] = kernel_activate(layer->activation_kind, layer->activation, pre_activation);
+            } else {
+                destination[j / BINARY_WORD_BITS] |= (uint64_t)(pre_activation > 0.5) << (j % BINARY_WORD_BITS);
+            }
+        }
+        uint64_t* swap = current;
+        current = next;
+        next = swap;
+    }
+}
+
+/**
+ * @brief Scratch for two packed activation vectors, on the stack when it fits
+ */
+#define BINARY_SCRATCH(binary, stack, scratch)                                                          \
+    uint64_t stack[2 * BINARY_STACK_WORDS];                                                             \
+    uint64_t* scratch = (binary)->max_words <= BINARY_STACK_WORDS ? stack : malloc(2 * (binary)->max_words * sizeof(uint64_t))
+
+/**
+ * @brief Forward pass of the binarized model on a real valued prompt
+ *
+ * @param binary(const BinaryModel*): From binarize_model
+ * @param input(const double*): input_length values, binarized by the input layer (input[r] + bias_r > 0.5)
+ * @param output(double*): output_length values, 0/1 if the last layer is a threshold layer
+ * @return ErrorCode
+ */
+ErrorCode binary_calculate_output(const BinaryModel* binary, const double* input, double* output){
+    if (binary == NULL || input == NULL || output == NULL){
+        fprintf(stderr, "Error in %s: NULL binary model, input or output.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    BINARY_SCRATCH(binary, stack, scratch);
+    if (scratch == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    memset(scratch, 0, BINARY_WORDS(binary->input_length) * sizeof(uint64_t));
+    for (size_t r = 0; r < binary->input_length; r++){
+        scratch[r / BINARY_WORD_BITS] |= (uint64_t)(input[r] + binary->input_biases[r] > 0.5) << (r % BINARY_WORD_BITS);
+    }
+    if (binary->number_of_layers == 1){
+        for (size_t r = 0; r < binary->input_length; r++){
+            output[r] = (double)((scratch[r / BINARY_WORD_BITS] >> (r % BINARY_WORD_BITS)) & 1);
+        }
+    } else {
+        binary_forward(binary, scratch, scratch + binary->max_words, output, NULL);
+    }
+    if (scratch != stack){
+        free(scratch);
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Forward pass with packed input and output, the fastest path for models whose every layer is a threshold layer
+ *
+ * @param binary(const BinaryModel*): From binarize_model, with binary_output != 0
+ * @param input_bits(const uint64_t*): The 0/1 prompt packed by binary_pack
+ * @param output_bits(uint64_t*): BINARY_WORDS(output_length) words, the packed outputs
+ * @return ErrorCode
+ */
+ErrorCode binary_calculate_output_packed(const BinaryModel* binary, const uint64_t* input_bits, uint64_t* output_bits){
+    if (binary == NULL || input_bits == NULL || output_bits == NULL){
+        fprintf(stderr, "Error in %s: NULL binary model, input or output.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (!binary->binary_output){
+        fprintf(stderr, "Error in %s: the last layer is not a threshold layer, use binary_calculate_output.\n", __func__);
+        return ERROR_UNSUPPORTED;
+    }
+    BINARY_SCRATCH(binary, stack, scratch);
+    if (scratch == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    const size_t input_words = BINARY_WORDS(binary->input_length);
+    uint64_t* bits = (binary->number_of_layers == 1) ? output_bits : scratch;
+    for (size_t w = 0; w < input_words; w++){
+        bits[w] = (input_bits[w] & binary->input_keep[w]) | binary->input_force[w];
+    }
+    if (binary->number_of_layers > 1){
+        binary_forward(binary, scratch, scratch + binary->max_words, NULL, output_bits);
+    }
+    if (scratch != stack){
+        free(scratch);
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief The conversion check: fraction of the output values of the prompts on which the binarized model and calculate_output agree
+ * (within 1e-9), 1 for an exact conversion
+ *
+ * @return double In [0, 1], -1 on failure
+ */
+double binary_model_agreement(const BinaryModel* binary, Model* model, Prompt* prompts, size_t number_of_prompts){
+    if (binary == NULL || model == NULL || prompts == NULL || number_of_prompts == 0){
+        fprintf(stderr, "Error in %s: NULL parameter or no prompt.\n", __func__);
+        return -1.0;
+    }
+    double* values = malloc(binary->output_length * sizeof(double));
+    if (values == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return -1.0;
+    }
+    size_t matching = 0;
+    for (size_t p = 0; p < number_of_prompts; p++){
+        Output reference = calculate_output(&prompts[p], model);
+        if (reference.is_valid != 1 || reference.length != binary->output_length
+            || binary_calculate_output(binary, prompts[p].data, values) != NO_ERROR){
+            free_output(&reference);
+            free(values);
+            return -1.0;
+        }
+        for (size_t j = 0; j < binary->output_length; j++){
+            matching += fabs(values[j] - reference.data[j]) <= 1e-9;
+        }
+        free_output(&reference);
+    }
+    free(values);
+    return (double)matching / (double)(number_of_prompts * binary->output_length);
+}
+
+void free_binary_model(BinaryModel* binary){
+    if (binary == NULL){
+        return;
+    }
+    for (size_t i = 1; i < binary->number_of_layers; i++){
+        free(binary->layers[i].positive_weights);
+        free(binary->layers[i].scales);
+        free(binary->layers[i].biases);
+    }
+    free(binary->input_biases);
+    free(binary->input_keep);
+    free(binary->input_force);
+    free(binary);
+}
@@ -0,0 +1,86 @@
+#ifndef BINARY_FUNCTIONS_H
+#define BINARY_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include "node_functions.h"
+
+/**
+ * @brief Bit-packed execution of threshold networks.
+ * myThresholdFunc outputs exactly 0 or 1, so the layers using it emit binary vectors, stored here as bits in 64 bit words.
+ * binarize_model converts a model whose layers (all but possibly the last) use the threshold activation: every weight becomes its sign
+ * times a per node scale (alpha_j = mean |w_rj| over the inputs r of node j, the XNOR-net binarization), stored as one bit per weight.
+ * With {0, 1} activations the ±1 dot product of XNOR networks becomes an AND:
+ *      sum_r in_r * sign(w_rj) = 2 * popcount(in & positive_j) - popcount(in)
+ * so a layer costs one AND and one popcount per 64 weights, 64 times less weight traffic than doubles.
+ * The popcounts run with AVX-512 VPOPCNTDQ when the CPU has it (checked once at run time), with the portable popcount otherwise.
+ * Models whose weights already are ±alpha_j per node (like the all-ones weights of create_FF_model_matrices) are converted exactly,
+ * for the others max_weight_error tells how far the conversion is, binary_model_agreement how often the outputs still match.
+ */
+
+#define BINARY_WORD_BITS 64
+#define BINARY_WORDS(n) (((n) + BINARY_WORD_BITS - 1) / BINARY_WORD_BITS)
+#define BINARY_STACK_WORDS 256      // binary_calculate_output keeps its activations on the stack up to this many words per layer
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT BINARY MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A binarized layer (every layer but the input one)
+ *
+ * @param number_of_inputs, number_of_nodes(size_t): Width of the previous layer and of the layer
+ * @param input_words(size_t): 64 bit words of a packed input vector
+ * @param positive_weights(uint64_t*): number_of_nodes rows of input_words words, bit r of row j is set when weights[r][j] >= 0
+ * @param scales(double*): alpha_j of every node
+ * @param biases(double*): The biases of the nodes
+ * @param activation_kind(ActivationKind), activation(activation_function): ACTIVATION_THRESHOLD except possibly for the last layer
+ */
+typedef struct BinaryLayer{
+    size_t number_of_inputs;
+    size_t number_of_nodes;
+    size_t input_words;
+    uint64_t* positive_weights;
+    double* scales;
+    double* biases;
+    ActivationKind activation_kind;
+    activation_function activation;
+} BinaryLayer;
+
+/**
+ * @brief A binarized model, independent of the model it was converted from
+ *
+ * @param input_length, output_length(size_t): Width of the first and of the last layer
+ * @param input_biases(double*): Biases of the input layer, bit r of the input is prompt[r] + input_biases[r] > 0.5
+ * @param input_keep, input_force(uint64_t*): The input layer on a packed 0/1 prompt: bits = (prompt & input_keep) | input_force
+ * @param max_weight_error(double): Largest |w - alpha_j * sign(w)| of the conversion, 0 if it is exact
+ * @param packed_bytes(size_t): Bytes of the packed weights
+ * @param max_words(size_t): Words of the widest packed activation vector
+ * @param binary_output(int): != 0 if the last layer is a threshold layer too (binary_calculate_output_packed can be used)
+ * @param number_of_layers(size_t): Layers of the model, layers[0] is unused (the input layer has no weights)
+ */
+typedef struct BinaryModel{
+    size_t input_length;
+    size_t output_length;
+    double* input_biases;
+    uint64_t* input_keep;
+    uint64_t* input_force;
+    double max_weight_error;
+    size_t packed_bytes;
+    size_t max_words;
+    int binary_output;
+    size_t number_of_layers;
+    BinaryLayer layers[];
+} BinaryModel;
+
+//                                          FUNCTION PROTOTYPES
+BinaryModel* binarize_model(const Model* model);
+void binary_pack(const double* values, size_t length, uint64_t* words);
+ErrorCode binary_calculate_output(const BinaryModel* binary, const double* input, double* output);
+ErrorCode binary_calculate_output_packed(const BinaryModel* binary, const uint64_t* input_bits, uint64_t* output_bits);
+double binary_model_agreement(const BinaryModel* binary, Model* model, Prompt* prompts, size_t number_of_prompts);
+int binary_uses_avx512_popcount(void);
+void free_binary_model(BinaryModel* binary);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT BINARY MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // BINARY_FUNCTIONS_H
@@ -0,0 +1,396 @@
+#include "settings.h"
+#include "bundle_functions.h"
+#include "kernel_functions.h"
+#include "training_functions.h"
+#include "threadpool_functions.h"
+#include "allocator_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUNDLE_ALIGNED_DOUBLES(n) (((n) + BUNDLE_ALIGNMENT / sizeof(double) - 1) / (BUNDLE_ALIGNMENT / sizeof(double)) * (BUNDLE_ALIGNMENT / sizeof(double)))
+
+/**
+ * @brief Checks that model has the topology and activations of reference
+ */
+static int same_shape(const Model* reference, const Model* model){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model != reference->number_of_layers_in_the_model
+        || (model->number_of_layers_in_the_model > 1 && model->model_weights == NULL)){
+        return 0;
+    }
+    for (size_t i = 0; i < reference->number_of_layers_in_the_model; i++){
+        const Layer* a = &reference->model_layers[i];
+        const Layer* b = &model->model_layers[i];
+        if (a->number_of_nodes_in_the_layer != b->number_of_nodes_in_the_layer || a->activation_kind != b->activation_kind
+            || (a->activation_kind == ACTIVATION_CUSTOM && a->activation != b->activation)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Packs K models with the same layer widths and activations into a bundle, the models are copied (see bundle_store_models)
+ *
+ * @param models(Model* const*): The K models
+ * @param number_of_models(size_t): K
+ * @return ModelBundle* The bundle (free_model_bundle), NULL if the shapes differ or out of memory
+ */
+ModelBundle* create_model_bundle(Model* const* models, size_t number_of_models){
+    if (models == NULL || number_of_models == 0 || models[0] == NULL || models[0]->number_of_layers_in_the_model == 0){
+        fprintf(stderr, "Error in %s: NULL models or no model.\n", __func__);
+        return NULL;
+    }
+    const Model* reference = models[0];
+    for (size_t k = 0; k < number_of_models; k++){
+        if (!same_shape(reference, models[k])){
+            fprintf(stderr, "Error in %s: model %zu does not have the layers of model 0.\n", __func__, k);
+            return NULL;
+        }
+    }
+    const size_t K = number_of_models;
+    const size_t number_of_layers = reference->number_of_layers_in_the_model;
+    size_t total = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = reference->model_layers[i].number_of_nodes_in_the_layer;
+        if (i > 0){
+            total += BUNDLE_ALIGNED_DOUBLES(reference->model_layers[i-1].number_of_nodes_in_the_layer * nodes * K);
+        }
+        total += 4 * BUNDLE_ALIGNED_DOUBLES(nodes * K);
+    }
+    ModelBundle* bundle = malloc(sizeof(ModelBundle));
+    BundleLayer* layers = malloc(number_of_layers * sizeof(BundleLayer));
+    double* block = allocator_allocate(NULL, total * sizeof(double), BUNDLE_ALIGNMENT, ALLOCATOR_SUBSYSTEM_MATRIX);
+    if (bundle == NULL || layers == NULL || block == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        free(bundle);
+        free(layers);
+        allocator_release(NULL, block, ALLOCATOR_SUBSYSTEM_MATRIX);
+        return NULL;
+    }
+    memset(block, 0, total * sizeof(double));
+    bundle->number_of_models = K;
+    bundle->number_of_layers = number_of_layers;
+    bundle->layers = layers;
+    bundle->block = block;
+
+    double* cursor = block;
+    for (size_t i = 0; i < number_of_layers; i++){
+        const Layer* source = &reference->model_layers[i];
+        BundleLayer* layer = &layers[i];
+        const size_t nodes = source->number_of_nodes_in_the_layer;
+        layer->number_of_nodes = nodes;
+        layer->activation_kind = source->activation_kind;
+        layer->activation = source->activation;
+        layer->weights = NULL;
+        if (i > 0){
+            const size_t rows = reference->model_layers[i-1].number_of_nodes_in_the_layer;
+            layer->weights = cursor;
+            cursor += BUNDLE_ALIGNED_DOUBLES(rows * nodes * K);
+            for (size_t k = 0; k < K; k++){
+                double** weights = models[k]->model_weights[i-1];
+                for (size_t r = 0; r < rows; r++){
+                    for (size_t c = 0; c < nodes; c++){
+                        layer->weights[(r * nodes + c) * K + k] = weights[r][c];
+                    }
+                }
+            }
+        }
+        layer->biases = cursor;
+        cursor += BUNDLE_ALIGNED_DOUBLES(nodes * K);
+        layer->pre_activations = cursor;
+        cursor += BUNDLE_ALIGNED_DOUBLES(nodes * K);
+        layer->outputs = cursor;
+        cursor += BUNDLE_ALIGNED_DOUBLES(nodes * K);
+        layer->deltas = cursor;
+        cursor += BUNDLE_ALIGNED_DOUBLES(nodes * K);
+        for (size_t k = 0; k < K; k++){
+            for (size_t c = 0; c < nodes; c++){
+                layer->biases[c * K + k] = models[k]->model_layers[i].biases[c];
+            }
+        }
+    }
+    return bundle;
+}
+
+/**
+ * @brief Copies the parameters of the bundle back into its K models (the models it was created from, or models of the same shape)
+ * @return ErrorCode
+ */
+ErrorCode bundle_store_models(const ModelBundle* bundle, Model* const* models){
+    if (bundle == NULL || models == NULL){
+        fprintf(stderr, "Error in %s: NULL bundle or models.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    const size_t K = bundle->number_of_models;
+    for (size_t k = 0; k < K; k++){
+        Model* model = models[k];
+        if (model == NULL || model->number_of_layers_in_the_model != bundle->number_of_layers){
+            fprintf(stderr, "Error in %s: model %zu does not match the bundle.\n", __func__, k);
+            return ERROR_INVALID_PARAMETER;
+        }
+        for (size_t i = 0; i < bundle->number_of_layers; i++){
+            const BundleLayer* layer = &bundle->layers[i];
+            if (model->model_layers[i].number_of_nodes_in_the_layer != layer->number_of_nodes){
+                fprintf(stderr, "Error in %s: model %zu does not match the bundle.\n", __func__, k);
+                return ERROR_INVALID_PARAMETER;
+            }
+            for (size_t c = 0; c < layer->number_of_nodes; c++){
+                model->model_layers[i].biases[c] = layer->biases[c * K + k];
+            }
+            if (i > 0){
+                const size_t rows = bundle->layers[i-1].number_of_nodes;
+                for (size_t r = 0; r < rows; r++){
+                    for (size_t c = 0; c < layer->number_of_nodes; c++){
+                        model->model_weights[i-1][r][c] = layer->weights[(r * layer->number_of_nodes + c) * K + k];
+                    }
+                }
+            }
+        }
+        model_weights_changed(model);
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Interleaves number_of_models vectors of length values: interleaved[x * number_of_models + k] = values[k][x]
+ */
+void bundle_interleave(const double* const* values, size_t length, size_t number_of_models, double* interleaved){
+    for (size_t k = 0; k < number_of_models; k++){
+        for (size_t x = 0; x < length; x++){
+            interleaved[x * number_of_models + k] = values[k][x];
+        }
+    }
+}
+
+/**
+ * @brief The forward pass of a layer for the K models: the sums of each node accumulate over the rows like in the fused kernels,
+ * the loop over the models is the innermost one
+ */
+static void bundle_layer_forward(const BundleLayer* previous, BundleLayer* layer, size_t K){
+    const size_t rows = previous->number_of_nodes;
+    const size_t columns = layer->number_of_nodes;
+    double* sums = layer->pre_activations;
+    memset(sums, 0, columns * K * sizeof(double));
+    for (size_t r = 0; r < rows; r++){
+        const double* x = previous->outputs + r * K;
+        const double* w = layer->weights + r * columns * K;
+        for (size_t c = 0; c < columns; c++){
+            double* sum = sums + c * K;
+            const double* wc = w + c * K;
+            for (size_t k = 0; k < K; k++){
+                sum[k] += x[k] * wc[k];
+            }
+        }
+    }
+    for (size_t v = 0; v < columns * K; v++){
+        layer->outputs[v] = kernel_activate(layer->activation_kind, layer->activation, sums[v] + layer->biases[v]);
+    }
+}
+
+/**
+ * @brief Forward pass of the K models, each on its own input
+ *
+ * @param bundle(ModelBundle*): The bundle
+ * @param inputs(const double*): Interleaved inputs, input_width * K values (see bundle_interleave)
+ * @return ErrorCode, the outputs are in bundle_outputs
+ */
+ErrorCode bundle_forward(ModelBundle* bundle, const double* inputs){
+    if (bundle == NULL || inputs == NULL){
+        fprintf(stderr, "Error in %s: NULL bundle or inputs.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    const size_t K = bundle->number_of_models;
+    BundleLayer* input_layer = &bundle->layers[0];
+    const size_t values = input_layer->number_of_nodes * K;
+    memcpy(input_layer->pre_activations, inputs, values * sizeof(double));
+    for (size_t v = 0; v < values; v++){
+        input_layer->outputs[v] = kernel_activate(input_layer->activation_kind, input_layer->activation, inputs[v] + input_layer->biases[v]);
+    }
+    for (size_t i = 1; i < bundle->number_of_layers; i++){
+        bundle_layer_forward(&bundle->layers[i-1], &bundle->layers[i], K);
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief The interleaved outputs of the last layer after bundle_forward, output_width * K values
+ */
+const double* bundle_outputs(const ModelBundle* bundle){
+    return bundle ? bundle->layers[bundle->number_of_layers - 1].outputs : NULL;
+}
+
+/**
+ * @brief One stochastic gradient descent step of each of the K models on its own sample, with its own learning rate
+ * (train_step of every model, in lockstep): forward, squared error, backpropagation and update
+ *
+ * @param bundle(ModelBundle*): The bundle
+ * @param inputs(const double*): Interleaved inputs, input_width * K values
+ * @param targets(const double*): Interleaved expected outputs, output_width * K values
+ * @param learning_rates(const double*): K step sizes
+ * @param losses(double*): If not NULL receives the K losses 0.5 * sum (output - target)^2 before the update
+ * @return ErrorCode
+ */
+ErrorCode bundle_train_step(ModelBundle* bundle, const double* inputs, const double* targets, const double* learning_rates, double* losses){
+    if (bundle == NULL || targets == NULL || learning_rates == NULL){
+        fprintf(stderr, "Error in %s: NULL bundle, targets or learning rates.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    ErrorCode error = bundle_forward(bundle, inputs);
+    if (error != NO_ERROR){
+        return error;
+    }
+    const size_t K = bundle->number_of_models;
+    BundleLayer* output_layer = &bundle->layers[bundle->number_of_layers - 1];
+    if (losses != NULL){
+        memset(losses, 0, K * sizeof(double));
+    }
+    for (size_t c = 0; c < output_layer->number_of_nodes; c++){
+        for (size_t k = 0; k < K; k++){
+            const size_t v = c * K + k;
+            const double difference = output_layer->outputs[v] - targets[v];
+            if (losses != NULL){
+                losses[k] += difference * difference;
+            }
+            output_layer->deltas[v] = difference * activation_derivative(output_layer->activation_kind, output_layer->activation, output_layer->pre_activations[v] + output_layer->biases[v],
+                                                                                output_layer->outputs[v]);
+        }
+    }
+    if (losses != NULL){
+        for (size_t k = 0; k < K; k++){
+            losses[k] *= 0.5;
+        }
+    }
+
+    // every layer from the last: the error of the previous layer is summed with the weights before they are updated
+    for (size_t i = bundle->number_of_layers - 1; i > 0; i--){
+        BundleLayer* layer = &bundle->layers[i];
+        BundleLayer* previous = &bundle->layers[i-1];
+        const size_t columns = layer->number_of_nodes;
+        const double* delta = layer->deltas;
+        for (size_t r = 0; r < previous->number_of_nodes; r++){
+            const double* x = previous->outputs + r * K;
+            double* w = layer->weights + r * columns * K;
+            double* deltas_row = previous->deltas + r * K;
+            memset(deltas_row, 0, K * sizeof(double));
+            for (size_t c = 0; c < columns; c++){
+                double* wc = w + c * K;
+                const double* dc = delta + c * K;
+                for (size_t k = 0; k < K; k++){
+                    deltas_row[k] += wc[k] * dc[k];
+                    wc[k] -= learning_rates[k] * (x[k] * dc[k]);
+                }
+            }
+            for (size_t k = 0; k < K; k++){
+                const size_t v = r * K + k;
+                deltas_row[k] *= activation_derivative(previous->activation_kind, previous->activation, previous->pre_activations[v] + previous->biases[v], previous->outputs[v]);
+            }
+        }
+        for (size_t c = 0; c < columns; c++){
+            for (size_t k = 0; k < K; k++){
+                layer->biases[c * K + k] -= learning_rates[k] * delta[c * K + k];
+            }
+        }
+    }
+    BundleLayer* input_layer = &bundle->layers[0];
+    for (size_t c = 0; c < input_layer->number_of_nodes; c++){
+        for (size_t k = 0; k < K; k++){
+            input_layer->biases[c * K + k] -= learning_rates[k] * input_layer->deltas[c * K + k];
+        }
+    }
+    return NO_ERROR;
+}
+
+void free_model_bundle(ModelBundle* bundle){
+    if (bundle == NULL){
+        return;
+    }
+    allocator_release(NULL, bundle->block, ALLOCATOR_SUBSYSTEM_MATRIX);
+    free(bundle->layers);
+    free(bundle);
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- SWEEP RUNNER -+-+-+-+-+-+-+-+-+-+-+- */
+
+typedef struct SweepTask{
+    Model* const* models;
+    size_t first_model;
+    size_t number_of_models;
+    bundle_sweep_function train;
+    void* user_data;
+    ErrorCode error;
+} SweepTask;
+
+static void sweep_task(void* argument){
+    SweepTask* task = argument;
+    ModelBundle* bundle = create_model_bundle(task->models + task->first_model, task->number_of_models);
+    if (bundle == NULL){
+        task->error = ERROR_MALLOC_OUT_OF_MEMORY;   // the shapes were checked by run_model_sweep
+        return;
+    }
+    task->error = task->train(bundle, task->first_model, task->user_data);
+    if (task->error == NO_ERROR){
+        task->error = bundle_store_models(bundle, task->models + task->first_model);
+    }
+    free_model_bundle(bundle);
+}
+
+/**
+ * @brief Trains a list of same-shape models: they are cut in bundles of models_per_bundle (the last one may be smaller), every bundle is
+ * created, given to train and stored back into its models by a task of a ThreadPool of number_of_threads workers
+ *
+ * @param models(Model* const*): The models, all with the same layers
+ * @param number_of_models(size_t): How many
+ * @param models_per_bundle(size_t): K of the bundles
+ * @param number_of_threads(size_t): Workers of the pool
+ * @param train(bundle_sweep_function): Runs the training of one bundle, called concurrently for different bundles
+ * @param user_data(void*): Given to train
+ * @return ErrorCode The first error of a bundle, NO_ERROR if every bundle succeeded
+ */
+ErrorCode run_model_sweep(Model* const* models, size_t number_of_models, size_t models_per_bundle, size_t number_of_threads,
+                          bundle_sweep_function train, void* user_data){
+    if (models == NULL || train == NULL || models_per_bundle == 0 || number_of_threads == 0){
+        fprintf(stderr, "Error in %s: NULL models or train function, or no model per bundle or thread.\n", __func__);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (number_of_models == 0){
+        return NO_ERROR;
+    }
+    for (size_t k = 0; k < number_of_models; k++){
+        if (models[0] == NULL || models[0]->number_of_layers_in_the_model == 0 || !same_shape(models[0], models[k])){
+            fprintf(stderr, "Error in %s: model %zu does not have the layers of model 0.\n", __func__, k);
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+    const size_t number_of_bundles = (number_of_models + models_per_bundle - 1) / models_per_bundle;
+    SweepTask* tasks = malloc(number_of_bundles * sizeof(SweepTask));
+    ThreadPool* pool = tasks ? create_thread_pool(number_of_threads, 0) : NULL;
+    if (pool == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        free(tasks);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    ErrorCode error = NO_ERROR;
+    size_t submitted = 0;
+    for (size_t b = 0; b < number_of_bundles; b++){
+        const size_t first = b * models_per_bundle;
+        tasks[b] = (SweepTask){ .models = models, .first_model = first, .train = train, .user_data = user_data, .error = NO_ERROR,
+                                .number_of_models = (number_of_models - first < models_per_bundle) ? number_of_models - first : models_per_bundle };
+        error = thread_pool_submit(pool, sweep_task, &tasks[b]);
+        if (error != NO_ERROR){
+            break;
+        }
+        submitted++;
+    }
+    thread_pool_wait(pool);
+    free_thread_pool(pool);
+    for (size_t b = 0; b < submitted && error == NO_ERROR; b++){
+        error = tasks[b].error;
+    }
+    TRACE_DEBUG(TRACE_CATEGORY_MODEL, "sweep of %zu models in %zu bundles on %zu threads: error %d", number_of_models, number_of_bundles, number_of_threads, (int)error);
+    free(tasks);
+    return error;
+}
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END SWEEP RUNNER -+-+-+-+-+-+-+-+-+-+-+- */
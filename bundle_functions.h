@@ -0,0 +1,73 @@
+#ifndef BUNDLE_FUNCTIONS_H
+#define BUNDLE_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+
+/**
+ * @brief Lockstep execution of many small models sharing a topology (hyperparameter sweeps).
+ * A bundle interleaves the parameters and activations of K same-shape models: value x of model k is stored at [x * K + k], so
+ *      weights of layer i:   [(r * nodes_i + c) * K + k]      biases, pre-activations, outputs, deltas:   [c * K + k]
+ * The innermost loop of every kernel walks the K models with unit stride: one vector instruction advances several models at once,
+ * and a 4 x 4 layer gives a loop of K iterations instead of 4. Each model works on its own sample and its own learning rate,
+ * and a step computes exactly what calculate_output and train_step compute for the model alone.
+ * run_model_sweep splits a list of models in bundles and trains the bundles on a ThreadPool.
+ */
+
+#define BUNDLE_ALIGNMENT 64     // bytes, every array of the bundle starts on a cache line
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT MODEL BUNDLE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A layer of the bundle, every array is interleaved (see above)
+ *
+ * @param number_of_nodes(size_t): Width of the layer
+ * @param activation_kind(ActivationKind), activation(activation_function): Shared by the K models
+ * @param weights(double*): Incoming weights, number_of_inputs * number_of_nodes * K values, NULL for the input layer
+ */
+typedef struct BundleLayer{
+    size_t number_of_nodes;
+    ActivationKind activation_kind;
+    activation_function activation;
+    double* weights;
+    double* biases;
+    double* pre_activations;
+    double* outputs;
+    double* deltas;
+} BundleLayer;
+
+/**
+ * @brief K models in lockstep
+ *
+ * @param number_of_models(size_t): K
+ * @param number_of_layers(size_t): Layers of every model
+ * @param layers(BundleLayer*): The layers
+ * @param block(double*): The single aligned allocation holding every array
+ */
+typedef struct ModelBundle{
+    size_t number_of_models;
+    size_t number_of_layers;
+    BundleLayer* layers;
+    double* block;
+} ModelBundle;
+
+/**
+ * @brief Trains one bundle of run_model_sweep, whose model k is models[first_model + k] of the sweep
+ */
+typedef ErrorCode (*bundle_sweep_function)(ModelBundle* bundle, size_t first_model, void* user_data);
+
+//                                          FUNCTION PROTOTYPES
+ModelBundle* create_model_bundle(Model* const* models, size_t number_of_models);
+ErrorCode bundle_store_models(const ModelBundle* bundle, Model* const* models);
+void bundle_interleave(const double* const* values, size_t length, size_t number_of_models, double* interleaved);
+ErrorCode bundle_forward(ModelBundle* bundle, const double* inputs);
+const double* bundle_outputs(const ModelBundle* bundle);
+ErrorCode bundle_train_step(ModelBundle* bundle, const double* inputs, const double* targets, const double* learning_rates, double* losses);
+ErrorCode run_model_sweep(Model* const* models, size_t number_of_models, size_t models_per_bundle, size_t number_of_threads,
+                          bundle_sweep_function train, void* user_data);
+void free_model_bundle(ModelBundle* bundle);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT MODEL BUNDLE -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // BUNDLE_FUNCTIONS_H
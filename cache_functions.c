@@ -0,0 +1,491 @@
+#include "settings.h"
+#include "cache_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- HASHING -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief 64 bit hash of the bytes of a prompt: each double is mixed in as a whole word (multiply + xorshift), then the result is finalized
+ */
+static uint64_t hash_prompt(const double* data, size_t length){
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ (uint64_t)length;
+    for (size_t i = 0; i < length; i++){
+        uint64_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+        hash ^= hash >> 31;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static size_t next_power_of_two(size_t value){
+    size_t power = 1;
+    while (power < value){
+        power <<= 1;
+    }
+    return power;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- CREATION -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Creates an empty cache
+ *
+ * @param input_length Length of the prompts of the model
+ * @param output_length Length of the outputs of the model
+ * @param capacity Maximum number of entries (split evenly between the shards)
+ * @param number_of_shards Rounded up to a power of two, 0 = OUTPUT_CACHE_DEFAULT_SHARDS
+ * @return OutputCache* or NULL on invalid parameters or allocation failure
+ */
+OutputCache* create_output_cache(size_t input_length, size_t output_length, size_t capacity, size_t number_of_shards){
+    if (input_length == 0 || output_length == 0 || capacity == 0){
+        fprintf(stderr, "Error in %s: invalid sizes 'input_length = %zu', 'output_length = %zu', 'capacity = %zu'.\n", __func__, input_length, output_length, capacity);
+        return NULL;
+    }
+    number_of_shards = next_power_of_two(number_of_shards == 0 ? OUTPUT_CACHE_DEFAULT_SHARDS : number_of_shards);
+    while (number_of_shards > 1 && number_of_shards > capacity){
+        number_of_shards >>= 1;
+    }
+
+    OutputCache* cache = calloc(1, sizeof(OutputCache));
+    if (cache == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'cache' is NULL.\n", __func__);
+        return NULL;
+    }
+    cache->shards = calloc(number_of_shards, sizeof(CacheShard));
+    if (cache->shards == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'cache->shards' is NULL.\n", __func__);
+        free(cache);
+        return NULL;
+    }
+    cache->input_length = input_length;
+    cache->output_length = output_length;
+    cache->number_of_shards = number_of_shards;
+    cache->capacity = capacity;
+
+    const size_t shard_capacity = (capacity + number_of_shards - 1) / number_of_shards;
+    for (size_t s = 0; s < number_of_shards; s++){
+        CacheShard* shard = &cache->shards[s];
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->number_of_buckets = next_power_of_two(shard_capacity * 2);   // load factor about 0.5 when the hash spreads evenly
+        shard->buckets = calloc(shard->number_of_buckets, sizeof(CacheEntry*));
+        if (shard->buckets == NULL){
+            fprintf(stderr, "Error in %s: memory allocation error for the buckets of shard %zu.\n", __func__, s);
+            cache->number_of_shards = s + 1;
+            free_output_cache(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+/**
+ * @brief Frees every entry and the cache. If the cache is attached to a model, detach it first (attach_output_cache(model, NULL)).
+ */
+void free_output_cache(OutputCache* cache){
+    if (cache == NULL){
+        return;
+    }
+    output_cache_clear(cache);
+    for (size_t s = 0; s < cache->number_of_shards; s++){
+        pthread_mutex_destroy(&cache->shards[s].mutex);
+        free(cache->shards[s].buckets);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+/**
+ * @brief Makes calculate_output_cached use the cache for the model, NULL detaches the current cache (which is not freed)
+ * @return ErrorCode, ERROR_INVALID_PARAMETER if the cache lengths don't match the model
+ */
+ErrorCode attach_output_cache(Model* model, OutputCache* cache){
+    if (model == NULL || model->model_layers == NULL){
+        fprintf(stderr, "Error in %s: 'model' is NULL.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (cache != NULL && (cache->input_length != model->model_layers[0].number_of_nodes_in_the_layer
+        || cache->output_length != model->model_layers[model->number_of_layers_in_the_model - 1].number_of_nodes_in_the_layer)){
+        fprintf(stderr, "Error in %s: the cache lengths (%zu -> %zu) don't match model '%s'.\n", __func__, cache->input_length, cache->output_length, model->model_name);
+        return ERROR_INVALID_PARAMETER;
+    }
+    model->output_cache = cache;
+    return NO_ERROR;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- SHARD OPERATIONS (shard mutex held) -+-+-+-+-+-+-+-+-+-+-+- */
+
+static CacheShard* shard_of(OutputCache* cache, uint64_t hash){
+    return &cache->shards[(hash >> 48) & (cache->number_of_shards - 1)];
+}
+
+static void lru_unlink(CacheShard* shard, CacheEntry* entry){
+    if (entry->lru_previous != NULL){
+        entry->lru_previous->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL){
+        entry->lru_next->lru_previous = entry->lru_previous;
+    } else {
+        shard->lru_tail = entry->lru_previous;
+    }
+    entry->lru_previous = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(CacheShard* shard, CacheEntry* entry){
+    entry->lru_previous = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL){
+        shard->lru_head->lru_previous = entry;
+    }
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL){
+        shard->lru_tail = entry;
+    }
+}
+
+static CacheEntry* shard_find(OutputCache* cache, CacheShard* shard, uint64_t hash, const double* input){
+    for (CacheEntry* entry = shard->buckets[hash & (shard->number_of_buckets - 1)]; entry != NULL; entry = entry->chain_next){
+        if (entry->hash == hash && memcmp(entry->key, input, cache->input_length * sizeof(double)) == 0){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void shard_remove(OutputCache* cache, CacheShard* shard, CacheEntry* entry){
+    CacheEntry** link = &shard->buckets[entry->hash & (shard->number_of_buckets - 1)];
+    while (*link != entry){
+        link = &(*link)->chain_next;
+    }
+    *link = entry->chain_next;
+    lru_unlink(shard, entry);
+    shard->number_of_entries--;
+    atomic_fetch_sub_explicit(&cache->number_of_entries, 1, memory_order_relaxed);
+    free(entry);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- LOOKUP AND INSERT -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Looks the input up, on a hit the cached output is copied into result and the entry becomes the most recently used
+ *
+ * @param cache The cache
+ * @param input cache->input_length values
+ * @param result Receives cache->output_length values on a hit (untouched on a miss)
+ * @return int 1 on a hit, 0 on a miss (stale entries count as misses and are dropped)
+ */
+int output_cache_lookup(OutputCache* cache, const double* input, double* result){
+    const uint64_t hash = hash_prompt(input, cache->input_length);
+    const uint64_t version = atomic_load_explicit(&cache->weights_version, memory_order_acquire);
+    CacheShard* shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry* entry = shard_find(cache, shard, hash, input);
+    if (entry != NULL && entry->weights_version != version){
+        shard_remove(cache, shard, entry);
+        entry = NULL;
+    }
+    if (entry != NULL){
+        memcpy(result, entry->value, cache->output_length * sizeof(double));
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    atomic_fetch_add_explicit(entry != NULL ? &cache->hits : &cache->misses, 1, memory_order_relaxed);
+    return entry != NULL;
+}
+
+/**
+ * @brief The weights version the cache currently accepts: read it before computing an output and pass it to output_cache_insert
+ */
+uint64_t output_cache_version(const OutputCache* cache){
+    return atomic_load_explicit(&cache->weights_version, memory_order_acquire);
+}
+
+/**
+ * @brief Evicts the least recently used entry of the first non empty shard, starting from preferred.
+ * The shards are locked one at a time, the caller must not hold any shard mutex.
+ * @return int 1 if an entry was evicted, 0 if every shard was empty
+ */
+static int evict_one(OutputCache* cache, size_t preferred){
+    for (size_t k = 0; k < cache->number_of_shards; k++){
+        CacheShard* shard = &cache->shards[(preferred + k) & (cache->number_of_shards - 1)];
+        pthread_mutex_lock(&shard->mutex);
+        const int evicted = shard->lru_tail != NULL;
+        if (evicted){
+            shard_remove(cache, shard, shard->lru_tail);
+            atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        if (evicted){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Inserts (or refreshes) the output of an input. When the cache is full the least recently used entry of the receiving shard
+ * is evicted (of another shard if that one is empty), so the whole cache never holds more than capacity entries.
+ *
+ * @param weights_version The output_cache_version read before the output was computed: if the weights changed since, the output is
+ * stale and it is not stored
+ * @return ErrorCode
+ */
+ErrorCode output_cache_insert(OutputCache* cache, const double* input, const double* value, uint64_t weights_version){
+    if (cache == NULL || input == NULL || value == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (weights_version != output_cache_version(cache)){
+        return NO_ERROR;
+    }
+    const uint64_t hash = hash_prompt(input, cache->input_length);
+    CacheShard* shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry* entry = shard_find(cache, shard, hash, input);
+    if (entry != NULL){
+        memcpy(entry->value, value, cache->output_length * sizeof(double));
+        entry->weights_version = weights_version;
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        pthread_mutex_unlock(&shard->mutex);
+        return NO_ERROR;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    // reserve a slot in the global count first, evicting until one is free
+    size_t count = atomic_load_explicit(&cache->number_of_entries, memory_order_relaxed);
+    for (;;){
+        if (count < cache->capacity){
+            if (atomic_compare_exchange_weak_explicit(&cache->number_of_entries, &count, count + 1, memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+            continue;
+        }
+        if (!evict_one(cache, (size_t)(shard - cache->shards))){
+            sched_yield();      // every slot is reserved by inserts in flight
+        }
+        count = atomic_load_explicit(&cache->number_of_entries, memory_order_relaxed);
+    }
+    entry = malloc(sizeof(CacheEntry) + (cache->input_length + cache->output_length) * sizeof(double));
+    if (entry == NULL){
+        atomic_fetch_sub_explicit(&cache->number_of_entries, 1, memory_order_relaxed);
+        fprintf(stderr, "Error in %s: memory allocation error. 'entry' is NULL.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    entry->hash = hash;
+    entry->weights_version = weights_version;
+    entry->key = (double*)(entry + 1);
+    entry->value = entry->key + cache->input_length;
+    memcpy(entry->key, input, cache->input_length * sizeof(double));
+    memcpy(entry->value, value, cache->output_length * sizeof(double));
+
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry* existing = shard_find(cache, shard, hash, input);
+    if (existing != NULL){
+        // inserted by another thread meanwhile: refresh it and give the slot back
+        memcpy(existing->value, value, cache->output_length * sizeof(double));
+        existing->weights_version = weights_version;
+        lru_unlink(shard, existing);
+        lru_push_front(shard, existing);
+        pthread_mutex_unlock(&shard->mutex);
+        atomic_fetch_sub_explicit(&cache->number_of_entries, 1, memory_order_relaxed);
+        free(entry);
+        return NO_ERROR;
+    }
+    CacheEntry** bucket = &shard->buckets[hash & (shard->number_of_buckets - 1)];
+    entry->chain_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->number_of_entries++;
+    pthread_mutex_unlock(&shard->mutex);
+    return NO_ERROR;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- INVALIDATION AND STATS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Makes every current entry stale in O(1): they will be misses and will be replaced lazily
+ */
+void output_cache_invalidate(OutputCache* cache){
+    if (cache != NULL){
+        atomic_fetch_add_explicit(&cache->weights_version, 1, memory_order_acq_rel);
+    }
+}
+
+/**
+ * @brief Removes every entry (the counters are kept)
+ */
+void output_cache_clear(OutputCache* cache){
+    if (cache == NULL){
+        return;
+    }
+    for (size_t s = 0; s < cache->number_of_shards; s++){
+        CacheShard* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->mutex);
+        CacheEntry* entry = shard->lru_head;
+        while (entry != NULL){
+            CacheEntry* next = entry->lru_next;
+            free(entry);
+            entry = next;
+        }
+        if (shard->buckets != NULL){
+            memset(shard->buckets, 0, shard->number_of_buckets * sizeof(CacheEntry*));
+        }
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        atomic_fetch_sub_explicit(&cache->number_of_entries, shard->number_of_entries, memory_order_relaxed);
+        shard->number_of_entries = 0;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+/**
+ * @brief Reads the counters and the current size of the cache
+ */
+OutputCacheStats output_cache_stats(OutputCache* cache){
+    OutputCacheStats stats = {0};
+    if (cache == NULL){
+        return stats;
+    }
+    stats.hits = atomic_load(&cache->hits);
+    stats.misses = atomic_load(&cache->misses);
+    stats.evictions = atomic_load(&cache->evictions);
+    stats.entries = atomic_load(&cache->number_of_entries);
+    stats.capacity = cache->capacity;
+    return stats;
+}
+
+/**
+ * @brief Bytes owned by the cache: descriptors, bucket tables and entries (with their key and value)
+ */
+size_t output_cache_memory_bytes(const OutputCache* cache){
+    if (cache == NULL){
+        return 0;
+    }
+    size_t bytes = sizeof(OutputCache) + cache->number_of_shards * sizeof(CacheShard);
+    for (size_t s = 0; s < cache->number_of_shards; s++){
+        bytes += cache->shards[s].number_of_buckets * sizeof(CacheEntry*);
+    }
+    bytes += atomic_load(&cache->number_of_entries) * (sizeof(CacheEntry) + (cache->input_length + cache->output_length) * sizeof(double));
+    return bytes;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- CACHED INFERENCE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Inference through the model's output cache: a hit copies the cached output, a miss runs calculate_output and caches its result.
+ * Without an attached cache it simply runs calculate_output.
+ *
+ * @param prompt The input of the model
+ * @param model The model, with a cache attached by attach_output_cache
+ * @param result Receives the output of the model (last layer width values)
+ * @return ErrorCode
+ */
+ErrorCode calculate_output_cached(Prompt* prompt, Model* model, double* result){
+    if (prompt == NULL || prompt->data == NULL || model == NULL || result == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    OutputCache* cache = model->output_cache;
+    if (cache != NULL && prompt->length == cache->input_length && output_cache_lookup(cache, prompt->data, result)){
+        TRACE_VERBOSE(TRACE_CATEGORY_INFERENCE, "cache hit for model '%s'", model->model_name);
+        return NO_ERROR;
+    }
+
+    // the version the output is computed with: if the weights change during calculate_output the result is not cached
+    const uint64_t version = (cache != NULL) ? output_cache_version(cache) : 0;
+    Output output = calculate_output(prompt, model);
+    if (output.is_valid != 1){
+        return ERROR_INVALID_PARAMETER;
+    }
+    memcpy(result, output.data, output.length * sizeof(double));
+    free_output(&output);
+    if (cache != NULL){
+        output_cache_insert(cache, prompt->data, result, version);
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Fills the model's cache with the output of every prompt whose elements are all taken from domain_values
+ * (e.g. {0, 1} for the binary inputs of the square root demo: 2^4 = 16 prompts). After this every prompt of the domain is a hit.
+ *
+ * @param model The model, with a cache attached that can hold the whole domain
+ * @param domain_values The values each input element can take
+ * @param number_of_values Number of domain values
+ * @return ErrorCode, ERROR_INVALID_PARAMETER if the domain is bigger than the cache capacity or OUTPUT_CACHE_MAX_DOMAIN
+ */
+ErrorCode precompute_output_domain(Model* model, const double* domain_values, size_t number_of_values){
+    if (model == NULL || model->output_cache == NULL || domain_values == NULL || number_of_values == 0){
+        fprintf(stderr, "Error in %s: NULL parameter (or model without cache).\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    OutputCache* cache = model->output_cache;
+    const size_t input_length = cache->input_length;
+
+    // domain size = number_of_values ^ input_length, checked for overflow against the limits
+    size_t domain_size = 1;
+    const size_t capacity = cache->capacity;
+    for (size_t i = 0; i < input_length; i++){
+        if (domain_size > OUTPUT_CACHE_MAX_DOMAIN / number_of_values){
+            fprintf(stderr, "Error in %s: the input domain is bigger than %d prompts.\n", __func__, OUTPUT_CACHE_MAX_DOMAIN);
+            return ERROR_INVALID_PARAMETER;
+        }
+        domain_size *= number_of_values;
+    }
+    if (domain_size > capacity){
+        fprintf(stderr, "Error in %s: the input domain (%zu prompts) doesn't fit in the cache (%zu entries).\n", __func__, domain_size, capacity);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    double* tokens = malloc(input_length * sizeof(double));
+    size_t* digits = calloc(input_length, sizeof(size_t));     // the prompt index written in base number_of_values
+    if (tokens == NULL || digits == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error.\n", __func__);
+        free(tokens);
+        free(digits);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    Prompt prompt = { tokens, input_length, NULL };
+    ErrorCode error = NO_ERROR;
+
+    for (size_t n = 0; n < domain_size && error == NO_ERROR; n++){
+        for (size_t i = 0; i < input_length; i++){
+            tokens[i] = domain_values[digits[i]];
+        }
+        const uint64_t version = output_cache_version(cache);
+        Output output = calculate_output(&prompt, model);
+        if (output.is_valid != 1){
+            error = ERROR_INVALID_PARAMETER;
+            break;
+        }
+        error = output_cache_insert(cache, tokens, output.data, version);
+        free_output(&output);
+
+        // next prompt: increment the base number_of_values counter
+        for (size_t i = 0; i < input_length; i++){
+            if (++digits[i] < number_of_values){
+                break;
+            }
+            digits[i] = 0;
+        }
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "precomputed %zu prompts for model '%s'", domain_size, model->model_name);
+    free(tokens);
+    free(digits);
+    return error;
+}
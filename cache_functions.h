@@ -0,0 +1,96 @@
+#ifndef CACHE_FUNCTIONS_H
+#define CACHE_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "node_functions.h"
+
+/**
+ * @brief Memoizing cache of model outputs, keyed by the bytes of Prompt.data.
+ * The table is split in shards (each with its own mutex, hash buckets and LRU list) so concurrent threads rarely contend,
+ * and it is bounded: when the cache is full the shard receiving a new entry evicts its least recently used one (another shard does
+ * if that one is empty), so the number of entries never exceeds the capacity.
+ * Entries are tagged with the weights version of the cache, output_cache_invalidate (called by model_weights_changed) bumps the version
+ * so every older entry becomes a miss without walking the table.
+ */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT OUTPUT CACHE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A cached prompt -> output pair, key and value are stored right after the struct in the same allocation
+ */
+typedef struct CacheEntry{
+    uint64_t hash;
+    uint64_t weights_version;       // version of the weights the value was computed with
+    double* key;                    // input_length values
+    double* value;                  // output_length values
+    struct CacheEntry* chain_next;  // next entry in the same bucket
+    struct CacheEntry* lru_previous;
+    struct CacheEntry* lru_next;
+} CacheEntry;
+
+typedef struct CacheShard{
+    pthread_mutex_t mutex;
+    CacheEntry** buckets;
+    size_t number_of_buckets;       // power of two
+    CacheEntry* lru_head;           // most recently used
+    CacheEntry* lru_tail;           // least recently used, evicted first
+    size_t number_of_entries;
+} CacheShard;
+
+/**
+ * @brief The cache, attach it to a model with attach_output_cache
+ *
+ * @param input_length(size_t): Length of the prompts (first layer width)
+ * @param output_length(size_t): Length of the outputs (last layer width)
+ * @param number_of_shards(size_t): Power of two
+ * @param shards(CacheShard*): The shards
+ * @param capacity(size_t): Maximum number of entries of the whole cache, a shard evicts its LRU entry when the cache is full
+ * @param number_of_entries(size_t): Current number of entries of the whole cache
+ * @param weights_version(uint64_t): Current version, entries with a different one are stale
+ * @param hits, misses, evictions(uint64_t): Counters, read them with output_cache_stats
+ */
+typedef struct OutputCache{
+    size_t input_length;
+    size_t output_length;
+    size_t number_of_shards;
+    CacheShard* shards;
+    size_t capacity;
+    _Atomic size_t number_of_entries;
+    _Atomic uint64_t weights_version;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t evictions;
+} OutputCache;
+
+typedef struct OutputCacheStats{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t capacity;
+} OutputCacheStats;
+
+#define OUTPUT_CACHE_DEFAULT_SHARDS 16
+#define OUTPUT_CACHE_MAX_DOMAIN 1048576     // precompute_output_domain refuses to enumerate more prompts than this
+
+//                                          FUNCTION PROTOTYPES
+OutputCache* create_output_cache(size_t input_length, size_t output_length, size_t capacity, size_t number_of_shards);
+void free_output_cache(OutputCache* cache);
+ErrorCode attach_output_cache(Model* model, OutputCache* cache);
+int output_cache_lookup(OutputCache* cache, const double* input, double* result);
+uint64_t output_cache_version(const OutputCache* cache);
+ErrorCode output_cache_insert(OutputCache* cache, const double* input, const double* value, uint64_t weights_version);
+void output_cache_invalidate(OutputCache* cache);
+void output_cache_clear(OutputCache* cache);
+OutputCacheStats output_cache_stats(OutputCache* cache);
+size_t output_cache_memory_bytes(const OutputCache* cache);
+ErrorCode calculate_output_cached(Prompt* prompt, Model* model, double* result);
+ErrorCode precompute_output_domain(Model* model, const double* domain_values, size_t number_of_values);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT OUTPUT CACHE -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // CACHE_FUNCTIONS_H
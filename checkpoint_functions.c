@@ -0,0 +1,393 @@
+#include "settings.h"
+#include "checkpoint_functions.h"
+#include "kernel_functions.h"
+#include "allocator_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- CHECKPOINT PLAN -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Completes a plan whose kept flags are set: forces the first and last layers and computes the memory figures
+ */
+static void finish_plan(CheckpointPlan* plan, const Model* model){
+    const size_t last = plan->number_of_layers - 1;
+    plan->kept[0] = 1;
+    plan->kept[last] = 1;
+    size_t segment = 0;
+    for (size_t i = 0; i < plan->number_of_layers; i++){
+        const size_t doubles = 2 * model->model_layers[i].number_of_nodes_in_the_layer;
+        plan->full_doubles += doubles;
+        if (model->model_layers[i].number_of_nodes_in_the_layer > plan->max_width){
+            plan->max_width = model->model_layers[i].number_of_nodes_in_the_layer;
+        }
+        if (plan->kept[i]){
+            plan->number_of_checkpoints++;
+            plan->stored_doubles += doubles;
+            segment = 0;
+        } else {
+            plan->recomputed_layers++;
+            segment += doubles;
+            if (segment > plan->segment_doubles){
+                plan->segment_doubles = segment;
+            }
+        }
+    }
+}
+
+static CheckpointPlan* allocate_plan(const Model* model, const char* caller){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0){
+        fprintf(stderr, "Error in %s: NULL model or model without layers.\n", caller);
+        return NULL;
+    }
+    CheckpointPlan* plan = calloc(1, sizeof(CheckpointPlan));
+    if (plan != NULL){
+        plan->number_of_layers = model->number_of_layers_in_the_model;
+        plan->kept = calloc(plan->number_of_layers, sizeof(unsigned char));
+    }
+    if (plan == NULL || plan->kept == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", caller);
+        free_checkpoint_plan(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+/**
+ * @brief Checkpoints at every stride-th layer (and at the last one)
+ *
+ * @param model(const Model*): The trained model
+ * @param stride(size_t): >= 1, 1 keeps every layer (no recomputation)
+ * @return CheckpointPlan* NULL on failure
+ */
+CheckpointPlan* create_checkpoint_plan(const Model* model, size_t stride){
+    if (stride == 0){
+        fprintf(stderr, "Error in %s: the stride must be at least 1.\n", __func__);
+        return NULL;
+    }
+    CheckpointPlan* plan = allocate_plan(model, __func__);
+    if (plan == NULL){
+        return NULL;
+    }
+    plan->stride = stride;
+    for (size_t i = 0; i < plan->number_of_layers; i += stride){
+        plan->kept[i] = 1;
+    }
+    finish_plan(plan, model);
+    return plan;
+}
+
+/**
+ * @brief Checkpoints at chosen layers (the first and the last are always added)
+ *
+ * @param layers(const size_t*): The layer indices, in any order
+ * @param number_of_checkpoints(size_t): How many
+ * @return CheckpointPlan* NULL on failure or if an index is out of the model
+ */
+CheckpointPlan* create_checkpoint_plan_at(const Model* model, const size_t* layers, size_t number_of_checkpoints){
+    if (layers == NULL && number_of_checkpoints > 0){
+        fprintf(stderr, "Error in %s: 'layers' is NULL.\n", __func__);
+        return NULL;
+    }
+    CheckpointPlan* plan = allocate_plan(model, __func__);
+    if (plan == NULL){
+        return NULL;
+    }
+    for (size_t k = 0; k < number_of_checkpoints; k++){
+        if (layers[k] >= plan->number_of_layers){
+            fprintf(stderr, "Error in %s: layer %zu is not in model '%s' (%zu layers).\n", __func__, layers[k], model->model_name,
+                    plan->number_of_layers);
+            free_checkpoint_plan(plan);
+            return NULL;
+        }
+        plan->kept[layers[k]] = 1;
+    }
+    finish_plan(plan, model);
+    return plan;
+}
+
+/**
+ * @brief Bytes a batch needs with the plan in checkpointed_train_batch. Every sample holds its checkpoints, its two arrays of layer
+ * pointers and its CheckpointedOutput until the backward passes. On top of them either one forward pass runs (4 * max_width
+ * doubles of scratch) or one backward pass (the longest segment and its two arrays of layer pointers)
+ */
+size_t checkpoint_plan_bytes(const CheckpointPlan* plan, size_t batch_size){
+    if (plan == NULL){
+        return 0;
+    }
+    const size_t pointers = 2 * plan->number_of_layers * sizeof(double*);
+    const size_t per_sample = plan->stored_doubles * sizeof(double) + pointers + sizeof(CheckpointedOutput);
+    const size_t forward_scratch = 4 * plan->max_width * sizeof(double);
+    const size_t backward_scratch = plan->segment_doubles * sizeof(double) + pointers;
+    return batch_size * per_sample + (forward_scratch > backward_scratch ? forward_scratch : backward_scratch);
+}
+
+/**
+ * @brief The plan of the smallest stride (the least recomputation) whose activations for batch_size samples fit in budget_bytes
+ *
+ * @return CheckpointPlan* NULL if even the input and output layers alone do not fit
+ */
+CheckpointPlan* create_checkpoint_plan_for_budget(const Model* model, size_t batch_size, size_t budget_bytes){
+    if (model == NULL || model->number_of_layers_in_the_model == 0 || batch_size == 0){
+        fprintf(stderr, "Error in %s: NULL model or empty batch.\n", __func__);
+        return NULL;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    const size_t largest_stride = (number_of_layers > 1) ? number_of_layers - 1 : 1;
+    for (size_t stride = 1; stride <= largest_stride; stride++){
+        CheckpointPlan* plan = create_checkpoint_plan(model, stride);
+        if (plan == NULL){
+            return NULL;
+        }
+        const size_t bytes = checkpoint_plan_bytes(plan, batch_size);
+        if (bytes <= budget_bytes){
+            TRACE_DEBUG(TRACE_CATEGORY_MEMORY, "model '%s', batch %zu: stride %zu needs %zu bytes of activations (budget %zu)",
+                        model->model_name, batch_size, stride, bytes, budget_bytes);
+            return plan;
+        }
+        free_checkpoint_plan(plan);
+    }
+    fprintf(stderr, "Error in %s: %zu bytes cannot hold the activations of a batch of %zu samples of model '%s'.\n", __func__,
+            budget_bytes, batch_size, model->model_name);
+    return NULL;
+}
+
+void free_checkpoint_plan(CheckpointPlan* plan){
+    if (plan == NULL){
+        return;
+    }
+    free(plan->kept);
+    free(plan);
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- CHECKPOINTED FORWARD AND BACKWARD -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Layer i > 0 with the kernel calculate_output_layers would use
+ */
+static void run_layer(Model* model, size_t i, const double* input, double* pre_activation, double* activation){
+    const Layer* layer = &model->model_layers[i];
+    const layer_kernel_function kernel = layer->kernel != NULL ? layer->kernel : fused_layer_forward;
+    kernel(input, model->model_layers[i-1].number_of_nodes_in_the_layer, model->model_weights[i-1], layer, pre_activation, activation);
+}
+
+static CheckpointedOutput empty_checkpointed_output(void){
+    CheckpointedOutput output;
+    memset(&output, 0, sizeof(output));
+    return output;
+}
+
+/**
+ * @brief Forward pass storing the activations of the checkpoint layers only
+ *
+ * @param prompt(Prompt*): The input, as long as the first layer
+ * @param model(Model*): The model
+ * @param plan(const CheckpointPlan*): A plan of this model, must outlive the output
+ * @return CheckpointedOutput is_valid != 1 on failure
+ */
+CheckpointedOutput checkpointed_forward(Prompt* prompt, Model* model, const CheckpointPlan* plan){
+    if (prompt == NULL || prompt->data == NULL || model == NULL || model->model_layers == NULL || plan == NULL
+        || (model->number_of_layers_in_the_model > 1 && model->model_weights == NULL)){
+        fprintf(stderr, "Error in %s: NULL prompt, model, weights or plan.\n", __func__);
+        return empty_checkpointed_output();
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    if (plan->number_of_layers != number_of_layers || prompt->length != model->model_layers[0].number_of_nodes_in_the_layer){
+        fprintf(stderr, "Error in %s: the plan or the prompt does not match model '%s'.\n", __func__, model->model_name);
+        return empty_checkpointed_output();
+    }
+    size_t max_width = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        if (model->model_layers[i].number_of_nodes_in_the_layer > max_width){
+            max_width = model->model_layers[i].number_of_nodes_in_the_layer;
+        }
+    }
+    CheckpointedOutput output = empty_checkpointed_output();
+    output.used_model = model;
+    output.plan = plan;
+    output.is_valid = 1;
+    output.allocator = allocator_get_current();
+    output.layer_inputs = allocator_allocate(output.allocator, number_of_layers * sizeof(double*), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    output.layer_outputs = allocator_allocate(output.allocator, number_of_layers * sizeof(double*), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    // the activations of the dropped layers go through two pairs of buffers, alternating
+    double* scratch = allocator_allocate(output.allocator, 4 * max_width * sizeof(double), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    int failed = output.layer_inputs == NULL || output.layer_outputs == NULL || scratch == NULL;
+    if (!failed){
+        memset(output.layer_inputs, 0, number_of_layers * sizeof(double*));
+        memset(output.layer_outputs, 0, number_of_layers * sizeof(double*));
+        for (size_t i = 0; i < number_of_layers && !failed; i++){
+            if (plan->kept[i]){
+                const size_t bytes = model->model_layers[i].number_of_nodes_in_the_layer * sizeof(double);
+                output.layer_inputs[i] = allocator_allocate(output.allocator, bytes, 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+                output.layer_outputs[i] = allocator_allocate(output.allocator, bytes, 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+                failed = output.layer_inputs[i] == NULL || output.layer_outputs[i] == NULL;
+            }
+        }
+    }
+    if (failed){
+        fprintf(stderr, "Error in %s: memory allocation error.\n", __func__);
+        allocator_release(output.allocator, scratch, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        free_checkpointed_output(&output);
+        return empty_checkpointed_output();
+    }
+
+    memcpy(output.layer_inputs[0], prompt->data, prompt->length * sizeof(double));
+    layer_activation_forward(output.layer_inputs[0], &model->model_layers[0], output.layer_outputs[0]);
+    const double* previous = output.layer_outputs[0];
+    for (size_t i = 1; i < number_of_layers; i++){
+        double* pre_activation = plan->kept[i] ? output.layer_inputs[i] : scratch + (i % 2) * 2 * max_width;
+        double* activation = plan->kept[i] ? output.layer_outputs[i] : pre_activation + max_width;
+        run_layer(model, i, previous, pre_activation, activation);
+        previous = activation;
+    }
+    allocator_release(output.allocator, scratch, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    output.length = model->model_layers[number_of_layers - 1].number_of_nodes_in_the_layer;
+    output.data = output.layer_outputs[number_of_layers - 1];
+    return output;
+}
+
+/**
+ * @brief backward_pass on a checkpointed output: each segment between two checkpoints is recomputed from the earlier one,
+ * then backpropagated. The gradients are the same as backward_pass on the Output of calculate_output
+ *
+ * @param model(Model*): The model that produced the output (its weights must not have changed since)
+ * @param output(const CheckpointedOutput*): From checkpointed_forward
+ * @param target(const double*): The expected output
+ * @param gradients(ModelGradients*): Where the gradients are added
+ * @param loss(double*): If not NULL receives 0.5 * sum (output - target)^2
+ * @return ErrorCode
+ */
+ErrorCode checkpointed_backward(Model* model, const CheckpointedOutput* output, const double* target, ModelGradients* gradients, double* loss){
+    if (model == NULL || output == NULL || output->is_valid != 1 || output->used_model != model || target == NULL || gradients == NULL){
+        fprintf(stderr, "Error in %s: NULL or invalid parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (gradients->number_of_layers != model->number_of_layers_in_the_model){
+        fprintf(stderr, "Error in %s: the gradients don't match model '%s'.\n", __func__, model->model_name);
+        return ERROR_INVALID_PARAMETER;
+    }
+    const CheckpointPlan* plan = output->plan;
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    double** pre_activations = allocator_allocate(output->allocator, 2 * number_of_layers * sizeof(double*), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    double* segment = allocator_allocate(output->allocator, (plan->segment_doubles ? plan->segment_doubles : 1) * sizeof(double), 0,
+                                         ALLOCATOR_SUBSYSTEM_OUTPUT);
+    if (pre_activations == NULL || segment == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error.\n", __func__);
+        allocator_release(output->allocator, pre_activations, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        allocator_release(output->allocator, segment, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    double** activations = pre_activations + number_of_layers;
+    for (size_t i = 0; i < number_of_layers; i++){
+        pre_activations[i] = output->layer_inputs[i];
+        activations[i] = output->layer_outputs[i];
+    }
+
+    const size_t last = number_of_layers - 1;
+    const double squared_error = output_layer_deltas(model, pre_activations[last], activations[last], target);
+    size_t end = last;
+    while (end > 0){
+        size_t begin = end - 1;
+        while (!plan->kept[begin]){
+            begin--;
+        }
+        // recompute the layers strictly between the checkpoints begin and end, then backpropagate from end down to begin + 1
+        size_t offset = 0;
+        for (size_t i = begin + 1; i < end; i++){
+            const size_t width = model->model_layers[i].number_of_nodes_in_the_layer;
+            pre_activations[i] = segment + offset;
+            activations[i] = segment + offset + width;
+            offset += 2 * width;
+            run_layer(model, i, activations[i-1], pre_activations[i], activations[i]);
+        }
+        for (size_t i = end; i > begin; i--){
+            backward_layer(model, i, pre_activations[i-1], activations[i-1], gradients);
+        }
+        end = begin;
+    }
+    for (size_t c = 0; c < model->model_layers[0].number_of_nodes_in_the_layer; c++){
+        gradients->biases[0][c] += model->model_layers[0].deltas[c];
+    }
+    allocator_release(output->allocator, pre_activations, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    allocator_release(output->allocator, segment, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    if (loss != NULL){
+        *loss = 0.5 * squared_error;
+    }
+    TRACE_DEBUG(TRACE_CATEGORY_LAYER, "checkpointed backward pass of model '%s', %zu layers recomputed, loss %lf", model->model_name,
+                plan->recomputed_layers, 0.5 * squared_error);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Frees the buffers of a checkpointed output and marks it invalid, an invalid output owns nothing
+ * @return ErrorCode
+ */
+ErrorCode free_checkpointed_output(CheckpointedOutput* output){
+    if (output == NULL){
+        fprintf(stderr, "Error in %s: argument passed as NULL pointer.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (output->is_valid == 1 && output->used_model != NULL){
+        for (size_t i = 0; i < output->used_model->number_of_layers_in_the_model; i++){
+            if (output->layer_inputs != NULL){
+                allocator_release(output->allocator, output->layer_inputs[i], ALLOCATOR_SUBSYSTEM_OUTPUT);
+            }
+            if (output->layer_outputs != NULL){
+                allocator_release(output->allocator, output->layer_outputs[i], ALLOCATOR_SUBSYSTEM_OUTPUT);
+            }
+        }
+        allocator_release(output->allocator, output->layer_inputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        allocator_release(output->allocator, output->layer_outputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    }
+    *output = empty_checkpointed_output();
+    return NO_ERROR;
+}
+
+/**
+ * @brief One mini-batch gradient descent step with checkpointing: the forward passes of the whole batch are kept (checkpoints only),
+ * then every sample is backpropagated and the summed gradients are applied once
+ *
+ * @param prompts(Prompt*), targets(const double* const*): The batch_size samples
+ * @param gradients(ModelGradients*): Scratch gradients of the model (zeroed by the step)
+ * @param loss(double*): If not NULL receives the summed loss of the batch before the update
+ * @return ErrorCode
+ */
+ErrorCode checkpointed_train_batch(Model* model, const CheckpointPlan* plan, Prompt* prompts, const double* const* targets, size_t batch_size,
+                                   double learning_rate, ModelGradients* gradients, double* loss){
+    if (model == NULL || plan == NULL || prompts == NULL || targets == NULL || gradients == NULL || batch_size == 0){
+        fprintf(stderr, "Error in %s: NULL parameter or empty batch.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    CheckpointedOutput* outputs = calloc(batch_size, sizeof(CheckpointedOutput));
+    if (outputs == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    ErrorCode error = NO_ERROR;
+    for (size_t s = 0; s < batch_size && error == NO_ERROR; s++){
+        outputs[s] = checkpointed_forward(&prompts[s], model, plan);
+        error = (outputs[s].is_valid == 1) ? NO_ERROR : ERROR_INVALID_PARAMETER;
+    }
+    if (error == NO_ERROR){
+        zero_model_gradients(gradients, model);
+    }
+    double total_loss = 0.0;
+    for (size_t s = 0; s < batch_size && error == NO_ERROR; s++){
+        double sample_loss = 0.0;
+        error = checkpointed_backward(model, &outputs[s], targets[s], gradients, &sample_loss);
+        total_loss += sample_loss;
+    }
+    for (size_t s = 0; s < batch_size; s++){
+        free_checkpointed_output(&outputs[s]);
+    }
+    free(outputs);
+    if (error == NO_ERROR){
+        error = apply_gradients(model, gradients, learning_rate);
+    }
+    if (loss != NULL){
+        *loss = total_loss;
+    }
+    return error;
+}
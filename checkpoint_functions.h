@@ -0,0 +1,78 @@
+#ifndef CHECKPOINT_FUNCTIONS_H
+#define CHECKPOINT_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+#include "training_functions.h"
+
+/**
+ * @brief Activation checkpointing for training deep models on large batches.
+ * An Output keeps the pre-activations and activations of every layer, so a batch held for its backward pass costs
+ * batch_size * sum of the widths * 2 doubles. A CheckpointPlan keeps them only at some layers (every stride-th one, or chosen ones;
+ * the input and the output layers always): checkpointed_forward stores those, checkpointed_backward recomputes the layers between
+ * two checkpoints from the earlier one, segment by segment from the last, and backpropagates through them.
+ * Every dropped layer is recomputed once per sample, with the kernels of calculate_output_layers, so the gradients are bit-identical
+ * to backward_pass on a full Output. create_checkpoint_plan_for_budget picks the smallest stride whose memory for the batch fits in
+ * a number of bytes: the stored activations and layer pointer arrays of every sample, plus the larger of the forward scratch and
+ * the scratch of the longest segment (see checkpoint_plan_bytes).
+ * The buffers are allocated through the current allocator (ALLOCATOR_SUBSYSTEM_OUTPUT), like the ones of an Output.
+ */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT CHECKPOINT PLAN -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Which layers keep their activations
+ *
+ * @param stride(size_t): Layers 0, stride, 2 stride... are kept (and the last), 0 for a plan of chosen layers
+ * @param kept(unsigned char*): number_of_layers flags, != 0 if the layer is a checkpoint
+ * @param stored_doubles(size_t): Doubles stored per sample by checkpointed_forward
+ * @param full_doubles(size_t): Doubles stored per sample by calculate_output
+ * @param segment_doubles(size_t): Scratch of checkpointed_backward, the recomputed activations of the longest segment
+ * @param recomputed_layers(size_t): Layers run again per sample by checkpointed_backward
+ * @param max_width(size_t): Widest layer, checkpointed_forward runs the dropped layers in a scratch of 4 * max_width doubles
+ */
+typedef struct CheckpointPlan{
+    size_t number_of_layers;
+    size_t stride;
+    unsigned char* kept;
+    size_t number_of_checkpoints;
+    size_t stored_doubles;
+    size_t full_doubles;
+    size_t segment_doubles;
+    size_t recomputed_layers;
+    size_t max_width;
+} CheckpointPlan;
+
+/**
+ * @brief The forward pass of a sample with only the checkpoint layers stored
+ *
+ * @param data(double*): The output of the model, points to layer_outputs of the last layer
+ * @param layer_inputs, layer_outputs(double**): Pre-activations and activations of the checkpoint layers, NULL for the others
+ */
+typedef struct CheckpointedOutput{
+    char is_valid;
+    Model* used_model;
+    const CheckpointPlan* plan;
+    size_t length;
+    double* data;
+    double** layer_inputs;
+    double** layer_outputs;
+    struct Allocator* allocator;
+} CheckpointedOutput;
+
+//                                          FUNCTION PROTOTYPES
+CheckpointPlan* create_checkpoint_plan(const Model* model, size_t stride);
+CheckpointPlan* create_checkpoint_plan_at(const Model* model, const size_t* layers, size_t number_of_checkpoints);
+CheckpointPlan* create_checkpoint_plan_for_budget(const Model* model, size_t batch_size, size_t budget_bytes);
+size_t checkpoint_plan_bytes(const CheckpointPlan* plan, size_t batch_size);
+void free_checkpoint_plan(CheckpointPlan* plan);
+CheckpointedOutput checkpointed_forward(Prompt* prompt, Model* model, const CheckpointPlan* plan);
+ErrorCode checkpointed_backward(Model* model, const CheckpointedOutput* output, const double* target, ModelGradients* gradients, double* loss);
+ErrorCode free_checkpointed_output(CheckpointedOutput* output);
+ErrorCode checkpointed_train_batch(Model* model, const CheckpointPlan* plan, Prompt* prompts, const double* const* targets, size_t batch_size,
+                                   double learning_rate, ModelGradients* gradients, double* loss);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT CHECKPOINT PLAN -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // CHECKPOINT_FUNCTIONS_H
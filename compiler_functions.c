@@ -0,0 +1,391 @@
+#include "settings.h"
+#include "compiler_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- SOURCE EMISSION -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief The name of the generated inline function implementing the activation of a layer
+ * @return const char*, or NULL if the activation is ACTIVATION_CUSTOM (a function of the process can't be called from the generated code)
+ */
+static const char* activation_function_name(ActivationKind kind){
+    switch (kind){
+        case ACTIVATION_SIGMOID:   return "ffm_sigmoid";
+        case ACTIVATION_THRESHOLD: return "ffm_threshold";
+        default:                   return NULL;
+    }
+}
+
+/* Writes the expression of weight [row][column] of the matrix before layer i */
+static void emit_weight(FILE* source, int bake_weights, size_t i, const char* row, const char* column){
+    if (bake_weights){
+        fprintf(source, "W%zu[%s][%s]", i, row, column);
+    } else {
+        fprintf(source, "weights[%zu][%s][%s]", i - 1, row, column);
+    }
+}
+
+static void emit_bias(FILE* source, int bake_weights, size_t i, const char* index){
+    if (bake_weights){
+        fprintf(source, "B%zu[%s]", i, index);
+    } else {
+        fprintf(source, "biases[%zu][%s]", i, index);
+    }
+}
+
+/**
+ * @brief Writes the constant weights and biases of the model as static const arrays (W<i> is the matrix before layer i)
+ */
+static void emit_baked_parameters(FILE* source, const Model* model){
+    for (size_t i = 0; i < model->number_of_layers_in_the_model; i++){
+        const Layer* layer = &model->model_layers[i];
+        if (i > 0){
+            const size_t rows = model->model_layers[i - 1].number_of_nodes_in_the_layer;
+            fprintf(source, "static const double W%zu[FFM_WIDTH_%zu][FFM_WIDTH_%zu] = {\n", i, i - 1, i);
+            for (size_t r = 0; r < rows; r++){
+                fprintf(source, "    {");
+                for (size_t c = 0; c < layer->number_of_nodes_in_the_layer; c++){
+                    fprintf(source, "%s%.17g", c > 0 ? ", " : "", model->model_weights[i - 1][r][c]);
+                }
+                fprintf(source, "},\n");
+            }
+            fprintf(source, "};\n");
+        }
+        fprintf(source, "static const double B%zu[FFM_WIDTH_%zu] = {", i, i);
+        for (size_t j = 0; j < layer->number_of_nodes_in_the_layer; j++){
+            fprintf(source, "%s%.17g", j > 0 ? ", " : "", layer->biases[j]);
+        }
+        fprintf(source, "};\n");
+    }
+    fprintf(source, "\n");
+}
+
+/**
+ * @brief Writes the code of layer i (i > 0) reading the outputs of layer i - 1.
+ * Small layers are fully unrolled, one statement per node; bigger ones accumulate the weights rows into a constant-size array
+ * (row after row, so both the baked arrays and the model's row pointers are read contiguously) and apply bias and activation after.
+ */
+static void emit_layer(FILE* source, const Model* model, size_t i, int bake_weights){
+    const size_t rows = model->model_layers[i - 1].number_of_nodes_in_the_layer;
+    const size_t columns = model->model_layers[i].number_of_nodes_in_the_layer;
+    const char* activation = activation_function_name(model->model_layers[i].activation_kind);
+    char row_index[32];
+    char column_index[32];
+
+    fprintf(source, "    /* layer %zu: %zu -> %zu */\n", i, rows, columns);
+    if (rows * columns <= COMPILER_UNROLL_LIMIT){
+        for (size_t c = 0; c < columns; c++){
+            snprintf(column_index, sizeof(column_index), "%zu", c);
+            fprintf(source, "    pre[%zu][%zu] = 0.0", i, c);
+            for (size_t r = 0; r < rows; r++){
+                snprintf(row_index, sizeof(row_index), "%zu", r);
+                fprintf(source, " + out[%zu][%zu] * ", i - 1, r);
+                emit_weight(source, bake_weights, i, row_index, column_index);
+            }
+            fprintf(source, ";\n    out[%zu][%zu] = %s(pre[%zu][%zu] + ", i, c, activation, i, c);
+            emit_bias(source, bake_weights, i, column_index);
+            fprintf(source, ");\n");
+        }
+    } else {
+        fprintf(source, "    {\n");
+        fprintf(source, "        double accumulator[FFM_WIDTH_%zu] = {0};\n", i);
+        fprintf(source, "        for (int r = 0; r < FFM_WIDTH_%zu; r++){\n", i - 1);
+        fprintf(source, "            const double x = out[%zu][r];\n", i - 1);
+        fprintf(source, "            for (int c = 0; c < FFM_WIDTH_%zu; c++){\n", i);
+        fprintf(source, "                accumulator[c] += x * ");
+        emit_weight(source, bake_weights, i, "r", "c");
+        fprintf(source, ";\n            }\n        }\n");
+        fprintf(source, "        for (int c = 0; c < FFM_WIDTH_%zu; c++){\n", i);
+        fprintf(source, "            pre[%zu][c] = accumulator[c];\n", i);
+        fprintf(source, "            out[%zu][c] = %s(accumulator[c] + ", i, activation);
+        emit_bias(source, bake_weights, i, "c");
+        fprintf(source, ");\n        }\n    }\n");
+    }
+}
+
+/**
+ * @brief Writes a standalone C source file specialized for the topology (and optionally the parameters) of the model.
+ * The file defines compiled_forward and compiled_infer (see compiled_forward_function and compiled_infer_function).
+ *
+ * @param model The model, every layer must use a library activation (mySigmoid or myThresholdFunc)
+ * @param source_path Path of the file that is written
+ * @param bake_weights != 0 to write weights and biases as static const arrays
+ * @return ErrorCode, ERROR_UNSUPPORTED if a layer has a custom activation
+ */
+ErrorCode emit_model_source(const Model* model, const char* source_path, int bake_weights){
+    if (model == NULL || source_path == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0){
+        fprintf(stderr, "Error in %s: invalid parameters 'model = %p', 'source_path = %p'.\n", __func__, (void*)model, (void*)source_path);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    for (size_t i = 0; i < model->number_of_layers_in_the_model; i++){
+        if (model->model_layers[i].activation_kind == ACTIVATION_CUSTOM){
+            fprintf(stderr, "Error in %s: layer %zu has a custom activation, it can't be compiled.\n", __func__, i);
+            return ERROR_UNSUPPORTED;
+        }
+    }
+    FILE* source = fopen(source_path, "w");
+    if (source == NULL){
+        fprintf(stderr, "Error in %s: could not open '%s'.\n", __func__, source_path);
+        return ERROR_IO;
+    }
+
+    const size_t layers = model->number_of_layers_in_the_model;
+    fprintf(source, "/* Generated by emit_model_source for model \"%s\", do not edit */\n", model->model_name != NULL ? model->model_name : "");
+    fprintf(source, "#include <math.h>\n\n");
+    fprintf(source, "#define FFM_LAYERS %zu\n", layers);
+    for (size_t i = 0; i < layers; i++){
+        fprintf(source, "#define FFM_WIDTH_%zu %zu\n", i, model->model_layers[i].number_of_nodes_in_the_layer);
+    }
+    fprintf(source, "\nstatic inline double ffm_sigmoid(double x){ return 1.0 / (1.0 + exp(-x)); }\n");
+    fprintf(source, "static inline double ffm_threshold(double x){ return (x > 0.5) ? 1.0 : 0.0; }\n\n");
+    if (bake_weights){
+        emit_baked_parameters(source, model);
+    }
+
+    // The core: out[i] / pre[i] are the outputs / inputs of layer i, pre[0] is the model input
+    fprintf(source, "static inline __attribute__((always_inline)) void ffm_forward(double* const* pre, double* const* out, double*** weights, double* const* biases){\n");
+    fprintf(source, "    (void)weights; (void)biases;\n");
+    fprintf(source, "    /* layer 0: input */\n");
+    fprintf(source, "    for (int c = 0; c < FFM_WIDTH_0; c++){\n        out[0][c] = %s(pre[0][c] + ", activation_function_name(model->model_layers[0].activation_kind));
+    emit_bias(source, bake_weights, 0, "c");
+    fprintf(source, ");\n    }\n");
+    for (size_t i = 1; i < layers; i++){
+        emit_layer(source, model, i, bake_weights);
+    }
+    fprintf(source, "}\n\n");
+
+    // Entry point filling the Output buffers
+    fprintf(source, "void compiled_forward(const double* input, double* const* layer_inputs, double* const* layer_outputs, double*** weights, double* const* biases){\n");
+    fprintf(source, "    double* pre[FFM_LAYERS];\n");
+    fprintf(source, "    for (int i = 0; i < FFM_LAYERS; i++){ pre[i] = layer_inputs[i]; }\n");
+    fprintf(source, "    if (input != layer_inputs[0]){ for (int c = 0; c < FFM_WIDTH_0; c++){ pre[0][c] = input[c]; } }\n");
+    fprintf(source, "    ffm_forward(pre, layer_outputs, weights, biases);\n}\n\n");
+
+    // Entry point with the intermediate values on the stack
+    fprintf(source, "void compiled_infer(const double* input, double* output, double*** weights, double* const* biases){\n");
+    for (size_t i = 0; i < layers; i++){
+        fprintf(source, "    double pre_%zu[FFM_WIDTH_%zu], out_%zu[FFM_WIDTH_%zu];\n", i, i, i, i);
+    }
+    fprintf(source, "    for (int c = 0; c < FFM_WIDTH_0; c++){ pre_0[c] = input[c]; }\n");
+    fprintf(source, "    double* const pre[FFM_LAYERS] = {");
+    for (size_t i = 0; i < layers; i++){
+        fprintf(source, "%spre_%zu", i > 0 ? ", " : "", i);
+    }
+    fprintf(source, "};\n    double* const out[FFM_LAYERS] = {");
+    for (size_t i = 0; i < layers; i++){
+        fprintf(source, "%sout_%zu", i > 0 ? ", " : "", i);
+    }
+    fprintf(source, "};\n");
+    fprintf(source, "    ffm_forward(pre, out, weights, biases);\n");
+    fprintf(source, "    for (int c = 0; c < FFM_WIDTH_%zu; c++){ output[c] = out_%zu[c]; }\n}\n", layers - 1, layers - 1);
+
+    if (fclose(source) != 0){
+        fprintf(stderr, "Error in %s: could not write '%s'.\n", __func__, source_path);
+        return ERROR_IO;
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "emitted %s (%zu layers, weights %s)", source_path, layers, bake_weights ? "baked" : "passed at runtime");
+    return NO_ERROR;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- BUILD AND LOAD -+-+-+-+-+-+-+-+-+-+-+- */
+
+#define COMPILER_MAX_ARGUMENTS 32
+
+/**
+ * @brief Runs COMPILER_CC COMPILER_CFLAGS -o library_path source_path -lm in a child process.
+ * The paths are passed as single arguments (no shell), so the work directory may contain any character.
+ * @return int 0 if the compiler ran and exited with status 0
+ */
+static int run_compiler(const char* library_path, const char* source_path){
+    char flags[] = COMPILER_CFLAGS;
+    char* arguments[COMPILER_MAX_ARGUMENTS];
+    size_t count = 0;
+    arguments[count++] = (char*)COMPILER_CC;
+    char* save = NULL;
+    for (char* flag = strtok_r(flags, " ", &save); flag != NULL && count < COMPILER_MAX_ARGUMENTS - 6; flag = strtok_r(NULL, " ", &save)){
+        arguments[count++] = flag;
+    }
+    arguments[count++] = (char*)"-o";
+    arguments[count++] = (char*)library_path;
+    arguments[count++] = (char*)source_path;
+    arguments[count++] = (char*)"-lm";
+    arguments[count] = NULL;
+
+    const pid_t child = fork();
+    if (child < 0){
+        fprintf(stderr, "Error in %s: fork failed.\n", __func__);
+        return -1;
+    }
+    if (child == 0){
+        execvp(arguments[0], arguments);
+        _exit(127);
+    }
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0){
+        if (errno != EINTR){
+            return -1;
+        }
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Emits the specialized source of the model, builds it with COMPILER_CC into a shared object in work_directory and loads it.
+ * Every call produces a differently named shared object, so a model can be recompiled (e.g. after training) without dlopen
+ * handing back the previous library.
+ *
+ * @param model The model to compile
+ * @param work_directory Directory where the .c and .so files are written (e.g. "/tmp")
+ * @param bake_weights != 0 to bake weights and biases in the shared object: fastest, but the result is only valid for the current parameters
+ * @return CompiledModel* or NULL if the model has more than COMPILER_MAX_LAYERS layers or the emission, the build or the load failed
+ */
+CompiledModel* compile_model(const Model* model, const char* work_directory, int bake_weights){
+    static unsigned int compilation_counter = 0;
+    if (model == NULL || work_directory == NULL){
+        fprintf(stderr, "Error in %s: invalid parameters 'model = %p', 'work_directory = %p'.\n", __func__, (void*)model, (void*)work_directory);
+        return NULL;
+    }
+    if (model->number_of_layers_in_the_model > COMPILER_MAX_LAYERS){
+        fprintf(stderr, "Error in %s: model '%s' has %zu layers, at most %d can be compiled.\n", __func__, model->model_name,
+            model->number_of_layers_in_the_model, COMPILER_MAX_LAYERS);
+        return NULL;
+    }
+
+    // File names only keep the alphanumeric characters of the model name
+    char name[64];
+    size_t length = 0;
+    for (const char* c = model->model_name != NULL ? model->model_name : ""; *c != '\0' && length < sizeof(name) - 1; c++){
+        name[length++] = isalnum((unsigned char)*c) ? *c : '_';
+    }
+    name[length] = '\0';
+
+    char source_path[512];
+    char library_path[512];
+    const unsigned int counter = __atomic_fetch_add(&compilation_counter, 1, __ATOMIC_RELAXED);
+    snprintf(source_path, sizeof(source_path), "%s/ffm_%s_%ld_%u.c", work_directory, name, (long)getpid(), counter);
+    snprintf(library_path, sizeof(library_path), "%s/ffm_%s_%ld_%u.so", work_directory, name, (long)getpid(), counter);
+
+    if (emit_model_source(model, source_path, bake_weights) != NO_ERROR){
+        return NULL;
+    }
+
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "building %s", library_path);
+    if (run_compiler(library_path, source_path) != 0){
+        fprintf(stderr, "Error in %s: %s failed to build '%s'.\n", __func__, COMPILER_CC, source_path);
+        return NULL;
+    }
+
+    CompiledModel* compiled = calloc(1, sizeof(CompiledModel));
+    if (compiled == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'compiled' is NULL.\n", __func__);
+        return NULL;
+    }
+    compiled->library_handle = dlopen(library_path, RTLD_NOW | RTLD_LOCAL);
+    if (compiled->library_handle == NULL){
+        fprintf(stderr, "Error in %s: dlopen failed: %s\n", __func__, dlerror());
+        free(compiled);
+        return NULL;
+    }
+    *(void**)(&compiled->forward) = dlsym(compiled->library_handle, "compiled_forward");
+    *(void**)(&compiled->infer) = dlsym(compiled->library_handle, "compiled_infer");
+    compiled->library_path = strdup(library_path);
+    compiled->layer_widths = malloc(model->number_of_layers_in_the_model * sizeof(size_t));
+    if (compiled->forward == NULL || compiled->infer == NULL || compiled->library_path == NULL || compiled->layer_widths == NULL){
+        fprintf(stderr, "Error in %s: the compiled model could not be loaded from %s.\n", __func__, library_path);
+        free_compiled_model(compiled);
+        return NULL;
+    }
+    for (size_t i = 0; i < model->number_of_layers_in_the_model; i++){
+        compiled->layer_widths[i] = model->model_layers[i].number_of_nodes_in_the_layer;
+    }
+    compiled->weights_baked = bake_weights != 0;
+    compiled->number_of_layers = model->number_of_layers_in_the_model;
+    compiled->input_length = model->model_layers[0].number_of_nodes_in_the_layer;
+    compiled->output_length = model->model_layers[model->number_of_layers_in_the_model - 1].number_of_nodes_in_the_layer;
+    return compiled;
+}
+
+/**
+ * @brief Makes calculate_output (and calculate_output_batch) of the model run the compiled code. Passing NULL detaches the compiled code.
+ * The model does not take ownership: free_compiled_model must still be called, after detaching.
+ *
+ * @return ErrorCode, ERROR_INVALID_PARAMETER if the compiled model was built from a different topology
+ */
+ErrorCode attach_compiled_model(Model* model, CompiledModel* compiled){
+    if (model == NULL){
+        fprintf(stderr, "Error in %s: 'model' is NULL.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (compiled != NULL){
+        // the generated code has every width as a constant: any difference would make it read and write out of the buffers
+        int matches = compiled->number_of_layers == model->number_of_layers_in_the_model;
+        for (size_t i = 0; matches && i < compiled->number_of_layers; i++){
+            matches = compiled->layer_widths[i] == model->model_layers[i].number_of_nodes_in_the_layer;
+        }
+        if (!matches){
+            fprintf(stderr, "Error in %s: the compiled model doesn't match the topology of model '%s'.\n", __func__, model->model_name);
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+    __atomic_store_n(&model->compiled, compiled, __ATOMIC_RELEASE);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Gathers the bias pointers of every layer of the model, in the layout the generated functions take.
+ * They are read from the model at every call rather than kept in the CompiledModel, so a compiled model attached to another model of the
+ * same topology runs with that model's biases and never with the ones of a model that may have been freed since.
+ *
+ * @param model The model being run, with at most COMPILER_MAX_LAYERS layers
+ * @param biases Receives model->number_of_layers_in_the_model pointers
+ */
+void compiled_model_biases(const Model* model, double** biases){
+    for (size_t i = 0; i < model->number_of_layers_in_the_model; i++){
+        biases[i] = model->model_layers[i].biases;
+    }
+}
+
+/**
+ * @brief Lowest latency inference: runs compiled_infer, no allocation and no intermediate value is kept
+ *
+ * @param compiled The compiled model
+ * @param model The model it was compiled from, may be NULL when the weights are baked
+ * @param input compiled->input_length values
+ * @param output Receives compiled->output_length values
+ * @return ErrorCode
+ */
+ErrorCode compiled_model_infer(const CompiledModel* compiled, const Model* model, const double* input, double* output){
+    if (compiled == NULL || input == NULL || output == NULL || (!compiled->weights_baked && model == NULL)){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    double* biases[COMPILER_MAX_LAYERS];
+    if (!compiled->weights_baked){
+        compiled_model_biases(model, biases);
+    }
+    compiled->infer(input, output, compiled->weights_baked ? NULL : model->model_weights, biases);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Unloads the shared object and frees the struct (the .c and .so files are left in the work directory)
+ */
+void free_compiled_model(CompiledModel* compiled){
+    if (compiled == NULL){
+        return;
+    }
+    if (compiled->library_handle != NULL){
+        dlclose(compiled->library_handle);
+    }
+    free(compiled->library_path);
+    free(compiled->layer_widths);
+    free(compiled);
+}
@@ -0,0 +1,62 @@
+#ifndef COMPILER_FUNCTIONS_H
+#define COMPILER_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+
+/**
+ * @brief Ahead-of-time compiler for fixed topology models.
+ * emit_model_source writes a standalone C file in which the layer widths are compile-time constants, small layers are fully unrolled,
+ * bigger ones are constant-bound loops the C compiler can vectorize, the activations are inlined and (optionally) weights and biases are
+ * baked in as static const arrays. compile_model builds that file with the system gcc into a shared object and loads it with dlopen;
+ * once attached to the model (attach_compiled_model) calculate_output runs the compiled code instead of the generic kernels.
+ */
+
+#define COMPILER_UNROLL_LIMIT 256   // Layers with (inputs x nodes) up to this many weights are fully unrolled
+#define COMPILER_CC "gcc"           // The compiler used by compile_model
+#define COMPILER_CFLAGS "-O3 -march=native -fPIC -shared"
+#define COMPILER_MAX_LAYERS 64      // Deeper models are not compiled: the bias pointers are gathered on the stack at every call
+
+/* Signature of the generated functions, weights and biases are ignored when they were baked in */
+typedef void (*compiled_forward_function)(const double* input, double* const* layer_inputs, double* const* layer_outputs,
+    double*** weights, double* const* biases);
+typedef void (*compiled_infer_function)(const double* input, double* output, double*** weights, double* const* biases);
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT COMPILED MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A model compiled to a shared object and loaded in the process
+ *
+ * @param library_handle(void*): The dlopen handle
+ * @param library_path(char*): Path of the shared object
+ * @param forward(compiled_forward_function): Fills every layer's inputs and outputs like calculate_output does (layer_inputs[0] is not written)
+ * @param infer(compiled_infer_function): Only computes the final output, the intermediate values live on the stack: this is the lowest latency entry point
+ * @param weights_baked(int): != 0 if weights and biases are constants of the shared object (the model's weights are ignored and must not change)
+ * @param number_of_layers(size_t): Number of layers of the model it was compiled from
+ * @param input_length, output_length(size_t): Width of the first and of the last layer
+ * @param layer_widths(size_t*): number_of_layers widths the code was generated for, attach_compiled_model checks every one
+ */
+typedef struct CompiledModel{
+    void* library_handle;
+    char* library_path;
+    compiled_forward_function forward;
+    compiled_infer_function infer;
+    int weights_baked;
+    size_t number_of_layers;
+    size_t input_length;
+    size_t output_length;
+    size_t* layer_widths;
+} CompiledModel;
+
+//                                          FUNCTION PROTOTYPES
+ErrorCode emit_model_source(const Model* model, const char* source_path, int bake_weights);
+CompiledModel* compile_model(const Model* model, const char* work_directory, int bake_weights);
+ErrorCode attach_compiled_model(Model* model, CompiledModel* compiled);
+void compiled_model_biases(const Model* model, double** biases);
+ErrorCode compiled_model_infer(const CompiledModel* compiled, const Model* model, const double* input, double* output);
+void free_compiled_model(CompiledModel* compiled);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT COMPILED MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // COMPILER_FUNCTIONS_H
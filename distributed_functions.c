@@ -0,0 +1,742 @@
+#define _GNU_SOURCE     // MSG_NOSIGNAL
+#include "settings.h"
+#include "distributed_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- HALF PRECISION -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Rounds to the nearest IEEE 754 half precision value (ties to even), saturating at +-65504 instead of overflowing
+ */
+uint16_t double_to_half(double value){
+    // rounded once, from the 52 bit mantissa of the double: going through a float would round twice
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (uint16_t)((bits >> 48) & 0x8000u);
+    const int exponent = (int)((bits >> 52) & 0x7FFu);
+    uint64_t mantissa = bits & 0xFFFFFFFFFFFFFull;
+    if (exponent == 0x7FF){
+        return sign | 0x7C00u | (mantissa ? 0x200u : 0u);      // infinity or NaN
+    }
+    const int half_exponent = exponent - 1023 + 15;
+    if (half_exponent >= 31){
+        return sign | 0x7BFFu;
+    }
+    if (half_exponent <= 0){
+        if (half_exponent < -10){
+            return sign;
+        }
+        mantissa |= 1ull << 52;
+        const int shift = 43 - half_exponent;
+        uint64_t half = mantissa >> shift;
+        const uint64_t remainder = mantissa & ((1ull << shift) - 1);
+        const uint64_t halfway = 1ull << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1u))){
+            half++;
+        }
+        return sign | (uint16_t)half;
+    }
+    uint64_t half = ((uint64_t)half_exponent << 10) | (mantissa >> 42);
+    const uint64_t remainder = mantissa & ((1ull << 42) - 1);
+    if (remainder > (1ull << 41) || (remainder == (1ull << 41) && (half & 1u))){
+        half++;
+    }
+    if (half >= 0x7C00u){
+        half = 0x7BFFu;
+    }
+    return sign | (uint16_t)half;
+}
+
+double half_to_double(uint16_t half){
+    const int exponent = (half >> 10) & 0x1F;
+    const int mantissa = half & 0x3FF;
+    double value;
+    if (exponent == 0){
+        value = ldexp((double)mantissa, -24);
+    } else if (exponent == 31){
+        value = mantissa ? NAN : INFINITY;
+    } else {
+        value = ldexp((double)(mantissa | 0x400), exponent - 25);
+    }
+    return (half & 0x8000u) ? -value : value;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END HALF PRECISION -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* -+-+-+-+-+-+-+-+-+-+-+- SOCKETS -+-+-+-+-+-+-+-+-+-+-+- */
+
+static uint64_t milliseconds_now(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u;
+}
+
+/**
+ * @brief Sends send_bytes to the right neighbour while receiving recv_bytes from the left one.
+ * Both directions progress together, so a ring where every rank sends first never blocks on full socket buffers.
+ * @return ErrorCode
+ */
+static ErrorCode exchange(DistributedContext* context, const void* send_buffer, size_t send_bytes, void* recv_buffer, size_t recv_bytes){
+    size_t sent = 0, received = 0;
+    while (sent < send_bytes || received < recv_bytes){
+        struct pollfd descriptors[2];
+        nfds_t count = 0;
+        if (sent < send_bytes){
+            descriptors[count++] = (struct pollfd){ context->right_fd, POLLOUT, 0 };
+        }
+        if (received < recv_bytes){
+            descriptors[count++] = (struct pollfd){ context->left_fd, POLLIN, 0 };
+        }
+        if (poll(descriptors, count, -1) < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "Error in %s: poll failed (errno %d).\n", __func__, errno);
+            return ERROR_IO;
+        }
+        for (nfds_t d = 0; d < count; d++){
+            if (descriptors[d].revents == 0){
+                continue;
+            }
+            if (descriptors[d].fd == context->right_fd && sent < send_bytes && (descriptors[d].revents & (POLLOUT | POLLERR | POLLHUP))){
+                const ssize_t n = send(context->right_fd, (const char*)send_buffer + sent, send_bytes - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                    fprintf(stderr, "Error in %s: send to rank %d failed (errno %d).\n", __func__, (context->rank + 1) % context->world_size, errno);
+                    return ERROR_IO;
+                }
+                sent += (n > 0) ? (size_t)n : 0;
+            } else if (descriptors[d].fd == context->left_fd && received < recv_bytes){
+                const ssize_t n = recv(context->left_fd, (char*)recv_buffer + received, recv_bytes - received, MSG_DONTWAIT);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+                    fprintf(stderr, "Error in %s: receive from rank %d failed.\n", __func__, (context->rank + context->world_size - 1) % context->world_size);
+                    return ERROR_IO;
+                }
+                received += (n > 0) ? (size_t)n : 0;
+            }
+        }
+    }
+    context->bytes_sent += send_bytes;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Fills the socket address of a rank
+ * @return socklen_t The length of the address, 0 on error
+ */
+static socklen_t endpoint_address(DistributedTransport transport, const char* address, int base_port, int rank, struct sockaddr_storage* storage){
+    memset(storage, 0, sizeof(*storage));
+    if (transport == DISTRIBUTED_UNIX){
+        struct sockaddr_un* unix_address = (struct sockaddr_un*)storage;
+        unix_address->sun_family = AF_UNIX;
+        const int length = snprintf(unix_address->sun_path, sizeof(unix_address->sun_path), "%s.%d", address, rank);
+        return (length > 0 && (size_t)length < sizeof(unix_address->sun_path)) ? (socklen_t)sizeof(struct sockaddr_un) : 0;
+    }
+    struct sockaddr_in* inet_address = (struct sockaddr_in*)storage;
+    inet_address->sin_family = AF_INET;
+    inet_address->sin_port = htons((uint16_t)(base_port + rank));
+    return (inet_pton(AF_INET, address, &inet_address->sin_addr) == 1) ? (socklen_t)sizeof(struct sockaddr_in) : 0;
+}
+
+/**
+ * @brief Listens on the endpoint of the rank, connects to the next rank (retrying until it listens) and accepts the previous one
+ * @return ErrorCode
+ */
+static ErrorCode connect_ring(DistributedContext* context, DistributedTransport transport, const char* address, int base_port){
+    const int family = (transport == DISTRIBUTED_UNIX) ? AF_UNIX : AF_INET;
+    const int right = (context->rank + 1) % context->world_size;
+    struct sockaddr_storage own, next;
+    const socklen_t own_length = endpoint_address(transport, address, base_port, context->rank, &own);
+    const socklen_t next_length = endpoint_address(transport, address, base_port, right, &next);
+    if (own_length == 0 || next_length == 0){
+        fprintf(stderr, "Error in %s: invalid address '%s'.\n", __func__, address);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    const int listen_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0){
+        fprintf(stderr, "Error in %s: socket failed (errno %d).\n", __func__, errno);
+        return ERROR_IO;
+    }
+    const int one = 1;
+    if (transport == DISTRIBUTED_UNIX){
+        unlink(((struct sockaddr_un*)&own)->sun_path);
+    } else {
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(listen_fd, (struct sockaddr*)&own, own_length) != 0 || listen(listen_fd, 1) != 0){
+        fprintf(stderr, "Error in %s: rank %d could not listen (errno %d).\n", __func__, context->rank, errno);
+        close(listen_fd);
+        return ERROR_IO;
+    }
+
+    ErrorCode error = ERROR_IO;
+    const uint64_t deadline = milliseconds_now() + DISTRIBUTED_CONNECT_TIMEOUT_MS;
+    while (context->right_fd < 0 && milliseconds_now() < deadline){
+        const int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&next, next_length) == 0){
+            context->right_fd = fd;
+            break;
+        }
+        if (fd >= 0){
+            close(fd);
+        }
+        usleep(10000);     // the next rank is not listening yet
+    }
+    if (context->right_fd >= 0){
+        struct pollfd descriptor = { listen_fd, POLLIN, 0 };
+        const int remaining = (int)(deadline > milliseconds_now() ? deadline - milliseconds_now() : 0);
+        if (poll(&descriptor, 1, remaining) == 1){
+            context->left_fd = accept(listen_fd, NULL, NULL);
+        }
+    }
+    close(listen_fd);
+    if (transport == DISTRIBUTED_UNIX){
+        unlink(((struct sockaddr_un*)&own)->sun_path);
+    }
+    if (context->right_fd < 0 || context->left_fd < 0){
+        fprintf(stderr, "Error in %s: rank %d could not join the ring within %d ms.\n", __func__, context->rank, DISTRIBUTED_CONNECT_TIMEOUT_MS);
+        return ERROR_IO;
+    }
+    if (transport == DISTRIBUTED_TCP){
+        setsockopt(context->right_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(context->left_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // the neighbours introduce themselves
+    int32_t own_rank = context->rank, left_rank = -1;
+    error = exchange(context, &own_rank, sizeof(own_rank), &left_rank, sizeof(left_rank));
+    if (error == NO_ERROR && left_rank != (context->rank + context->world_size - 1) % context->world_size){
+        fprintf(stderr, "Error in %s: rank %d accepted rank %d instead of its left neighbour.\n", __func__, context->rank, left_rank);
+        error = ERROR_IO;
+    }
+    return error;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END SOCKETS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* -+-+-+-+-+-+-+-+-+-+-+- ALL-REDUCE -+-+-+-+-+-+-+-+-+-+-+- */
+
+static unsigned char* ensure_scratch(DistributedContext* context, size_t bytes){
+    if (bytes > context->scratch_bytes){
+        unsigned char* grown = realloc(context->scratch, bytes);
+        if (grown == NULL){
+            fprintf(stderr, "Error in %s: memory allocation error for %zu bytes.\n", __func__, bytes);
+            return NULL;
+        }
+        context->scratch = grown;
+        context->scratch_bytes = bytes;
+    }
+    return context->scratch;
+}
+
+static size_t chunk_start(size_t count, int world_size, int chunk){
+    return count * (size_t)chunk / (size_t)world_size;
+}
+
+static void encode_chunk(const double* values, size_t count, int half, unsigned char* buffer){
+    if (half){
+        uint16_t* halves = (uint16_t*)buffer;
+        for (size_t j = 0; j < count; j++){
+            halves[j] = double_to_half(values[j]);
+        }
+    } else {
+        memcpy(buffer, values, count * sizeof(double));
+    }
+}
+
+/**
+ * @brief Dense ring all-reduce: reduce-scatter then all-gather, optionally moving half precision values
+ */
+static ErrorCode ring_allreduce(DistributedContext* context, double* values, size_t count, int half){
+    const int W = context->world_size, rank = context->rank;
+    const size_t element = half ? sizeof(uint16_t) : sizeof(double);
+    const size_t largest_chunk = count / (size_t)W + 1;
+    unsigned char* scratch = ensure_scratch(context, 2 * largest_chunk * sizeof(double));
+    if (scratch == NULL){
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    unsigned char* send_buffer = scratch;
+    unsigned char* recv_buffer = scratch + largest_chunk * sizeof(double);
+
+    // reduce-scatter: after W - 1 steps rank r holds the sum of chunk r + 1
+    for (int step = 0; step < W - 1; step++){
+        const int send_chunk = (rank - step + W) % W, recv_chunk = (rank - step - 1 + W) % W;
+        const size_t send_first = chunk_start(count, W, send_chunk), send_count = chunk_start(count, W, send_chunk + 1) - send_first;
+        const size_t recv_first = chunk_start(count, W, recv_chunk), recv_count = chunk_start(count, W, recv_chunk + 1) - recv_first;
+        encode_chunk(values + send_first, send_count, half, send_buffer);
+        const ErrorCode error = exchange(context, send_buffer, send_count * element, recv_buffer, recv_count * element);
+        if (error != NO_ERROR){
+            return error;
+        }
+        for (size_t j = 0; j < recv_count; j++){
+            values[recv_first + j] += half ? half_to_double(((uint16_t*)recv_buffer)[j]) : ((double*)recv_buffer)[j];
+        }
+    }
+    // the owner rounds its chunk as the others will receive it, so every rank ends with the same values
+    if (half){
+        const int owned = (rank + 1) % W;
+        for (size_t j = chunk_start(count, W, owned); j < chunk_start(count, W, owned + 1); j++){
+            values[j] = half_to_double(double_to_half(values[j]));
+        }
+    }
+    // all-gather
+    for (int step = 0; step < W - 1; step++){
+        const int send_chunk = (rank + 1 - step + W) % W, recv_chunk = (rank - step + W) % W;
+        const size_t send_first = chunk_start(count, W, send_chunk), send_count = chunk_start(count, W, send_chunk + 1) - send_first;
+        const size_t recv_first = chunk_start(count, W, recv_chunk), recv_count = chunk_start(count, W, recv_chunk + 1) - recv_first;
+        encode_chunk(values + send_first, send_count, half, send_buffer);
+        const ErrorCode error = exchange(context, send_buffer, send_count * element, recv_buffer, recv_count * element);
+        if (error != NO_ERROR){
+            return error;
+        }
+        for (size_t j = 0; j < recv_count; j++){
+            values[recv_first + j] = half ? half_to_double(((uint16_t*)recv_buffer)[j]) : ((double*)recv_buffer)[j];
+        }
+    }
+    return NO_ERROR;
+}
+
+typedef struct SparseEntry{
+    uint32_t index;
+    float value;
+} SparseEntry;
+
+/**
+ * @brief The k-th largest of n magnitudes (quickselect with a three way partition, reorders magnitudes)
+ */
+static double kth_largest(double* magnitudes, size_t n, size_t k){
+    size_t low = 0, high = n - 1;
+    const size_t target = k - 1;
+    while (low < high){
+        const double pivot = magnitudes[low + (high - low) / 2];
+        // [low, greater) > pivot, [greater, i) == pivot, [smaller, high] < pivot
+        size_t greater = low, i = low, smaller = high + 1;
+        while (i < smaller){
+            const double value = magnitudes[i];
+            if (value > pivot){
+                magnitudes[i++] = magnitudes[greater];
+                magnitudes[greater++] = value;
+            } else if (value < pivot){
+                magnitudes[i] = magnitudes[--smaller];
+                magnitudes[smaller] = value;
+            } else {
+                i++;
+            }
+        }
+        if (target < greater){
+            high = greater - 1;
+        } else if (target >= smaller){
+            low = smaller;
+        } else {
+            return pivot;
+        }
+    }
+    return magnitudes[target];
+}
+
+/**
+ * @brief Top-k all-reduce with error feedback: the sparse contributions of every rank go around the ring and are summed in rank order
+ */
+static ErrorCode topk_allreduce(DistributedContext* context, double* values, size_t count, double* residual){
+    const int W = context->world_size, rank = context->rank;
+    size_t k = (size_t)ceil(context->topk_ratio * (double)count);
+    k = (k == 0) ? 1 : (k > count ? count : k);
+    // layout of the scratch: the magnitudes, the lengths of the W lists, then the W lists of up to k entries
+    unsigned char* scratch = ensure_scratch(context, count * sizeof(double) + (size_t)W * sizeof(uint64_t) + (size_t)W * k * sizeof(SparseEntry));
+    if (scratch == NULL){
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    double* magnitudes = (double*)scratch;
+    uint64_t* lengths = (uint64_t*)(scratch + count * sizeof(double));
+    SparseEntry* lists = (SparseEntry*)(lengths + W);
+
+    for (size_t j = 0; j < count; j++){
+        values[j] += residual[j];
+        magnitudes[j] = fabs(values[j]);
+    }
+    const double threshold = kth_largest(magnitudes, count, k);
+    SparseEntry* own = lists + (size_t)rank * k;
+    size_t length = 0;
+    for (int pass = 0; pass < 2; pass++){
+        // strictly above the threshold first, then the ties while there is room
+        for (size_t j = 0; j < count && length < k; j++){
+            const double magnitude = fabs(values[j]);
+            if ((pass == 0) ? (magnitude > threshold) : (magnitude == threshold && residual[j] != -INFINITY)){
+                own[length].index = (uint32_t)j;
+                own[length].value = (float)values[j];
+                residual[j] = -INFINITY;    // marks it as sent for the second pass
+                length++;
+            }
+        }
+    }
+    for (size_t j = 0; j < count; j++){
+        residual[j] = (residual[j] == -INFINITY) ? 0.0 : values[j];
+    }
+    for (size_t e = 0; e < length; e++){
+        residual[own[e].index] = values[own[e].index] - (double)own[e].value;   // the float rounding is fed back too
+    }
+    lengths[rank] = length;
+
+    for (int step = 0; step < W - 1; step++){
+        const int send_origin = (rank - step + W) % W, recv_origin = (rank - step - 1 + W) % W;
+        ErrorCode error = exchange(context, &lengths[send_origin], sizeof(uint64_t), &lengths[recv_origin], sizeof(uint64_t));
+        if (error == NO_ERROR && lengths[recv_origin] > k){
+            fprintf(stderr, "Error in %s: rank %d sent %lu entries, more than %zu.\n", __func__, recv_origin, (unsigned long)lengths[recv_origin], k);
+            error = ERROR_IO;
+        }
+        if (error == NO_ERROR){
+            error = exchange(context, lists + (size_t)send_origin * k, lengths[send_origin] * sizeof(SparseEntry),
+                             lists + (size_t)recv_origin * k, lengths[recv_origin] * sizeof(SparseEntry));
+        }
+        if (error != NO_ERROR){
+            return error;
+        }
+    }
+    memset(values, 0, count * sizeof(double));
+    for (int origin = 0; origin < W; origin++){
+        const SparseEntry* list = lists + (size_t)origin * k;
+        for (uint64_t e = 0; e < lengths[origin]; e++){
+            if (list[e].index < count){
+                values[list[e].index] += (double)list[e].value;
+            }
+        }
+    }
+    return NO_ERROR;
+}
+
+static void run_job(DistributedContext* context, const AllReduceJob* job){
+    ErrorCode error;
+    if (job->compress && context->compression == DISTRIBUTED_COMPRESSION_TOPK && job->offset != (size_t)-1){
+        error = topk_allreduce(context, job->values, job->count, context->residual + job->offset);
+    } else {
+        error = ring_allreduce(context, job->values, job->count, job->compress && context->compression == DISTRIBUTED_COMPRESSION_FP16);
+    }
+    if (error != NO_ERROR && context->error == NO_ERROR){
+        context->error = error;
+    }
+}
+
+static void* communication_thread(void* argument){
+    DistributedContext* context = argument;
+    pthread_mutex_lock(&context->mutex);
+    for (;;){
+        while (context->head == NULL && !context->stopping){
+            pthread_cond_wait(&context->job_available, &context->mutex);
+        }
+        if (context->head == NULL){
+            break;
+        }
+        AllReduceJob* job = context->head;
+        context->head = job->next;
+        if (context->head == NULL){
+            context->tail = NULL;
+        }
+        const int failed = (context->error != NO_ERROR);
+        pthread_mutex_unlock(&context->mutex);
+        if (!failed){
+            run_job(context, job);   // the ring is broken after a failure, the jobs left are dropped
+        }
+        free(job);
+        pthread_mutex_lock(&context->mutex);
+        if (--context->unfinished == 0){
+            pthread_cond_broadcast(&context->idle);
+        }
+    }
+    pthread_mutex_unlock(&context->mutex);
+    return NULL;
+}
+
+static ErrorCode enqueue(DistributedContext* context, double* values, size_t count, size_t offset, int compress){
+    AllReduceJob* job = malloc(sizeof(AllReduceJob));
+    if (job == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'job' is NULL.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    *job = (AllReduceJob){ values, count, offset, compress, NULL };
+    pthread_mutex_lock(&context->mutex);
+    if (context->tail != NULL){
+        context->tail->next = job;
+    } else {
+        context->head = job;
+    }
+    context->tail = job;
+    context->unfinished++;
+    pthread_cond_signal(&context->job_available);
+    pthread_mutex_unlock(&context->mutex);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Waits until every queued all-reduce completed
+ * @return ErrorCode The first communication error, NO_ERROR if none
+ */
+ErrorCode distributed_wait(DistributedContext* context){
+    if (context == NULL){
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (context->world_size == 1){
+        return NO_ERROR;
+    }
+    pthread_mutex_lock(&context->mutex);
+    while (context->unfinished > 0){
+        pthread_cond_wait(&context->idle, &context->mutex);
+    }
+    const ErrorCode error = context->error;
+    pthread_mutex_unlock(&context->mutex);
+    return error;
+}
+
+/**
+ * @brief Replaces values with their exact sum over every rank (no compression). Every rank must call it with the same count.
+ * @return ErrorCode
+ */
+ErrorCode distributed_allreduce(DistributedContext* context, double* values, size_t count){
+    if (context == NULL || (values == NULL && count > 0)){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (context->world_size == 1 || count == 0){
+        return NO_ERROR;
+    }
+    const ErrorCode error = enqueue(context, values, count, (size_t)-1, 0);
+    return (error != NO_ERROR) ? error : distributed_wait(context);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END ALL-REDUCE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* -+-+-+-+-+-+-+-+-+-+-+- CONTEXT -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Joins the ring. Every rank calls it with the same world_size, transport, address and base_port.
+ *
+ * @param rank Position of this process, 0 to world_size - 1
+ * @param world_size Number of processes, 1 gives a context where every collective is a no-op
+ * @param transport DISTRIBUTED_UNIX or DISTRIBUTED_TCP
+ * @param address Path prefix of the Unix sockets, or IPv4 host of the TCP ones (each rank listens on its own port)
+ * @param base_port Rank r listens on base_port + r, TCP only
+ * @param compression Compression of the gradients
+ * @param topk_ratio Fraction of the gradients sent with DISTRIBUTED_COMPRESSION_TOPK, in (0, 1]
+ * @return DistributedContext* or NULL on error
+ */
+DistributedContext* create_distributed_context(int rank, int world_size, DistributedTransport transport, const char* address, int base_port,
+                                               DistributedCompression compression, double topk_ratio){
+    if (world_size < 1 || rank < 0 || rank >= world_size || (world_size > 1 && address == NULL)
+        || (compression == DISTRIBUTED_COMPRESSION_TOPK && !(topk_ratio > 0.0 && topk_ratio <= 1.0))){
+        fprintf(stderr, "Error in %s: invalid parameters (rank %d of %d).\n", __func__, rank, world_size);
+        return NULL;
+    }
+    DistributedContext* context = calloc(1, sizeof(DistributedContext));
+    if (context == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'context' is NULL.\n", __func__);
+        return NULL;
+    }
+    context->rank = rank;
+    context->world_size = world_size;
+    context->left_fd = -1;
+    context->right_fd = -1;
+    context->compression = compression;
+    context->topk_ratio = topk_ratio;
+    context->error = NO_ERROR;
+    pthread_mutex_init(&context->mutex, NULL);
+    pthread_cond_init(&context->job_available, NULL);
+    pthread_cond_init(&context->idle, NULL);
+    if (world_size == 1){
+        return context;
+    }
+    if (connect_ring(context, transport, address, base_port) != NO_ERROR
+        || pthread_create(&context->thread, NULL, communication_thread, context) != 0){
+        if (context->left_fd >= 0) close(context->left_fd);
+        if (context->right_fd >= 0) close(context->right_fd);
+        pthread_cond_destroy(&context->idle);
+        pthread_cond_destroy(&context->job_available);
+        pthread_mutex_destroy(&context->mutex);
+        free(context);
+        return NULL;
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "rank %d of %d joined the ring", rank, world_size);
+    return context;
+}
+
+void free_distributed_context(DistributedContext* context){
+    if (context == NULL){
+        return;
+    }
+    if (context->world_size > 1){
+        pthread_mutex_lock(&context->mutex);
+        context->stopping = 1;
+        pthread_cond_broadcast(&context->job_available);
+        pthread_mutex_unlock(&context->mutex);
+        pthread_join(context->thread, NULL);
+        close(context->left_fd);
+        close(context->right_fd);
+    }
+    pthread_cond_destroy(&context->idle);
+    pthread_cond_destroy(&context->job_available);
+    pthread_mutex_destroy(&context->mutex);
+    free(context->residual);
+    free(context->scratch);
+    free(context);
+}
+
+/**
+ * @brief Copies the weights and biases of rank 0 into the model of every rank (ring broadcast), so they start identical
+ * @return ErrorCode
+ */
+ErrorCode distributed_broadcast_parameters(DistributedContext* context, Model* model){
+    if (context == NULL || model == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (context->world_size == 1){
+        return NO_ERROR;
+    }
+    ErrorCode error = distributed_wait(context);     // the sockets must be idle
+    ModelGradients* packed = create_model_gradients(model);     // same layout as the parameters
+    if (error != NO_ERROR || packed == NULL){
+        free_model_gradients(packed);
+        return (error != NO_ERROR) ? error : ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    const size_t L = model->number_of_layers_in_the_model;
+    const size_t count = model_parameter_count(model);
+    double* values = packed->biases[0];
+    if (context->rank == 0){
+        for (size_t i = 0; i < L; i++){
+            const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+            memcpy(packed->biases[i], model->model_layers[i].biases, nodes * sizeof(double));
+            for (size_t r = 0; i + 1 < L && r < nodes; r++){
+                memcpy(packed->weights[i][r], model->model_weights[i][r], model->model_layers[i+1].number_of_nodes_in_the_layer * sizeof(double));
+            }
+        }
+        error = exchange(context, values, count * sizeof(double), NULL, 0);
+    } else {
+        error = exchange(context, NULL, 0, values, count * sizeof(double));
+        if (error == NO_ERROR && context->rank + 1 < context->world_size){
+            error = exchange(context, values, count * sizeof(double), NULL, 0);
+        }
+        if (error == NO_ERROR){
+            for (size_t i = 0; i < L; i++){
+                const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+                memcpy(model->model_layers[i].biases, packed->biases[i], nodes * sizeof(double));
+                for (size_t r = 0; i + 1 < L && r < nodes; r++){
+                    memcpy(model->model_weights[i][r], packed->weights[i][r], model->model_layers[i+1].number_of_nodes_in_the_layer * sizeof(double));
+                }
+            }
+            model_weights_changed(model);
+        }
+    }
+    free_model_gradients(packed);
+    return error;
+}
+
+static void gradients_ready(size_t layer, double* values, size_t count, void* user_data){
+    (void)layer;
+    DistributedContext* context = user_data;
+    const size_t offset = (size_t)(values - context->gradient_base);
+    if (enqueue(context, values, count, offset, 1) != NO_ERROR){
+        // the peers wait for this layer in exchange: it is reduced on this thread, after the layers already queued so the order is kept
+        distributed_wait(context);
+        const AllReduceJob job = { values, count, offset, 1, NULL };
+        pthread_mutex_lock(&context->mutex);
+        const int failed = (context->error != NO_ERROR);
+        pthread_mutex_unlock(&context->mutex);
+        if (!failed){
+            run_job(context, &job);
+        }
+    }
+}
+
+/**
+ * @brief Queues the all-reduces of the last backward pass of a step, in the same order, on zeroed gradients:
+ * a rank that failed before that pass still takes part in them, its peers would block in exchange otherwise
+ */
+static void enqueue_zero_gradients(DistributedContext* context, Model* model, ModelGradients* gradients){
+    zero_model_gradients(gradients, model);
+    for (size_t i = model->number_of_layers_in_the_model - 1; i > 0; i--){
+        const size_t columns = model->model_layers[i].number_of_nodes_in_the_layer;
+        gradients_ready(i, gradients->weights[i-1][0], model->model_layers[i-1].number_of_nodes_in_the_layer * columns + columns, context);
+    }
+    gradients_ready(0, gradients->biases[0], model->model_layers[0].number_of_nodes_in_the_layer, context);
+}
+
+/**
+ * @brief One data parallel step: forward and backward on the local samples, sum of the gradients of every rank
+ * (overlapped with the backward pass of the last sample) and the update with the mean gradient over all the samples.
+ * Every rank calls it with the same number_of_samples. A rank whose local pass fails still takes part in the all-reduces,
+ * with zero gradients, then returns the error without updating its model.
+ *
+ * @param context The rank
+ * @param model The model, identical on every rank (see distributed_broadcast_parameters)
+ * @param prompts The local samples
+ * @param targets Their expected outputs
+ * @param number_of_samples Number of local samples, at least 1
+ * @param learning_rate Step size
+ * @param gradients Scratch gradients of the model
+ * @param loss If not NULL receives the mean loss of the local samples before the update
+ * @return ErrorCode
+ */
+ErrorCode distributed_train_step(DistributedContext* context, Model* model, Prompt* prompts, const double* const* targets,
+                                 size_t number_of_samples, double learning_rate, ModelGradients* gradients, double* loss){
+    if (context == NULL || model == NULL || prompts == NULL || targets == NULL || gradients == NULL || number_of_samples == 0){
+        fprintf(stderr, "Error in %s: NULL parameter or no sample.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    const size_t count = model_parameter_count(model);
+    if (context->compression == DISTRIBUTED_COMPRESSION_TOPK && context->residual_count != count){
+        free(context->residual);
+        context->residual = calloc(count, sizeof(double));
+        context->residual_count = (context->residual != NULL) ? count : 0;
+        if (context->residual == NULL){
+            fprintf(stderr, "Error in %s: memory allocation error. 'residual' is NULL.\n", __func__);
+            return ERROR_MALLOC_OUT_OF_MEMORY;
+        }
+    }
+    zero_model_gradients(gradients, model);
+    context->gradient_base = gradients->biases[0];
+    double total_loss = 0.0;
+    ErrorCode error = NO_ERROR;
+    int reduced = 0;
+    for (size_t s = 0; s < number_of_samples && error == NO_ERROR; s++){
+        Output output = calculate_output(&prompts[s], model);
+        if (output.is_valid != 1){
+            error = ERROR_INVALID_PARAMETER;
+            break;
+        }
+        double sample_loss = 0.0;
+        const int last = (s + 1 == number_of_samples) && context->world_size > 1;
+        error = backward_pass_hooked(model, &output, targets[s], gradients, &sample_loss, last ? gradients_ready : NULL, context);
+        reduced = last && error == NO_ERROR;
+        total_loss += sample_loss;
+        free_output(&output);
+    }
+    if (context->world_size > 1 && !reduced){
+        fprintf(stderr, "Error in %s: rank %d failed its local pass, it sends zero gradients.\n", __func__, context->rank);
+        enqueue_zero_gradients(context, model, gradients);
+    }
+    // every rank must take part in the all-reduce of every layer, so the step is only abandoned after it
+    const ErrorCode communication = distributed_wait(context);
+    if (error == NO_ERROR){
+        error = communication;
+    }
+    if (error != NO_ERROR){
+        return error;
+    }
+    if (loss != NULL){
+        *loss = total_loss / (double)number_of_samples;
+    }
+    return apply_gradients(model, gradients, learning_rate / ((double)context->world_size * (double)number_of_samples));
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END CONTEXT -+-+-+-+-+-+-+-+-+-+-+- */
@@ -0,0 +1,100 @@
+#ifndef DISTRIBUTED_FUNCTIONS_H
+#define DISTRIBUTED_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "node_functions.h"
+#include "training_functions.h"
+
+/**
+ * @brief Data parallel training over several processes.
+ * The world_size processes (ranks) form a ring over Unix domain or TCP sockets: every rank listens on its own endpoint,
+ * connects to rank + 1 and accepts rank - 1. Each rank trains on its shard of the dataset and the gradients are summed with a
+ * ring all-reduce (reduce-scatter then all-gather, 2 * (world_size - 1) steps moving 1 / world_size of the data each).
+ * The all-reduce of a layer starts on a communication thread as soon as backward_pass_hooked finished it, while the earlier
+ * layers are still being backpropagated. Optional compression:
+ *  - fp16: the chunks travel as IEEE half precision (saturating), the final values are rounded identically on every rank;
+ *  - top-k: every rank sends only the largest ratio of its values (index + float), keeping the rest as a residual added to
+ *    the next step (error feedback), the sparse contributions are gathered around the ring and summed in rank order.
+ * Every rank ends a step with bit identical parameters.
+ */
+
+#define DISTRIBUTED_CONNECT_TIMEOUT_MS 10000
+#define DISTRIBUTED_MAX_PATH 108
+
+typedef enum DistributedTransport{
+    DISTRIBUTED_UNIX = 0,       // address is a path prefix, rank r listens on "<address>.<r>"
+    DISTRIBUTED_TCP,            // address is an IPv4 host, rank r listens on base_port + r
+} DistributedTransport;
+
+typedef enum DistributedCompression{
+    DISTRIBUTED_COMPRESSION_NONE = 0,
+    DISTRIBUTED_COMPRESSION_FP16,
+    DISTRIBUTED_COMPRESSION_TOPK,
+} DistributedCompression;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT DISTRIBUTED CONTEXT -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A segment of values to sum over the ring, queued for the communication thread
+ */
+typedef struct AllReduceJob{
+    double* values;
+    size_t count;
+    size_t offset;          // of values in the gradients, for the top-k residual; (size_t)-1 if not gradients
+    int compress;           // 0 forces an exact all-reduce
+    struct AllReduceJob* next;
+} AllReduceJob;
+
+/**
+ * @brief One rank of the ring
+ *
+ * @param rank, world_size(int): Position in the ring and number of processes
+ * @param left_fd, right_fd(int): Sockets receiving from rank - 1 and sending to rank + 1, -1 when world_size is 1
+ * @param compression(DistributedCompression): Applied to the gradients
+ * @param topk_ratio(double): Fraction of the values sent with DISTRIBUTED_COMPRESSION_TOPK
+ * @param residual(double*): Error feedback of top-k, one value per parameter
+ * @param error(ErrorCode): First failure of the communication thread, reported by distributed_wait
+ * @param bytes_sent(size_t): Payload sent so far
+ */
+typedef struct DistributedContext{
+    int rank;
+    int world_size;
+    int left_fd;
+    int right_fd;
+    DistributedCompression compression;
+    double topk_ratio;
+    double* residual;
+    size_t residual_count;
+    unsigned char* scratch;
+    size_t scratch_bytes;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_available;
+    pthread_cond_t idle;
+    AllReduceJob* head;
+    AllReduceJob* tail;
+    size_t unfinished;
+    int stopping;
+    ErrorCode error;
+    double* gradient_base;      // values of the gradients of the step in progress
+    size_t bytes_sent;
+} DistributedContext;
+
+//                                          FUNCTION PROTOTYPES
+DistributedContext* create_distributed_context(int rank, int world_size, DistributedTransport transport, const char* address, int base_port,
+                                               DistributedCompression compression, double topk_ratio);
+void free_distributed_context(DistributedContext* context);
+ErrorCode distributed_allreduce(DistributedContext* context, double* values, size_t count);
+ErrorCode distributed_wait(DistributedContext* context);
+ErrorCode distributed_broadcast_parameters(DistributedContext* context, Model* model);
+ErrorCode distributed_train_step(DistributedContext* context, Model* model, Prompt* prompts, const double* const* targets,
+                                 size_t number_of_samples, double learning_rate, ModelGradients* gradients, double* loss);
+uint16_t double_to_half(double value);
+double half_to_double(uint16_t half);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT DISTRIBUTED CONTEXT -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // DISTRIBUTED_FUNCTIONS_H
@@ -0,0 +1,541 @@
+#include "settings.h"
+#include "graph_functions.h"
+#include "plan_functions.h"
+#include "matrix_functions.h"
+#include "kernel_functions.h"
+#include "allocator_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GRAPH_ALIGNED_DOUBLES(n) (((n) + PLAN_ALIGNMENT / sizeof(double) - 1) / (PLAN_ALIGNMENT / sizeof(double)) * (PLAN_ALIGNMENT / sizeof(double)))
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- GRAPH CONSTRUCTION -+-+-+-+-+-+-+-+-+-+-+- */
+
+Graph* create_graph(void){
+    Graph* graph = calloc(1, sizeof(Graph));
+    if (graph == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return NULL;
+    }
+    graph->output = GRAPH_INVALID_NODE;
+    return graph;
+}
+
+/**
+ * @brief Appends a node reading the given earlier nodes, the kind specific fields are left to the caller
+ * @return GraphNode* The new node, NULL on failure
+ */
+static GraphNode* append_node(Graph* graph, GraphNodeKind kind, size_t width, const size_t* inputs, size_t number_of_inputs, const char* caller){
+    if (graph == NULL || width == 0 || (number_of_inputs > 0 && inputs == NULL)){
+        fprintf(stderr, "Error in %s: NULL graph or inputs, or a node of width 0.\n", caller);
+        return NULL;
+    }
+    for (size_t k = 0; k < number_of_inputs; k++){
+        if (inputs[k] >= graph->number_of_nodes){
+            fprintf(stderr, "Error in %s: input %zu is not an existing node (the graph has %zu).\n", caller, inputs[k], graph->number_of_nodes);
+            return NULL;
+        }
+    }
+    if (graph->number_of_nodes == graph->capacity){
+        const size_t capacity = graph->capacity ? 2 * graph->capacity : 8;
+        GraphNode* nodes = realloc(graph->nodes, capacity * sizeof(GraphNode));
+        if (nodes == NULL){
+            fprintf(stderr, "Error in %s: out of memory.\n", caller);
+            return NULL;
+        }
+        graph->nodes = nodes;
+        graph->capacity = capacity;
+    }
+    GraphNode* node = &graph->nodes[graph->number_of_nodes];
+    memset(node, 0, sizeof(GraphNode));
+    node->kind = kind;
+    node->width = width;
+    node->number_of_inputs = number_of_inputs;
+    if (number_of_inputs > 0){
+        node->inputs = malloc(number_of_inputs * sizeof(size_t));
+        if (node->inputs == NULL){
+            fprintf(stderr, "Error in %s: out of memory.\n", caller);
+            return NULL;
+        }
+        memcpy(node->inputs, inputs, number_of_inputs * sizeof(size_t));
+    }
+    graph->number_of_nodes++;
+    return node;
+}
+
+/**
+ * @brief Removes the last node after its allocations failed, what it did allocate is freed by the caller
+ */
+static size_t drop_last_node(Graph* graph){
+    free(graph->nodes[--graph->number_of_nodes].inputs);
+    return GRAPH_INVALID_NODE;
+}
+
+/**
+ * @brief Adds an input vector
+ *
+ * @param width(size_t): Its length
+ * @param activation(activation_function): Applied with the node's biases (zeros) like the input layer of a Model, NULL for none
+ * @return size_t The id of the node, GRAPH_INVALID_NODE on failure
+ */
+size_t graph_add_input(Graph* graph, size_t width, activation_function activation){
+    GraphNode* node = append_node(graph, GRAPH_NODE_INPUT, width, NULL, 0, __func__);
+    if (node == NULL){
+        return GRAPH_INVALID_NODE;
+    }
+    if (activation != NULL){
+        node->layer = create_layer(width, activation, NULL);
+        if (node->layer.biases == NULL){
+            return drop_last_node(graph);
+        }
+        node->has_layer = 1;
+    }
+    return graph->number_of_nodes - 1;
+}
+
+/**
+ * @brief Adds a fully connected layer, its weights and biases are zeros to be filled through graph->nodes[id]
+ *
+ * @param input(size_t): The node it reads
+ * @param width(size_t): Its number of nodes
+ * @param activation(activation_function): Its activation
+ * @return size_t The id of the node, GRAPH_INVALID_NODE on failure
+ */
+size_t graph_add_dense(Graph* graph, size_t input, size_t width, activation_function activation){
+    if (activation == NULL){
+        fprintf(stderr, "Error in %s: NULL activation.\n", __func__);
+        return GRAPH_INVALID_NODE;
+    }
+    GraphNode* node = append_node(graph, GRAPH_NODE_DENSE, width, &input, 1, __func__);
+    if (node == NULL){
+        return GRAPH_INVALID_NODE;
+    }
+    const size_t fan_in = graph->nodes[input].width;
+    node->weights = create_matrix_double((int)fan_in, (int)width);
+    node->layer = create_layer(width, activation, NULL);
+    if (node->weights == NULL || node->layer.biases == NULL){
+        fprintf(stderr, "Error in %s: out of memory for a %zu x %zu layer.\n", __func__, fan_in, width);
+        if (node->layer.biases != NULL){
+            free_layer(&node->layer);
+        }
+        free(node->inputs);
+        if (node->weights != NULL){
+            free_double_matrix(node->weights, (int)fan_in);
+        }
+        graph->number_of_nodes--;
+        return GRAPH_INVALID_NODE;
+    }
+    init_matrix_to_double_value(node->weights, (int)fan_in, (int)width, 0.0);
+    node->layer.kernel = select_layer_kernel(fan_in, width);
+    node->has_layer = 1;
+    return graph->number_of_nodes - 1;
+}
+
+/**
+ * @brief Adds the element-wise sum of nodes of the same width (a residual connection)
+ * @return size_t The id of the node, GRAPH_INVALID_NODE on failure
+ */
+size_t graph_add_add(Graph* graph, const size_t* inputs, size_t number_of_inputs){
+    if (graph == NULL || inputs == NULL || number_of_inputs < 2){
+        fprintf(stderr, "Error in %s: an add node needs at least two inputs.\n", __func__);
+        return GRAPH_INVALID_NODE;
+    }
+    for (size_t k = 0; k < number_of_inputs; k++){
+        if (inputs[k] >= graph->number_of_nodes || graph->nodes[inputs[k]].width != graph->nodes[inputs[0]].width){
+            fprintf(stderr, "Error in %s: input %zu is not a node of the width of the first one.\n", __func__, inputs[k]);
+            return GRAPH_INVALID_NODE;
+        }
+    }
+    return append_node(graph, GRAPH_NODE_ADD, graph->nodes[inputs[0]].width, inputs, number_of_inputs, __func__) != NULL
+           ? graph->number_of_nodes - 1 : GRAPH_INVALID_NODE;
+}
+
+/**
+ * @brief Adds the concatenation of nodes, in the order given
+ * @return size_t The id of the node, GRAPH_INVALID_NODE on failure
+ */
+size_t graph_add_concat(Graph* graph, const size_t* inputs, size_t number_of_inputs){
+    if (graph == NULL || inputs == NULL || number_of_inputs == 0){
+        fprintf(stderr, "Error in %s: a concat node needs inputs.\n", __func__);
+        return GRAPH_INVALID_NODE;
+    }
+    size_t width = 0;
+    for (size_t k = 0; k < number_of_inputs; k++){
+        if (inputs[k] >= graph->number_of_nodes){
+            fprintf(stderr, "Error in %s: input %zu is not an existing node.\n", __func__, inputs[k]);
+            return GRAPH_INVALID_NODE;
+        }
+        width += graph->nodes[inputs[k]].width;
+    }
+    return append_node(graph, GRAPH_NODE_CONCAT, width, inputs, number_of_inputs, __func__) != NULL
+           ? graph->number_of_nodes - 1 : GRAPH_INVALID_NODE;
+}
+
+ErrorCode graph_set_output(Graph* graph, size_t node){
+    if (graph == NULL || node >= graph->number_of_nodes){
+        fprintf(stderr, "Error in %s: NULL graph or node %zu out of the graph.\n", __func__, node);
+        return ERROR_INVALID_PARAMETER;
+    }
+    graph->output = node;
+    return NO_ERROR;
+}
+
+/**
+ * @brief The chain of a Model as a graph: an input node with the input layer's biases and activation, then one dense node per layer
+ * with copies of the weights, biases and kernels
+ *
+ * @return Graph* NULL on failure
+ */
+Graph* graph_from_model(const Model* model){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0
+        || (model->number_of_layers_in_the_model > 1 && model->model_weights == NULL)){
+        fprintf(stderr, "Error in %s: NULL model, layers or weights.\n", __func__);
+        return NULL;
+    }
+    Graph* graph = create_graph();
+    if (graph == NULL){
+        return NULL;
+    }
+    const Layer* input_layer = &model->model_layers[0];
+    size_t previous = graph_add_input(graph, input_layer->number_of_nodes_in_the_layer, input_layer->activation);
+    if (previous != GRAPH_INVALID_NODE){
+        memcpy(graph->nodes[previous].layer.biases, input_layer->biases, input_layer->number_of_nodes_in_the_layer * sizeof(double));
+        graph->nodes[previous].layer.threshold = input_layer->threshold;
+    }
+    for (size_t i = 1; i < model->number_of_layers_in_the_model && previous != GRAPH_INVALID_NODE; i++){
+        const Layer* source = &model->model_layers[i];
+        const size_t fan_in = model->model_layers[i-1].number_of_nodes_in_the_layer;
+        const size_t node = graph_add_dense(graph, previous, source->number_of_nodes_in_the_layer, source->activation);
+        if (node != GRAPH_INVALID_NODE){
+            GraphNode* dense = &graph->nodes[node];
+            for (size_t r = 0; r < fan_in; r++){
+                memcpy(dense->weights[r], model->model_weights[i-1][r], source->number_of_nodes_in_the_layer * sizeof(double));
+            }
+            memcpy(dense->layer.biases, source->biases, source->number_of_nodes_in_the_layer * sizeof(double));
+            dense->layer.threshold = source->threshold;
+            if (source->kernel != NULL){
+                dense->layer.kernel = source->kernel;
+            }
+        }
+        previous = node;
+    }
+    if (previous == GRAPH_INVALID_NODE){
+        fprintf(stderr, "Error in %s: cannot convert model '%s'.\n", __func__, model->model_name);
+        free_graph(graph);
+        return NULL;
+    }
+    graph_set_output(graph, previous);
+    return graph;
+}
+
+void free_graph(Graph* graph){
+    if (graph == NULL){
+        return;
+    }
+    for (size_t i = 0; i < graph->number_of_nodes; i++){
+        GraphNode* node = &graph->nodes[i];
+        if (node->weights != NULL){
+            free_double_matrix(node->weights, (int)graph->nodes[node->inputs[0]].width);
+        }
+        if (node->has_layer){
+            free_layer(&node->layer);
+        }
+        free(node->inputs);
+    }
+    free(graph->nodes);
+    free(graph);
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- SCHEDULE AND MEMORY PLAN -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A buffer of the arena: alive from step first to step last (both included)
+ */
+typedef struct GraphValue{
+    size_t doubles;
+    size_t first;
+    size_t last;
+    size_t offset;
+} GraphValue;
+
+static int compare_values_by_size(const void* a, const void* b){
+    const GraphValue* x = *(const GraphValue* const*)a;
+    const GraphValue* y = *(const GraphValue* const*)b;
+    if (x->doubles != y->doubles){
+        return x->doubles < y->doubles ? 1 : -1;
+    }
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+/**
+ * @brief Greedy by size: each value, largest first, goes to the lowest offset that no placed value alive at the same time covers
+ *
+ * @param arena_doubles(size_t*): Receives the arena size in doubles
+ * @return ErrorCode
+ */
+static ErrorCode pack_values(GraphValue* values, size_t number_of_values, size_t* arena_doubles){
+    GraphValue** order = malloc(number_of_values * sizeof(GraphValue*));
+    GraphValue** overlapping = malloc(number_of_values * sizeof(GraphValue*));
+    if (order == NULL || overlapping == NULL){
+        free(order);
+        free(overlapping);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    for (size_t v = 0; v < number_of_values; v++){
+        order[v] = &values[v];
+    }
+    qsort(order, number_of_values, sizeof(GraphValue*), compare_values_by_size);
+    size_t arena = 0;
+    for (size_t placed = 0; placed < number_of_values; placed++){
+        GraphValue* value = order[placed];
+        // the placed values alive at the same time as this one, by offset
+        size_t count = 0;
+        for (size_t p = 0; p < placed; p++){
+            if (order[p]->first <= value->last && value->first <= order[p]->last){
+                size_t position = count++;
+                for (; position > 0 && overlapping[position - 1]->offset > order[p]->offset; position--){
+                    overlapping[position] = overlapping[position - 1];
+                }
+                overlapping[position] = order[p];
+            }
+        }
+        size_t offset = 0;
+        for (size_t o = 0; o < count; o++){
+            if (offset + value->doubles <= overlapping[o]->offset){
+                break;
+            }
+            if (overlapping[o]->offset + overlapping[o]->doubles > offset){
+                offset = overlapping[o]->offset + overlapping[o]->doubles;
+            }
+        }
+        value->offset = offset;
+        if (offset + value->doubles > arena){
+            arena = offset + value->doubles;
+        }
+    }
+    free(order);
+    free(overlapping);
+    *arena_doubles = arena;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Schedules the nodes the output depends on and plans their buffers in one arena.
+ * Node ids are a topological order (a node only reads earlier ones), the schedule is the needed nodes in that order.
+ * The plan points to the nodes of the graph: it must be compiled again if nodes are added, and freed before the graph.
+ *
+ * @param graph(const Graph*): A graph with an output
+ * @return GraphPlan* NULL on failure
+ */
+GraphPlan* compile_graph(const Graph* graph){
+    if (graph == NULL || graph->output >= graph->number_of_nodes){
+        fprintf(stderr, "Error in %s: NULL graph or no output node.\n", __func__);
+        return NULL;
+    }
+    const size_t number_of_nodes = graph->number_of_nodes;
+    size_t* step_of = malloc(number_of_nodes * sizeof(size_t));
+    size_t* input_index = malloc(number_of_nodes * sizeof(size_t));
+    GraphPlan* plan = calloc(1, sizeof(GraphPlan));
+    if (step_of == NULL || input_index == NULL || plan == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        free(step_of);
+        free(input_index);
+        free(plan);
+        return NULL;
+    }
+    // what the output needs: walk the ids down from the output
+    for (size_t i = 0; i < number_of_nodes; i++){
+        step_of[i] = GRAPH_INVALID_NODE;
+    }
+    step_of[graph->output] = 0;
+    size_t total_inputs = 0;
+    for (size_t i = graph->output + 1; i-- > 0;){
+        if (step_of[i] == GRAPH_INVALID_NODE){
+            continue;
+        }
+        plan->number_of_steps++;
+        total_inputs += graph->nodes[i].number_of_inputs;
+        for (size_t k = 0; k < graph->nodes[i].number_of_inputs; k++){
+            step_of[graph->nodes[i].inputs[k]] = 0;
+        }
+    }
+    for (size_t i = 0, step = 0; i < number_of_nodes; i++){
+        input_index[i] = (graph->nodes[i].kind == GRAPH_NODE_INPUT) ? plan->number_of_graph_inputs++ : GRAPH_INVALID_NODE;
+        if (step_of[i] != GRAPH_INVALID_NODE){
+            step_of[i] = step++;
+        }
+    }
+
+    // one value per node output, one per dense pre-activation
+    GraphValue* values = calloc(2 * plan->number_of_steps, sizeof(GraphValue));
+    size_t* value_of = malloc(number_of_nodes * sizeof(size_t));
+    plan->steps = calloc(plan->number_of_steps, sizeof(GraphStep));
+    plan->offsets = malloc((2 * total_inputs + 1) * sizeof(size_t));
+    size_t* pre_activation_value = malloc(plan->number_of_steps * sizeof(size_t));
+    if (values == NULL || value_of == NULL || plan->steps == NULL || plan->offsets == NULL || pre_activation_value == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        free(step_of);
+        free(input_index);
+        free(values);
+        free(value_of);
+        free(pre_activation_value);
+        free_graph_plan(plan);
+        return NULL;
+    }
+    size_t number_of_values = 0;
+    for (size_t i = 0; i < number_of_nodes; i++){
+        if (step_of[i] == GRAPH_INVALID_NODE){
+            continue;
+        }
+        const GraphNode* node = &graph->nodes[i];
+        const size_t step = step_of[i];
+        value_of[i] = number_of_values;
+        values[number_of_values++] = (GraphValue){ .doubles = GRAPH_ALIGNED_DOUBLES(node->width), .first = step,
+                                                   .last = (i == graph->output) ? plan->number_of_steps : step };
+        pre_activation_value[step] = GRAPH_INVALID_NODE;
+        if (node->kind == GRAPH_NODE_DENSE){
+            pre_activation_value[step] = number_of_values;
+            values[number_of_values++] = (GraphValue){ .doubles = GRAPH_ALIGNED_DOUBLES(node->width), .first = step, .last = step };
+        }
+        for (size_t k = 0; k < node->number_of_inputs; k++){
+            GraphValue* input = &values[value_of[node->inputs[k]]];
+            if (input->last < step){
+                input->last = step;
+            }
+        }
+    }
+    for (size_t v = 0; v < number_of_values; v++){
+        plan->naive_doubles += values[v].doubles;
+    }
+    for (size_t step = 0; step <= plan->number_of_steps; step++){
+        size_t alive = 0;
+        for (size_t v = 0; v < number_of_values; v++){
+            alive += (values[v].first <= step && step <= values[v].last) ? values[v].doubles : 0;
+        }
+        if (alive > plan->lower_bound_doubles){
+            plan->lower_bound_doubles = alive;
+        }
+    }
+    if (pack_values(values, number_of_values, &plan->arena_doubles) != NO_ERROR){
+        fprintf(stderr, "Error in %s: out of memory while packing the buffers.\n", __func__);
+        free(step_of);
+        free(input_index);
+        free(values);
+        free(value_of);
+        free(pre_activation_value);
+        free_graph_plan(plan);
+        return NULL;
+    }
+
+    size_t* input_offsets = plan->offsets;
+    size_t* input_widths = plan->offsets + total_inputs;
+    for (size_t i = 0; i < number_of_nodes; i++){
+        if (step_of[i] == GRAPH_INVALID_NODE){
+            continue;
+        }
+        const GraphNode* node = &graph->nodes[i];
+        GraphStep* step = &plan->steps[step_of[i]];
+        step->kind = node->kind;
+        step->node = i;
+        step->width = node->width;
+        step->number_of_inputs = node->number_of_inputs;
+        step->input_offsets = input_offsets;
+        step->input_widths = input_widths;
+        for (size_t k = 0; k < node->number_of_inputs; k++){
+            *input_offsets++ = values[value_of[node->inputs[k]]].offset;
+            *input_widths++ = graph->nodes[node->inputs[k]].width;
+        }
+        step->input_index = input_index[i];
+        step->output_offset = values[value_of[i]].offset;
+        if (pre_activation_value[step_of[i]] != GRAPH_INVALID_NODE){
+            step->pre_activation_offset = values[pre_activation_value[step_of[i]]].offset;
+        }
+        step->weights = node->weights;
+        step->layer = node->has_layer ? &node->layer : NULL;
+    }
+    plan->graph = graph;
+    plan->output_length = graph->nodes[graph->output].width;
+    plan->output_offset = values[value_of[graph->output]].offset;
+    TRACE_DEBUG(TRACE_CATEGORY_MEMORY, "graph plan: %zu steps, arena %zu doubles (lower bound %zu, one buffer per value %zu)",
+                plan->number_of_steps, plan->arena_doubles, plan->lower_bound_doubles, plan->naive_doubles);
+    free(step_of);
+    free(input_index);
+    free(values);
+    free(value_of);
+    free(pre_activation_value);
+    return plan;
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- EXECUTION -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Allocates an arena for graph_execute from the thread's current allocator, a thread reuses it for every call
+ * @return double* The arena, NULL if out of memory
+ */
+double* graph_create_arena(const GraphPlan* plan){
+    if (plan == NULL){
+        fprintf(stderr, "Error in %s: 'plan' is NULL.\n", __func__);
+        return NULL;
+    }
+    return allocator_allocate(NULL, (plan->arena_doubles ? plan->arena_doubles : 1) * sizeof(double), PLAN_ALIGNMENT, ALLOCATOR_SUBSYSTEM_OUTPUT);
+}
+
+void graph_free_arena(double* arena){
+    allocator_release(NULL, arena, ALLOCATOR_SUBSYSTEM_OUTPUT);
+}
+
+/**
+ * @brief Runs the schedule in the arena, nothing is checked
+ *
+ * @param plan(const GraphPlan*): From compile_graph
+ * @param inputs(const double* const*): One vector per input node of the graph, in creation order (the unused ones may be NULL)
+ * @param arena(double*): plan->arena_doubles values (graph_create_arena); the values of the nodes overwrite each other in it
+ * @return const double* The plan->output_length values of the output node, inside the arena
+ */
+const double* graph_execute(const GraphPlan* plan, const double* const* inputs, double* arena){
+    const GraphStep* const end = plan->steps + plan->number_of_steps;
+    for (const GraphStep* step = plan->steps; step < end; step++){
+        double* output = arena + step->output_offset;
+        switch (step->kind){
+            case GRAPH_NODE_INPUT:
+                if (step->layer != NULL){
+                    layer_activation_forward(inputs[step->input_index], step->layer, output);
+                } else {
+                    memcpy(output, inputs[step->input_index], step->width * sizeof(double));
+                }
+                break;
+            case GRAPH_NODE_DENSE:
+                step->layer->kernel(arena + step->input_offsets[0], step->input_widths[0], step->weights, step->layer,
+                                    arena + step->pre_activation_offset, output);
+                break;
+            case GRAPH_NODE_ADD:{
+                memcpy(output, arena + step->input_offsets[0], step->width * sizeof(double));
+                for (size_t k = 1; k < step->number_of_inputs; k++){
+                    const double* input = arena + step->input_offsets[k];
+                    for (size_t j = 0; j < step->width; j++){
+                        output[j] += input[j];
+                    }
+                }
+                break;
+            }
+            case GRAPH_NODE_CONCAT:
+                for (size_t k = 0; k < step->number_of_inputs; k++){
+                    memcpy(output, arena + step->input_offsets[k], step->input_widths[k] * sizeof(double));
+                    output += step->input_widths[k];
+                }
+                break;
+        }
+    }
+    return arena + plan->output_offset;
+}
+
+void free_graph_plan(GraphPlan* plan){
+    if (plan == NULL){
+        return;
+    }
+    free(plan->steps);
+    free(plan->offsets);
+    free(plan);
+}
@@ -0,0 +1,125 @@
+#ifndef GRAPH_FUNCTIONS_H
+#define GRAPH_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+
+/**
+ * @brief Networks with a general DAG topology: skip and residual connections, element-wise sums and concatenations.
+ * A Graph is built node by node, a node only reads nodes created before it (so the graph is acyclic by construction):
+ *  - GRAPH_NODE_INPUT: an input vector, with optional biases and activation (the input layer of a Model), identity if activation is NULL
+ *  - GRAPH_NODE_DENSE: a fully connected layer of one input, computed by the kernels of kernel_functions.h
+ *  - GRAPH_NODE_ADD: element-wise sum of inputs of the same width
+ *  - GRAPH_NODE_CONCAT: the inputs one after the other
+ * compile_graph keeps the nodes the output depends on, orders them topologically and plans the activation memory statically:
+ * every value (the output of a node, the pre-activations of a dense node) lives from the step that writes it to the last step that
+ * reads it, and the values are packed into one arena, largest first, each at the lowest offset free over its whole lifetime.
+ * Values whose lifetimes do not overlap share memory, so the arena is close to the largest sum of values alive at a single step
+ * (lower_bound_doubles) instead of one buffer per node (naive_doubles).
+ * graph_from_model turns a Model into the equivalent chain, its outputs are the ones of calculate_output.
+ */
+
+#define GRAPH_INVALID_NODE ((size_t)-1)
+
+typedef enum GraphNodeKind{
+    GRAPH_NODE_INPUT = 0,
+    GRAPH_NODE_DENSE,
+    GRAPH_NODE_ADD,
+    GRAPH_NODE_CONCAT,
+} GraphNodeKind;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT GRAPH -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A node of a graph
+ *
+ * @param width(size_t): Length of the output of the node
+ * @param inputs(size_t*): number_of_inputs ids of earlier nodes (one for a dense node, none for an input node)
+ * @param weights(double**): GRAPH_NODE_DENSE: input width x width matrix, weights[r][c] from input r to node c, zeros at creation
+ * @param layer(Layer): GRAPH_NODE_INPUT with an activation and GRAPH_NODE_DENSE: biases (zeros at creation), activation and kernel
+ * @param has_layer(int): != 0 if layer is allocated
+ */
+typedef struct GraphNode{
+    GraphNodeKind kind;
+    size_t width;
+    size_t number_of_inputs;
+    size_t* inputs;
+    double** weights;
+    Layer layer;
+    int has_layer;
+} GraphNode;
+
+/**
+ * @brief A graph under construction
+ *
+ * @param output(size_t): The node whose value is the result, GRAPH_INVALID_NODE until graph_set_output
+ */
+typedef struct Graph{
+    size_t number_of_nodes;
+    size_t capacity;
+    GraphNode* nodes;
+    size_t output;
+} Graph;
+
+/**
+ * @brief One node of the schedule, with its buffers resolved to arena offsets
+ *
+ * @param input_offsets(size_t*): Where the inputs are in the arena, input_widths their lengths
+ * @param input_index(size_t): GRAPH_NODE_INPUT: which vector of graph_execute it takes
+ * @param pre_activation_offset(size_t): GRAPH_NODE_DENSE: scratch for the weighted sums
+ */
+typedef struct GraphStep{
+    GraphNodeKind kind;
+    size_t node;
+    size_t width;
+    size_t number_of_inputs;
+    const size_t* input_offsets;
+    const size_t* input_widths;
+    size_t input_index;
+    size_t output_offset;
+    size_t pre_activation_offset;
+    double* const* weights;
+    const Layer* layer;
+} GraphStep;
+
+/**
+ * @brief The compiled graph
+ *
+ * @param number_of_graph_inputs(size_t): Input nodes of the graph (graph_execute takes one vector per input node, in creation order)
+ * @param arena_doubles(size_t): Size of the arena graph_execute works in
+ * @param lower_bound_doubles(size_t): Largest sum of the (aligned) values alive at one step, no plan can use less
+ * @param naive_doubles(size_t): One buffer per value, what the arena would be without reuse
+ * @param steps(GraphStep*): number_of_steps steps in execution order
+ */
+typedef struct GraphPlan{
+    const Graph* graph;
+    size_t number_of_graph_inputs;
+    size_t output_length;
+    size_t output_offset;
+    size_t arena_doubles;
+    size_t lower_bound_doubles;
+    size_t naive_doubles;
+    size_t number_of_steps;
+    GraphStep* steps;
+    size_t* offsets;
+} GraphPlan;
+
+//                                          FUNCTION PROTOTYPES
+Graph* create_graph(void);
+size_t graph_add_input(Graph* graph, size_t width, activation_function activation);
+size_t graph_add_dense(Graph* graph, size_t input, size_t width, activation_function activation);
+size_t graph_add_add(Graph* graph, const size_t* inputs, size_t number_of_inputs);
+size_t graph_add_concat(Graph* graph, const size_t* inputs, size_t number_of_inputs);
+ErrorCode graph_set_output(Graph* graph, size_t node);
+Graph* graph_from_model(const Model* model);
+void free_graph(Graph* graph);
+GraphPlan* compile_graph(const Graph* graph);
+double* graph_create_arena(const GraphPlan* plan);
+void graph_free_arena(double* arena);
+const double* graph_execute(const GraphPlan* plan, const double* const* inputs, double* arena);
+void free_graph_plan(GraphPlan* plan);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT GRAPH -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // GRAPH_FUNCTIONS_H
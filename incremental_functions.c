@@ -0,0 +1,224 @@
+#include "settings.h"
+#include "incremental_functions.h"
+#include "kernel_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- CREATION -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Creates the state of an incremental evaluation of the model, the first incremental_forward is a full pass
+ *
+ * @param model The model, its topology must not change while the state is used
+ * @param full_pass_ratio Fraction in (0, 1] of changed inputs above which a layer is recomputed in full, <= 0 = INCREMENTAL_DEFAULT_FULL_PASS_RATIO
+ * @param refresh_interval Incremental updates between two full passes, 0 = INCREMENTAL_DEFAULT_REFRESH_INTERVAL
+ * @return IncrementalState* or NULL on error
+ */
+IncrementalState* create_incremental_state(Model* model, double full_pass_ratio, size_t refresh_interval){
+    if (model == NULL || model->model_layers == NULL || model->model_weights == NULL){
+        fprintf(stderr, "Error in %s: 'model' is NULL or not initialized.\n", __func__);
+        return NULL;
+    }
+    IncrementalState* state = calloc(1, sizeof(IncrementalState));
+    if (state == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'state' is NULL.\n", __func__);
+        return NULL;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    size_t widest_layer = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        if (model->model_layers[i].number_of_nodes_in_the_layer > widest_layer){
+            widest_layer = model->model_layers[i].number_of_nodes_in_the_layer;
+        }
+    }
+
+    state->model = model;
+    state->full_pass_ratio = (full_pass_ratio > 0.0) ? full_pass_ratio : INCREMENTAL_DEFAULT_FULL_PASS_RATIO;
+    state->refresh_interval = (refresh_interval > 0) ? refresh_interval : INCREMENTAL_DEFAULT_REFRESH_INTERVAL;
+    state->previous_prompt = malloc(model->model_layers[0].number_of_nodes_in_the_layer * sizeof(double));
+    state->pre_activations = calloc(number_of_layers, sizeof(double*));
+    state->outputs = calloc(number_of_layers, sizeof(double*));
+    state->changed_nodes = malloc(widest_layer * sizeof(size_t));
+    state->next_changed_nodes = malloc(widest_layer * sizeof(size_t));
+    state->changes = malloc(widest_layer * sizeof(double));
+    state->next_changes = malloc(widest_layer * sizeof(double));
+    int failed = (state->previous_prompt == NULL || state->pre_activations == NULL || state->outputs == NULL || state->changed_nodes == NULL
+                  || state->next_changed_nodes == NULL || state->changes == NULL || state->next_changes == NULL);
+    for (size_t i = 0; i < number_of_layers && !failed; i++){
+        const size_t number_of_nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        state->pre_activations[i] = malloc(number_of_nodes * sizeof(double));
+        state->outputs[i] = malloc(number_of_nodes * sizeof(double));
+        failed = (state->pre_activations[i] == NULL || state->outputs[i] == NULL);
+    }
+    if (failed){
+        fprintf(stderr, "Error in %s: memory allocation error.\n", __func__);
+        free_incremental_state(state);
+        return NULL;
+    }
+    return state;
+}
+
+void free_incremental_state(IncrementalState* state){
+    if (state == NULL){
+        return;
+    }
+    for (size_t i = 0; state->model != NULL && i < state->model->number_of_layers_in_the_model; i++){
+        if (state->pre_activations != NULL) free(state->pre_activations[i]);
+        if (state->outputs != NULL) free(state->outputs[i]);
+    }
+    free(state->pre_activations);
+    free(state->outputs);
+    free(state->previous_prompt);
+    free(state->changed_nodes);
+    free(state->next_changed_nodes);
+    free(state->changes);
+    free(state->next_changes);
+    free(state);
+}
+
+/**
+ * @brief Forces the next incremental_forward to be a full pass
+ */
+void incremental_reset(IncrementalState* state){
+    if (state != NULL){
+        state->is_primed = 0;
+    }
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- FORWARD -+-+-+-+-+-+-+-+-+-+-+- */
+
+static void full_forward(IncrementalState* state, const double* tokens){
+    Model* model = state->model;
+    const size_t input_length = model->model_layers[0].number_of_nodes_in_the_layer;
+    memcpy(state->previous_prompt, tokens, input_length * sizeof(double));
+    memcpy(state->pre_activations[0], tokens, input_length * sizeof(double));
+    layer_activation_forward(state->pre_activations[0], &model->model_layers[0], state->outputs[0]);
+    for (size_t i = 1; i < model->number_of_layers_in_the_model; i++){
+        const Layer* layer = &model->model_layers[i];
+        layer_kernel_function kernel = (layer->kernel != NULL) ? layer->kernel : fused_layer_forward;
+        kernel(state->outputs[i-1], model->model_layers[i-1].number_of_nodes_in_the_layer, model->model_weights[i-1],
+               layer, state->pre_activations[i], state->outputs[i]);
+    }
+    state->is_primed = 1;
+    state->updates_since_refresh = 0;
+    state->weights_version = model->weights_version;
+    state->full_passes++;
+}
+
+/**
+ * @brief Applies the changes of the previous layer to layer i and collects the nodes of layer i whose output changed
+ * @return size_t The number of changed nodes of layer i (stored in next_changed_nodes / next_changes)
+ */
+static size_t update_layer(IncrementalState* state, size_t i, size_t number_of_changes){
+    Model* model = state->model;
+    const Layer* layer = &model->model_layers[i];
+    const size_t number_of_inputs = model->model_layers[i-1].number_of_nodes_in_the_layer;
+    const size_t number_of_nodes = layer->number_of_nodes_in_the_layer;
+    double* pre_activation = state->pre_activations[i];
+    double* output = state->outputs[i];
+
+    if ((double)number_of_changes > state->full_pass_ratio * (double)number_of_inputs){
+        // Too many changed inputs: the dense kernel is cheaper, the old outputs are kept in next_changes to find what changed
+        memcpy(state->next_changes, output, number_of_nodes * sizeof(double));
+        layer_kernel_function kernel = (layer->kernel != NULL) ? layer->kernel : fused_layer_forward;
+        kernel(state->outputs[i-1], number_of_inputs, model->model_weights[i-1], layer, pre_activation, output);
+        size_t changed = 0;
+        for (size_t c = 0; c < number_of_nodes; c++){
+            if (output[c] != state->next_changes[c]){
+                state->next_changes[changed] = output[c] - state->next_changes[c];
+                state->next_changed_nodes[changed++] = c;
+            }
+        }
+        return changed;
+    }
+
+    // Sparse rank-1 updates: pre_activation += change_j * weights[j][:]
+    double* const* weights = model->model_weights[i-1];
+    for (size_t k = 0; k < number_of_changes; k++){
+        const double change = state->changes[k];
+        const double* row = weights[state->changed_nodes[k]];
+        for (size_t c = 0; c < number_of_nodes; c++){
+            pre_activation[c] += change * row[c];
+        }
+    }
+    size_t changed = 0;
+    for (size_t c = 0; c < number_of_nodes; c++){
+        const double value = kernel_activate(layer->activation_kind, layer->activation, pre_activation[c] + layer->biases[c]);
+        if (value != output[c]){
+            state->next_changes[changed] = value - output[c];
+            state->next_changed_nodes[changed++] = c;
+            output[c] = value;
+        }
+    }
+    return changed;
+}
+
+/**
+ * @brief Evaluates the model on the prompt reusing the values of the previous call: only the changed inputs,
+ * and downstream only the nodes whose output changed, are recomputed.
+ *
+ * @param state The incremental state of the model
+ * @param prompt The new prompt, its length must be the width of the input layer
+ * @param result If not NULL receives the output of the model (last layer width values), it is also readable in state->outputs[last]
+ * @return ErrorCode
+ */
+ErrorCode incremental_forward(IncrementalState* state, const Prompt* prompt, double* result){
+    if (state == NULL || prompt == NULL || prompt->data == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    Model* model = state->model;
+    const Layer* input_layer = &model->model_layers[0];
+    const size_t input_length = input_layer->number_of_nodes_in_the_layer;
+    const size_t last = model->number_of_layers_in_the_model - 1;
+    if (prompt->length != input_length){
+        fprintf(stderr, "Error in %s: prompt length %zu differs from the input layer width %zu.\n", __func__, prompt->length, input_length);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    size_t number_of_changes = 0;
+    if (state->is_primed && state->weights_version == model->weights_version && state->updates_since_refresh < state->refresh_interval){
+        for (size_t j = 0; j < input_length; j++){
+            number_of_changes += (prompt->data[j] != state->previous_prompt[j]);
+        }
+    }
+    if (!state->is_primed || state->weights_version != model->weights_version || state->updates_since_refresh >= state->refresh_interval
+        || (double)number_of_changes > state->full_pass_ratio * (double)input_length){
+        full_forward(state, prompt->data);
+    } else {
+        // Input layer: output = activation(input + bias) of the changed elements only
+        size_t changed = 0;
+        for (size_t j = 0; j < input_length && number_of_changes > 0; j++){
+            if (prompt->data[j] == state->previous_prompt[j]){
+                continue;
+            }
+            state->previous_prompt[j] = prompt->data[j];
+            state->pre_activations[0][j] = prompt->data[j];
+            const double value = kernel_activate(input_layer->activation_kind, input_layer->activation, prompt->data[j] + input_layer->biases[j]);
+            if (value != state->outputs[0][j]){
+                state->changes[changed] = value - state->outputs[0][j];
+                state->changed_nodes[changed++] = j;
+                state->outputs[0][j] = value;
+            }
+        }
+        for (size_t i = 1; i <= last && changed > 0; i++){
+            changed = update_layer(state, i, changed);
+            size_t* nodes = state->changed_nodes;
+            double* changes = state->changes;
+            state->changed_nodes = state->next_changed_nodes;
+            state->changes = state->next_changes;
+            state->next_changed_nodes = nodes;
+            state->next_changes = changes;
+        }
+        state->updates_since_refresh++;
+        state->incremental_passes++;
+        TRACE_VERBOSE(TRACE_CATEGORY_INFERENCE, "incremental update of model '%s': %zu changed inputs", model->model_name, number_of_changes);
+    }
+
+    if (result != NULL){
+        memcpy(result, state->outputs[last], model->model_layers[last].number_of_nodes_in_the_layer * sizeof(double));
+    }
+    return NO_ERROR;
+}
@@ -0,0 +1,64 @@
+#ifndef INCREMENTAL_FUNCTIONS_H
+#define INCREMENTAL_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+
+/**
+ * @brief Incremental forward pass for streams of prompts that differ in a few elements.
+ * The state keeps the pre-activations and the outputs of every layer for the previous prompt. When only k inputs change,
+ * the pre-activations of the next layer are patched with k sparse rank-1 updates (delta_j * weights row j): O(k*m) instead of O(n*m).
+ * Only the nodes whose output actually changed propagate further, so a threshold layer that absorbs the change stops the update.
+ * A layer whose number of changed inputs is above full_pass_ratio is recomputed with its regular kernel instead,
+ * and every refresh_interval updates (or when the weights version of the model changes) a full pass removes the accumulated rounding drift.
+ */
+
+#define INCREMENTAL_DEFAULT_FULL_PASS_RATIO 0.25   // above this fraction of changed inputs a layer is recomputed in full
+#define INCREMENTAL_DEFAULT_REFRESH_INTERVAL 256   // incremental updates between two full passes
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT INCREMENTAL STATE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief The values of the previous evaluation of a model
+ *
+ * @param model(Model*): The evaluated model
+ * @param previous_prompt(double*): The last prompt, compared element by element with the next one
+ * @param pre_activations(double**): Per layer weighted sums (same meaning as Output.layer_inputs)
+ * @param outputs(double**): Per layer activations (same meaning as Output.layer_outputs), outputs[last] is the result
+ * @param changed_nodes, next_changed_nodes(size_t*): Scratch lists of the nodes whose output changed in the current / next layer
+ * @param changes, next_changes(double*): Scratch lists of the output differences of those nodes
+ * @param full_pass_ratio(double): Fraction of changed inputs above which a layer is recomputed in full
+ * @param refresh_interval(size_t): Number of incremental updates after which a full pass is forced
+ * @param updates_since_refresh(size_t): Incremental updates since the last full pass
+ * @param weights_version(unsigned long): model->weights_version when the state was last refreshed
+ * @param is_primed(int): 0 until the first full pass
+ * @param full_passes, incremental_passes(size_t): Counters
+ */
+typedef struct IncrementalState{
+    Model* model;
+    double* previous_prompt;
+    double** pre_activations;
+    double** outputs;
+    size_t* changed_nodes;
+    size_t* next_changed_nodes;
+    double* changes;
+    double* next_changes;
+    double full_pass_ratio;
+    size_t refresh_interval;
+    size_t updates_since_refresh;
+    unsigned long weights_version;
+    int is_primed;
+    size_t full_passes;
+    size_t incremental_passes;
+} IncrementalState;
+
+//                                          FUNCTION PROTOTYPES
+IncrementalState* create_incremental_state(Model* model, double full_pass_ratio, size_t refresh_interval);
+void free_incremental_state(IncrementalState* state);
+void incremental_reset(IncrementalState* state);
+ErrorCode incremental_forward(IncrementalState* state, const Prompt* prompt, double* result);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT INCREMENTAL STATE -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // INCREMENTAL_FUNCTIONS_H
@@ -0,0 +1,353 @@
+#include "settings.h"
+#include "initializer_functions.h"
+#include "model_functions.h"
+#include "matrix_functions.h"
+#include "allocator_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- PHILOX -+-+-+-+-+-+-+-+-+-+-+- */
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+/**
+ * @brief Philox4x32 with 10 rounds (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"), the reference single block version
+ *
+ * @param counter(const uint32_t[4]): The block to encrypt
+ * @param key(const uint32_t[2]): The key (the seed)
+ * @param result(uint32_t[4]): 128 random bits
+ */
+void philox4x32_10(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]){
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < PHILOX_ROUNDS; round++){
+        const uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        const uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    result[0] = c0; result[1] = c1; result[2] = c2; result[3] = c3;
+}
+
+/**
+ * @brief Philox4x32-10 of the counters (first_pair + lane, stream) for PHILOX_LANES lanes at once, turned into two doubles in [0, 1) per lane.
+ * The lanes are kept as separate arrays so every round is a plain loop over 8 x 32 bit values the compiler vectorizes.
+ *
+ * @param values(double[2 * PHILOX_LANES]): values[2 * lane] and values[2 * lane + 1] are the values of the positions 2 * (first_pair + lane) and + 1
+ */
+static void philox_uniform_lanes(uint64_t first_pair, uint64_t stream, const uint32_t key[2], double values[2 * PHILOX_LANES]){
+    uint32_t c0[PHILOX_LANES], c1[PHILOX_LANES], c2[PHILOX_LANES], c3[PHILOX_LANES];
+    for (int lane = 0; lane < PHILOX_LANES; lane++){
+        const uint64_t pair = first_pair + (uint64_t)lane;
+        c0[lane] = (uint32_t)pair;
+        c1[lane] = (uint32_t)(pair >> 32);
+        c2[lane] = (uint32_t)stream;
+        c3[lane] = (uint32_t)(stream >> 32);
+    }
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < PHILOX_ROUNDS; round++){
+        for (int lane = 0; lane < PHILOX_LANES; lane++){
+            const uint64_t p0 = (uint64_t)PHILOX_M0 * c0[lane];
+            const uint64_t p1 = (uint64_t)PHILOX_M1 * c2[lane];
+            const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[lane] ^ k0;
+            const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3[lane] ^ k1;
+            c1[lane] = (uint32_t)p1;
+            c3[lane] = (uint32_t)p0;
+            c0[lane] = n0;
+            c2[lane] = n2;
+        }
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    for (int lane = 0; lane < PHILOX_LANES; lane++){
+        // the top 53 bits of each 64 bit half, scaled to [0, 1)
+        const uint64_t first = ((uint64_t)c1[lane] << 32) | c0[lane];
+        const uint64_t second = ((uint64_t)c3[lane] << 32) | c2[lane];
+        values[2 * lane] = (double)(first >> 11) * 0x1.0p-53;
+        values[2 * lane + 1] = (double)(second >> 11) * 0x1.0p-53;
+    }
+}
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END PHILOX -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A matrix to fill, with its distribution reduced to constant, uniform in [a, b) or normal (a, b)
+ */
+typedef struct InitializerTarget{
+    double** matrix;
+    size_t rows;
+    size_t columns;
+    uint64_t stream;
+    InitializerKind kind;       // INITIALIZER_CONSTANT, INITIALIZER_UNIFORM or INITIALIZER_NORMAL
+    double a;
+    double b;
+} InitializerTarget;
+
+/**
+ * @brief The rows [first_row, end_row) of the concatenation of the rows of all the targets, the share of one thread
+ */
+typedef struct InitializerWork{
+    const InitializerTarget* targets;
+    size_t number_of_targets;
+    size_t first_row;
+    size_t end_row;
+    uint32_t key[2];
+} InitializerWork;
+
+/**
+ * @brief Fills one row, position n = row * columns + c takes the value of n in the stream of the matrix
+ */
+static void fill_row(const InitializerTarget* target, size_t row, const uint32_t key[2]){
+    double* values = target->matrix[row];
+    if (target->kind == INITIALIZER_CONSTANT){
+        for (size_t c = 0; c < target->columns; c++){
+            values[c] = target->a;
+        }
+        return;
+    }
+    const uint64_t first = (uint64_t)row * target->columns;
+    const uint64_t end = first + target->columns;
+    double block[2 * PHILOX_LANES];
+    uint64_t pair = first >> 1;
+    while (2 * pair < end){
+        philox_uniform_lanes(pair, target->stream, key, block);
+        if (target->kind == INITIALIZER_NORMAL){
+            // Box-Muller on each pair: both values come from the same two uniforms, independently of where the row starts
+            for (int lane = 0; lane < PHILOX_LANES; lane++){
+                const double radius = sqrt(-2.0 * log(1.0 - block[2 * lane]));
+                const double angle = 2.0 * M_PI * block[2 * lane + 1];
+                block[2 * lane] = target->a + target->b * radius * cos(angle);
+                block[2 * lane + 1] = target->a + target->b * radius * sin(angle);
+            }
+        } else {
+            for (int i = 0; i < 2 * PHILOX_LANES; i++){
+                block[i] = target->a + (target->b - target->a) * block[i];
+            }
+        }
+        const uint64_t block_first = 2 * pair;
+        const uint64_t from = block_first < first ? first : block_first;
+        const uint64_t to = block_first + 2 * PHILOX_LANES < end ? block_first + 2 * PHILOX_LANES : end;
+        for (uint64_t n = from; n < to; n++){
+            values[n - first] = block[n - block_first];
+        }
+        pair += PHILOX_LANES;
+    }
+}
+
+static void* initializer_worker(void* argument){
+    const InitializerWork* work = argument;
+    size_t row_base = 0;
+    for (size_t t = 0; t < work->number_of_targets && row_base < work->end_row; t++){
+        const InitializerTarget* target = &work->targets[t];
+        const size_t from = work->first_row > row_base ? work->first_row - row_base : 0;
+        const size_t to = work->end_row - row_base < target->rows ? work->end_row - row_base : target->rows;
+        for (size_t r = from; r < to; r++){
+            fill_row(target, r, work->key);
+        }
+        row_base += target->rows;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Resolves the distribution of a fan_in x fan_out matrix
+ */
+static ErrorCode resolve_target(InitializerTarget* target, const WeightInitializer* initializer, size_t fan_in, size_t fan_out){
+    target->kind = INITIALIZER_UNIFORM;
+    switch (initializer->kind){
+        case INITIALIZER_CONSTANT:
+            target->kind = INITIALIZER_CONSTANT;
+            target->a = initializer->a;
+            return(NO_ERROR);
+        case INITIALIZER_UNIFORM:
+            if (!(initializer->a <= initializer->b)){
+                return(ERROR_INVALID_PARAMETER);
+            }
+            target->a = initializer->a;
+            target->b = initializer->b;
+            return(NO_ERROR);
+        case INITIALIZER_NORMAL:
+            if (!(initializer->b >= 0)){
+                return(ERROR_INVALID_PARAMETER);
+            }
+            target->kind = INITIALIZER_NORMAL;
+            target->a = initializer->a;
+            target->b = initializer->b;
+            return(NO_ERROR);
+        case INITIALIZER_XAVIER_UNIFORM:
+            target->b = sqrt(6.0 / (double)(fan_in + fan_out));
+            target->a = -target->b;
+            return(NO_ERROR);
+        case INITIALIZER_XAVIER_NORMAL:
+            target->kind = INITIALIZER_NORMAL;
+            target->a = 0;
+            target->b = sqrt(2.0 / (double)(fan_in + fan_out));
+            return(NO_ERROR);
+        case INITIALIZER_HE_UNIFORM:
+            target->b = sqrt(6.0 / (double)fan_in);
+            target->a = -target->b;
+            return(NO_ERROR);
+        case INITIALIZER_HE_NORMAL:
+            target->kind = INITIALIZER_NORMAL;
+            target->a = 0;
+            target->b = sqrt(2.0 / (double)fan_in);
+            return(NO_ERROR);
+    }
+    return(ERROR_INVALID_PARAMETER);
+}
+
+/**
+ * @brief Fills the targets, splitting their rows evenly over the threads of the initializer (the calling thread takes the first share)
+ */
+static ErrorCode fill_targets(const InitializerTarget* targets, size_t number_of_targets, const WeightInitializer* initializer){
+    size_t total_rows = 0;
+    for (size_t t = 0; t < number_of_targets; t++){
+        total_rows += targets[t].rows;
+    }
+    size_t threads = initializer->number_of_threads;
+    if (threads == 0){
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+    }
+    if (threads > INITIALIZER_MAX_THREADS){
+        threads = INITIALIZER_MAX_THREADS;
+    }
+    if (threads > total_rows){
+        threads = total_rows > 0 ? total_rows : 1;
+    }
+
+    InitializerWork work[INITIALIZER_MAX_THREADS];
+    pthread_t handles[INITIALIZER_MAX_THREADS];
+    int started[INITIALIZER_MAX_THREADS] = {0};
+    for (size_t i = 0; i < threads; i++){
+        work[i].targets = targets;
+        work[i].number_of_targets = number_of_targets;
+        work[i].first_row = total_rows * i / threads;
+        work[i].end_row = total_rows * (i + 1) / threads;
+        work[i].key[0] = (uint32_t)initializer->seed;
+        work[i].key[1] = (uint32_t)(initializer->seed >> 32);
+    }
+    for (size_t i = 1; i < threads; i++){
+        started[i] = pthread_create(&handles[i], NULL, initializer_worker, &work[i]) == 0;
+    }
+    initializer_worker(&work[0]);
+    for (size_t i = 1; i < threads; i++){
+        if (started[i]){
+            pthread_join(handles[i], NULL);
+        } else {
+            initializer_worker(&work[i]);       // no thread for this share, the values do not depend on who computes them
+        }
+    }
+    return(NO_ERROR);
+}
+
+/**
+ * @brief Fills a rows x columns matrix, a single matrix is fan_in = rows, fan_out = columns
+ *
+ * @param matrix(double**): The matrix
+ * @param initializer(const WeightInitializer*): The distribution, seed and threads
+ * @param stream(uint64_t): Selects an independent sequence for this matrix (initialize_model_weights uses the index of the matrix)
+ * @return ErrorCode
+ */
+ErrorCode initialize_matrix(double** matrix, size_t rows, size_t columns, const WeightInitializer* initializer, uint64_t stream){
+    if (matrix == NULL || initializer == NULL){
+        fprintf(stderr, "Error in %s: NULL matrix or initializer\n", __func__);
+        return(ERROR_NULL_POINTER_AS_PARAMETER);
+    }
+    InitializerTarget target = {.matrix = matrix, .rows = rows, .columns = columns, .stream = stream};
+    if (resolve_target(&target, initializer, rows, columns) != NO_ERROR){
+        fprintf(stderr, "Error in %s: invalid initializer\n", __func__);
+        return(ERROR_INVALID_PARAMETER);
+    }
+    return(fill_targets(&target, 1, initializer));
+}
+
+/**
+ * @brief Fills every weight matrix of the model in one parallel pass, matrix i is stream i.
+ * The biases are left as they are (0 after create_layer). The model is told its weights changed.
+ *
+ * @param model(Model*): The model
+ * @param initializer(const WeightInitializer*): The distribution, seed and threads
+ * @return ErrorCode
+ */
+ErrorCode initialize_model_weights(Model* model, const WeightInitializer* initializer){
+    if (model == NULL || model->model_weights == NULL || initializer == NULL){
+        fprintf(stderr, "Error in %s: NULL model, weights or initializer\n", __func__);
+        return(ERROR_NULL_POINTER_AS_PARAMETER);
+    }
+    const size_t number_of_matrices = model->number_of_layers_in_the_model - 1;
+    if (model->number_of_layers_in_the_model < 2){
+        return(NO_ERROR);
+    }
+    InitializerTarget* targets = malloc(number_of_matrices * sizeof(InitializerTarget));
+    if (targets == NULL){
+        fprintf(stderr, "Error in %s: out of memory\n", __func__);
+        return(ERROR_MALLOC_OUT_OF_MEMORY);
+    }
+    for (size_t i = 0; i < number_of_matrices; i++){
+        const size_t fan_in = model->model_layers[i].number_of_nodes_in_the_layer;
+        const size_t fan_out = model->model_layers[i+1].number_of_nodes_in_the_layer;
+        targets[i] = (InitializerTarget){.matrix = model->model_weights[i], .rows = fan_in, .columns = fan_out, .stream = i};
+        if (resolve_target(&targets[i], initializer, fan_in, fan_out) != NO_ERROR){
+            fprintf(stderr, "Error in %s: invalid initializer\n", __func__);
+            free(targets);
+            return(ERROR_INVALID_PARAMETER);
+        }
+    }
+    ErrorCode error = fill_targets(targets, number_of_matrices, initializer);
+    free(targets);
+    model_weights_changed(model);
+    return(error);
+}
+
+/**
+ * @brief Like create_FF_model_matrices, with the weights drawn from the initializer instead of set to 1 (matrix i is stream i,
+ * the same weights initialize_model_weights gives to a model built on them)
+ *
+ * @return double*** The matrices, NULL on failure
+ */
+double*** create_FF_model_matrices_initialized(size_t layers, size_t nodes_per_layer, const WeightInitializer* initializer){
+    if (initializer == NULL || layers < 2){
+        fprintf(stderr, "Error in %s: NULL initializer or less than 2 layers\n", __func__);
+        return(NULL);
+    }
+    double*** matrices_vector = allocator_allocate(NULL, (layers - 1) * sizeof(double**), 0, ALLOCATOR_SUBSYSTEM_MATRIX);
+    InitializerTarget* targets = malloc((layers - 1) * sizeof(InitializerTarget));
+    if (matrices_vector == NULL || targets == NULL){
+        fprintf(stderr, "Error in %s: out of memory\n", __func__);
+        allocator_release(NULL, matrices_vector, ALLOCATOR_SUBSYSTEM_MATRIX);
+        free(targets);
+        return(NULL);
+    }
+    for (size_t i = 0; i < layers - 1; i++){
+        matrices_vector[i] = create_matrix_double((int)nodes_per_layer, (int)nodes_per_layer);
+        if (matrices_vector[i] == NULL){
+            free_FF_model_matrices(matrices_vector, i, nodes_per_layer);
+            free(targets);
+            return(NULL);
+        }
+        targets[i] = (InitializerTarget){.matrix = matrices_vector[i], .rows = nodes_per_layer, .columns = nodes_per_layer, .stream = i};
+        if (resolve_target(&targets[i], initializer, nodes_per_layer, nodes_per_layer) != NO_ERROR){
+            fprintf(stderr, "Error in %s: invalid initializer\n", __func__);
+            free_FF_model_matrices(matrices_vector, i + 1, nodes_per_layer);
+            free(targets);
+            return(NULL);
+        }
+    }
+    fill_targets(targets, layers - 1, initializer);
+    free(targets);
+    return(matrices_vector);
+}
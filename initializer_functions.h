@@ -0,0 +1,67 @@
+#ifndef INITIALIZER_FUNCTIONS_H
+#define INITIALIZER_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include "node_functions.h"
+
+/**
+ * @brief Random initialization of the weights.
+ * The values come from Philox4x32-10, a counter based generator: the value of weight (r, c) of matrix m is a pure function of
+ * (seed, m, r * columns + c), so the matrices are filled in one pass split over any number of threads and the result is bit
+ * identical whatever the number of threads. Every Philox call gives the two values of an even/odd pair of positions.
+ * The fan in of weights[i] is the number of nodes of layer i (its rows), the fan out the number of nodes of layer i + 1 (its columns).
+ */
+
+#define PHILOX_LANES 8          // counters computed together by the fill loop, one vector of 8 x 32 bits
+#define INITIALIZER_MAX_THREADS 64
+
+/**
+ * @brief The distribution of the weights
+ *
+ * @param INITIALIZER_CONSTANT: every weight is a
+ * @param INITIALIZER_UNIFORM: uniform in [a, b)
+ * @param INITIALIZER_NORMAL: normal of mean a and standard deviation b
+ * @param INITIALIZER_XAVIER_UNIFORM: uniform in [-l, l), l = sqrt(6 / (fan_in + fan_out)) (Glorot)
+ * @param INITIALIZER_XAVIER_NORMAL: normal of mean 0 and standard deviation sqrt(2 / (fan_in + fan_out))
+ * @param INITIALIZER_HE_UNIFORM: uniform in [-l, l), l = sqrt(6 / fan_in)
+ * @param INITIALIZER_HE_NORMAL: normal of mean 0 and standard deviation sqrt(2 / fan_in)
+ */
+typedef enum InitializerKind{
+    INITIALIZER_CONSTANT = 0,
+    INITIALIZER_UNIFORM,
+    INITIALIZER_NORMAL,
+    INITIALIZER_XAVIER_UNIFORM,
+    INITIALIZER_XAVIER_NORMAL,
+    INITIALIZER_HE_UNIFORM,
+    INITIALIZER_HE_NORMAL,
+} InitializerKind;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT WEIGHT INITIALIZER -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief How to fill the weights
+ *
+ * @param kind(InitializerKind): The distribution
+ * @param seed(uint64_t): Key of the generator, the same seed gives the same weights
+ * @param a, b(double): Parameters of INITIALIZER_CONSTANT, INITIALIZER_UNIFORM and INITIALIZER_NORMAL (see InitializerKind), unused by the others
+ * @param number_of_threads(size_t): Threads filling the matrices, 0 = one per online CPU
+ */
+typedef struct WeightInitializer{
+    InitializerKind kind;
+    uint64_t seed;
+    double a;
+    double b;
+    size_t number_of_threads;
+} WeightInitializer;
+
+//                                          FUNCTION PROTOTYPES
+void philox4x32_10(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]);
+ErrorCode initialize_matrix(double** matrix, size_t rows, size_t columns, const WeightInitializer* initializer, uint64_t stream);
+ErrorCode initialize_model_weights(Model* model, const WeightInitializer* initializer);
+double*** create_FF_model_matrices_initialized(size_t layers, size_t nodes_per_layer, const WeightInitializer* initializer);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT WEIGHT INITIALIZER -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // INITIALIZER_FUNCTIONS_H
@@ -0,0 +1,258 @@
+#include "settings.h"
+#include "kernel_functions.h"
+#include <stddef.h>
+
+/* The kernels are written once as always-inline bodies taking the activation kind, and instantiated by a switch on the kind
+   of the layer: every instantiation gets a constant kind, so the activation is inlined in the epilogue instead of being called per node */
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+/* -+-+-+-+-+-+-+-+-+-+-+- INPUT LAYER -+-+-+-+-+-+-+-+-+-+-+- */
+
+KERNEL_INLINE void layer_activation_forward_body(ActivationKind kind, const double* pre_activation, const Layer* layer, double* output){
+    const double* biases = layer->biases;
+    for (size_t j = 0; j < layer->number_of_nodes_in_the_layer; j++){
+        output[j] = kernel_activate(kind, layer->activation, pre_activation[j] + biases[j]);
+    }
+}
+
+/**
+ * @brief Adds the bias and applies the activation of every node of the layer (used for the input layer, which has no incoming weights)
+ *
+ * @param pre_activation The inputs of the layer (one per node)
+ * @param layer The layer, gives biases and activation
+ * @param output Where the activations are stored (one per node), may be the same array as pre_activation
+ */
+void layer_activation_forward(const double* pre_activation, const Layer* layer, double* output){
+    switch (layer->activation_kind){
+        case ACTIVATION_SIGMOID:   layer_activation_forward_body(ACTIVATION_SIGMOID, pre_activation, layer, output);   break;
+        case ACTIVATION_THRESHOLD: layer_activation_forward_body(ACTIVATION_THRESHOLD, pre_activation, layer, output); break;
+        default:                   layer_activation_forward_body(ACTIVATION_CUSTOM, pre_activation, layer, output);    break;
+    }
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- FUSED LAYER -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Computes KERNEL_COLUMN_BLOCK columns of a layer for one sample, starting at column
+ */
+KERNEL_INLINE void fused_block_body(ActivationKind kind, const double* input, size_t number_of_inputs, double* const* weights,
+                                    const Layer* layer, size_t column, double* pre_activation, double* output){
+    double sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+    for (size_t row = 0; row < number_of_inputs; row++){
+        const double x = input[row];
+        const double* w = weights[row] + column;
+        sum0 += x * w[0];
+        sum1 += x * w[1];
+        sum2 += x * w[2];
+        sum3 += x * w[3];
+    }
+    // Epilogue: bias and activation while the sums are still in registers
+    const double* bias = layer->biases + column;
+    pre_activation[column]     = sum0;
+    pre_activation[column + 1] = sum1;
+    pre_activation[column + 2] = sum2;
+    pre_activation[column + 3] = sum3;
+    output[column]     = kernel_activate(kind, layer->activation, sum0 + bias[0]);
+    output[column + 1] = kernel_activate(kind, layer->activation, sum1 + bias[1]);
+    output[column + 2] = kernel_activate(kind, layer->activation, sum2 + bias[2]);
+    output[column + 3] = kernel_activate(kind, layer->activation, sum3 + bias[3]);
+}
+
+/**
+ * @brief Computes a single column of a layer for one sample (remainder of the blocks)
+ */
+KERNEL_INLINE void fused_column_body(ActivationKind kind, const double* input, size_t number_of_inputs, double* const* weights,
+                                     const Layer* layer, size_t column, double* pre_activation, double* output){
+    double sum = 0.0;
+    for (size_t row = 0; row < number_of_inputs; row++){
+        sum += input[row] * weights[row][column];
+    }
+    pre_activation[column] = sum;
+    output[column] = kernel_activate(kind, layer->activation, sum + layer->biases[column]);
+}
+
+KERNEL_INLINE void fused_layer_forward_body(ActivationKind kind, const double* input, size_t number_of_inputs, double* const* weights,
+                                            const Layer* layer, double* pre_activation, double* output){
+    const size_t columns = layer->number_of_nodes_in_the_layer;
+    size_t column = 0;
+    for (; column + KERNEL_COLUMN_BLOCK <= columns; column += KERNEL_COLUMN_BLOCK){
+        fused_block_body(kind, input, number_of_inputs, weights, layer, column, pre_activation, output);
+    }
+    // Remaining columns when the layer width is not a multiple of the block
+    for (; column < columns; column++){
+        fused_column_body(kind, input, number_of_inputs, weights, layer, column, pre_activation, output);
+    }
+}
+
+/**
+ * @brief Computes a whole layer from the outputs of the previous one in a single sweep:
+ * pre_activation[c] = sum_r input[r] * weights[r][c];   output[c] = activation(pre_activation[c] + bias[c])
+ * The columns are processed in blocks of KERNEL_COLUMN_BLOCK, each row of the block is a contiguous load of the weights row.
+ *
+ * @param input Outputs of the previous layer (number_of_inputs elements)
+ * @param number_of_inputs Number of nodes of the previous layer (rows of the weights matrix)
+ * @param weights The weights matrix between the previous layer and this one
+ * @param layer The layer that is computed, gives biases and activation
+ * @param pre_activation Where the weighted sums are stored (kept for training), number_of_nodes_in_the_layer elements
+ * @param output Where the activations are stored, number_of_nodes_in_the_layer elements
+ */
+void fused_layer_forward(const double* input, size_t number_of_inputs, double* const* weights,
+                         const Layer* layer, double* pre_activation, double* output){
+    switch (layer->activation_kind){
+        case ACTIVATION_SIGMOID:   fused_layer_forward_body(ACTIVATION_SIGMOID, input, number_of_inputs, weights, layer, pre_activation, output);   break;
+        case ACTIVATION_THRESHOLD: fused_layer_forward_body(ACTIVATION_THRESHOLD, input, number_of_inputs, weights, layer, pre_activation, output); break;
+        default:                   fused_layer_forward_body(ACTIVATION_CUSTOM, input, number_of_inputs, weights, layer, pre_activation, output);    break;
+    }
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- ROW STREAMING LAYER -+-+-+-+-+-+-+-+-+-+-+- */
+
+KERNEL_INLINE void row_stream_layer_forward_body(ActivationKind kind, const double* input, size_t number_of_inputs, double* const* weights,
+                                                 const Layer* layer, double* pre_activation, double* output){
+    const size_t columns = layer->number_of_nodes_in_the_layer;
+    for (size_t column = 0; column < columns; column++){
+        pre_activation[column] = 0.0;
+    }
+    for (size_t row = 0; row < number_of_inputs; row++){
+        const double x = input[row];
+        const double* w = weights[row];
+        for (size_t column = 0; column < columns; column++){
+            pre_activation[column] += x * w[column];
+        }
+    }
+    for (size_t column = 0; column < columns; column++){
+        output[column] = kernel_activate(kind, layer->activation, pre_activation[column] + layer->biases[column]);
+    }
+}
+
+/**
+ * @brief Same result as fused_layer_forward, with the other loop order: every row of the weights is streamed once over the whole
+ * width (an axpy into pre_activation), instead of being revisited by every block of columns. Wins on wide layers whose sums
+ * do not fit in registers; the autotuner (tuner_functions.h) decides per shape.
+ */
+void row_stream_layer_forward(const double* input, size_t number_of_inputs, double* const* weights,
+                              const Layer* layer, double* pre_activation, double* output){
+    switch (layer->activation_kind){
+        case ACTIVATION_SIGMOID:   row_stream_layer_forward_body(ACTIVATION_SIGMOID, input, number_of_inputs, weights, layer, pre_activation, output);   break;
+        case ACTIVATION_THRESHOLD: row_stream_layer_forward_body(ACTIVATION_THRESHOLD, input, number_of_inputs, weights, layer, pre_activation, output); break;
+        default:                   row_stream_layer_forward_body(ACTIVATION_CUSTOM, input, number_of_inputs, weights, layer, pre_activation, output);    break;
+    }
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END ROW STREAMING LAYER -+-+-+-+-+-+-+-+-+-+-+- */
+
+KERNEL_INLINE void fused_layer_forward_batch_body(ActivationKind kind, const double* const* inputs, size_t batch_size, size_t number_of_inputs,
+                                                  double* const* weights, const Layer* layer, double* const* pre_activations, double* const* outputs){
+    const size_t columns = layer->number_of_nodes_in_the_layer;
+    size_t column = 0;
+    for (; column + KERNEL_COLUMN_BLOCK <= columns; column += KERNEL_COLUMN_BLOCK){
+        for (size_t b = 0; b < batch_size; b++){
+            fused_block_body(kind, inputs[b], number_of_inputs, weights, layer, column, pre_activations[b], outputs[b]);
+        }
+    }
+    for (; column < columns; column++){
+        for (size_t b = 0; b < batch_size; b++){
+            fused_column_body(kind, inputs[b], number_of_inputs, weights, layer, column, pre_activations[b], outputs[b]);
+        }
+    }
+}
+
+/**
+ * @brief Batched version of fused_layer_forward: computes the same layer for batch_size independent samples.
+ * For every block of columns the samples are iterated innermost, so the block of weights is loaded from memory once
+ * and then reused from L1 by every sample.
+ *
+ * @param inputs inputs[b] are the outputs of the previous layer for sample b
+ * @param batch_size Number of samples
+ * @param number_of_inputs Number of nodes of the previous layer
+ * @param weights The weights matrix between the previous layer and this one
+ * @param layer The layer that is computed
+ * @param pre_activations pre_activations[b] receives the weighted sums of sample b
+ * @param outputs outputs[b] receives the activations of sample b
+ */
+void fused_layer_forward_batch(const double* const* inputs, size_t batch_size, size_t number_of_inputs, double* const* weights,
+                               const Layer* layer, double* const* pre_activations, double* const* outputs){
+    switch (layer->activation_kind){
+        case ACTIVATION_SIGMOID:
+            fused_layer_forward_batch_body(ACTIVATION_SIGMOID, inputs, batch_size, number_of_inputs, weights, layer, pre_activations, outputs);
+            break;
+        case ACTIVATION_THRESHOLD:
+            fused_layer_forward_batch_body(ACTIVATION_THRESHOLD, inputs, batch_size, number_of_inputs, weights, layer, pre_activations, outputs);
+            break;
+        default:
+            fused_layer_forward_batch_body(ACTIVATION_CUSTOM, inputs, batch_size, number_of_inputs, weights, layer, pre_activations, outputs);
+            break;
+    }
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- FIXED WIDTH LAYERS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Defines fused_layer_forward_w<W>: the fused kernel of a W -> W layer with every loop bound a literal.
+ * The rows of the weights are accumulated into a W-element array that the compiler keeps in registers (or vectorizes for the wider ones),
+ * and the epilogue (bias + activation) runs once per node after the last row.
+ */
+#define DEFINE_FIXED_WIDTH_KERNEL(W)                                                                                            \
+KERNEL_INLINE void fused_layer_forward_w##W##_body(ActivationKind kind, const double* input, double* const* weights,          \
+                                                    const Layer* layer, double* pre_activation, double* output){               \
+    double accumulator[W] = {0};                                                                                               \
+    _Pragma("GCC unroll 64")                                                                                                   \
+    for (size_t row = 0; row < W; row++){                                                                                      \
+        const double x = input[row];                                                                                           \
+        const double* w = weights[row];                                                                                        \
+        _Pragma("GCC unroll 64")                                                                                               \
+        for (size_t column = 0; column < W; column++){                                                                         \
+            accumulator[column] += x * w[column];                                                                              \
+        }                                                                                                                      \
+    }                                                                                                                          \
+    const double* bias = layer->biases;                                                                                        \
+    _Pragma("GCC unroll 64")                                                                                                   \
+    for (size_t column = 0; column < W; column++){                                                                             \
+        pre_activation[column] = accumulator[column];                                                                          \
+        output[column] = kernel_activate(kind, layer->activation, accumulator[column] + bias[column]);                         \
+    }                                                                                                                          \
+}                                                                                                                              \
+static void fused_layer_forward_w##W(const double* input, size_t number_of_inputs, double* const* weights,                   \
+                                     const Layer* layer, double* pre_activation, double* output){                             \
+    (void)number_of_inputs;  /* always W, checked by select_layer_kernel */                                                    \
+    switch (layer->activation_kind){                                                                                           \
+        case ACTIVATION_SIGMOID:   fused_layer_forward_w##W##_body(ACTIVATION_SIGMOID, input, weights, layer, pre_activation, output);   break; \
+        case ACTIVATION_THRESHOLD: fused_layer_forward_w##W##_body(ACTIVATION_THRESHOLD, input, weights, layer, pre_activation, output); break; \
+        default:                   fused_layer_forward_w##W##_body(ACTIVATION_CUSTOM, input, weights, layer, pre_activation, output);    break; \
+    }                                                                                                                          \
+}
+
+KERNEL_FIXED_WIDTHS(DEFINE_FIXED_WIDTH_KERNEL)
+
+/**
+ * @brief Returns the kernel for a layer of the given shape: a fixed width specialization when one exists, fused_layer_forward otherwise
+ *
+ * @param number_of_inputs Number of nodes of the previous layer
+ * @param number_of_nodes Number of nodes of the layer
+ * @return layer_kernel_function, never NULL
+ */
+layer_kernel_function select_layer_kernel(size_t number_of_inputs, size_t number_of_nodes){
+    if (number_of_inputs == number_of_nodes){
+        switch (number_of_nodes){
+            #define FIXED_WIDTH_KERNEL_CASE(W) case W: return fused_layer_forward_w##W;
+            KERNEL_FIXED_WIDTHS(FIXED_WIDTH_KERNEL_CASE)
+            #undef FIXED_WIDTH_KERNEL_CASE
+            default: break;
+        }
+    }
+    return fused_layer_forward;
+}
+
+/**
+ * @brief Binds every layer of the model (but the input one, which has no incoming weights) to the kernel matching its shape.
+ * init_model calls it; call it again if the layers of a model are replaced.
+ */
+void bind_layer_kernels(Model* model){
+    if (model == NULL || model->model_layers == NULL){
+        return;
+    }
+    for (size_t i = 1; i < model->number_of_layers_in_the_model; i++){
+        model->model_layers[i].kernel = select_layer_kernel(model->model_layers[i-1].number_of_nodes_in_the_layer,
+                                                            model->model_layers[i].number_of_nodes_in_the_layer);
+    }
+}
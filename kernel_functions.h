@@ -0,0 +1,55 @@
+#ifndef KERNEL_FUNCTIONS_H
+#define KERNEL_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <math.h>
+#include "node_functions.h"
+
+/**
+ * @brief Layer kernels of the forward pass.
+ * A fused kernel computes the weighted sum of the previous layer's outputs for a block of nodes, then adds the bias and applies the activation
+ * in the epilogue while the sums are still in registers, storing the pre-activation (layer_inputs) and the activation (layer_outputs) once.
+ * This replaces the three sweeps (bias + activation, store, separate mat-vec) calculate_output used to do per layer.
+ *
+ * Weights follow the model convention: weights[row][column], row = node of the previous layer, column = node of the computed layer.
+ */
+
+#define KERNEL_COLUMN_BLOCK 4     // Number of output nodes whose sums are kept in registers at the same time
+
+/**
+ * @brief Applies the activation of a layer to a single value. The kernels call it with a compile-time constant kind,
+ * so the switch disappears and the library's activations are inlined; only ACTIVATION_CUSTOM goes through the pointer.
+ */
+static inline double kernel_activate(ActivationKind kind, activation_function activation, double x){
+    switch (kind){
+        case ACTIVATION_SIGMOID:   return 1.0 / (1.0 + exp(-x));           // same as mySigmoid
+        case ACTIVATION_THRESHOLD: return (x > 0.5) ? 1.0 : 0.0;            // same as myThresholdFunc
+        default:                   return activation(x);
+    }
+}
+
+/**
+ * @brief Widths for which the library ships pre-instantiated square kernels (number_of_inputs == number_of_nodes == W).
+ * Every entry expands (X-macro) to a kernel whose loop bounds are the compile-time constant W, fully unrolled by the compiler.
+ * bind_layer_kernels gives each layer of a model its specialization, the others keep the generic fused_layer_forward.
+ */
+#define KERNEL_FIXED_WIDTHS(X) \
+    X(4)                       \
+    X(8)                       \
+    X(16)                      \
+    X(32)                      \
+    X(64)
+
+//                                          FUNCTION PROTOTYPES
+void layer_activation_forward(const double* pre_activation, const Layer* layer, double* output);
+void fused_layer_forward(const double* input, size_t number_of_inputs, double* const* weights,
+    const Layer* layer, double* pre_activation, double* output);
+void row_stream_layer_forward(const double* input, size_t number_of_inputs, double* const* weights,
+    const Layer* layer, double* pre_activation, double* output);
+void fused_layer_forward_batch(const double* const* inputs, size_t batch_size, size_t number_of_inputs, double* const* weights,
+    const Layer* layer, double* const* pre_activations, double* const* outputs);
+layer_kernel_function select_layer_kernel(size_t number_of_inputs, size_t number_of_nodes);
+void bind_layer_kernels(Model* model);
+//                                         END FUNCTION PROTOTYPES
+
+#endif // KERNEL_FUNCTIONS_H
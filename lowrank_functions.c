@@ -0,0 +1,540 @@
+#include "settings.h"
+#include "lowrank_functions.h"
+#include "initializer_functions.h"
+#include "kernel_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- RANDOMIZED SVD -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief out_c = W in_c for count columns: in holds columns of length n, out columns of length m (both column major)
+ */
+static void multiply_columns(double** weights, size_t m, size_t n, const double* in, double* out, size_t count){
+    for (size_t c = 0; c < count; c++){
+        const double* x = in + c * n;
+        double* y = out + c * m;
+        for (size_t r = 0; r < m; r++){
+            const double* row = weights[r];
+            double sum = 0.0;
+            for (size_t j = 0; j < n; j++){
+                sum += row[j] * x[j];
+            }
+            y[r] = sum;
+        }
+    }
+}
+
+/**
+ * @brief out_c = W^T in_c for count columns: in holds columns of length m, out columns of length n. Streams the rows of W
+ */
+static void multiply_columns_transposed(double** weights, size_t m, size_t n, const double* in, double* out, size_t count){
+    memset(out, 0, count * n * sizeof(double));
+    for (size_t r = 0; r < m; r++){
+        const double* row = weights[r];
+        for (size_t c = 0; c < count; c++){
+            const double x = in[c * m + r];
+            double* y = out + c * n;
+            for (size_t j = 0; j < n; j++){
+                y[j] += x * row[j];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Modified Gram-Schmidt, twice for orthogonality to working precision. A column that vanishes (the sketch has a larger rank
+ * than the matrix) is set to zero: it adds nothing to the product and gets a zero singular value
+ */
+static void orthonormalize_columns(double* columns, size_t length, size_t count){
+    for (size_t c = 0; c < count; c++){
+        double* column = columns + c * length;
+        double original = 0.0;
+        for (size_t i = 0; i < length; i++){
+            original += column[i] * column[i];
+        }
+        for (int pass = 0; pass < 2; pass++){
+            for (size_t p = 0; p < c; p++){
+                const double* previous = columns + p * length;
+                double projection = 0.0;
+                for (size_t i = 0; i < length; i++){
+                    projection += previous[i] * column[i];
+                }
+                for (size_t i = 0; i < length; i++){
+                    column[i] -= projection * previous[i];
+                }
+            }
+        }
+        double norm = 0.0;
+        for (size_t i = 0; i < length; i++){
+            norm += column[i] * column[i];
+        }
+        if (norm <= 1e-24 * original || norm == 0.0){
+            memset(column, 0, length * sizeof(double));
+            continue;
+        }
+        norm = 1.0 / sqrt(norm);
+        for (size_t i = 0; i < length; i++){
+            column[i] *= norm;
+        }
+    }
+}
+
+/**
+ * @brief One-sided Jacobi: rotates the count columns of a (length each) until they are orthogonal, accumulating the rotations in
+ * v (count x count, column major, starts as the identity). Afterwards a_in = a_out v^T, the norms of the columns of a_out are the
+ * singular values of a_in
+ */
+static void jacobi_orthogonalize(double* a, size_t length, double* v, size_t count){
+    memset(v, 0, count * count * sizeof(double));
+    for (size_t c = 0; c < count; c++){
+        v[c * count + c] = 1.0;
+    }
+    for (int sweep = 0; sweep < LOWRANK_JACOBI_MAX_SWEEPS; sweep++){
+        int rotated = 0;
+        for (size_t p = 0; p + 1 < count; p++){
+            for (size_t q = p + 1; q < count; q++){
+                double* ap = a + p * length;
+                double* aq = a + q * length;
+                double alpha = 0.0, beta = 0.0, gamma = 0.0;
+                for (size_t i = 0; i < length; i++){
+                    alpha += ap[i] * ap[i];
+                    beta += aq[i] * aq[i];
+                    gamma += ap[i] * aq[i];
+                }
+                if (gamma == 0.0 || fabs(gamma) <= 1e-15 * sqrt(alpha * beta)){
+                    continue;
+                }
+                rotated = 1;
+                const double zeta = (beta - alpha) / (2.0 * gamma);
+                const double t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+                const double cosine = 1.0 / sqrt(1.0 + t * t);
+                const double sine = cosine * t;
+                for (size_t i = 0; i < length; i++){
+                    const double x = ap[i], y = aq[i];
+                    ap[i] = cosine * x - sine * y;
+                    aq[i] = sine * x + cosine * y;
+                }
+                double* vp = v + p * count;
+                double* vq = v + q * count;
+                for (size_t i = 0; i < count; i++){
+                    const double x = vp[i], y = vq[i];
+                    vp[i] = cosine * x - sine * y;
+                    vq[i] = sine * x + cosine * y;
+                }
+            }
+        }
+        if (!rotated){
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Power iterations on count columns of Q, then Q orthonormalized. Only these columns are iterated, the earlier ones
+ * are already orthonormal and the last orthonormalize_columns projects the new ones out of them
+ *
+ * @param q(double*): The l columns of length m, the new ones (W times the sketch) start at column first
+ * @param scratch(double*): count columns of length n
+ */
+static void refine_columns(double** weights, size_t m, size_t n, double* q, size_t first, size_t count, double* scratch, size_t power_iterations){
+    double* block = q + first * m;
+    for (size_t it = 0; it < power_iterations; it++){
+        orthonormalize_columns(block, m, count);
+        multiply_columns_transposed(weights, m, n, block, scratch, count);
+        orthonormalize_columns(scratch, n, count);
+        multiply_columns(weights, m, n, scratch, block, count);
+    }
+    orthonormalize_columns(q, m, first + count);
+}
+
+/**
+ * @brief Randomized SVD of one m x n matrix into layer->left (m x r) and layer->right (r x n).
+ * Q (m x l) spans the range of W, A = W^T Q = (Q^T W)^T is rotated by Jacobi into A V with orthogonal columns sigma_k u_k, so
+ *      W ~ Q Q^T W = Q A^T = (Q V) (A V)^T
+ * and the r columns of largest norm give left = (Q V)[:, :r] and right = (A V)[:, :r]^T.
+ * With a fixed rank Q comes from one sketch of rank + oversampling columns. By energy the rank is not known beforehand: Q grows by
+ * blocks of oversampling columns (adaptive range finder) until ||Q^T W||_F^2, the energy it captures, reaches the fraction asked,
+ * then one more block oversamples it; a matrix whose spectrum decays fast is sketched far below its full rank.
+ *
+ * @param stream(uint64_t): Philox stream of the sketch, the index of the matrix
+ * @return ErrorCode
+ */
+static ErrorCode factorize_matrix(double** weights, LowRankLayer* layer, const LowRankOptions* options, uint64_t stream){
+    const size_t m = layer->number_of_inputs, n = layer->number_of_nodes;
+    const size_t full_rank = m < n ? m : n;
+    const size_t oversampling = options->oversampling ? options->oversampling : LOWRANK_DEFAULT_OVERSAMPLING;
+    // most columns Q can get: the rank asked plus the oversampling, or every column by energy
+    const size_t max_columns = (options->rank && options->rank + oversampling < full_rank) ? options->rank + oversampling : full_rank;
+
+    double* q = malloc(max_columns * m * sizeof(double));
+    double* a = malloc(max_columns * n * sizeof(double));
+    double* sketch = malloc(max_columns * n * sizeof(double));
+    double** sketch_rows = malloc(max_columns * sizeof(double*));
+    double* norms = malloc(max_columns * sizeof(double));
+    size_t* order = malloc(max_columns * sizeof(size_t));
+    double* v = NULL;
+    size_t l = 0;
+    ErrorCode error = (q && a && sketch && sketch_rows && norms && order) ? NO_ERROR : ERROR_MALLOC_OUT_OF_MEMORY;
+    if (error == NO_ERROR){
+        // the Gaussian test matrix, as max_columns columns of length n: the blocks take its columns in turn
+        for (size_t c = 0; c < max_columns; c++){
+            sketch_rows[c] = sketch + c * n;
+        }
+        const WeightInitializer gaussian = { .kind = INITIALIZER_NORMAL, .seed = options->seed, .a = 0.0, .b = 1.0, .number_of_threads = 1 };
+        error = initialize_matrix(sketch_rows, max_columns, n, &gaussian, stream);
+    }
+    double total = 0.0, kept = 0.0;
+    if (error == NO_ERROR){
+        for (size_t r = 0; r < m; r++){
+            for (size_t j = 0; j < n; j++){
+                total += weights[r][j] * weights[r][j];
+            }
+        }
+        double captured = 0.0;
+        int reached = 0;
+        size_t next = options->rank ? max_columns : (oversampling < max_columns ? oversampling : max_columns);
+        while (l < next){
+            const size_t count = next - l;
+            multiply_columns(weights, m, n, sketch + l * n, q + l * m, count);
+            refine_columns(weights, m, n, q, l, count, a + l * n, options->power_iterations);
+            multiply_columns_transposed(weights, m, n, q + l * m, a + l * n, count);
+            for (size_t j = 0; j < count * n; j++){
+                captured += a[l * n + j] * a[l * n + j];
+            }
+            l = next;
+            if (options->rank == 0 && !reached){
+                // once the energy is reached the next block is the last one
+                reached = captured >= options->energy * total;
+                next = (l + oversampling < max_columns) ? l + oversampling : max_columns;
+            }
+        }
+        if (options->rank == 0){
+            // the last orthonormalizations may have moved the earlier columns by rounding errors
+            multiply_columns_transposed(weights, m, n, q, a, l);
+        }
+        v = malloc(l * l * sizeof(double));
+        error = (v != NULL) ? NO_ERROR : ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    if (error == NO_ERROR){
+        jacobi_orthogonalize(a, n, v, l);
+        for (size_t c = 0; c < l; c++){
+            double norm = 0.0;
+            for (size_t j = 0; j < n; j++){
+                norm += a[c * n + j] * a[c * n + j];
+            }
+            norms[c] = norm;        // sigma_c^2
+            size_t position = c;
+            for (; position > 0 && norms[order[position - 1]] < norm; position--){
+                order[position] = order[position - 1];
+            }
+            order[position] = c;
+        }
+        size_t rank = 0;
+        if (options->rank){
+            rank = options->rank < l ? options->rank : l;
+            for (size_t k = 0; k < rank; k++){
+                kept += norms[order[k]];
+            }
+        } else {
+            while (rank < l && kept < options->energy * total){
+                kept += norms[order[rank++]];
+            }
+        }
+        layer->rank = rank;
+        layer->sketch_columns = l;
+        layer->kept_energy = (total > 0.0) ? kept / total : 1.0;
+        layer->left = malloc((rank ? rank : 1) * m * sizeof(double));
+        layer->right = malloc((rank ? rank : 1) * n * sizeof(double));
+        error = (layer->left && layer->right) ? NO_ERROR : ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    if (error == NO_ERROR){
+        const size_t rank = layer->rank;
+        for (size_t r = 0; r < m; r++){
+            for (size_t k = 0; k < rank; k++){
+                const double* rotation = v + order[k] * l;
+                double sum = 0.0;
+                for (size_t i = 0; i < l; i++){
+                    sum += q[i * m + r] * rotation[i];
+                }
+                layer->left[r * rank + k] = sum;
+            }
+        }
+        for (size_t k = 0; k < rank; k++){
+            memcpy(layer->right + k * n, a + order[k] * n, n * sizeof(double));
+        }
+        // the exact error of the factors, not the estimate of the discarded singular values
+        double difference = 0.0, total = 0.0;
+        for (size_t r = 0; r < m; r++){
+            for (size_t j = 0; j < n; j++){
+                double product = 0.0;
+                for (size_t k = 0; k < rank; k++){
+                    product += layer->left[r * rank + k] * layer->right[k * n + j];
+                }
+                difference += (weights[r][j] - product) * (weights[r][j] - product);
+                total += weights[r][j] * weights[r][j];
+            }
+        }
+        layer->relative_error = (total > 0.0) ? sqrt(difference / total) : 0.0;
+    }
+    free(q);
+    free(a);
+    free(v);
+    free(sketch);
+    free(sketch_rows);
+    free(norms);
+    free(order);
+    return error;
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- LOW RANK MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Compresses the weight matrices of a model with randomized SVD
+ *
+ * @param model(const Model*): The model, left untouched
+ * @param options(const LowRankOptions*): Fixed rank or energy to keep, sketch parameters
+ * @return LowRankModel* The compressed model (free_lowrank_model), NULL on failure
+ */
+LowRankModel* factorize_model(const Model* model, const LowRankOptions* options){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0 || options == NULL
+        || (model->number_of_layers_in_the_model > 1 && model->model_weights == NULL)){
+        fprintf(stderr, "Error in %s: NULL model, layers, weights or options.\n", __func__);
+        return NULL;
+    }
+    if (options->rank == 0 && !(options->energy > 0.0 && options->energy <= 1.0)){
+        fprintf(stderr, "Error in %s: neither a rank nor an energy in (0, 1] given (energy %lf).\n", __func__, options->energy);
+        return NULL;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    LowRankModel* compressed = calloc(1, sizeof(LowRankModel) + number_of_layers * sizeof(LowRankLayer));
+    if (compressed == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return NULL;
+    }
+    compressed->number_of_layers = number_of_layers;
+    compressed->input_length = model->model_layers[0].number_of_nodes_in_the_layer;
+    compressed->output_length = model->model_layers[number_of_layers - 1].number_of_nodes_in_the_layer;
+    for (size_t i = 0; i < number_of_layers; i++){
+        const Layer* source = &model->model_layers[i];
+        LowRankLayer* layer = &compressed->layers[i];
+        layer->number_of_inputs = (i > 0) ? model->model_layers[i-1].number_of_nodes_in_the_layer : 0;
+        layer->number_of_nodes = source->number_of_nodes_in_the_layer;
+        layer->activation_kind = source->activation_kind;
+        layer->activation = source->activation;
+        layer->biases = malloc(layer->number_of_nodes * sizeof(double));
+        if (layer->biases == NULL){
+            fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+            free_lowrank_model(compressed);
+            return NULL;
+        }
+        memcpy(layer->biases, source->biases, layer->number_of_nodes * sizeof(double));
+        if (layer->number_of_nodes > compressed->max_width){
+            compressed->max_width = layer->number_of_nodes;
+        }
+        if (i == 0){
+            continue;
+        }
+        double** weights = model->model_weights[i-1];
+        const size_t m = layer->number_of_inputs, n = layer->number_of_nodes;
+        ErrorCode error = (weights != NULL) ? factorize_matrix(weights, layer, options, i - 1) : ERROR_NULL_POINTER_AS_PARAMETER;
+        if (error != NO_ERROR){
+            fprintf(stderr, "Error in %s: cannot factorize weight matrix %zu (error %d).\n", __func__, i - 1, error);
+            free_lowrank_model(compressed);
+            return NULL;
+        }
+        layer->dense_flops = 2 * m * n;
+        layer->dense_bytes = m * n * sizeof(double);
+        layer->factorized = layer->rank * (m + n) < m * n;
+        if (layer->factorized){
+            layer->flops = 2 * layer->rank * (m + n);
+            layer->bytes = layer->rank * (m + n) * sizeof(double);
+            if (layer->rank > compressed->max_width){
+                compressed->max_width = layer->rank;
+            }
+        } else {
+            // the rank does not pay: keep the exact weights
+            free(layer->left);
+            free(layer->right);
+            layer->left = layer->right = NULL;
+            layer->relative_error = 0.0;
+            layer->dense = malloc(m * n * sizeof(double));
+            if (layer->dense == NULL){
+                fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+                free_lowrank_model(compressed);
+                return NULL;
+            }
+            for (size_t r = 0; r < m; r++){
+                memcpy(layer->dense + r * n, weights[r], n * sizeof(double));
+            }
+            layer->flops = layer->dense_flops;
+            layer->bytes = layer->dense_bytes;
+        }
+        compressed->dense_flops += layer->dense_flops;
+        compressed->flops += layer->flops;
+        compressed->dense_bytes += layer->dense_bytes;
+        compressed->bytes += layer->bytes;
+    }
+    TRACE_DEBUG(TRACE_CATEGORY_MODEL, "factorized model '%s': %zu -> %zu weight bytes, %zu -> %zu flops",
+                model->model_name, compressed->dense_bytes, compressed->bytes, compressed->dense_flops, compressed->flops);
+    return compressed;
+}
+
+/**
+ * @brief Forward pass of the compressed model. A dense layer sums its inputs in the order of the kernels (kernel_functions.h),
+ * so a model with no factorized layer gives the outputs of calculate_output exactly
+ *
+ * @param compressed(const LowRankModel*): From factorize_model
+ * @param input(const double*): input_length values
+ * @param output(double*): output_length values
+ * @return ErrorCode
+ */
+ErrorCode lowrank_calculate_output(const LowRankModel* compressed, const double* input, double* output){
+    if (compressed == NULL || input == NULL || output == NULL){
+        fprintf(stderr, "Error in %s: NULL compressed model, input or output.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    double* scratch = malloc(3 * compressed->max_width * sizeof(double));
+    if (scratch == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    double* current = scratch;
+    double* next = scratch + compressed->max_width;
+    double* thin = next + compressed->max_width;
+    const LowRankLayer* input_layer = &compressed->layers[0];
+    for (size_t r = 0; r < compressed->input_length; r++){
+        current[r] = kernel_activate(input_layer->activation_kind, input_layer->activation, input[r] + input_layer->biases[r]);
+    }
+    for (size_t i = 1; i < compressed->number_of_layers; i++){
+        const LowRankLayer* layer = &compressed->layers[i];
+        const size_t m = layer->number_of_inputs, n = layer->number_of_nodes, rank = layer->rank;
+        memset(next, 0, n * sizeof(double));
+        if (layer->factorized){
+            // t = L^T x, then pre = R^T t: both stream their matrix row by row
+            memset(thin, 0, rank * sizeof(double));
+            for (size_t r = 0; r < m; r++){
+                const double x = current[r];
+                const double* row = layer->left + r * rank;
+                for (size_t k = 0; k < rank; k++){
+                    thin[k] += x * row[k];
+                }
+            }
+            for (size_t k = 0; k < rank; k++){
+                const double t = thin[k];
+                const double* row = layer->right + k * n;
+                for (size_t j = 0; j < n; j++){
+                    next[j] += t * row[j];
+                }
+            }
+        } else {
+            for (size_t r = 0; r < m; r++){
+                const double x = current[r];
+                const double* row = layer->dense + r * n;
+                for (size_t j = 0; j < n; j++){
+                    next[j] += x * row[j];
+                }
+            }
+        }
+        for (size_t j = 0; j < n; j++){
+            next[j] = kernel_activate(layer->activation_kind, layer->activation, next[j] + layer->biases[j]);
+        }
+        double* swap = current;
+        current = next;
+        next = swap;
+    }
+    memcpy(output, current, compressed->output_length * sizeof(double));
+    free(scratch);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Accuracy of the compressed model against calculate_output on the prompts, with the savings
+ *
+ * @return LowRankReport number_of_prompts is 0 on failure
+ */
+LowRankReport lowrank_evaluate(const LowRankModel* compressed, Model* model, Prompt* prompts, size_t number_of_prompts){
+    LowRankReport report = {0};
+    if (compressed == NULL || model == NULL || prompts == NULL || number_of_prompts == 0){
+        fprintf(stderr, "Error in %s: NULL parameter or no prompt.\n", __func__);
+        return report;
+    }
+    double* values = malloc(compressed->output_length * sizeof(double));
+    if (values == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return report;
+    }
+    double total_error = 0.0;
+    for (size_t p = 0; p < number_of_prompts; p++){
+        Output reference = calculate_output(&prompts[p], model);
+        if (reference.is_valid != 1 || reference.length != compressed->output_length
+            || lowrank_calculate_output(compressed, prompts[p].data, values) != NO_ERROR){
+            fprintf(stderr, "Error in %s: prompt %zu cannot be evaluated.\n", __func__, p);
+            free_output(&reference);
+            free(values);
+            return (LowRankReport){0};
+        }
+        for (size_t j = 0; j < compressed->output_length; j++){
+            const double error = fabs(values[j] - reference.data[j]);
+            total_error += error;
+            if (error > report.max_absolute_error){
+                report.max_absolute_error = error;
+            }
+        }
+        free_output(&reference);
+    }
+    free(values);
+    report.number_of_prompts = number_of_prompts;
+    report.mean_absolute_error = total_error / (double)(number_of_prompts * compressed->output_length);
+    for (size_t i = 1; i < compressed->number_of_layers; i++){
+        if (compressed->layers[i].relative_error > report.max_relative_weight_error){
+            report.max_relative_weight_error = compressed->layers[i].relative_error;
+        }
+    }
+    report.flop_ratio = compressed->dense_flops ? (double)compressed->flops / (double)compressed->dense_flops : 1.0;
+    report.byte_ratio = compressed->dense_bytes ? (double)compressed->bytes / (double)compressed->dense_bytes : 1.0;
+    return report;
+}
+
+/**
+ * @brief Prints the ranks, errors and savings of every layer, then the accuracy of the report (if not NULL)
+ */
+void lowrank_print_report(const LowRankModel* compressed, const LowRankReport* report, FILE* stream){
+    if (compressed == NULL || stream == NULL){
+        return;
+    }
+    fprintf(stream, "%-5s %8s %8s %6s %8s %10s %12s %12s %12s %12s\n", "layer", "inputs", "nodes", "rank", "energy", "rel_error",
+            "dense_flops", "flops", "dense_bytes", "bytes");
+    for (size_t i = 1; i < compressed->number_of_layers; i++){
+        const LowRankLayer* layer = &compressed->layers[i];
+        char rank[24] = "dense";
+        if (layer->factorized){
+            snprintf(rank, sizeof(rank), "%zu", layer->rank);
+        }
+        fprintf(stream, "%-5zu %8zu %8zu %6s %8.4lf %10.2e %12zu %12zu %12zu %12zu\n", i, layer->number_of_inputs, layer->number_of_nodes,
+                rank, layer->kept_energy, layer->relative_error, layer->dense_flops, layer->flops, layer->dense_bytes, layer->bytes);
+    }
+    fprintf(stream, "total flops %zu -> %zu (x%.3lf), weight bytes %zu -> %zu (x%.3lf)\n", compressed->dense_flops, compressed->flops,
+            compressed->dense_flops ? (double)compressed->flops / (double)compressed->dense_flops : 1.0, compressed->dense_bytes,
+            compressed->bytes, compressed->dense_bytes ? (double)compressed->bytes / (double)compressed->dense_bytes : 1.0);
+    if (report != NULL && report->number_of_prompts > 0){
+        fprintf(stream, "accuracy on %zu prompts: max |error| %.3e, mean |error| %.3e, max relative weight error %.3e\n",
+                report->number_of_prompts, report->max_absolute_error, report->mean_absolute_error, report->max_relative_weight_error);
+    }
+}
+
+void free_lowrank_model(LowRankModel* compressed){
+    if (compressed == NULL){
+        return;
+    }
+    for (size_t i = 0; i < compressed->number_of_layers; i++){
+        free(compressed->layers[i].left);
+        free(compressed->layers[i].right);
+        free(compressed->layers[i].dense);
+        free(compressed->layers[i].biases);
+    }
+    free(compressed);
+}
@@ -0,0 +1,125 @@
+#ifndef LOWRANK_FUNCTIONS_H
+#define LOWRANK_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdio.h>
+#include "node_functions.h"
+
+/**
+ * @brief Low-rank compression of the weight matrices for serving.
+ * factorize_model replaces each m x n weight matrix W by the product L * R of an m x r and an r x n matrix, from a randomized SVD
+ * (Halko, Martinsson, Tropp): W is multiplied by a Gaussian sketch of r + oversampling columns (Philox, initializer_functions.h),
+ * refined by power iterations, orthonormalized into Q, and the small matrix Q^T W is decomposed exactly with one-sided Jacobi.
+ * The rank is either fixed or the smallest one keeping a fraction of the energy (sum of the squared singular values) of W: the
+ * sketch then grows by blocks of oversampling columns until it captures that energy, plus one block.
+ * A factorized layer runs as two thin mat-vecs, t = L^T x then pre = R^T t + b: 2 r (m + n) flops and 8 r (m + n) bytes of weights
+ * instead of 2 m n and 8 m n. A layer where the rank does not pay (r (m + n) >= m n) keeps its dense matrix.
+ * lowrank_evaluate measures the output error against the original model, lowrank_print_report lays it next to the savings.
+ */
+
+#define LOWRANK_DEFAULT_OVERSAMPLING 8
+#define LOWRANK_DEFAULT_POWER_ITERATIONS 2
+#define LOWRANK_JACOBI_MAX_SWEEPS 60
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT LOW RANK MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief How to choose the rank of each matrix
+ *
+ * @param rank(size_t): Fixed rank, 0 to choose it by energy
+ * @param energy(double): With rank 0, the fraction in (0, 1] of the energy of each matrix to keep
+ * @param oversampling(size_t): Extra sketch columns, LOWRANK_DEFAULT_OVERSAMPLING if 0
+ * @param power_iterations(size_t): Power iterations sharpening the sketch when the spectrum decays slowly
+ * @param seed(uint64_t): Seed of the sketch, the same seed gives the same factors
+ */
+typedef struct LowRankOptions{
+    size_t rank;
+    double energy;
+    size_t oversampling;
+    size_t power_iterations;
+    uint64_t seed;
+} LowRankOptions;
+
+/**
+ * @brief A layer of a compressed model
+ *
+ * @param number_of_inputs, number_of_nodes(size_t): m and n, 0 inputs for the input layer
+ * @param factorized(int): != 0 if the layer runs with left and right, else with dense
+ * @param rank(size_t): r
+ * @param sketch_columns(size_t): Columns of the range Q the rank was taken from (grown by blocks when the rank is chosen by energy)
+ * @param left(double*): m x r, row major
+ * @param right(double*): r x n, row major
+ * @param dense(double*): m x n row major, the original weights of a layer kept dense
+ * @param biases(double*): The biases of the nodes
+ * @param kept_energy(double): Fraction of the energy of W in the r largest singular values found
+ * @param relative_error(double): ||W - L R||_F / ||W||_F, 0 for a dense layer
+ * @param dense_flops, flops(size_t): Multiply-adds times 2 of the original and of the compressed layer
+ * @param dense_bytes, bytes(size_t): Weight bytes of the original and of the compressed layer
+ */
+typedef struct LowRankLayer{
+    size_t number_of_inputs;
+    size_t number_of_nodes;
+    int factorized;
+    size_t rank;
+    size_t sketch_columns;
+    double* left;
+    double* right;
+    double* dense;
+    double* biases;
+    ActivationKind activation_kind;
+    activation_function activation;
+    double kept_energy;
+    double relative_error;
+    size_t dense_flops;
+    size_t flops;
+    size_t dense_bytes;
+    size_t bytes;
+} LowRankLayer;
+
+/**
+ * @brief A compressed model, independent of the model it was built from
+ *
+ * @param max_width(size_t): Widest layer or rank, the size of the scratch vectors
+ * @param dense_flops, flops, dense_bytes, bytes(size_t): Sums over the layers
+ * @param number_of_layers(size_t): layers[0] is the input layer (biases and activation only)
+ */
+typedef struct LowRankModel{
+    size_t input_length;
+    size_t output_length;
+    size_t max_width;
+    size_t dense_flops;
+    size_t flops;
+    size_t dense_bytes;
+    size_t bytes;
+    size_t number_of_layers;
+    LowRankLayer layers[];
+} LowRankModel;
+
+/**
+ * @brief Accuracy of a compressed model on a set of prompts
+ *
+ * @param max_absolute_error, mean_absolute_error(double): Over every output value of every prompt, against calculate_output
+ * @param max_relative_weight_error(double): Largest relative_error of the layers
+ * @param flop_ratio, byte_ratio(double): Compressed over original, < 1 is a saving
+ */
+typedef struct LowRankReport{
+    size_t number_of_prompts;
+    double max_absolute_error;
+    double mean_absolute_error;
+    double max_relative_weight_error;
+    double flop_ratio;
+    double byte_ratio;
+} LowRankReport;
+
+//                                          FUNCTION PROTOTYPES
+LowRankModel* factorize_model(const Model* model, const LowRankOptions* options);
+ErrorCode lowrank_calculate_output(const LowRankModel* compressed, const double* input, double* output);
+LowRankReport lowrank_evaluate(const LowRankModel* compressed, Model* model, Prompt* prompts, size_t number_of_prompts);
+void lowrank_print_report(const LowRankModel* compressed, const LowRankReport* report, FILE* stream);
+void free_lowrank_model(LowRankModel* compressed);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT LOW RANK MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // LOWRANK_FUNCTIONS_H
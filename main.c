@@ -29,10 +29,41 @@ typedef struct {
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
 #include "settings.h"
 #include "matrix_functions.h"
 #include "model_functions.h"
 #include "node_functions.h"
+#include "trace_functions.h"
+#include "metrics_functions.h"
+#include "compiler_functions.h"
+#include "cache_functions.h"
+#include "incremental_functions.h"
+#include "training_functions.h"
+#include "snapshot_functions.h"
+#include "allocator_functions.h"
+#include "numa_functions.h"
+#include "threadpool_functions.h"
+#include "pipeline_functions.h"
+#include "async_functions.h"
+#include "distributed_functions.h"
+#include "initializer_functions.h"
+#include "plan_functions.h"
+#include "binary_functions.h"
+#include "bundle_functions.h"
+#include "tuner_functions.h"
+#include "kernel_functions.h"
+#include "registry_functions.h"
+#include "lowrank_functions.h"
+#include "checkpoint_functions.h"
+#include "stream_functions.h"
+#include "graph_functions.h"
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
 
 /**
  * @brief function to test the new functions
@@ -49,23 +80,25 @@ void test1(){
         printf("given value to matrices_vector %p\n", matrices_vector);
     #endif
     print_matrix_vector_double(matrices_vector, layers, nodes_per_layer);
+    free_FF_model_matrices(matrices_vector, layers - 1, nodes_per_layer);
 
 }
 
 void test_init_model(void){
     const size_t number_of_layers = 3;
     const size_t number_of_nodes_per_layer = 4;
-    const char   name[10] = "test model";
+    const char   name[] = "test model";
     activation_function test_activation = mySigmoid;
     threshold_function test_threshold = myThresholdFunc;
 
     double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
-    Model* test_model = init_model(&name, number_of_layers, test_weights, number_of_nodes_per_layer, test_activation, test_threshold);
+    Model* test_model = init_model(name, number_of_layers, test_weights, number_of_nodes_per_layer, test_activation, test_threshold);
     if (!test_model){fprintf(stderr,
         "Error in %s: init_model returned NULL pointer.\n",
         __func__);
         return;
     }
+    free_model(test_model);
     
     fprintf(stderr,
         "Exited function %s: without recognising any problems.\n",
@@ -77,10 +110,2338 @@ void test_calculate_output(void){
         1 input, 1 secret, 1 output.
         Every layer will be composed of 4 nodes
         To do so we'll only use the given creation functions */
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;
+
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("test model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    if (!test_model){fprintf(stderr,
+        "Error in %s: init_model returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+
+    double tokens[4] = {0, 1, 0, 1};
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+
+    // Record everything the forward pass traces, then dump it once it is done
+    trace_set_level(TRACE_LEVEL_VERBOSE);
+    Output test_output = calculate_output(&test_prompt, test_model);
+    trace_set_level(TRACE_LEVEL_ERROR);
+    trace_dump(stderr);
+
+    if (test_output.is_valid != 1){fprintf(stderr,
+        "Error in %s: calculate_output returned a non valid output.\n",
+        __func__);
+        return;
+    }
+    for (size_t i = 0; i < test_output.length; i++){
+        printf("%lf ", test_output.data[i]);
+    }
+    printf("\n");
+    free_output(&test_output);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_layer_nodes(void){
+    Layer layer = create_layer(5, mySigmoid, myThresholdFunc);
+    if (layer.biases == NULL){fprintf(stderr,
+        "Error in %s: create_layer failed.\n",
+        __func__);
+        return;
+    }
+    Node node = create_node(3, 0.75, mySigmoid, myThresholdFunc);
+    node.output = 0.5;
+    node.delta = -0.25;
+    if (layer_set_node(&layer, 3, node) != NO_ERROR || layer.biases[3] != 0.75 || layer.outputs[3] != 0.5 || layer.deltas[3] != -0.25){fprintf(stderr,
+        "Error in %s: layer_set_node did not write the node vectors.\n",
+        __func__);
+        return;
+    }
+    Node read = layer_get_node(&layer, 3);
+    if (read.index != 3 || read.bias != 0.75 || read.output != 0.5 || read.delta != -0.25 || read.activation != mySigmoid){fprintf(stderr,
+        "Error in %s: layer_get_node returned index %d bias %lf.\n",
+        __func__, read.index, read.bias);
+        return;
+    }
+
+    // out of range and NULL layers are rejected without touching memory
+    if (layer_get_node(&layer, 5).index != -1 || layer_get_node(NULL, 0).index != -1
+        || layer_set_node(&layer, 5, node) != ERROR_INVALID_PARAMETER || layer_set_node(NULL, 0, node) != ERROR_NULL_POINTER_AS_PARAMETER){fprintf(stderr,
+        "Error in %s: invalid layers or indexes were accepted.\n",
+        __func__);
+        return;
+    }
+    free_layer(&layer);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_calculate_output_batch(void){
+    /* 6 is not a multiple of KERNEL_COLUMN_BLOCK, so the remainder path runs too;
+       8 has a fixed width kernel, so the single prompt path runs the specialization while the batch runs the generic kernel.
+       Every weight is different (and the matrices are not symmetric), so a swapped row and column index changes the result */
+    const size_t widths[2] = {6, 8};
+    for (size_t w = 0; w < 2; w++){
+        const size_t number_of_layers = 3;
+        const size_t number_of_nodes_per_layer = widths[w];
+        double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+        Model* test_model = init_model("batch model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+        if (!test_model){fprintf(stderr,
+            "Error in %s: init_model returned NULL pointer.\n",
+            __func__);
+            return;
+        }
+        for (size_t i = 0; i < number_of_layers; i++){
+            for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+                test_model->model_layers[i].biases[c] = 0.1 * (double)c - 0.05 * (double)i;
+                for (size_t r = 0; i + 1 < number_of_layers && r < number_of_nodes_per_layer; r++){
+                    test_weights[i][r][c] = 0.3 * sin((double)(7 * r + 3 * c + 11 * i) + 0.5) + 0.02 * (double)r;
+                }
+            }
+        }
+
+        Prompt prompts[3];
+        for (size_t b = 0; b < 3; b++){
+            double tokens[8] = {(double)b, 1, 0, 1, 0.5, -(double)b, 0.25, 2};
+            prompts[b] = create_prompt(number_of_nodes_per_layer, tokens);
+        }
+        Output* batch = calculate_output_batch(prompts, 3, test_model);
+        if (!batch){fprintf(stderr,
+            "Error in %s: calculate_output_batch returned NULL pointer.\n",
+            __func__);
+            return;
+        }
+        for (size_t b = 0; b < 3; b++){
+            // reference written out: weights[i][r][c] goes from node r of layer i to node c of layer i + 1
+            double values[8], next[8];
+            for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+                values[c] = mySigmoid(prompts[b].data[c] + test_model->model_layers[0].biases[c]);
+            }
+            for (size_t i = 1; i < number_of_layers; i++){
+                for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+                    double sum = 0.0;
+                    for (size_t r = 0; r < number_of_nodes_per_layer; r++){
+                        sum += values[r] * test_weights[i-1][r][c];
+                    }
+                    next[c] = mySigmoid(sum + test_model->model_layers[i].biases[c]);
+                }
+                memcpy(values, next, sizeof(values));
+            }
+            Output single = calculate_output(&prompts[b], test_model);
+            for (size_t i = 0; i < single.length; i++){
+                if (fabs(single.data[i] - batch[b].data[i]) > 1e-12 || fabs(single.data[i] - values[i]) > 1e-12){fprintf(stderr,
+                    "Error in %s: output [%zu][%zu]: batch %lf, single %lf, reference %lf (width %zu).\n",
+                    __func__, b, i, batch[b].data[i], single.data[i], values[i], number_of_nodes_per_layer);
+                    return;
+                }
+            }
+            free_output(&single);
+            free_prompt(&prompts[b]);
+        }
+        free_output_batch(batch, 3);
+        free_model(test_model);
+    }
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_compile_model(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 20;    // 20 x 20 > COMPILER_UNROLL_LIMIT, so the loop form is emitted too
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("compiled model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    if (!test_model){fprintf(stderr,
+        "Error in %s: init_model returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+    for (size_t i = 0; i < number_of_nodes_per_layer; i++){
+        test_model->model_layers[1].biases[i] = 0.01 * (double)i;
+        test_weights[0][i][i] = -0.5;
+    }
+    double tokens[20];
+    for (size_t i = 0; i < number_of_nodes_per_layer; i++){
+        tokens[i] = (double)(i % 3);
+    }
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    Output reference = calculate_output(&test_prompt, test_model);
+
+    // the second build goes to a directory whose name a shell would split and unquote
+    const char* directories[2] = {"/tmp", "/tmp/ffnn compiled 'model' dir"};
+    mkdir(directories[1], 0700);
+    for (int bake = 0; bake <= 1; bake++){
+        CompiledModel* compiled = compile_model(test_model, directories[bake], bake);
+        if (!compiled){fprintf(stderr,
+            "Error in %s: compile_model returned NULL pointer (bake_weights = %d).\n",
+            __func__, bake);
+            return;
+        }
+        attach_compiled_model(test_model, compiled);
+        Output compiled_output = calculate_output(&test_prompt, test_model);
+        double infer_output[20];
+        compiled_model_infer(compiled, test_model, test_prompt.data, infer_output);
+        attach_compiled_model(test_model, NULL);
+
+        // a model whose hidden layer has another width must be refused, the first and last widths alone are not enough
+        compiled->layer_widths[1]++;
+        if (attach_compiled_model(test_model, compiled) != ERROR_INVALID_PARAMETER || test_model->compiled != NULL){fprintf(stderr,
+            "Error in %s: a compiled model of another hidden width was attached.\n",
+            __func__);
+            return;
+        }
+        compiled->layer_widths[1]--;
+
+        // without baked weights, a model of the same topology runs with its own biases, not with the ones of the model compiled
+        if (!bake){
+            Model* twin_model = init_model("compiled twin", number_of_layers, create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer),
+                                           number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+            if (!twin_model){fprintf(stderr,
+                "Error in %s: init_model returned NULL pointer.\n",
+                __func__);
+                return;
+            }
+            for (size_t i = 0; i < number_of_nodes_per_layer; i++){
+                twin_model->model_layers[1].biases[i] = -0.02 * (double)i;
+            }
+            Output twin_reference = calculate_output(&test_prompt, twin_model);
+            attach_compiled_model(twin_model, compiled);
+            Output twin_output = calculate_output(&test_prompt, twin_model);
+            attach_compiled_model(twin_model, NULL);
+            int same = twin_output.is_valid == 1;
+            for (size_t i = 0; same && i < twin_reference.length; i++){
+                same = fabs(twin_output.data[i] - twin_reference.data[i]) <= 1e-12;
+            }
+            free_output(&twin_reference);
+            free_output(&twin_output);
+            free_model(twin_model);
+            if (!same){fprintf(stderr,
+                "Error in %s: the compiled model did not run with the biases of the model it is attached to.\n",
+                __func__);
+                return;
+            }
+        }
+
+        for (size_t i = 0; i < reference.length; i++){
+            if (fabs(compiled_output.data[i] - reference.data[i]) > 1e-12 || fabs(infer_output[i] - reference.data[i]) > 1e-12){fprintf(stderr,
+                "Error in %s: compiled output [%zu] = %lf / %lf differs from %lf (bake_weights = %d).\n",
+                __func__, i, compiled_output.data[i], infer_output[i], reference.data[i], bake);
+                return;
+            }
+        }
+        free_output(&compiled_output);
+        free_compiled_model(compiled);
+    }
+    free_output(&reference);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_metrics(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;
+
+    metrics_set_enabled(TRUE);
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("metrics model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    if (!test_model){fprintf(stderr,
+        "Error in %s: init_model returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+    double tokens[4] = {1, 0, 0, 1};
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    for (int i = 0; i < 10; i++){
+        Output output = calculate_output(&test_prompt, test_model);
+        free_output(&output);
+    }
+
+    // a second live model with the same name gets series of its own
+    Model* twin_model = init_model("metrics model", number_of_layers, create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer),
+                                   number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    if (!twin_model){fprintf(stderr,
+        "Error in %s: init_model returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+
+    MetricsSnapshot snapshot = metrics_snapshot();
+    size_t same_name = 0;
+    uint64_t ids[2] = {0, 0};
+    for (size_t m = 0; m < snapshot.number_of_models; m++){
+        if (strcmp(snapshot.models[m].model_name, "metrics model") == 0 && same_name < 2){
+            ids[same_name++] = snapshot.models[m].model_id;
+        }
+    }
+    if (same_name != 2 || ids[0] == ids[1]){fprintf(stderr,
+        "Error in %s: two models named 'metrics model' are not told apart (%zu found).\n",
+        __func__, same_name);
+        return;
+    }
+    metrics_export(&snapshot, METRICS_FORMAT_PROMETHEUS, stdout);
+    metrics_export(&snapshot, METRICS_FORMAT_JSON, stdout);
+    free_metrics_snapshot(&snapshot);
+    free_model(twin_model);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+    metrics_set_enabled(FALSE);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_output_cache(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;     // the 4 bit binary inputs of the square root demo: 16 prompts
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("cached model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    OutputCache* cache = create_output_cache(number_of_nodes_per_layer, number_of_nodes_per_layer, 16, 4);
+    if (!test_model || !cache){fprintf(stderr,
+        "Error in %s: init_model or create_output_cache returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+    attach_output_cache(test_model, cache);
+    const double bits[2] = {0, 1};
+    if (precompute_output_domain(test_model, bits, 2) != NO_ERROR || output_cache_stats(cache).entries != 16){fprintf(stderr,
+        "Error in %s: the whole domain was not precomputed.\n",
+        __func__);
+        return;
+    }
+
+    double tokens[4] = {1, 0, 1, 1};
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    double cached[4];
+    calculate_output_cached(&test_prompt, test_model, cached);
+    Output reference = calculate_output(&test_prompt, test_model);
+    OutputCacheStats stats = output_cache_stats(cache);
+    if (stats.hits != 1 || memcmp(cached, reference.data, sizeof(cached)) != 0){fprintf(stderr,
+        "Error in %s: expected a hit returning the calculated output (hits = %llu).\n",
+        __func__, (unsigned long long)stats.hits);
+        return;
+    }
+
+    // After the weights change the old entries must not be returned
+    test_weights[0][0][0] = -2.0;
+    model_weights_changed(test_model);
+    calculate_output_cached(&test_prompt, test_model, cached);
+    Output changed = calculate_output(&test_prompt, test_model);
+    stats = output_cache_stats(cache);
+    if (stats.misses != 1 || memcmp(cached, changed.data, sizeof(cached)) != 0){fprintf(stderr,
+        "Error in %s: expected a miss after model_weights_changed (misses = %llu).\n",
+        __func__, (unsigned long long)stats.misses);
+        return;
+    }
+    // an output computed before the weights changed is not stored under the new version
+    const uint64_t old_version = output_cache_version(cache);
+    model_weights_changed(test_model);
+    const double other[4] = {0, 0, 0, 1};
+    if (output_cache_insert(cache, other, reference.data, old_version) != NO_ERROR || output_cache_lookup(cache, other, cached)){fprintf(stderr,
+        "Error in %s: a stale output was cached under the current weights version.\n",
+        __func__);
+        return;
+    }
+    attach_output_cache(test_model, NULL);
+    free_output_cache(cache);
+
+    // the capacity bounds the whole cache even when every new entry lands in an empty shard
+    cache = create_output_cache(1, 1, 4, 4);
+    for (size_t n = 0; n < 64 && cache != NULL; n++){
+        const double key = (double)n;
+        output_cache_insert(cache, &key, &key, output_cache_version(cache));
+        if (output_cache_stats(cache).entries > 4){fprintf(stderr,
+            "Error in %s: %zu entries in a cache of capacity 4.\n",
+            __func__, output_cache_stats(cache).entries);
+            return;
+        }
+    }
+    free_output_cache(cache);
+    free_output(&reference);
+    free_output(&changed);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_incremental_forward(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 32;
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("incremental model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    if (!test_model){fprintf(stderr,
+        "Error in %s: init_model returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+    for (size_t r = 0; r < number_of_nodes_per_layer; r++){
+        for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+            test_weights[0][r][c] = 0.01 * (double)((r * 7 + c * 3) % 11) - 0.05;
+        }
+    }
+    IncrementalState* state = create_incremental_state(test_model, 0.0, 0);
+    if (!state){fprintf(stderr,
+        "Error in %s: create_incremental_state returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+
+    double tokens[32] = {0};
+    double result[32];
+    for (size_t step = 0; step < 20; step++){
+        // a couple of inputs change per step, every 10 steps the weights change too
+        tokens[(step * 5) % 32] += 0.5;
+        tokens[(step * 11) % 32] -= 0.25;
+        if (step == 10){
+            test_weights[1][3][4] = 2.0;
+            model_weights_changed(test_model);
+        }
+        Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+        incremental_forward(state, &test_prompt, result);
+        Output reference = calculate_output(&test_prompt, test_model);
+        for (size_t i = 0; i < reference.length; i++){
+            if (fabs(result[i] - reference.data[i]) > 1e-9){fprintf(stderr,
+                "Error in %s: incremental output [%zu] = %lf differs from %lf at step %zu.\n",
+                __func__, i, result[i], reference.data[i], step);
+                return;
+            }
+        }
+    }
+    if (state->full_passes != 2 || state->incremental_passes != 18){fprintf(stderr,
+        "Error in %s: expected 2 full and 18 incremental passes, got %zu and %zu.\n",
+        __func__, state->full_passes, state->incremental_passes);
+        return;
+    }
+    free_incremental_state(state);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+typedef struct SnapshotTrainer{
+    Model* model;
+    SnapshotDomain* domain;
+    double first_loss;
+    double last_loss;
+} SnapshotTrainer;
+
+static void* snapshot_trainer_thread(void* argument){
+    SnapshotTrainer* trainer = argument;
+    ModelGradients* gradients = create_model_gradients(trainer->model);
+    double tokens[4] = {1, 0, 1, 0};
+    const double target[4] = {0.1, 0.9, 0.1, 0.9};
+    Prompt prompt = create_prompt(4, tokens);
+    for (int step = 0; step < 200; step++){
+        double loss;
+        train_step(trainer->model, &prompt, target, 0.5, gradients, &loss);
+        trainer->first_loss = (step == 0) ? loss : trainer->first_loss;
+        trainer->last_loss = loss;
+        snapshot_publish(trainer->domain);
+    }
+    free_model_gradients(gradients);
+    return NULL;
+}
+
+void test_snapshots(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("snapshot model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    SnapshotDomain* domain = test_model ? create_snapshot_domain(test_model) : NULL;
+    if (!domain){fprintf(stderr,
+        "Error in %s: init_model or create_snapshot_domain returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+
+    // The trainer updates the model and publishes while this thread serves from the snapshots
+    SnapshotTrainer trainer = {test_model, domain, 0, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, snapshot_trainer_thread, &trainer);
+    const int reader = snapshot_register_reader(domain);
+    double tokens[4] = {1, 0, 1, 0};
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    unsigned long last_version = 0;
+    for (int i = 0; i < 500; i++){
+        const WeightSnapshot* snapshot = snapshot_read_begin(domain, reader);
+        if (snapshot->version < last_version){fprintf(stderr,
+            "Error in %s: snapshot version went back from %lu to %lu.\n",
+            __func__, last_version, snapshot->version);
+            return;
+        }
+        last_version = snapshot->version;
+        Output served = calculate_output_with_weights(&test_prompt, test_model, snapshot->weights, snapshot->biases);
+        snapshot_read_end(domain, reader);
+        if (served.is_valid != 1){fprintf(stderr,
+            "Error in %s: serving from snapshot %lu failed.\n",
+            __func__, last_version);
+            return;
+        }
+    }
+    pthread_join(thread, NULL);
+
+    // Once the trainer is done the current snapshot is the trained model, and nothing is left to reclaim
+    Output served = snapshot_calculate_output(domain, reader, &test_prompt);
+    Output trained = calculate_output(&test_prompt, test_model);
+    snapshot_unregister_reader(domain, reader);
+    snapshot_reclaim(domain);
+    if (!(trainer.last_loss < trainer.first_loss) || domain->number_of_retired != 0
+        || atomic_load(&domain->current)->version != 201 || memcmp(served.data, trained.data, 4 * sizeof(double)) != 0){fprintf(stderr,
+        "Error in %s: loss %lf -> %lf, %zu snapshots not reclaimed, version %lu.\n",
+        __func__, trainer.first_loss, trainer.last_loss, domain->number_of_retired, atomic_load(&domain->current)->version);
+        return;
+    }
+    free_snapshot_domain(domain);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_memory_lifecycle(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("lifecycle model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    if (!test_model){fprintf(stderr,
+        "Error in %s: init_model returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+
+    // 2 matrices of 4 rows: 4 row pointers + 4 x 4 values each, plus the vector of 2 matrices; every layer vector takes a 64 byte line
+    ModelMemoryFootprint footprint = model_memory_footprint(test_model);
+    const size_t expected_weights = 2 * 4 * (sizeof(double*) + 4 * sizeof(double)) + 2 * sizeof(double**);
+    if (footprint.weights != expected_weights || footprint.biases != 3 * 64 || footprint.activations != 3 * 2 * 64
+        || footprint.caches != 0 || footprint.bytes_per_output != 3 * 2 * (sizeof(double*) + 4 * sizeof(double))){fprintf(stderr,
+        "Error in %s: unexpected footprint weights %zu, biases %zu, activations %zu, caches %zu, per output %zu.\n",
+        __func__, footprint.weights, footprint.biases, footprint.activations, footprint.caches, footprint.bytes_per_output);
+        return;
+    }
+    OutputCache* cache = create_output_cache(number_of_nodes_per_layer, number_of_nodes_per_layer, 8, 2);
+    attach_output_cache(test_model, cache);
+    if (model_memory_footprint(test_model).caches != output_cache_memory_bytes(cache)){fprintf(stderr,
+        "Error in %s: the attached cache is not accounted.\n",
+        __func__);
+        return;
+    }
+
+    double tokens[4] = {1, 0, 0, 1};
+    Prompt prompts[2] = {create_prompt(number_of_nodes_per_layer, tokens), create_prompt(number_of_nodes_per_layer, tokens)};
+    Output single = calculate_output(&prompts[0], test_model);
+    Output* batch = calculate_output_batch(prompts, 2, test_model);
+    free_output(&single);
+    free_output_batch(batch, 2);
+    free_prompt(&prompts[0]);
+    free_prompt(&prompts[1]);
+    if (single.is_valid == 1 || prompts[0].data != NULL){fprintf(stderr,
+        "Error in %s: freed output or prompt still looks valid.\n",
+        __func__);
+        return;
+    }
+    free_model(test_model);
+    free_output_cache(cache);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_allocators(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 8;
+    double tokens[8] = {1, 0, 0, 1, 1, 0, 0, 1};
+
+    // 1) tracking: every subsystem is accounted and everything is given back
+    TrackingAllocator* tracking = create_tracking_allocator(NULL);
+    Allocator* previous = allocator_set_current(&tracking->base);
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("tracked model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    Output reference = calculate_output(&test_prompt, test_model);
+    for (int s = 0; s < ALLOCATOR_SUBSYSTEM_OTHER; s++){
+        if (atomic_load(&tracking->subsystems[s].live_bytes) == 0){fprintf(stderr,
+            "Error in %s: no live bytes tracked for subsystem %s.\n",
+            __func__, allocator_subsystem_name((AllocatorSubsystem)s));
+            return;
+        }
+    }
+    double expected[8];
+    memcpy(expected, reference.data, sizeof(expected));
+    free_output(&reference);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+    allocator_set_current(previous);
+    tracking_allocator_report(tracking, stdout);
+    for (int s = 0; s < ALLOCATOR_SUBSYSTEM_COUNT; s++){
+        if (atomic_load(&tracking->subsystems[s].live_bytes) != 0){fprintf(stderr,
+            "Error in %s: %zu bytes of subsystem %s still live after the frees.\n",
+            __func__, atomic_load(&tracking->subsystems[s].live_bytes), allocator_subsystem_name((AllocatorSubsystem)s));
+            return;
+        }
+    }
+    free_tracking_allocator(tracking);
+
+    // 2) arena: the whole model lives in one chunk and is dropped at once
+    ArenaAllocator* arena = create_arena_allocator(0);
+    previous = allocator_set_current(&arena->base);
+    test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    test_model = init_model("arena model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    allocator_set_current(previous);
+    test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    Output arena_output = calculate_output(&test_prompt, test_model);
+    if (arena->chunks == NULL || arena->chunks->next != NULL || memcmp(arena_output.data, expected, sizeof(expected)) != 0){fprintf(stderr,
+        "Error in %s: the arena model is not in a single chunk or computes a different output.\n",
+        __func__);
+        return;
+    }
+    free_output(&arena_output);
+    free_model(test_model);     // only unregisters the metrics, the releases are no-ops
+    free_arena_allocator(arena);
+
+    // 3) pool: per request buffers are recycled, a single slab serves every request
+    test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    test_model = init_model("pooled model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    PoolAllocator* pool = create_pool_allocator(number_of_nodes_per_layer * sizeof(double), 16, NULL);
+    previous = allocator_set_current(&pool->base);
+    for (int request = 0; request < 100; request++){
+        Output pooled = calculate_output(&test_prompt, test_model);
+        if (memcmp(pooled.data, expected, sizeof(expected)) != 0){fprintf(stderr,
+            "Error in %s: pooled output differs at request %d.\n",
+            __func__, request);
+            return;
+        }
+        free_output(&pooled);
+    }
+    allocator_set_current(previous);
+    if (pool->live_blocks != 0 || pool->slabs == NULL || pool->slabs->next != NULL){fprintf(stderr,
+        "Error in %s: %zu pool blocks still live or more than one slab used.\n",
+        __func__, pool->live_blocks);
+        return;
+    }
+    free_pool_allocator(pool);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+typedef struct NumaRequest{
+    ModelReplicas* replicas;
+    Prompt* prompt;
+    double result[4];
+    int node;
+    int is_valid;
+} NumaRequest;
+
+static void numa_request_task(void* argument){
+    NumaRequest* request = argument;
+    Output served = numa_calculate_output(request->replicas, request->prompt);
+    request->node = local_model_replica(request->replicas)->node;
+    request->is_valid = served.is_valid;
+    if (served.is_valid == 1){
+        memcpy(request->result, served.data, sizeof(request->result));
+    }
+    free_output(&served);
+}
+
+void test_numa_replicas(void){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;
+    double tokens[4] = {1, 0, 1, 1};
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("numa model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    Output reference = calculate_output(&test_prompt, test_model);
+    const NumaTopology* topology = numa_topology();
+    printf("NUMA topology: %d node(s), %d CPU(s)\n", topology->number_of_nodes, topology->number_of_cpus);
+
+    // One replica per node, on a single node machine it is the model itself
+    ModelReplicas* replicas = create_model_replicas(test_model, NUMA_REPLICATE_PER_NODE);
+    if (!replicas || replicas->number_of_replicas != topology->number_of_nodes
+        || (topology->number_of_nodes == 1 && replicas->replicas[0].slab != NULL)){fprintf(stderr,
+        "Error in %s: create_model_replicas returned NULL or the wrong replicas.\n",
+        __func__);
+        return;
+    }
+    free_model_replicas(replicas);
+
+    // Huge page backed slabs (falling back to regular pages), served by pinned workers
+    replicas = create_model_replicas(test_model, NUMA_REPLICATE_PER_NODE | NUMA_HUGE_PAGES);
+    ThreadPool* pool = create_thread_pool(4, 1);
+    if (!replicas || !pool || replicas->replicas[0].slab == NULL){fprintf(stderr,
+        "Error in %s: huge page replicas or the thread pool could not be created.\n",
+        __func__);
+        return;
+    }
+    // every worker started, pinned ones (to a CPU this process may use) know their node, unpinned ones have none
+    for (size_t w = 0; w < pool->number_of_threads; w++){
+        if (pool->number_of_threads != 4 || (pool->worker_cpus[w] < 0) != (pool->worker_nodes[w] < 0)){fprintf(stderr,
+            "Error in %s: %zu workers, worker %zu on CPU %d of node %d.\n",
+            __func__, pool->number_of_threads, w, pool->worker_cpus[w], pool->worker_nodes[w]);
+            return;
+        }
+    }
+    NumaRequest requests[16];
+    for (int i = 0; i < 16; i++){
+        requests[i] = (NumaRequest){ replicas, &test_prompt, {0}, -1, 0 };
+        thread_pool_submit(pool, numa_request_task, &requests[i]);
+    }
+    thread_pool_wait(pool);
+    for (int i = 0; i < 16; i++){
+        if (requests[i].is_valid != 1 || requests[i].node < 0 || requests[i].node >= replicas->number_of_replicas
+            || memcmp(requests[i].result, reference.data, sizeof(requests[i].result)) != 0){fprintf(stderr,
+            "Error in %s: request %d served by node %d differs from the model's output.\n",
+            __func__, i, requests[i].node);
+            return;
+        }
+    }
+
+    // After training the replicas are refreshed
+    test_model->model_layers[2].biases[1] += 0.5;
+    model_weights_changed(test_model);
+    refresh_model_replicas(replicas);
+    Output updated = calculate_output(&test_prompt, test_model);
+    requests[0] = (NumaRequest){ replicas, &test_prompt, {0}, -1, 0 };
+    thread_pool_submit(pool, numa_request_task, &requests[0]);
+    thread_pool_wait(pool);
+    if (memcmp(requests[0].result, updated.data, sizeof(requests[0].result)) != 0){fprintf(stderr,
+        "Error in %s: refreshed replica differs from the updated model.\n",
+        __func__);
+        return;
+    }
+    free_thread_pool(pool);
+    free_model_replicas(replicas);
+    free_output(&updated);
+    free_output(&reference);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_pipeline(void){
+    const size_t number_of_layers = 8;
+    const size_t number_of_nodes_per_layer = 16;
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("pipelined model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+
+    // 7 layers with weights over 3 stages: the heaviest stage holds 3 of them, the input layer (no weights) rides along
+    size_t first_layers[4];
+    double heaviest = 0.0;
+    const size_t number_of_stages = test_model ? partition_layers_by_flops(test_model, 3, first_layers) : 0;
+    for (size_t s = 0; s < number_of_stages; s++){
+        double flops = 0.0;
+        for (size_t i = first_layers[s]; i < first_layers[s + 1]; i++){
+            flops += layer_flops(test_model, i);
+        }
+        heaviest = (flops > heaviest) ? flops : heaviest;
+    }
+    if (number_of_stages != 3 || first_layers[0] != 0 || first_layers[3] != number_of_layers
+        || heaviest != 3 * layer_flops(test_model, 1)){fprintf(stderr,
+        "Error in %s: unbalanced partition, heaviest stage %.0lf FLOPs.\n",
+        __func__, heaviest);
+        return;
+    }
+
+    Pipeline* pipeline = create_pipeline(test_model, 3, 4);
+    if (!pipeline){fprintf(stderr,
+        "Error in %s: create_pipeline returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+    double tokens[64][16];
+    Prompt prompts[64];
+    for (size_t r = 0; r < 64; r++){
+        for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+            tokens[r][j] = (double)((r >> (j % 6)) & 1);
+        }
+        prompts[r] = create_prompt(number_of_nodes_per_layer, tokens[r]);
+    }
+    // Stream the prompts, keeping at most 8 in flight, the results come back in order
+    size_t submitted = 0, received = 0;
+    while (received < 64){
+        if (submitted < 64 && submitted - received < 8){
+            pipeline_submit(pipeline, &prompts[submitted], (void*)(prompts + submitted));
+            submitted++;
+            continue;
+        }
+        Output streamed;
+        void* tag;
+        pipeline_receive(pipeline, &streamed, &tag);
+        Output expected = calculate_output(&prompts[received], test_model);
+        if (tag != (void*)(prompts + received) || streamed.is_valid != 1
+            || memcmp(streamed.data, expected.data, number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+            "Error in %s: result %zu out of order or different from calculate_output.\n",
+            __func__, received);
+            return;
+        }
+        free_output(&streamed);
+        free_output(&expected);
+        received++;
+    }
+    // Idle stages sleep: waiting 100 ms for work costs (almost) no CPU time
+    struct timespec cpu_before, cpu_after, idle = { 0, 100000000L };
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_before);
+    nanosleep(&idle, NULL);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_after);
+    const double idle_cpu_seconds = (double)(cpu_after.tv_sec - cpu_before.tv_sec) + 1e-9 * (double)(cpu_after.tv_nsec - cpu_before.tv_nsec);
+    if (idle_cpu_seconds > 0.05){fprintf(stderr,
+        "Error in %s: the idle pipeline used %.3lf s of CPU in 0.1 s.\n",
+        __func__, idle_cpu_seconds);
+        return;
+    }
+
+    // Requests still in flight are dropped by free_pipeline
+    pipeline_submit(pipeline, &prompts[0], NULL);
+    free_pipeline(pipeline);
+    for (size_t r = 0; r < 64; r++){
+        free_prompt(&prompts[r]);
+    }
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+static void async_count_completion(AsyncRequest* request, void* user_data){
+    if (async_poll(request) == ASYNC_DONE){
+        atomic_fetch_add((_Atomic int*)user_data, 1);
+    }
+}
+
+void test_async_inference(void){
+    const size_t number_of_layers = 4;
+    const size_t number_of_nodes_per_layer = 8;
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("async model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, myThresholdFunc);
+    AsyncEngine* engine = test_model ? create_async_engine(test_model, 2, 16) : NULL;
+    if (!engine){fprintf(stderr,
+        "Error in %s: init_model or create_async_engine returned NULL pointer.\n",
+        __func__);
+        return;
+    }
+    double tokens[8] = {1, 1, 0, 0, 1, 0, 1, 0};
+    Prompt test_prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    Output expected = calculate_output(&test_prompt, test_model);
+
+    // 1) wait
+    AsyncRequest* waited = async_submit(engine, &test_prompt, NULL, NULL);
+    Output* waited_output = async_wait(waited);
+    if (async_poll(waited) != ASYNC_DONE || memcmp(waited_output->data, expected.data, 8 * sizeof(double)) != 0){fprintf(stderr,
+        "Error in %s: async_wait returned a different output.\n",
+        __func__);
+        return;
+    }
+    async_release(waited);
+
+    // A prompt of the wrong length is refused at submit time instead of failing its batch
+    Prompt short_prompt = create_prompt(number_of_nodes_per_layer - 1, tokens);
+    AsyncRequest* refused = async_submit(engine, &short_prompt, NULL, NULL);
+    free_prompt(&short_prompt);
+    if (refused != NULL){fprintf(stderr,
+        "Error in %s: async_submit accepted a prompt of the wrong length.\n",
+        __func__);
+        return;
+    }
+
+    // 2) callbacks
+    _Atomic int completions = 0;
+    AsyncRequest* requests[40];
+    for (int i = 0; i < 40; i++){
+        requests[i] = async_submit(engine, &test_prompt, async_count_completion, &completions);
+    }
+    for (int i = 0; i < 40; i++){
+        async_wait(requests[i]);
+        async_release(requests[i]);
+    }
+    if (atomic_load(&completions) != 40){fprintf(stderr,
+        "Error in %s: %d callbacks instead of 40.\n",
+        __func__, atomic_load(&completions));
+        return;
+    }
+
+    // 3) event loop: poll the eventfd and drain the completion queue
+    const int event_fd = async_event_fd(engine);
+    for (int i = 0; i < 40; i++){
+        requests[i] = async_submit(engine, &test_prompt, NULL, NULL);
+    }
+    int drained = 0;
+    while (event_fd >= 0 && drained < 40){
+        struct pollfd descriptor = { event_fd, POLLIN, 0 };
+        if (poll(&descriptor, 1, 1000) != 1){
+            break;
+        }
+        uint64_t count;
+        if (read(event_fd, &count, sizeof(count)) != sizeof(count)){
+            break;
+        }
+        AsyncRequest* completed;
+        while ((completed = async_next_completed(engine)) != NULL){
+            Output taken = async_take_output(completed);
+            if (taken.is_valid != 1 || memcmp(taken.data, expected.data, 8 * sizeof(double)) != 0){fprintf(stderr,
+                "Error in %s: completed request with a different output.\n",
+                __func__);
+                return;
+            }
+            free_output(&taken);
+            async_release(completed);
+            drained++;
+        }
+    }
+    if (event_fd >= 0 && drained != 40){fprintf(stderr,
+        "Error in %s: only %d requests drained through the eventfd.\n",
+        __func__, drained);
+        return;
+    }
+    if (event_fd < 0){
+        for (int i = 0; i < 40; i++){
+            async_wait(requests[i]);
+            async_release(requests[i]);
+        }
+    }
+    printf("async engine: %zu requests in %zu batches\n", engine->requests, engine->batches);
+
+    // A handle can outlive the engine
+    AsyncRequest* late = async_submit(engine, &test_prompt, NULL, NULL);
+    free_async_engine(engine);
+    if (async_poll(late) != ASYNC_DONE){fprintf(stderr,
+        "Error in %s: free_async_engine did not complete the queued request.\n",
+        __func__);
+        return;
+    }
+    async_release(late);
+    free_output(&expected);
+    free_prompt(&test_prompt);
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+/**
+ * @brief One rank of test_distributed_training, run in a forked process
+ * @return int 0 if the rank saw no problem
+ */
+static int distributed_training_rank(int rank, int world_size, DistributedTransport transport, const char* address, int base_port,
+                                     DistributedCompression compression){
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("distributed model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    DistributedContext* context = create_distributed_context(rank, world_size, transport, address, base_port, compression, 0.25);
+    ModelGradients* gradients = test_model ? create_model_gradients(test_model) : NULL;
+    if (!context || !gradients){
+        return 1;
+    }
+    // the ranks start from different biases, the broadcast gives every rank those of rank 0
+    test_model->model_layers[1].biases[0] = 0.1 * rank;
+    if (distributed_broadcast_parameters(context, test_model) != NO_ERROR || test_model->model_layers[1].biases[0] != 0.0){
+        return 1;
+    }
+    // 12 samples, rank r trains on the samples s with s % world_size == r
+    double tokens[12][4], expected[12][4];
+    Prompt prompts[12];
+    const double* targets[12];
+    size_t shard = 0;
+    for (size_t s = 0; s < 12; s++){
+        for (size_t j = 0; j < 4; j++){
+            tokens[s][j] = (double)((s >> j) & 1);
+            expected[s][3 - j] = 0.2 + 0.6 * tokens[s][j];     // the bits reversed
+        }
+        if ((int)(s % (size_t)world_size) == rank){
+            prompts[shard] = create_prompt(number_of_nodes_per_layer, tokens[s]);
+            targets[shard] = expected[s];
+            shard++;
+        }
+    }
+    double losses[2] = {0.0, 0.0};
+    for (int step = 0; step < 60; step++){
+        double loss;
+        if (distributed_train_step(context, test_model, prompts, targets, shard, 2.0, gradients, &loss) != NO_ERROR){
+            return 2;
+        }
+        losses[step == 0 ? 0 : 1] = loss;
+    }
+    // the mean loss over the ranks went down, and every rank holds the same parameters (mean of x and of x^2 agree)
+    double checksum = 0.0;
+    for (size_t r = 0; r < number_of_nodes_per_layer; r++){
+        for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+            checksum += test_model->model_weights[1][r][c] * (double)(1 + r * 4 + c);
+        }
+    }
+    double reduced[4] = { losses[0], losses[1], checksum, checksum * checksum };
+    if (distributed_allreduce(context, reduced, 4) != NO_ERROR){
+        return 3;
+    }
+    const double mean = reduced[2] / world_size;
+    const int identical = fabs(reduced[3] / world_size - mean * mean) <= 1e-9 * (1.0 + mean * mean) && fabs(mean - checksum) <= 1e-12 * (1.0 + fabs(mean));
+    if (rank == 0){
+        printf("distributed (%s, compression %d): loss %lf -> %lf, %zu bytes sent by rank 0\n",
+               transport == DISTRIBUTED_TCP ? "tcp" : "unix", (int)compression, reduced[0] / world_size, reduced[1] / world_size, context->bytes_sent);
+    }
+    int result = (reduced[1] < reduced[0] && identical) ? 0 : 4;
+    // a rank whose forward pass fails still takes part in the all-reduces: its peers complete the step, only it reports the error
+    Prompt bad_prompt = create_prompt(number_of_nodes_per_layer - 1, tokens[0]);
+    const int failing = (rank == world_size - 1);
+    const ErrorCode failed_step = distributed_train_step(context, test_model, failing ? &bad_prompt : prompts, targets, 1, 2.0, gradients, NULL);
+    if ((failed_step != NO_ERROR) != failing){
+        result = 5;
+    }
+    free_prompt(&bad_prompt);
+    for (size_t s = 0; s < shard; s++){
+        free_prompt(&prompts[s]);
+    }
+    free_model_gradients(gradients);
+    free_distributed_context(context);
+    free_model(test_model);
+    return result;
+}
+
+void test_distributed_training(void){
+    // 1 + 2^-11 + 2^-40 is just above the tie between two halves: a float drops the 2^-40 and rounds the tie down to even
+    if (double_to_half(1.0 + ldexp(1.0, -11) + ldexp(1.0, -40)) != 0x3C01u || double_to_half(1.0 + ldexp(1.0, -11)) != 0x3C00u
+        || double_to_half(-65520.0) != 0xFBFFu || double_to_half(ldexp(1.5, -25)) != 0x0001u){fprintf(stderr,
+        "Error in %s: double_to_half did not round to the nearest half.\n",
+        __func__);
+        return;
+    }
+    const int world_size = 3;
+    const struct { DistributedTransport transport; DistributedCompression compression; } runs[3] = {
+        { DISTRIBUTED_UNIX, DISTRIBUTED_COMPRESSION_NONE },
+        { DISTRIBUTED_TCP, DISTRIBUTED_COMPRESSION_FP16 },
+        { DISTRIBUTED_UNIX, DISTRIBUTED_COMPRESSION_TOPK },
+    };
+    for (int run = 0; run < 3; run++){
+        char address[64];
+        if (runs[run].transport == DISTRIBUTED_UNIX){
+            snprintf(address, sizeof(address), "/tmp/ffnn-ring-%d-%d", (int)getpid(), run);
+        } else {
+            snprintf(address, sizeof(address), "127.0.0.1");
+        }
+        const int base_port = 20000 + (int)(getpid() % 20000) + 8 * run;
+        pid_t children[3];
+        fflush(stdout);
+        fflush(stderr);
+        for (int rank = 0; rank < world_size; rank++){
+            children[rank] = fork();
+            if (children[rank] == 0){
+                const int code = distributed_training_rank(rank, world_size, runs[run].transport, address, base_port, runs[run].compression);
+                fflush(stdout);
+                _exit(code);
+            }
+        }
+        for (int rank = 0; rank < world_size; rank++){
+            int status = -1;
+            if (children[rank] < 0 || waitpid(children[rank], &status, 0) != children[rank] || !WIFEXITED(status) || WEXITSTATUS(status) != 0){fprintf(stderr,
+                "Error in %s: rank %d of run %d failed (status %d).\n",
+                __func__, rank, run, status);
+                return;
+            }
+        }
+    }
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_weight_initializers(void){
+    // known answer of the reference Philox4x32-10 (Random123): counter 0, key 0
+    const uint32_t zero_counter[4] = {0, 0, 0, 0}, zero_key[2] = {0, 0};
+    uint32_t block[4];
+    philox4x32_10(zero_counter, zero_key, block);
+    if (block[0] != 0x6627e8d5u || block[1] != 0xe169c58du || block[2] != 0xbc57ac4cu || block[3] != 0x9b00dbd8u){fprintf(stderr,
+        "Error in %s: Philox4x32-10 does not match the reference.\n",
+        __func__);
+        return;
+    }
+
+    // the same seed gives bit identical weights with 1 and 3 threads, and through create_FF_model_matrices_initialized
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 37;      // odd, so rows start on both halves of a Philox pair
+    WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_UNIFORM, .seed = 42, .number_of_threads = 1 };
+    Model* single = init_model("initialized model", number_of_layers, create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer),
+                               number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    Model* threaded = init_model("initialized model", number_of_layers, create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer),
+                                 number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    double*** created = NULL;
+    if (single == NULL || threaded == NULL || initialize_model_weights(single, &initializer) != NO_ERROR){fprintf(stderr,
+        "Error in %s: initialization failed.\n",
+        __func__);
+        return;
+    }
+    initializer.number_of_threads = 3;
+    created = create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer);
+    if (initialize_model_weights(threaded, &initializer) != NO_ERROR || created == NULL){fprintf(stderr,
+        "Error in %s: threaded initialization failed.\n",
+        __func__);
+        return;
+    }
+    const double limit = sqrt(6.0 / (2.0 * number_of_nodes_per_layer));
+    double sum = 0.0;
+    for (size_t m = 0; m < number_of_layers - 1; m++){
+        for (size_t r = 0; r < number_of_nodes_per_layer; r++){
+            if (memcmp(single->model_weights[m][r], threaded->model_weights[m][r], number_of_nodes_per_layer * sizeof(double)) != 0
+                || memcmp(single->model_weights[m][r], created[m][r], number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+                "Error in %s: weights of matrix %zu row %zu depend on the number of threads.\n",
+                __func__, m, r);
+                return;
+            }
+            for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+                const double w = single->model_weights[m][r][c];
+                if (w < -limit || w >= limit){fprintf(stderr,
+                    "Error in %s: Xavier weight %lf outside [-%lf, %lf).\n",
+                    __func__, w, limit, limit);
+                    return;
+                }
+                sum += w;
+            }
+        }
+    }
+    if (memcmp(single->model_weights[0][0], single->model_weights[1][0], number_of_nodes_per_layer * sizeof(double)) == 0
+        || fabs(sum / (2.0 * number_of_nodes_per_layer * number_of_nodes_per_layer)) > 0.1 * limit){fprintf(stderr,
+        "Error in %s: the matrices share their stream or the Xavier weights are not centered (mean %lf).\n",
+        __func__, sum / (2.0 * number_of_nodes_per_layer * number_of_nodes_per_layer));
+        return;
+    }
+    free_FF_model_matrices(created, number_of_layers - 1, number_of_nodes_per_layer);
+
+    // He normal: mean 0 and standard deviation sqrt(2 / fan_in) over 64 x 64 samples
+    const size_t size = 64;
+    double** matrix = create_matrix_double((int)size, (int)size);
+    initializer = (WeightInitializer){ .kind = INITIALIZER_HE_NORMAL, .seed = 7, .number_of_threads = 0 };
+    if (matrix == NULL || initialize_matrix(matrix, size, size, &initializer, 0) != NO_ERROR){fprintf(stderr,
+        "Error in %s: initialize_matrix failed.\n",
+        __func__);
+        return;
+    }
+    double mean = 0.0, squares = 0.0;
+    for (size_t r = 0; r < size; r++){
+        for (size_t c = 0; c < size; c++){
+            mean += matrix[r][c];
+            squares += matrix[r][c] * matrix[r][c];
+        }
+    }
+    mean /= (double)(size * size);
+    const double deviation = sqrt(squares / (double)(size * size) - mean * mean);
+    const double expected_deviation = sqrt(2.0 / (double)size);
+    if (fabs(mean) > 0.1 * expected_deviation || fabs(deviation - expected_deviation) > 0.05 * expected_deviation){fprintf(stderr,
+        "Error in %s: He normal gave mean %lf and deviation %lf instead of 0 and %lf.\n",
+        __func__, mean, deviation, expected_deviation);
+        return;
+    }
+    // an invalid distribution is refused
+    initializer = (WeightInitializer){ .kind = INITIALIZER_UNIFORM, .a = 1.0, .b = -1.0 };
+    if (initialize_matrix(matrix, size, size, &initializer, 0) != ERROR_INVALID_PARAMETER){fprintf(stderr,
+        "Error in %s: uniform in [1, -1) was accepted.\n",
+        __func__);
+        return;
+    }
+    free_double_matrix(matrix, (int)size);
+
+    // the initialized model trains: one step on a single sample lowers the loss
+    double tokens[37], expected[37];
+    for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+        tokens[j] = (double)(j % 2);
+        expected[j] = 0.2 + 0.6 * (double)((j / 2) % 2);
+    }
+    Prompt prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    ModelGradients* gradients = create_model_gradients(single);
+    double first_loss = 0.0, loss = 0.0;
+    for (int step = 0; step < 20; step++){
+        if (train_step(single, &prompt, expected, 0.5, gradients, &loss) != NO_ERROR){fprintf(stderr,
+            "Error in %s: train_step failed.\n",
+            __func__);
+            return;
+        }
+        if (step == 0){
+            first_loss = loss;
+        }
+    }
+    if (!(loss < first_loss)){fprintf(stderr,
+        "Error in %s: the loss went from %lf to %lf.\n",
+        __func__, first_loss, loss);
+        return;
+    }
+    free_prompt(&prompt);
+    free_model_gradients(gradients);
+    free_model(single);
+    free_model(threaded);
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_execution_plan(void){
+    const size_t number_of_layers = 4;
+    const size_t number_of_nodes_per_layer = 6;
+    const WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_NORMAL, .seed = 3, .number_of_threads = 1 };
+    double*** test_weights = create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer);
+    Model* test_model = init_model("planned model", number_of_layers, test_weights, number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    ExecutionPlan* plan = compile_plan(test_model);
+    double* arena = plan_create_arena(plan);
+    if (plan == NULL || arena == NULL || plan->number_of_steps != number_of_layers || plan->input_length != number_of_nodes_per_layer){fprintf(stderr,
+        "Error in %s: compile_plan failed.\n",
+        __func__);
+        return;
+    }
+    for (size_t i = 0; i < plan->number_of_steps; i++){
+        if (plan->steps[i].output_offset % (PLAN_ALIGNMENT / sizeof(double)) != 0 || (i > 0 && plan->steps[i].layer.kernel == NULL)){fprintf(stderr,
+            "Error in %s: step %zu is not aligned or has no kernel.\n",
+            __func__, i);
+            return;
+        }
+    }
+
+    // the plan computes exactly what calculate_output computes, also after the weights changed in place
+    double tokens[6] = {0.5, -1.0, 0.25, 2.0, 0.0, 1.0};
+    Prompt prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    for (int round = 0; round < 2; round++){
+        Output reference = calculate_output(&prompt, test_model);
+        Output planned = plan_calculate_output(plan, &prompt);
+        const double* executed = plan_execute(plan, tokens, arena);
+        if (reference.is_valid != 1 || planned.is_valid != 1 || planned.length != reference.length){fprintf(stderr,
+            "Error in %s: invalid outputs.\n",
+            __func__);
+            return;
+        }
+        for (size_t i = 0; i < number_of_layers; i++){
+            if (memcmp(reference.layer_inputs[i], planned.layer_inputs[i], number_of_nodes_per_layer * sizeof(double)) != 0
+                || memcmp(reference.layer_outputs[i], planned.layer_outputs[i], number_of_nodes_per_layer * sizeof(double)) != 0
+                || memcmp(reference.layer_inputs[i], arena + plan->steps[i].pre_activation_offset, number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+                "Error in %s: layer %zu of the plan differs from calculate_output (round %d).\n",
+                __func__, i, round);
+                return;
+            }
+        }
+        if (memcmp(executed, reference.data, reference.length * sizeof(double)) != 0){fprintf(stderr,
+            "Error in %s: plan_execute differs from calculate_output.\n",
+            __func__);
+            return;
+        }
+        free_output(&reference);
+        free_output(&planned);
+        test_model->model_weights[1][2][3] += 0.5;
+        test_model->model_layers[2].biases[1] -= 0.25;
+        model_weights_changed(test_model);
+    }
+
+    // invalid inputs are refused once, at plan time or at the only check of plan_calculate_output
+    Prompt short_prompt = { .data = tokens, .length = 5 };
+    Output refused = plan_calculate_output(plan, &short_prompt);
+    double* row = test_model->model_weights[0][4];
+    test_model->model_weights[0][4] = NULL;
+    ExecutionPlan* broken = compile_plan(test_model);
+    test_model->model_weights[0][4] = row;
+    if (refused.is_valid == 1 || broken != NULL || compile_plan(NULL) != NULL){fprintf(stderr,
+        "Error in %s: an invalid prompt or model was accepted.\n",
+        __func__);
+        return;
+    }
+    free_prompt(&prompt);
+    plan_free_arena(arena);
+    free_plan(plan);
+    free_model(test_model);
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_binarized_model(void){
+    // weights of ±0.5 and biases ending in .25: the conversion is exact and no sum falls on the 0.5 threshold
+    const size_t number_of_layers = 4;
+    const size_t number_of_nodes_per_layer = 130;     // 3 words, the last one partial
+    double*** test_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    Model* test_model = init_model("binary model", number_of_layers, test_weights, number_of_nodes_per_layer, myThresholdFunc, myThresholdFunc);
+    if (test_model == NULL){fprintf(stderr,
+        "Error in %s: init_model failed.\n",
+        __func__);
+        return;
+    }
+    for (size_t m = 0; m < number_of_layers - 1; m++){
+        for (size_t r = 0; r < number_of_nodes_per_layer; r++){
+            for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+                test_weights[m][r][c] = ((r * 7 + c * 3 + m) % 5 < 2) ? -0.5 : 0.5;
+            }
+        }
+    }
+    for (size_t i = 0; i < number_of_layers; i++){
+        for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+            test_model->model_layers[i].biases[j] = (i == 0) ? ((j % 11 == 0) ? 0.75 : (j % 13 == 0) ? -0.75 : 0.0) : 0.25 - 0.5 * (double)(j % 9);
+        }
+    }
+    model_weights_changed(test_model);
+
+    BinaryModel* binary = binarize_model(test_model);
+    if (binary == NULL || binary->max_weight_error != 0.0 || !binary->binary_output
+        || binary->packed_bytes * 32 > (number_of_layers - 1) * number_of_nodes_per_layer * number_of_nodes_per_layer * sizeof(double)){fprintf(stderr,
+        "Error in %s: conversion failed, not exact or not packed.\n",
+        __func__);
+        return;
+    }
+    Prompt prompts[16];
+    double tokens[16][130];
+    for (size_t p = 0; p < 16; p++){
+        for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+            tokens[p][j] = (double)(((p * 131 + j * 17) >> 2) % 3 == 0);
+        }
+        prompts[p] = create_prompt(number_of_nodes_per_layer, tokens[p]);
+    }
+    const double agreement = binary_model_agreement(binary, test_model, prompts, 16);
+    if (agreement != 1.0){fprintf(stderr,
+        "Error in %s: the exact conversion agrees on %lf of the outputs.\n",
+        __func__, agreement);
+        return;
+    }
+    // the packed path gives the same bits
+    for (size_t p = 0; p < 16; p++){
+        uint64_t input_bits[BINARY_WORDS(130)], output_bits[BINARY_WORDS(130)], expected_bits[BINARY_WORDS(130)];
+        double values[130];
+        binary_pack(tokens[p], number_of_nodes_per_layer, input_bits);
+        if (binary_calculate_output_packed(binary, input_bits, output_bits) != NO_ERROR
+            || binary_calculate_output(binary, tokens[p], values) != NO_ERROR){fprintf(stderr,
+            "Error in %s: binarized forward failed.\n",
+            __func__);
+            return;
+        }
+        binary_pack(values, number_of_nodes_per_layer, expected_bits);
+        if (memcmp(output_bits, expected_bits, sizeof(expected_bits)) != 0){fprintf(stderr,
+            "Error in %s: packed and unpacked outputs differ for prompt %zu.\n",
+            __func__, p);
+            return;
+        }
+    }
+    free_binary_model(binary);
+
+    // a sigmoid output layer reads binary inputs, it keeps its real outputs
+    test_model->model_layers[number_of_layers - 1].activation = mySigmoid;
+    test_model->model_layers[number_of_layers - 1].activation_kind = ACTIVATION_SIGMOID;
+    binary = binarize_model(test_model);
+    if (binary == NULL || binary->binary_output || binary_model_agreement(binary, test_model, prompts, 16) != 1.0){fprintf(stderr,
+        "Error in %s: the sigmoid output layer is not converted exactly.\n",
+        __func__);
+        return;
+    }
+    free_binary_model(binary);
+
+    // trained style weights convert with an error, and hidden layers that are not threshold layers are refused
+    test_model->model_layers[number_of_layers - 1].activation = myThresholdFunc;
+    test_model->model_layers[number_of_layers - 1].activation_kind = ACTIVATION_THRESHOLD;
+    const WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_UNIFORM, .seed = 11, .number_of_threads = 1 };
+    initialize_model_weights(test_model, &initializer);
+    binary = binarize_model(test_model);
+    const double approximate = binary ? binary_model_agreement(binary, test_model, prompts, 16) : -1.0;
+    test_model->model_layers[1].activation_kind = ACTIVATION_SIGMOID;
+    if (binary == NULL || !(binary->max_weight_error > 0.0) || approximate < 0.0 || approximate > 1.0 || binarize_model(test_model) != NULL){fprintf(stderr,
+        "Error in %s: approximate conversion or refusal failed (agreement %lf).\n",
+        __func__, approximate);
+        return;
+    }
+    printf("binarized model: %zu bytes packed, Xavier weights agree on %.3lf of the outputs, AVX-512 popcount %s\n",
+           binary->packed_bytes, approximate, binary_uses_avx512_popcount() ? "used" : "not available");
+    free_binary_model(binary);
+    for (size_t p = 0; p < 16; p++){
+        free_prompt(&prompts[p]);
+    }
+    free_model(test_model);
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+/**
+ * @brief The sample of model m at step t of test_model_bundles, 4 tokens and 4 targets
+ */
+static void bundle_test_sample(size_t m, int t, double* tokens, double* target){
+    for (size_t j = 0; j < 4; j++){
+        tokens[j] = (double)(((size_t)t + m + j) % 3) * 0.5;
+        target[j] = 0.2 + 0.15 * (double)((m + j + (size_t)t / 2) % 5);
+    }
+}
+
+static double bundle_test_learning_rate(size_t m){
+    return 0.1 + 0.05 * (double)m;
+}
+
+/**
+ * @brief Training of a sweep bundle: 25 lockstep steps on the samples of its models
+ */
+static ErrorCode bundle_test_train(ModelBundle* bundle, size_t first_model, void* user_data){
+    (void)user_data;
+    const size_t K = bundle->number_of_models;
+    double tokens[16][4], targets[16][4], rates[16], inputs[64], expected[64];
+    const double* token_rows[16];
+    const double* target_rows[16];
+    for (int t = 0; t < 25; t++){
+        for (size_t k = 0; k < K; k++){
+            bundle_test_sample(first_model + k, t, tokens[k], targets[k]);
+            token_rows[k] = tokens[k];
+            target_rows[k] = targets[k];
+            rates[k] = bundle_test_learning_rate(first_model + k);
+        }
+        bundle_interleave(token_rows, 4, K, inputs);
+        bundle_interleave(target_rows, 4, K, expected);
+        ErrorCode error = bundle_train_step(bundle, inputs, expected, rates, NULL);
+        if (error != NO_ERROR){
+            return error;
+        }
+    }
+    return NO_ERROR;
+}
+
+void test_model_bundles(void){
+    // 12 models of the 4 nodes per layer scale, each pair (bundled, alone) starts from the same seed
+    const size_t number_of_models = 12;
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 4;
+    Model* bundled[12];
+    Model* alone[12];
+    for (size_t m = 0; m < number_of_models; m++){
+        const WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_UNIFORM, .seed = 100 + m, .number_of_threads = 1 };
+        bundled[m] = init_model("bundled model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                                number_of_nodes_per_layer, mySigmoid, mySigmoid);
+        alone[m] = init_model("lone model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                              number_of_nodes_per_layer, mySigmoid, mySigmoid);
+        if (bundled[m] == NULL || alone[m] == NULL){fprintf(stderr,
+            "Error in %s: init_model failed.\n",
+            __func__);
+            return;
+        }
+    }
+
+    // the forward pass of a bundle is calculate_output of each model
+    ModelBundle* bundle = create_model_bundle(bundled, 5);
+    double tokens[5][4], targets[5][4], inputs[20];
+    const double* rows[5];
+    for (size_t k = 0; k < 5; k++){
+        bundle_test_sample(k, 0, tokens[k], targets[k]);
+        rows[k] = tokens[k];
+    }
+    bundle_interleave(rows, 4, 5, inputs);
+    if (bundle == NULL || bundle_forward(bundle, inputs) != NO_ERROR){fprintf(stderr,
+        "Error in %s: bundle forward failed.\n",
+        __func__);
+        return;
+    }
+    for (size_t k = 0; k < 5; k++){
+        Prompt prompt = create_prompt(number_of_nodes_per_layer, tokens[k]);
+        Output output = calculate_output(&prompt, bundled[k]);
+        for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+            if (output.data[j] != bundle_outputs(bundle)[j * 5 + k]){fprintf(stderr,
+                "Error in %s: output %zu of model %zu is %lf in the bundle and %lf alone.\n",
+                __func__, j, k, bundle_outputs(bundle)[j * 5 + k], output.data[j]);
+                return;
+            }
+        }
+        free_output(&output);
+        free_prompt(&prompt);
+    }
+    free_model_bundle(bundle);
+
+    // models of another shape are refused
+    Model* other = init_model("other model", 2, create_FF_model_matrices(2, 4), 4, mySigmoid, mySigmoid);
+    Model* mixed[2] = { bundled[0], other };
+    if (create_model_bundle(mixed, 2) != NULL){fprintf(stderr,
+        "Error in %s: models of different shapes were bundled.\n",
+        __func__);
+        return;
+    }
+    if (run_model_sweep(mixed, 2, 1, 1, bundle_test_train, NULL) != ERROR_INVALID_PARAMETER){fprintf(stderr,
+        "Error in %s: a sweep of models of different shapes did not report an invalid parameter.\n",
+        __func__);
+        return;
+    }
+    free_model(other);
+
+    // a sweep of bundles of 5 (the last one has 2) on 3 threads trains every model like train_step alone
+    if (run_model_sweep(bundled, number_of_models, 5, 3, bundle_test_train, NULL) != NO_ERROR){fprintf(stderr,
+        "Error in %s: the sweep failed.\n",
+        __func__);
+        return;
+    }
+    ModelGradients* gradients = create_model_gradients(alone[0]);
+    for (size_t m = 0; m < number_of_models; m++){
+        for (int t = 0; t < 25; t++){
+            double token[4], target[4];
+            bundle_test_sample(m, t, token, target);
+            Prompt prompt = create_prompt(number_of_nodes_per_layer, token);
+            train_step(alone[m], &prompt, target, bundle_test_learning_rate(m), gradients, NULL);
+            free_prompt(&prompt);
+        }
+        for (size_t i = 0; i < number_of_layers; i++){
+            if (memcmp(alone[m]->model_layers[i].biases, bundled[m]->model_layers[i].biases, number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+                "Error in %s: biases of layer %zu of model %zu differ from train_step.\n",
+                __func__, i, m);
+                return;
+            }
+            for (size_t r = 0; i + 1 < number_of_layers && r < number_of_nodes_per_layer; r++){
+                if (memcmp(alone[m]->model_weights[i][r], bundled[m]->model_weights[i][r], number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+                    "Error in %s: weights %zu row %zu of model %zu differ from train_step.\n",
+                    __func__, i, r, m);
+                    return;
+                }
+            }
+        }
+    }
+    free_model_gradients(gradients);
+    for (size_t m = 0; m < number_of_models; m++){
+        free_model(bundled[m]);
+        free_model(alone[m]);
+    }
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_kernel_autotuner(void){
+    // the candidates compute the same values
+    double input[7], row_values[7][5], biases[5], pre_blocked[5], out_blocked[5], pre_stream[5], out_stream[5];
+    double* rows[7];
+    for (size_t r = 0; r < 7; r++){
+        input[r] = 0.1 * (double)r - 0.3;
+        for (size_t c = 0; c < 5; c++){
+            row_values[r][c] = 0.05 * (double)(r * 5 + c) - 0.8;
+        }
+        rows[r] = row_values[r];
+    }
+    for (size_t c = 0; c < 5; c++){
+        biases[c] = 0.1 * (double)c;
+    }
+    Layer layer = create_layer(5, mySigmoid, mySigmoid);
+    memcpy(layer.biases, biases, sizeof(biases));
+    fused_layer_forward(input, 7, rows, &layer, pre_blocked, out_blocked);
+    row_stream_layer_forward(input, 7, rows, &layer, pre_stream, out_stream);
+    free_layer(&layer);
+    if (memcmp(pre_blocked, pre_stream, sizeof(pre_blocked)) != 0 || memcmp(out_blocked, out_stream, sizeof(out_blocked)) != 0){fprintf(stderr,
+        "Error in %s: row_stream_layer_forward differs from fused_layer_forward.\n",
+        __func__);
+        return;
+    }
+
+    // first start: nothing cached, every shape is measured and the model computes the same outputs with the winners
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/ffnn-tuning-%d.txt", (int)getpid());
+    remove(path);
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 16;
+    const WeightInitializer initializer = { .kind = INITIALIZER_HE_UNIFORM, .seed = 5, .number_of_threads = 1 };
+    Model* test_model = init_model("tuned model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                                   number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    double tokens[16];
+    for (size_t j = 0; j < 16; j++){
+        tokens[j] = 0.0625 * (double)j;
+    }
+    Prompt prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    Output before = calculate_output(&prompt, test_model);
+    TuningCache* cache = load_tuning_cache(path);
+    if (test_model == NULL || cache == NULL || cache->number_of_entries != 0 || strlen(tuner_cpu_model()) == 0
+        || autotune_model(test_model, cache) != NO_ERROR || cache->tunings != 1 || cache->hits != 1 || cache->number_of_entries != 1){fprintf(stderr,
+        "Error in %s: the first tuning did not measure the single shape once.\n",
+        __func__);
+        return;
+    }
+    Output after = calculate_output(&prompt, test_model);
+    if (memcmp(before.data, after.data, before.length * sizeof(double)) != 0){fprintf(stderr,
+        "Error in %s: the tuned kernels changed the outputs.\n",
+        __func__);
+        return;
+    }
+    free_output(&before);
+    free_output(&after);
+    const layer_kernel_function chosen = test_model->model_layers[1].kernel;
+
+    // an entry measured on another CPU (appended to the file) is loaded and saved again, but not used here
+    if (save_tuning_cache(cache, path) != NO_ERROR){fprintf(stderr,
+        "Error in %s: save_tuning_cache failed.\n",
+        __func__);
+        return;
+    }
+    FILE* file = fopen(path, "a");
+    if (file == NULL){fprintf(stderr,
+        "Error in %s: cannot append to '%s'.\n",
+        __func__, path);
+        return;
+    }
+    fprintf(file, "Some Other CPU @ 1.00GHz\t16\t16\t%d\t%d\t1.0\nnot a tuning entry\n", (int)ACTIVATION_SIGMOID,
+            (int)(cache->entries[0].variant == KERNEL_VARIANT_BLOCKED ? KERNEL_VARIANT_ROW_STREAM : KERNEL_VARIANT_BLOCKED));
+    fclose(file);
+    free_tuning_cache(cache);
+    cache = load_tuning_cache(path);
+    if (cache == NULL || cache->number_of_entries != 2 || save_tuning_cache(cache, path) != NO_ERROR){fprintf(stderr,
+        "Error in %s: the entry of the other CPU was not kept.\n",
+        __func__);
+        return;
+    }
+    free_tuning_cache(cache);
+
+    // next start: the choice is read from the file, nothing is measured
+    test_model->model_layers[1].kernel = test_model->model_layers[2].kernel = NULL;
+    cache = load_tuning_cache(path);
+    if (cache == NULL || cache->number_of_entries != 2 || autotune_model(test_model, cache) != NO_ERROR || cache->tunings != 0 || cache->hits != 2
+        || test_model->model_layers[1].kernel != chosen || test_model->model_layers[2].kernel != chosen){fprintf(stderr,
+        "Error in %s: the cached choice was not reused (%zu tunings, %zu hits).\n",
+        __func__, cache ? cache->tunings : 0, cache ? cache->hits : 0);
+        return;
+    }
+    printf("autotuner on '%s': %zu x %zu layers use %s\n", tuner_cpu_model(), number_of_nodes_per_layer, number_of_nodes_per_layer,
+           chosen == fused_layer_forward ? "the blocked kernel" : chosen == row_stream_layer_forward ? "the row streaming kernel" : "the fixed width kernel");
+    free_tuning_cache(cache);
+    remove(path);
+    free_prompt(&prompt);
+    free_model(test_model);
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+/**
+ * @brief Outputs of a registry attachment compared with the ones of the published model, 1 if they are the same
+ */
+static int registry_outputs_match(Model* attached, const double* expected, size_t length, Prompt* prompt){
+    Output output = calculate_output(prompt, attached);
+    const int same = output.is_valid && output.length == length && memcmp(output.data, expected, length * sizeof(double)) == 0;
+    free_output(&output);
+    return same;
+}
+
+void test_model_registry(void){
+    char name[64], version_path[128];
+    snprintf(name, sizeof(name), "ffnn-registry-%d", (int)getpid());
+    const size_t number_of_layers = 3;
+    const size_t number_of_nodes_per_layer = 8;
+    const WeightInitializer initializer_a = { .kind = INITIALIZER_XAVIER_UNIFORM, .seed = 11, .number_of_threads = 1 };
+    const WeightInitializer initializer_b = { .kind = INITIALIZER_XAVIER_NORMAL, .seed = 12, .number_of_threads = 1 };
+    Model* model_a = init_model("registry model a", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer_a),
+                                number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    Model* model_b = init_model("registry model b", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer_b),
+                                number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    if (model_a == NULL || model_b == NULL){fprintf(stderr,
+        "Error in %s: cannot create the models.\n",
+        __func__);
+        return;
+    }
+    model_a->model_layers[1].biases[3] = 0.25;
+    double tokens[8];
+    for (size_t j = 0; j < 8; j++){
+        tokens[j] = 0.125 * (double)j - 0.4;
+    }
+    Prompt prompt = create_prompt(number_of_nodes_per_layer, tokens);
+    Output output_a = calculate_output(&prompt, model_a);
+    Output output_b = calculate_output(&prompt, model_b);
+
+    // publish, attach: the worker processes compute the outputs of the publisher from the shared weights
+    if (registry_current_version(name) != 0 || registry_publish(name, model_a) != 1 || registry_current_version(name) != 1){fprintf(stderr,
+        "Error in %s: the first publish is not version 1.\n",
+        __func__);
+        return;
+    }
+    RegistryAttachment* attachment = registry_attach(name);
+    if (attachment == NULL || attachment->version != 1 || atomic_load(&attachment->header->references) != 2
+        || !registry_outputs_match(attachment->model, output_a.data, output_a.length, &prompt)){fprintf(stderr,
+        "Error in %s: the attachment of version 1 is wrong.\n",
+        __func__);
+        return;
+    }
+    pid_t workers[3];
+    fflush(stdout);
+    fflush(stderr);
+    for (int worker = 0; worker < 3; worker++){
+        workers[worker] = fork();
+        if (workers[worker] == 0){
+            RegistryAttachment* own = registry_attach(name);
+            const int code = (own != NULL && own->version == 1 && atomic_load(&own->header->references) >= 3
+                              && registry_outputs_match(own->model, output_a.data, output_a.length, &prompt)) ? 0 : 1;
+            registry_detach(own);
+            fflush(stdout);
+            _exit(code);
+        }
+    }
+    for (int worker = 0; worker < 3; worker++){
+        int status = -1;
+        if (workers[worker] < 0 || waitpid(workers[worker], &status, 0) != workers[worker] || !WIFEXITED(status) || WEXITSTATUS(status) != 0){fprintf(stderr,
+            "Error in %s: worker %d failed (status %d).\n",
+            __func__, worker, status);
+            return;
+        }
+    }
+    if (atomic_load(&attachment->header->references) != 2){fprintf(stderr,
+        "Error in %s: the workers did not drop their references.\n",
+        __func__);
+        return;
+    }
+
+    // a header that does not match its data is refused, its reference given back
+    const uint64_t published_layers = attachment->header->number_of_layers;
+    attachment->header->number_of_layers = (uint64_t)1 << 60;
+    RegistryAttachment* corrupted = registry_attach(name);
+    attachment->header->number_of_layers = published_layers + 1;
+    RegistryAttachment* mismatched = registry_attach(name);
+    attachment->header->number_of_layers = published_layers;
+    if (corrupted != NULL || mismatched != NULL || atomic_load(&attachment->header->references) != 2){fprintf(stderr,
+        "Error in %s: a version with a wrong number of layers was attached.\n",
+        __func__);
+        return;
+    }
+
+    // a new version: the attachment keeps the old one until it refreshes, then the old segment goes away with it
+    snprintf(version_path, sizeof(version_path), "/dev/shm/%s.v1", name);
+    if (registry_publish(name, model_b) != 2 || attachment->version != 1 || access(version_path, F_OK) != 0
+        || !registry_outputs_match(attachment->model, output_a.data, output_a.length, &prompt)){fprintf(stderr,
+        "Error in %s: publishing version 2 disturbed the attachment of version 1.\n",
+        __func__);
+        return;
+    }
+    if (registry_refresh(attachment) != 1 || attachment->version != 2 || access(version_path, F_OK) == 0
+        || !registry_outputs_match(attachment->model, output_b.data, output_b.length, &prompt) || registry_refresh(attachment) != 0){fprintf(stderr,
+        "Error in %s: the refresh did not move to version 2 and release version 1.\n",
+        __func__);
+        return;
+    }
+
+    // custom activations cannot be shared, the current version stays
+    model_b->model_layers[2].activation_kind = ACTIVATION_CUSTOM;
+    if (registry_publish(name, model_b) != 0 || registry_current_version(name) != 2){fprintf(stderr,
+        "Error in %s: a model with a custom activation was published.\n",
+        __func__);
+        return;
+    }
+
+    // unlinking the registry leaves the attached version alive until the detach
+    snprintf(version_path, sizeof(version_path), "/dev/shm/%s.v2", name);
+    if (registry_unlink(name) != NO_ERROR || registry_current_version(name) != 0 || access(version_path, F_OK) != 0
+        || !registry_outputs_match(attachment->model, output_b.data, output_b.length, &prompt)){fprintf(stderr,
+        "Error in %s: the unlink released the attached version.\n",
+        __func__);
+        return;
+    }
+    registry_detach(attachment);
+    if (access(version_path, F_OK) == 0 || registry_attach(name) != NULL){fprintf(stderr,
+        "Error in %s: the last detach did not remove version 2.\n",
+        __func__);
+        return;
+    }
+    model_b->model_layers[2].activation_kind = ACTIVATION_SIGMOID;
+    free_output(&output_a);
+    free_output(&output_b);
+    free_prompt(&prompt);
+    free_model(model_a);
+    free_model(model_b);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_lowrank_factorization(void){
+    // weights of rank 3 exactly: the factors reproduce them and the outputs, at 3 * 64 instead of 32 * 32 multiply-adds per layer
+    const size_t number_of_layers = 4;
+    const size_t number_of_nodes_per_layer = 32;
+    double*** low_rank_weights = create_FF_model_matrices(number_of_layers, number_of_nodes_per_layer);
+    for (size_t i = 0; i + 1 < number_of_layers; i++){
+        for (size_t r = 0; r < number_of_nodes_per_layer; r++){
+            for (size_t c = 0; c < number_of_nodes_per_layer; c++){
+                double value = 0.0;
+                for (size_t k = 0; k < 3; k++){
+                    value += sin(0.3 * (double)((k + 1) * (r + 1) + i)) * cos(0.2 * (double)((k + 2) * (c + 1))) / (double)(k + 1);
+                }
+                low_rank_weights[i][r][c] = 0.25 * value;
+            }
+        }
+    }
+    Model* low_rank_model = init_model("low rank model", number_of_layers, low_rank_weights, number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    Prompt prompts[6];
+    double tokens[6][32];
+    for (size_t p = 0; p < 6; p++){
+        for (size_t j = 0; j < 32; j++){
+            tokens[p][j] = sin(0.7 * (double)(p * 32 + j));
+        }
+        prompts[p] = create_prompt(number_of_nodes_per_layer, tokens[p]);
+    }
+    const LowRankOptions fixed_rank = { .rank = 3, .power_iterations = 2, .seed = 9 };
+    const LowRankOptions by_energy = { .energy = 0.9999, .power_iterations = 2, .seed = 9 };
+    LowRankModel* compressed = factorize_model(low_rank_model, &fixed_rank);
+    LowRankModel* chosen = factorize_model(low_rank_model, &by_energy);
+    if (low_rank_model == NULL || compressed == NULL || chosen == NULL){fprintf(stderr,
+        "Error in %s: cannot factorize the rank 3 model.\n",
+        __func__);
+        return;
+    }
+    for (size_t i = 1; i < number_of_layers; i++){
+        if (!compressed->layers[i].factorized || compressed->layers[i].rank != 3 || compressed->layers[i].relative_error > 1e-10
+            || chosen->layers[i].rank != 3 || chosen->layers[i].sketch_columns != 2 * LOWRANK_DEFAULT_OVERSAMPLING
+            || chosen->layers[i].relative_error > 1e-10 || compressed->layers[i].flops != 2 * 3 * 64){fprintf(stderr,
+            "Error in %s: layer %zu has rank %zu (%zu by energy from %zu columns) and relative error %e.\n",
+            __func__, i, compressed->layers[i].rank, chosen->layers[i].rank, chosen->layers[i].sketch_columns, compressed->layers[i].relative_error);
+            return;
+        }
+    }
+    LowRankReport report = lowrank_evaluate(compressed, low_rank_model, prompts, 6);
+    if (report.number_of_prompts != 6 || report.max_absolute_error > 1e-10 || fabs(report.flop_ratio - 192.0 / 1024.0) > 1e-12
+        || fabs(report.byte_ratio - 192.0 / 1024.0) > 1e-12){fprintf(stderr,
+        "Error in %s: the rank 3 factors give an error of %e, flop ratio %lf.\n",
+        __func__, report.max_absolute_error, report.flop_ratio);
+        return;
+    }
+    FILE* stream = tmpfile();
+    char line[256] = "";
+    int has_total = 0;
+    lowrank_print_report(compressed, &report, stream);
+    rewind(stream);
+    while (stream != NULL && fgets(line, sizeof(line), stream) != NULL){
+        has_total |= strncmp(line, "total flops", 11) == 0;
+    }
+    if (stream != NULL){
+        fclose(stream);
+    }
+    if (!has_total){fprintf(stderr,
+        "Error in %s: the report has no totals.\n",
+        __func__);
+        return;
+    }
+    free_lowrank_model(compressed);
+    free_lowrank_model(chosen);
+    free_model(low_rank_model);
+
+    // full rank weights: the truncation error is the discarded energy, the same seed gives the same factors,
+    // a rank that does not pay keeps the dense matrix and the exact outputs
+    const WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_NORMAL, .seed = 4, .number_of_threads = 1 };
+    Model* dense_model = init_model("full rank model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                                    number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    const LowRankOptions rank_8 = { .rank = 8, .power_iterations = 2, .seed = 9 };
+    const LowRankOptions rank_20 = { .rank = 20, .seed = 9 };
+    LowRankModel* truncated = factorize_model(dense_model, &rank_8);
+    LowRankModel* again = factorize_model(dense_model, &rank_8);
+    LowRankModel* kept_dense = factorize_model(dense_model, &rank_20);
+    const LowRankOptions energy_60 = { .energy = 0.6, .power_iterations = 2, .seed = 9 };
+    LowRankModel* grown = factorize_model(dense_model, &energy_60);
+    if (dense_model == NULL || truncated == NULL || again == NULL || kept_dense == NULL || grown == NULL){fprintf(stderr,
+        "Error in %s: cannot factorize the full rank model.\n",
+        __func__);
+        return;
+    }
+    for (size_t i = 1; i < number_of_layers; i++){
+        const LowRankLayer* layer = &truncated->layers[i];
+        if (!layer->factorized || layer->relative_error < 0.1 || layer->kept_energy >= 1.0
+            || fabs(layer->relative_error * layer->relative_error - (1.0 - layer->kept_energy)) > 1e-9
+            || memcmp(layer->left, again->layers[i].left, 32 * 8 * sizeof(double)) != 0 || kept_dense->layers[i].factorized){fprintf(stderr,
+            "Error in %s: layer %zu: relative error %e for kept energy %lf.\n",
+            __func__, i, layer->relative_error, layer->kept_energy);
+            return;
+        }
+        // by energy the sketch grows until it holds 60 % of the energy, the factors keep it
+        const LowRankLayer* by_blocks = &grown->layers[i];
+        if (!by_blocks->factorized || by_blocks->kept_energy < 0.6 || by_blocks->rank > by_blocks->sketch_columns || by_blocks->sketch_columns % LOWRANK_DEFAULT_OVERSAMPLING != 0
+            || fabs(by_blocks->relative_error * by_blocks->relative_error - (1.0 - by_blocks->kept_energy)) > 1e-9){fprintf(stderr,
+            "Error in %s: layer %zu by energy: rank %zu from %zu columns keeps %lf of the energy.\n",
+            __func__, i, by_blocks->rank, by_blocks->sketch_columns, by_blocks->kept_energy);
+            return;
+        }
+    }
+    LowRankReport truncated_report = lowrank_evaluate(truncated, dense_model, prompts, 6);
+    LowRankReport dense_report = lowrank_evaluate(kept_dense, dense_model, prompts, 6);
+    if (truncated_report.max_absolute_error <= 0.0 || truncated_report.flop_ratio != 0.5 || dense_report.max_absolute_error != 0.0
+        || dense_report.flop_ratio != 1.0){fprintf(stderr,
+        "Error in %s: truncated error %e (flop ratio %lf), dense error %e.\n",
+        __func__, truncated_report.max_absolute_error, truncated_report.flop_ratio, dense_report.max_absolute_error);
+        return;
+    }
+    const LowRankOptions nothing = { .rank = 0, .energy = 0.0 };
+    if (factorize_model(dense_model, &nothing) != NULL){fprintf(stderr,
+        "Error in %s: options without rank or energy were accepted.\n",
+        __func__);
+        return;
+    }
+    free_lowrank_model(truncated);
+    free_lowrank_model(again);
+    free_lowrank_model(kept_dense);
+    free_lowrank_model(grown);
+    free_model(dense_model);
+    for (size_t p = 0; p < 6; p++){
+        free_prompt(&prompts[p]);
+    }
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_activation_checkpointing(void){
+    const size_t number_of_layers = 10;
+    const size_t number_of_nodes_per_layer = 16;
+    const size_t batch_size = 4;
+    const WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_NORMAL, .seed = 21, .number_of_threads = 1 };
+    Model* test_model = init_model("checkpointed model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                                   number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    Model* reference_model = init_model("reference model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                                        number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    ModelGradients* expected = create_model_gradients(test_model);
+    ModelGradients* gradients = create_model_gradients(test_model);
+    if (test_model == NULL || reference_model == NULL || expected == NULL || gradients == NULL){fprintf(stderr,
+        "Error in %s: cannot create the models or the gradients.\n",
+        __func__);
+        return;
+    }
+    for (size_t i = 0; i < number_of_layers; i++){
+        test_model->model_layers[i].biases[i % number_of_nodes_per_layer] = 0.05 * (double)i;
+        reference_model->model_layers[i].biases[i % number_of_nodes_per_layer] = 0.05 * (double)i;
+    }
+    Prompt prompts[4];
+    double tokens[4][16], target_values[4][16];
+    const double* targets[4];
+    for (size_t s = 0; s < batch_size; s++){
+        for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+            tokens[s][j] = cos(0.37 * (double)(s * 16 + j));
+            target_values[s][j] = 0.5 + 0.4 * sin(0.11 * (double)(s * 16 + j));
+        }
+        prompts[s] = create_prompt(number_of_nodes_per_layer, tokens[s]);
+        targets[s] = target_values[s];
+    }
+    const size_t parameters = model_parameter_count(test_model);
+
+    // the gradients of the full Outputs
+    zero_model_gradients(expected, test_model);
+    double expected_loss = 0.0;
+    for (size_t s = 0; s < batch_size; s++){
+        double sample_loss = 0.0;
+        Output output = calculate_output(&prompts[s], test_model);
+        backward_pass(test_model, &output, targets[s], expected, &sample_loss);
+        expected_loss += sample_loss;
+        free_output(&output);
+    }
+
+    // every stride and a plan of chosen layers give the same gradients, bit for bit
+    const size_t chosen_layers[2] = {7, 4};
+    for (size_t stride = 1; stride <= 10; stride++){
+        CheckpointPlan* plan = (stride < 10) ? create_checkpoint_plan(test_model, stride) : create_checkpoint_plan_at(test_model, chosen_layers, 2);
+        const size_t expected_checkpoints = (stride < 10) ? (9 / stride + 1 + (9 % stride != 0)) : 4;
+        if (plan == NULL || plan->number_of_checkpoints != expected_checkpoints || plan->full_doubles != 10 * 32
+            || plan->stored_doubles != expected_checkpoints * 32 || plan->recomputed_layers != 10 - expected_checkpoints){fprintf(stderr,
+            "Error in %s: wrong plan for stride %zu.\n",
+            __func__, stride);
+            return;
+        }
+        zero_model_gradients(gradients, test_model);
+        double loss = 0.0;
+        for (size_t s = 0; s < batch_size; s++){
+            double sample_loss = 0.0;
+            CheckpointedOutput output = checkpointed_forward(&prompts[s], test_model, plan);
+            if (output.is_valid != 1 || checkpointed_backward(test_model, &output, targets[s], gradients, &sample_loss) != NO_ERROR){fprintf(stderr,
+                "Error in %s: checkpointed pass failed for stride %zu.\n",
+                __func__, stride);
+                return;
+            }
+            loss += sample_loss;
+            free_checkpointed_output(&output);
+        }
+        if (memcmp(gradients->biases[0], expected->biases[0], parameters * sizeof(double)) != 0 || loss != expected_loss){fprintf(stderr,
+            "Error in %s: the gradients of stride %zu differ from backward_pass.\n",
+            __func__, stride);
+            return;
+        }
+        free_checkpoint_plan(plan);
+    }
+
+    // the activations held for a batch shrink with the stride
+    TrackingAllocator* tracking = create_tracking_allocator(allocator_heap());
+    CheckpointPlan* plan = create_checkpoint_plan(test_model, 3);
+    Allocator* previous = allocator_set_current(&tracking->base);
+    Output full[4];
+    for (size_t s = 0; s < batch_size; s++){
+        full[s] = calculate_output(&prompts[s], test_model);
+    }
+    const size_t full_peak = atomic_load(&tracking->subsystems[ALLOCATOR_SUBSYSTEM_OUTPUT].live_bytes);
+    for (size_t s = 0; s < batch_size; s++){
+        free_output(&full[s]);
+    }
+    CheckpointedOutput checkpointed[4];
+    for (size_t s = 0; s < batch_size; s++){
+        checkpointed[s] = checkpointed_forward(&prompts[s], test_model, plan);
+    }
+    const size_t checkpointed_live = atomic_load(&tracking->subsystems[ALLOCATOR_SUBSYSTEM_OUTPUT].live_bytes);
+    for (size_t s = 0; s < batch_size; s++){
+        free_checkpointed_output(&checkpointed[s]);
+    }
+    allocator_set_current(previous);
+    if (checkpointed_live * 2 >= full_peak || plan->stored_doubles != 4 * 32 || plan->segment_doubles != 2 * 32){fprintf(stderr,
+        "Error in %s: %zu bytes of checkpoints against %zu bytes of full outputs.\n",
+        __func__, checkpointed_live, full_peak);
+        return;
+    }
+    free_tracking_allocator(tracking);
+
+    // the budget picks the smallest stride that fits
+    const size_t budget = checkpoint_plan_bytes(plan, batch_size);
+    CheckpointPlan* budgeted = create_checkpoint_plan_for_budget(test_model, batch_size, budget);
+    CheckpointPlan* unlimited = create_checkpoint_plan_for_budget(test_model, batch_size, (size_t)-1);
+    if (budgeted == NULL || budgeted->stride > 3 || checkpoint_plan_bytes(budgeted, batch_size) > budget || unlimited == NULL
+        || unlimited->stride != 1 || unlimited->recomputed_layers != 0 || create_checkpoint_plan_for_budget(test_model, batch_size, 64) != NULL){fprintf(stderr,
+        "Error in %s: the budget did not choose the stride.\n",
+        __func__);
+        return;
+    }
+    free_checkpoint_plan(budgeted);
+    free_checkpoint_plan(unlimited);
+
+    // a checkpointed training step updates the model exactly like the step on full outputs, within the bytes of its plan
+    double loss = 0.0;
+    tracking = create_tracking_allocator(allocator_heap());
+    previous = allocator_set_current(&tracking->base);
+    const ErrorCode step_error = checkpointed_train_batch(test_model, plan, prompts, targets, batch_size, 0.5, gradients, &loss);
+    allocator_set_current(previous);
+    const size_t step_peak = atomic_load(&tracking->subsystems[ALLOCATOR_SUBSYSTEM_OUTPUT].peak_bytes);
+    free_tracking_allocator(tracking);
+    if (step_error != NO_ERROR || loss != expected_loss || step_peak > checkpoint_plan_bytes(plan, batch_size)){fprintf(stderr,
+        "Error in %s: the checkpointed training step failed or used %zu bytes instead of at most %zu.\n",
+        __func__, step_peak, checkpoint_plan_bytes(plan, batch_size));
+        return;
+    }
+    zero_model_gradients(expected, reference_model);
+    for (size_t s = 0; s < batch_size; s++){
+        Output output = calculate_output(&prompts[s], reference_model);
+        backward_pass(reference_model, &output, targets[s], expected, NULL);
+        free_output(&output);
+    }
+    apply_gradients(reference_model, expected, 0.5);
+    for (size_t i = 0; i + 1 < number_of_layers; i++){
+        for (size_t r = 0; r < number_of_nodes_per_layer; r++){
+            if (memcmp(test_model->model_weights[i][r], reference_model->model_weights[i][r], number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+                "Error in %s: row %zu of matrix %zu differs after the training step.\n",
+                __func__, r, i);
+                return;
+            }
+        }
+    }
+    free_checkpoint_plan(plan);
+    free_model_gradients(expected);
+    free_model_gradients(gradients);
+    for (size_t s = 0; s < batch_size; s++){
+        free_prompt(&prompts[s]);
+    }
+    free_model(test_model);
+    free_model(reference_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_streamed_inference(void){
+    const size_t number_of_layers = 5;
+    const size_t number_of_nodes_per_layer = 96;
+    const size_t number_of_prompts = 7;
+    const WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_UNIFORM, .seed = 33, .number_of_threads = 1 };
+    Model* test_model = init_model("streamed model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                                   number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    if (test_model == NULL){fprintf(stderr,
+        "Error in %s: cannot create the model.\n",
+        __func__);
+        return;
+    }
+    test_model->model_layers[3].activation = myThresholdFunc;
+    test_model->model_layers[3].activation_kind = ACTIVATION_THRESHOLD;
+    for (size_t i = 0; i < number_of_layers; i++){
+        for (size_t j = 0; j < number_of_nodes_per_layer; j += 7){
+            test_model->model_layers[i].biases[j] = 0.01 * (double)(i + j) - 0.3;
+        }
+    }
+    Prompt prompts[7];
+    double tokens[7][96], values[7][96];
+    double* outputs[7];
+    for (size_t b = 0; b < number_of_prompts; b++){
+        for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+            tokens[b][j] = sin(0.05 * (double)(b * 96 + j));
+        }
+        prompts[b] = create_prompt(number_of_nodes_per_layer, tokens[b]);
+        outputs[b] = values[b];
+    }
+    Output* expected = calculate_output_batch(prompts, number_of_prompts, test_model);
+
+    // the file: a header page, the biases, then each matrix on its own page boundary
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/ffnn-stream-%d.bin", (int)getpid());
+    struct stat status;
+    const size_t matrix_bytes = number_of_nodes_per_layer * number_of_nodes_per_layer * sizeof(double);
+    if (expected == NULL || save_streamable_model(test_model, path) != NO_ERROR || stat(path, &status) != 0
+        || status.st_size % STREAM_FILE_ALIGNMENT != 0 || (size_t)status.st_size < STREAM_FILE_ALIGNMENT + 4 * matrix_bytes){fprintf(stderr,
+        "Error in %s: the model file was not written.\n",
+        __func__);
+        return;
+    }
+
+    // both modes compute the outputs of calculate_output_batch, batch after batch, reading every matrix once per batch
+    const StreamMode modes[2] = {STREAM_MODE_PREAD, STREAM_MODE_MMAP};
+    for (int m = 0; m < 2; m++){
+        StreamedModel* streamed = open_streamed_model(path, modes[m]);
+        if (streamed == NULL || streamed->number_of_layers != number_of_layers || streamed->max_weights_bytes != matrix_bytes
+            || streamed->layers[3].activation_kind != ACTIVATION_THRESHOLD || streamed->entries[2].weights_offset % STREAM_FILE_ALIGNMENT != 0){fprintf(stderr,
+            "Error in %s: cannot open the model file in mode %d.\n",
+            __func__, (int)modes[m]);
+            return;
+        }
+        for (int pass = 0; pass < 2; pass++){
+            memset(values, 0, sizeof(values));
+            if (streamed_calculate_output_batch(streamed, prompts, number_of_prompts, outputs) != NO_ERROR){fprintf(stderr,
+                "Error in %s: pass %d of mode %d failed.\n",
+                __func__, pass, (int)modes[m]);
+                return;
+            }
+            for (size_t b = 0; b < number_of_prompts; b++){
+                if (memcmp(values[b], expected[b].data, number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+                    "Error in %s: prompt %zu of pass %d differs in mode %d.\n",
+                    __func__, b, pass, (int)modes[m]);
+                    return;
+                }
+            }
+        }
+        if (streamed->bytes_loaded != 2 * 4 * matrix_bytes
+            || (modes[m] == STREAM_MODE_PREAD && streamed_resident_weight_bytes(streamed) != 2 * ((matrix_bytes + STREAM_FILE_ALIGNMENT - 1) / STREAM_FILE_ALIGNMENT * STREAM_FILE_ALIGNMENT))
+            || streamed_resident_weight_bytes(streamed) > (size_t)status.st_size){fprintf(stderr,
+            "Error in %s: %llu bytes loaded, %zu resident in mode %d.\n",
+            __func__, (unsigned long long)streamed->bytes_loaded, streamed_resident_weight_bytes(streamed), (int)modes[m]);
+            return;
+        }
+        close_streamed_model(streamed);
+    }
+
+    // a truncated file and a custom activation are refused
+    if (truncate(path, status.st_size - STREAM_FILE_ALIGNMENT) != 0 || open_streamed_model(path, STREAM_MODE_PREAD) != NULL){fprintf(stderr,
+        "Error in %s: a truncated model file was opened.\n",
+        __func__);
+        return;
+    }
+    // so is a header whose layer count or widths would overflow the sizes computed from them
+    const StreamFileHeader forged_header = { .magic = STREAM_FILE_MAGIC, .version = STREAM_FILE_VERSION, .alignment = STREAM_FILE_ALIGNMENT,
+                                             .number_of_layers = (uint64_t)1 << 61, .file_bytes = STREAM_FILE_ALIGNMENT };
+    const StreamFileLayer forged_layers[2] = { { .number_of_nodes = 1, .biases_offset = 256 },
+                                               { .number_of_nodes = (uint64_t)1 << 62, .biases_offset = 256, .weights_offset = 0, .weights_bytes = 0 } };
+    for (int forged = 0; forged < 2; forged++){
+        StreamFileHeader header = forged_header;
+        header.number_of_layers = forged ? 2 : header.number_of_layers;
+        unsigned char page[STREAM_FILE_ALIGNMENT];
+        memset(page, 0, sizeof(page));
+        memcpy(page, &header, sizeof(header));
+        memcpy(page + sizeof(header), forged_layers, sizeof(forged_layers));
+        FILE* file = fopen(path, "wb");
+        const int written = file != NULL && fwrite(page, 1, sizeof(page), file) == sizeof(page);
+        if (file != NULL){
+            fclose(file);
+        }
+        if (!written || open_streamed_model(path, STREAM_MODE_PREAD) != NULL){fprintf(stderr,
+            "Error in %s: forged model file %d was opened.\n",
+            __func__, forged);
+            return;
+        }
+    }
+    test_model->model_layers[2].activation_kind = ACTIVATION_CUSTOM;
+    if (save_streamable_model(test_model, path) != ERROR_UNSUPPORTED){fprintf(stderr,
+        "Error in %s: a custom activation was saved.\n",
+        __func__);
+        return;
+    }
+    test_model->model_layers[2].activation_kind = ACTIVATION_SIGMOID;
+    remove(path);
+    free_output_batch(expected, number_of_prompts);
+    for (size_t b = 0; b < number_of_prompts; b++){
+        free_prompt(&prompts[b]);
+    }
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
+}
+
+void test_graph_executor(void){
+    const size_t number_of_layers = 8;
+    const size_t number_of_nodes_per_layer = 16;
+    const WeightInitializer initializer = { .kind = INITIALIZER_XAVIER_UNIFORM, .seed = 50, .number_of_threads = 1 };
+    Model* test_model = init_model("graph model", number_of_layers, create_FF_model_matrices_initialized(number_of_layers, number_of_nodes_per_layer, &initializer),
+                                   number_of_nodes_per_layer, mySigmoid, mySigmoid);
+    if (test_model == NULL){fprintf(stderr,
+        "Error in %s: cannot create the model.\n",
+        __func__);
+        return;
+    }
+    for (size_t i = 0; i < number_of_layers; i++){
+        for (size_t j = 0; j < number_of_nodes_per_layer; j += 3){
+            test_model->model_layers[i].biases[j] = 0.02 * (double)(i + j) - 0.2;
+        }
+    }
+
+    // a model as a chain: the outputs of calculate_output, in an arena of three vectors instead of one per layer
+    double tokens[16];
+    for (size_t j = 0; j < number_of_nodes_per_layer; j++){
+        tokens[j] = cos(0.3 * (double)j);
+    }
+    Prompt prompt = { .data = tokens, .length = number_of_nodes_per_layer, .allocator = NULL };
+    Output expected = calculate_output(&prompt, test_model);
+    Graph* chain = graph_from_model(test_model);
+    GraphPlan* chain_plan = compile_graph(chain);
+    double* arena = graph_create_arena(chain_plan);
+    if (chain == NULL || chain_plan == NULL || arena == NULL || chain_plan->number_of_steps != number_of_layers
+        || chain_plan->output_length != number_of_nodes_per_layer){fprintf(stderr,
+        "Error in %s: cannot compile the graph of the model.\n",
+        __func__);
+        return;
+    }
+    if (chain_plan->arena_doubles < chain_plan->lower_bound_doubles || chain_plan->arena_doubles != 3 * number_of_nodes_per_layer
+        || chain_plan->naive_doubles != (2 * number_of_layers - 1) * number_of_nodes_per_layer){fprintf(stderr,
+        "Error in %s: arena of %zu doubles (lower bound %zu, naive %zu).\n",
+        __func__, chain_plan->arena_doubles, chain_plan->lower_bound_doubles, chain_plan->naive_doubles);
+        return;
+    }
+    const double* inputs[1] = { tokens };
+    for (int run = 0; run < 2; run++){
+        const double* result = graph_execute(chain_plan, inputs, arena);
+        if (memcmp(result, expected.data, number_of_nodes_per_layer * sizeof(double)) != 0){fprintf(stderr,
+            "Error in %s: the graph of the model differs from calculate_output (run %d).\n",
+            __func__, run);
+            return;
+        }
+    }
+    graph_free_arena(arena);
+    free_graph_plan(chain_plan);
+    free_graph(chain);
+    free_output(&expected);
+
+    // residual connections and a concatenation: input -> d1 -> d2 -> a1 = d2 + d1 -> d3 -> a2 = d3 + a1 -> concat(a2, d1)
+    const size_t width = 12;
+    Graph* graph = create_graph();
+    const size_t input = graph_add_input(graph, width, NULL);
+    const size_t d1 = graph_add_dense(graph, input, width, mySigmoid);
+    const size_t d2 = graph_add_dense(graph, d1, width, mySigmoid);
+    const size_t pair1[2] = { d2, d1 };
+    const size_t a1 = graph_add_add(graph, pair1, 2);
+    const size_t unused = graph_add_dense(graph, a1, 40, mySigmoid);
+    const size_t d3 = graph_add_dense(graph, a1, width, mySigmoid);
+    const size_t pair2[2] = { d3, a1 };
+    const size_t a2 = graph_add_add(graph, pair2, 2);
+    const size_t pair3[2] = { a2, d1 };
+    const size_t concat = graph_add_concat(graph, pair3, 2);
+    const size_t mismatched[2] = { unused, d1 };
+    const size_t dangling[2] = { d1, 99 };
+    if (concat == GRAPH_INVALID_NODE || unused == GRAPH_INVALID_NODE || graph->nodes[concat].width != 2 * width
+        || graph_add_add(graph, mismatched, 2) != GRAPH_INVALID_NODE || graph_add_concat(graph, dangling, 2) != GRAPH_INVALID_NODE
+        || graph_add_dense(graph, 99, width, mySigmoid) != GRAPH_INVALID_NODE || compile_graph(graph) != NULL
+        || graph_set_output(graph, 99) == NO_ERROR || graph_set_output(graph, concat) != NO_ERROR){fprintf(stderr,
+        "Error in %s: the graph builder accepted or rejected the wrong nodes.\n",
+        __func__);
+        return;
+    }
+    const size_t dense[3] = { d1, d2, d3 };
+    for (size_t n = 0; n < 3; n++){
+        GraphNode* node = &graph->nodes[dense[n]];
+        for (size_t r = 0; r < width; r++){
+            for (size_t c = 0; c < width; c++){
+                node->weights[r][c] = 0.1 * sin((double)(17 * n + 5 * r + c));
+            }
+        }
+        for (size_t c = 0; c < width; c++){
+            node->layer.biases[c] = 0.05 * (double)c - 0.25;
+        }
+    }
+    GraphPlan* plan = compile_graph(graph);
+    arena = graph_create_arena(plan);
+    if (plan == NULL || arena == NULL || plan->number_of_steps != 7 || plan->number_of_graph_inputs != 1
+        || plan->arena_doubles < plan->lower_bound_doubles || plan->arena_doubles >= plan->naive_doubles){fprintf(stderr,
+        "Error in %s: cannot compile the residual graph.\n",
+        __func__);
+        return;
+    }
+
+    // the same network by hand, one buffer per value
+    double x[12], v1[12], v2[12], s1[12], v3[12], s2[12];
+    for (size_t j = 0; j < width; j++){
+        x[j] = 0.5 - 0.07 * (double)j;
+    }
+    const double* sources[3] = { x, v1, s1 };
+    double* targets[3] = { v1, v2, v3 };
+    for (size_t n = 0; n < 3; n++){
+        const GraphNode* node = &graph->nodes[dense[n]];
+        for (size_t c = 0; c < width; c++){
+            double sum = node->layer.biases[c];
+            for (size_t r = 0; r < width; r++){
+                sum += sources[n][r] * node->weights[r][c];
+            }
+            targets[n][c] = mySigmoid(sum);
+        }
+        for (size_t j = 0; n == 1 && j < width; j++){
+            s1[j] = v2[j] + v1[j];
+        }
+    }
+    for (size_t j = 0; j < width; j++){
+        s2[j] = v3[j] + s1[j];
+    }
+    const double* graph_inputs[1] = { x };
+    const double* result = graph_execute(plan, graph_inputs, arena);
+    for (size_t j = 0; j < 2 * width; j++){
+        const double reference = (j < width) ? s2[j] : v1[j - width];
+        if (fabs(result[j] - reference) > 1e-12){fprintf(stderr,
+            "Error in %s: output %zu = %lf instead of %lf.\n",
+            __func__, j, result[j], reference);
+            return;
+        }
+    }
+    graph_free_arena(arena);
+    free_graph_plan(plan);
+    free_graph(graph);
+    free_model(test_model);
+
+    fprintf(stderr,
+        "Exited function %s: without recognising any problems.\n",
+        __func__);
 }
 
 int main(){
     test_init_model();
+    test_calculate_output();
+    test_layer_nodes();
+    test_calculate_output_batch();
+    test_compile_model();
+    test_metrics();
+    test_output_cache();
+    test_incremental_forward();
+    test_snapshots();
+    test_memory_lifecycle();
+    test_allocators();
+    test_numa_replicas();
+    test_pipeline();
+    test_async_inference();
+    test_distributed_training();
+    test_weight_initializers();
+    test_execution_plan();
+    test_binarized_model();
+    test_model_bundles();
+    test_kernel_autotuner();
+    test_model_registry();
+    test_lowrank_factorization();
+    test_activation_checkpointing();
+    test_streamed_inference();
+    test_graph_executor();
     //test1();
 
     /*
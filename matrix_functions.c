@@ -1,5 +1,7 @@
 /* devo creare delle funzioni capaci di creare e gestire una tabella di archi di un grafo di dimensioni pari al numero di nodi*/
 #include "matrix_functions.h"
+#include "metrics_functions.h"
+#include "allocator_functions.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -21,7 +23,7 @@ typedef enum {
 /**
  * @brief Creates a matrix of doubles with specified rows and columns.
  *
- * This function dynamically allocates memory for a matrix represented as a
+ * This function dynamically allocates memory, from the current allocator of the thread (see allocator_functions.h), for a matrix represented as a
  * pointer to an array of pointers, each pointing to an array of doubles.
  * The function creates the Matrix as a pointer to a vector of pointers, each pointer in said vector is a pointer to another vector which contains all the values.
  * to better explain: the matrix is a pointer, this pointer references a vector, this vector (columns) cotains j pointers, each of these pointers reference a vector (rows) wich contains the values of the matrix
@@ -33,7 +35,7 @@ typedef enum {
 double** create_matrix_double(int rows, int columns){
 
     // Allocate mem for pointers to rows
-    double** matrix = (double **)malloc(rows * sizeof(double*));
+    double** matrix = allocator_allocate(NULL, rows * sizeof(double*), 0, ALLOCATOR_SUBSYSTEM_MATRIX);
     if (matrix == NULL){
         printf("Error in mem allocation for rows\n");
         return(NULL);
@@ -41,12 +43,21 @@ double** create_matrix_double(int rows, int columns){
 
     // Allocate mem for row values
     for (int i = 0; i < rows; i++){
-        matrix[i] = (double *)malloc(columns * sizeof(double));
+        matrix[i] = allocator_allocate(NULL, columns * sizeof(double), 0, ALLOCATOR_SUBSYSTEM_MATRIX);
         if (matrix[i] == NULL){
             printf("Error in mem allocation for column %d\n", i);
+            // release the rows allocated so far and the row pointers
+            for (int j = 0; j < i; j++){
+                allocator_release(NULL, matrix[j], ALLOCATOR_SUBSYSTEM_MATRIX);
+            }
+            allocator_release(NULL, matrix, ALLOCATOR_SUBSYSTEM_MATRIX);
             return(NULL);
         }
     }
+    if (metrics_enabled()){
+        metrics_add(&global_metrics.matrices_created, 1);
+        metrics_add(&global_metrics.matrix_bytes_allocated, (uint64_t)rows * (sizeof(double*) + (uint64_t)columns * sizeof(double)));
+    }
     return(matrix);
 }
   
@@ -105,18 +116,21 @@ MatrixError check_if_all_elements_of_matrix_are_equal_to_value(double** matrix_p
 }
 
 /**
- * @brief frees the matrix allocated memory
+ * @brief frees the matrix allocated memory: every row and the vector of row pointers. The matrix pointer is invalid after the call.
+ * The memory goes back to the current allocator, it must be the one that was current when the matrix was created.
  * 
  * @param matrix_pointer 
  * @param rows 
  */
 void free_double_matrix(double** matrix_pointer, int rows){
-
+    if (matrix_pointer == NULL){
+        return;
+    }
     for (int i = 0; i < rows; i++){
-        free(matrix_pointer[i]);
+        allocator_release(NULL, matrix_pointer[i], ALLOCATOR_SUBSYSTEM_MATRIX);
         matrix_pointer[i] = NULL;
     }
-
+    allocator_release(NULL, matrix_pointer, ALLOCATOR_SUBSYSTEM_MATRIX);
 }
 
 
@@ -265,7 +279,6 @@ void testmat(){
     print_matrix_double(matrix, i, j);
 
     free_double_matrix(matrix, i);
-    change_value_matrix(matrix, 0, 0, 27);
     matrix = NULL;
     
     change_value_matrix(matrix, 0, 0, 27);
@@ -0,0 +1,382 @@
+#include "settings.h"
+#include "metrics_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- GLOBAL STATE -+-+-+-+-+-+-+-+-+-+-+- */
+
+_Atomic int metrics_runtime_enabled = FALSE;
+GlobalMetrics global_metrics;
+
+/* The registry is only modified when a model is created or freed, so a mutex is fine here */
+static ModelMetrics* metrics_registry = NULL;
+static pthread_mutex_t metrics_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t metrics_next_model_id = 0;     // protected by metrics_registry_mutex
+
+/**
+ * @brief Turns the counting on or off for the whole library
+ *
+ * @param enabled TRUE or FALSE (metrics_functions.h doesn't include settings.h, so that matrix_functions.c can keep its own VERBOSE)
+ */
+void metrics_set_enabled(int enabled){
+    atomic_store_explicit(&metrics_runtime_enabled, enabled != FALSE, memory_order_relaxed);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- MODEL METRICS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Creates the counters of a model and links them in the global registry
+ *
+ * @param model_name(const char*): The name of the model, it is NOT copied so it has to live as long as the returned counters
+ * @param number_of_layers(size_t): The number of layers of the model
+ * @return ModelMetrics* or NULL if the allocation fails
+ */
+ModelMetrics* create_model_metrics(const char* model_name, size_t number_of_layers){
+    ModelMetrics* metrics = calloc(1, sizeof(ModelMetrics));
+    if (metrics == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'metrics' is NULL.\n", __func__);
+        return NULL;
+    }
+    metrics->layers = calloc(number_of_layers > 0 ? number_of_layers : 1, sizeof(LayerMetrics));
+    if (metrics->layers == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'metrics->layers' is NULL.\n", __func__);
+        free(metrics);
+        return NULL;
+    }
+    metrics->model_name = model_name;
+    metrics->number_of_layers = number_of_layers;
+
+    pthread_mutex_lock(&metrics_registry_mutex);
+    metrics->model_id = metrics_next_model_id++;
+    metrics->next = metrics_registry;
+    metrics_registry = metrics;
+    pthread_mutex_unlock(&metrics_registry_mutex);
+    return metrics;
+}
+
+/**
+ * @brief Unlinks the counters from the registry and frees them
+ */
+void free_model_metrics(ModelMetrics* metrics){
+    if (metrics == NULL){
+        return;
+    }
+    pthread_mutex_lock(&metrics_registry_mutex);
+    for (ModelMetrics** link = &metrics_registry; *link != NULL; link = &(*link)->next){
+        if (*link == metrics){
+            *link = metrics->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics_registry_mutex);
+    free(metrics->layers);
+    free(metrics);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- RECORDING -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Adds one forward step of a layer to its counters (the caller is expected to have checked metrics_enabled before timing)
+ *
+ * @param metrics The counters of the model, NULL is accepted and ignored
+ * @param layer Index of the layer in the model
+ * @param elapsed_ns Time spent in the step
+ * @param bytes_touched Estimate of the bytes read and written by the step
+ */
+void metrics_record_layer_forward(ModelMetrics* metrics, size_t layer, uint64_t elapsed_ns, uint64_t bytes_touched){
+    if (metrics == NULL || layer >= metrics->number_of_layers){
+        return;
+    }
+    metrics_add(&metrics->layers[layer].forward_ns, elapsed_ns);
+    metrics_add(&metrics->layers[layer].forward_calls, 1);
+    metrics_add(&metrics->layers[layer].bytes_touched, bytes_touched);
+}
+
+/**
+ * @brief Adds one backward step of a layer to its counters
+ */
+void metrics_record_layer_backward(ModelMetrics* metrics, size_t layer, uint64_t elapsed_ns, uint64_t bytes_touched){
+    if (metrics == NULL || layer >= metrics->number_of_layers){
+        return;
+    }
+    metrics_add(&metrics->layers[layer].backward_ns, elapsed_ns);
+    metrics_add(&metrics->layers[layer].backward_calls, 1);
+    metrics_add(&metrics->layers[layer].bytes_touched, bytes_touched);
+}
+
+/**
+ * @brief Adds one call of an inference entry point of the model, that processed the given number of samples
+ */
+void metrics_record_model_forward(ModelMetrics* metrics, uint64_t elapsed_ns, size_t samples){
+    if (metrics == NULL){
+        return;
+    }
+    metrics_add(&metrics->calls, 1);
+    metrics_add(&metrics->samples, samples);
+    metrics_add(&metrics->forward_ns, elapsed_ns);
+}
+
+/**
+ * @brief Sets every counter (global and of every registered model) back to 0
+ */
+void metrics_reset(void){
+    atomic_store(&global_metrics.matrices_created, 0);
+    atomic_store(&global_metrics.matrix_bytes_allocated, 0);
+    atomic_store(&global_metrics.allocations, 0);
+    atomic_store(&global_metrics.frees, 0);
+    atomic_store(&global_metrics.bytes_allocated, 0);
+
+    pthread_mutex_lock(&metrics_registry_mutex);
+    for (ModelMetrics* metrics = metrics_registry; metrics != NULL; metrics = metrics->next){
+        atomic_store(&metrics->calls, 0);
+        atomic_store(&metrics->samples, 0);
+        atomic_store(&metrics->forward_ns, 0);
+        for (size_t i = 0; i < metrics->number_of_layers; i++){
+            atomic_store(&metrics->layers[i].forward_ns, 0);
+            atomic_store(&metrics->layers[i].backward_ns, 0);
+            atomic_store(&metrics->layers[i].forward_calls, 0);
+            atomic_store(&metrics->layers[i].backward_calls, 0);
+            atomic_store(&metrics->layers[i].bytes_touched, 0);
+        }
+    }
+    pthread_mutex_unlock(&metrics_registry_mutex);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- SNAPSHOT -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Copies every counter into a MetricsSnapshot. The single counters are read atomically, the snapshot as a whole is not
+ * (a call that is running while the snapshot is taken may be partially counted).
+ * @return MetricsSnapshot, number_of_models is 0 and models is NULL if the allocation fails
+ */
+MetricsSnapshot metrics_snapshot(void){
+    MetricsSnapshot snapshot = {0};
+    snapshot.timestamp_ns = metrics_now_ns();
+    snapshot.matrices_created = atomic_load(&global_metrics.matrices_created);
+    snapshot.matrix_bytes_allocated = atomic_load(&global_metrics.matrix_bytes_allocated);
+    snapshot.allocations = atomic_load(&global_metrics.allocations);
+    snapshot.frees = atomic_load(&global_metrics.frees);
+    snapshot.bytes_allocated = atomic_load(&global_metrics.bytes_allocated);
+
+    pthread_mutex_lock(&metrics_registry_mutex);
+    size_t number_of_models = 0;
+    for (ModelMetrics* metrics = metrics_registry; metrics != NULL; metrics = metrics->next){
+        number_of_models++;
+    }
+    if (number_of_models > 0){
+        snapshot.models = calloc(number_of_models, sizeof(ModelMetricsSnapshot));
+        if (snapshot.models == NULL){
+            fprintf(stderr, "Error in %s: memory allocation error. 'snapshot.models' is NULL.\n", __func__);
+            pthread_mutex_unlock(&metrics_registry_mutex);
+            return snapshot;
+        }
+    }
+    size_t m = 0;
+    for (ModelMetrics* metrics = metrics_registry; metrics != NULL; metrics = metrics->next, m++){
+        ModelMetricsSnapshot* model = &snapshot.models[m];
+        model->model_name = strdup(metrics->model_name != NULL ? metrics->model_name : "");
+        model->model_id = metrics->model_id;
+        model->calls = atomic_load(&metrics->calls);
+        model->samples = atomic_load(&metrics->samples);
+        model->forward_ns = atomic_load(&metrics->forward_ns);
+        model->layers = calloc(metrics->number_of_layers > 0 ? metrics->number_of_layers : 1, sizeof(LayerMetricsSnapshot));
+        if (model->model_name == NULL || model->layers == NULL){
+            fprintf(stderr, "Error in %s: memory allocation error for model %zu.\n", __func__, m);
+            continue;   // number_of_layers stays 0, the model is exported without its layers
+        }
+        model->number_of_layers = metrics->number_of_layers;
+        for (size_t i = 0; i < metrics->number_of_layers; i++){
+            model->layers[i].forward_ns = atomic_load(&metrics->layers[i].forward_ns);
+            model->layers[i].backward_ns = atomic_load(&metrics->layers[i].backward_ns);
+            model->layers[i].forward_calls = atomic_load(&metrics->layers[i].forward_calls);
+            model->layers[i].backward_calls = atomic_load(&metrics->layers[i].backward_calls);
+            model->layers[i].bytes_touched = atomic_load(&metrics->layers[i].bytes_touched);
+        }
+    }
+    snapshot.number_of_models = number_of_models;
+    pthread_mutex_unlock(&metrics_registry_mutex);
+    return snapshot;
+}
+
+/**
+ * @brief Frees the memory owned by a snapshot, the struct itself is left zeroed
+ */
+void free_metrics_snapshot(MetricsSnapshot* snapshot){
+    if (snapshot == NULL){
+        return;
+    }
+    for (size_t m = 0; m < snapshot->number_of_models; m++){
+        free(snapshot->models[m].model_name);
+        free(snapshot->models[m].layers);
+    }
+    free(snapshot->models);
+    MetricsSnapshot empty = {0};
+    *snapshot = empty;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- EXPORTERS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* Prometheus label values and JSON strings escape the same characters */
+static void metrics_write_escaped(FILE* stream, const char* string){
+    for (const char* c = string; *c != '\0'; c++){
+        if (*c == '"' || *c == '\\'){
+            fputc('\\', stream);
+            fputc(*c, stream);
+        } else if (*c == '\n'){
+            fputs("\\n", stream);
+        } else {
+            fputc(*c, stream);
+        }
+    }
+}
+
+static void metrics_export_prometheus(const MetricsSnapshot* snapshot, FILE* stream){
+    fprintf(stream, "# TYPE ffnn_matrices_created_total counter\nffnn_matrices_created_total %llu\n", (unsigned long long)snapshot->matrices_created);
+    fprintf(stream, "# TYPE ffnn_matrix_bytes_allocated_total counter\nffnn_matrix_bytes_allocated_total %llu\n", (unsigned long long)snapshot->matrix_bytes_allocated);
+    fprintf(stream, "# TYPE ffnn_allocations_total counter\nffnn_allocations_total %llu\n", (unsigned long long)snapshot->allocations);
+    fprintf(stream, "# TYPE ffnn_frees_total counter\nffnn_frees_total %llu\n", (unsigned long long)snapshot->frees);
+    fprintf(stream, "# TYPE ffnn_bytes_allocated_total counter\nffnn_bytes_allocated_total %llu\n", (unsigned long long)snapshot->bytes_allocated);
+
+    /* Model level series */
+    const struct { const char* name; size_t offset; } model_series[] = {
+        {"ffnn_model_calls_total",           offsetof(ModelMetricsSnapshot, calls)},
+        {"ffnn_model_samples_total",         offsetof(ModelMetricsSnapshot, samples)},
+        {"ffnn_model_forward_seconds_total", offsetof(ModelMetricsSnapshot, forward_ns)},
+    };
+    for (size_t s = 0; s < sizeof(model_series) / sizeof(model_series[0]); s++){
+        fprintf(stream, "# TYPE %s counter\n", model_series[s].name);
+        for (size_t m = 0; m < snapshot->number_of_models; m++){
+            const ModelMetricsSnapshot* model = &snapshot->models[m];
+            uint64_t value = *(const uint64_t*)((const char*)model + model_series[s].offset);
+            fprintf(stream, "%s{model=\"", model_series[s].name);
+            metrics_write_escaped(stream, model->model_name != NULL ? model->model_name : "");
+            if (model_series[s].offset == offsetof(ModelMetricsSnapshot, forward_ns)){
+                fprintf(stream, "\",model_id=\"%llu\"} %.9f\n", (unsigned long long)model->model_id, (double)value / 1e9);
+            } else {
+                fprintf(stream, "\",model_id=\"%llu\"} %llu\n", (unsigned long long)model->model_id, (unsigned long long)value);
+            }
+        }
+    }
+
+    /* Layer level series */
+    const struct { const char* name; size_t offset; Bool is_time; } layer_series[] = {
+        {"ffnn_layer_forward_seconds_total",  offsetof(LayerMetricsSnapshot, forward_ns),     TRUE},
+        {"ffnn_layer_backward_seconds_total", offsetof(LayerMetricsSnapshot, backward_ns),    TRUE},
+        {"ffnn_layer_forward_calls_total",    offsetof(LayerMetricsSnapshot, forward_calls),  FALSE},
+        {"ffnn_layer_backward_calls_total",   offsetof(LayerMetricsSnapshot, backward_calls), FALSE},
+        {"ffnn_layer_bytes_touched_total",    offsetof(LayerMetricsSnapshot, bytes_touched),  FALSE},
+    };
+    for (size_t s = 0; s < sizeof(layer_series) / sizeof(layer_series[0]); s++){
+        fprintf(stream, "# TYPE %s counter\n", layer_series[s].name);
+        for (size_t m = 0; m < snapshot->number_of_models; m++){
+            const ModelMetricsSnapshot* model = &snapshot->models[m];
+            for (size_t i = 0; i < model->number_of_layers; i++){
+                uint64_t value = *(const uint64_t*)((const char*)&model->layers[i] + layer_series[s].offset);
+                fprintf(stream, "%s{model=\"", layer_series[s].name);
+                metrics_write_escaped(stream, model->model_name != NULL ? model->model_name : "");
+                if (layer_series[s].is_time){
+                    fprintf(stream, "\",model_id=\"%llu\",layer=\"%zu\"} %.9f\n", (unsigned long long)model->model_id, i, (double)value / 1e9);
+                } else {
+                    fprintf(stream, "\",model_id=\"%llu\",layer=\"%zu\"} %llu\n", (unsigned long long)model->model_id, i, (unsigned long long)value);
+                }
+            }
+        }
+    }
+}
+
+static void metrics_export_json(const MetricsSnapshot* snapshot, FILE* stream){
+    fprintf(stream, "{\"timestamp_ns\":%llu,\"matrices_created\":%llu,\"matrix_bytes_allocated\":%llu,"
+                    "\"allocations\":%llu,\"frees\":%llu,\"bytes_allocated\":%llu,\"models\":[",
+        (unsigned long long)snapshot->timestamp_ns,
+        (unsigned long long)snapshot->matrices_created,
+        (unsigned long long)snapshot->matrix_bytes_allocated,
+        (unsigned long long)snapshot->allocations,
+        (unsigned long long)snapshot->frees,
+        (unsigned long long)snapshot->bytes_allocated);
+    for (size_t m = 0; m < snapshot->number_of_models; m++){
+        const ModelMetricsSnapshot* model = &snapshot->models[m];
+        fprintf(stream, "%s{\"name\":\"", m > 0 ? "," : "");
+        metrics_write_escaped(stream, model->model_name != NULL ? model->model_name : "");
+        fprintf(stream, "\",\"model_id\":%llu,\"calls\":%llu,\"samples\":%llu,\"forward_ns\":%llu,\"layers\":[",
+            (unsigned long long)model->model_id, (unsigned long long)model->calls, (unsigned long long)model->samples, (unsigned long long)model->forward_ns);
+        for (size_t i = 0; i < model->number_of_layers; i++){
+            const LayerMetricsSnapshot* layer = &model->layers[i];
+            fprintf(stream, "%s{\"layer\":%zu,\"forward_ns\":%llu,\"backward_ns\":%llu,\"forward_calls\":%llu,\"backward_calls\":%llu,\"bytes_touched\":%llu}",
+                i > 0 ? "," : "", i,
+                (unsigned long long)layer->forward_ns, (unsigned long long)layer->backward_ns,
+                (unsigned long long)layer->forward_calls, (unsigned long long)layer->backward_calls,
+                (unsigned long long)layer->bytes_touched);
+        }
+        fprintf(stream, "]}");
+    }
+    fprintf(stream, "]}\n");
+}
+
+/**
+ * @brief Writes a snapshot to a stream in the given format
+ * @return int 0 on success, -1 on invalid parameters or write errors
+ */
+int metrics_export(const MetricsSnapshot* snapshot, MetricsFormat format, FILE* stream){
+    if (snapshot == NULL || stream == NULL){
+        fprintf(stderr, "Error in %s: invalid parameters 'snapshot = %p', 'stream = %p'.\n", __func__, (void*)snapshot, (void*)stream);
+        return -1;
+    }
+    if (format == METRICS_FORMAT_JSON){
+        metrics_export_json(snapshot, stream);
+    } else {
+        metrics_export_prometheus(snapshot, stream);
+    }
+    return (fflush(stream) == 0 && !ferror(stream)) ? 0 : -1;
+}
+
+/**
+ * @brief Takes a snapshot and writes it to the file at path (the file is truncated), e.g. for the node exporter textfile collector
+ * @return int 0 on success, -1 on error
+ */
+int metrics_export_to_file(const char* path, MetricsFormat format){
+    if (path == NULL){
+        fprintf(stderr, "Error in %s: 'path' is NULL.\n", __func__);
+        return -1;
+    }
+    FILE* stream = fopen(path, "w");
+    if (stream == NULL){
+        fprintf(stderr, "Error in %s: could not open '%s'.\n", __func__, path);
+        return -1;
+    }
+    MetricsSnapshot snapshot = metrics_snapshot();
+    int result = metrics_export(&snapshot, format, stream);
+    free_metrics_snapshot(&snapshot);
+    if (fclose(stream) != 0){
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * @brief Takes a snapshot and writes it to an already connected socket (or any writable file descriptor).
+ * The descriptor is duplicated, so it stays open and owned by the caller.
+ * @return int 0 on success, -1 on error
+ */
+int metrics_export_to_socket(int socket_fd, MetricsFormat format){
+    int duplicated_fd = dup(socket_fd);
+    if (duplicated_fd < 0){
+        fprintf(stderr, "Error in %s: invalid descriptor %d.\n", __func__, socket_fd);
+        return -1;
+    }
+    FILE* stream = fdopen(duplicated_fd, "w");
+    if (stream == NULL){
+        fprintf(stderr, "Error in %s: fdopen failed.\n", __func__);
+        close(duplicated_fd);
+        return -1;
+    }
+    MetricsSnapshot snapshot = metrics_snapshot();
+    int result = metrics_export(&snapshot, format, stream);
+    free_metrics_snapshot(&snapshot);
+    if (fclose(stream) != 0){
+        result = -1;
+    }
+    return result;
+}
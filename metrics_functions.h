@@ -0,0 +1,184 @@
+#ifndef METRICS_FUNCTIONS_H
+#define METRICS_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/**
+ * @brief Low overhead counters for the model, layer and matrix paths.
+ * Counting is toggled at runtime with metrics_set_enabled (it is off by default), when it is off every instrumented path pays a single relaxed atomic load.
+ * Every model created with init_model owns a ModelMetrics that is linked in a global registry, metrics_snapshot copies the registry
+ * and the global counters into plain integers that can be exported in Prometheus text format or JSON to a file or a socket.
+ */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT MODEL METRICS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief The live counters of a single layer
+ *
+ * @param forward_ns(uint64_t): Total time spent in the forward step of the layer, in nanoseconds
+ * @param backward_ns(uint64_t): Total time spent in the backward step of the layer, in nanoseconds
+ * @param forward_calls(uint64_t): How many times the forward step of the layer was executed
+ * @param backward_calls(uint64_t): How many times the backward step of the layer was executed
+ * @param bytes_touched(uint64_t): Estimate of the bytes read and written by the layer (activations, biases and weights)
+ */
+typedef struct LayerMetrics{
+    _Atomic uint64_t forward_ns;
+    _Atomic uint64_t backward_ns;
+    _Atomic uint64_t forward_calls;
+    _Atomic uint64_t backward_calls;
+    _Atomic uint64_t bytes_touched;
+} LayerMetrics;
+
+/**
+ * @brief The live counters of a model, linked in the global registry
+ *
+ * @param model_name(const char*): Name of the model the counters belong to (points to Model.model_name, not a copy)
+ * @param model_id(uint64_t): Unique for the life of the process, it tells apart live models with the same name
+ * @param number_of_layers(size_t): Number of elements of the layers array
+ * @param calls(uint64_t): How many times an inference entry point was called on the model
+ * @param samples(uint64_t): How many prompts were processed (a batched call counts once in calls and n times in samples)
+ * @param forward_ns(uint64_t): Total time spent in the forward pass of the model, in nanoseconds
+ * @param layers(LayerMetrics*): The counters of each layer
+ */
+typedef struct ModelMetrics{
+    const char* model_name;
+    uint64_t model_id;
+    size_t number_of_layers;
+    _Atomic uint64_t calls;
+    _Atomic uint64_t samples;
+    _Atomic uint64_t forward_ns;
+    LayerMetrics* layers;
+    struct ModelMetrics* next;      // registry link
+} ModelMetrics;
+
+//                                          FUNCTION PROTOTYPES
+ModelMetrics* create_model_metrics(const char* model_name, size_t number_of_layers);
+void free_model_metrics(ModelMetrics* metrics);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT MODEL METRICS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- RUNTIME TOGGLE AND RECORDING -+-+-+-+-+-+-+-+-+-+-+- */
+
+extern _Atomic int metrics_runtime_enabled;
+
+/* Library wide counters that don't belong to a single model */
+typedef struct GlobalMetrics{
+    _Atomic uint64_t matrices_created;
+    _Atomic uint64_t matrix_bytes_allocated;
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t frees;
+    _Atomic uint64_t bytes_allocated;
+} GlobalMetrics;
+
+extern GlobalMetrics global_metrics;
+
+static inline int metrics_enabled(void){
+    return atomic_load_explicit(&metrics_runtime_enabled, memory_order_relaxed);
+}
+
+static inline uint64_t metrics_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Relaxed add, counters are only ever read as a whole by metrics_snapshot */
+static inline void metrics_add(_Atomic uint64_t* counter, uint64_t value){
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+/**
+ * @brief Counts an allocation of the given size in the global counters (does nothing if metrics are disabled)
+ */
+static inline void metrics_count_allocation(size_t bytes){
+    if (metrics_enabled()){
+        metrics_add(&global_metrics.allocations, 1);
+        metrics_add(&global_metrics.bytes_allocated, bytes);
+    }
+}
+
+static inline void metrics_count_free(void){
+    if (metrics_enabled()){
+        metrics_add(&global_metrics.frees, 1);
+    }
+}
+
+//                                          FUNCTION PROTOTYPES
+void metrics_set_enabled(int enabled);
+void metrics_record_layer_forward(ModelMetrics* metrics, size_t layer, uint64_t elapsed_ns, uint64_t bytes_touched);
+void metrics_record_layer_backward(ModelMetrics* metrics, size_t layer, uint64_t elapsed_ns, uint64_t bytes_touched);
+void metrics_record_model_forward(ModelMetrics* metrics, uint64_t elapsed_ns, size_t samples);
+void metrics_reset(void);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END RUNTIME TOGGLE AND RECORDING -+-+-+-+-+-+-+-+-+-+-+- */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT METRICS SNAPSHOT -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Plain copy of the counters of a layer (see LayerMetrics)
+ */
+typedef struct LayerMetricsSnapshot{
+    uint64_t forward_ns;
+    uint64_t backward_ns;
+    uint64_t forward_calls;
+    uint64_t backward_calls;
+    uint64_t bytes_touched;
+} LayerMetricsSnapshot;
+
+/**
+ * @brief Plain copy of the counters of a model (see ModelMetrics)
+ * @param model_name(char*): an owned copy of the model name
+ * @param model_id(uint64_t): see ModelMetrics, exported as the model_id label
+ */
+typedef struct ModelMetricsSnapshot{
+    char* model_name;
+    uint64_t model_id;
+    size_t number_of_layers;
+    uint64_t calls;
+    uint64_t samples;
+    uint64_t forward_ns;
+    LayerMetricsSnapshot* layers;
+} ModelMetricsSnapshot;
+
+/**
+ * @brief Everything metrics_snapshot copied, it must be released with free_metrics_snapshot
+ *
+ * @param timestamp_ns(uint64_t): CLOCK_MONOTONIC time of the snapshot
+ * @param number_of_models(size_t): number of elements of models
+ * @param models(ModelMetricsSnapshot*): one element for every registered model
+ * @param matrices_created, matrix_bytes_allocated: matrix path counters
+ * @param allocations, frees, bytes_allocated: allocator activity
+ */
+typedef struct MetricsSnapshot{
+    uint64_t timestamp_ns;
+    size_t number_of_models;
+    ModelMetricsSnapshot* models;
+    uint64_t matrices_created;
+    uint64_t matrix_bytes_allocated;
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t bytes_allocated;
+} MetricsSnapshot;
+
+typedef enum MetricsFormat{
+    METRICS_FORMAT_PROMETHEUS = 0,
+    METRICS_FORMAT_JSON = 1,
+} MetricsFormat;
+
+//                                          FUNCTION PROTOTYPES
+MetricsSnapshot metrics_snapshot(void);
+void free_metrics_snapshot(MetricsSnapshot* snapshot);
+int metrics_export(const MetricsSnapshot* snapshot, MetricsFormat format, FILE* stream);
+int metrics_export_to_file(const char* path, MetricsFormat format);
+int metrics_export_to_socket(int socket_fd, MetricsFormat format);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT METRICS SNAPSHOT -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // METRICS_FUNCTIONS_H
@@ -1,6 +1,7 @@
 #include "matrix_functions.h"
 #include "model_functions.h"
 #include "settings.h"
+#include "allocator_functions.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -37,33 +38,51 @@ double** create_adj_matrix_double_square(int layers, int nodes_per_layer){
 double*** create_FF_model_matrices(size_t layers, size_t nodes_per_layer){
     // 1) Creating the vector to store the matrices
     // @note: we create (layers - 1) and not (layers) matrices because adj matrices are only present between two layers, so the input layer and the output layer do not need an adjacency matrix themselves. EX: let's imagine a model: [input]{matrix}[secret]{matrix}[output] => 3 layers but two matrices! 
-    double*** matrices_vector = (double ***)malloc((layers - 1) * sizeof(double**));
+    double*** matrices_vector = allocator_allocate(NULL, (layers - 1) * sizeof(double**), 0, ALLOCATOR_SUBSYSTEM_MATRIX);
+    if (matrices_vector == NULL){
+        printf("\n Error in mem allocation for the matrices vector\n");
+        return(NULL);
+    }
 
-    for (size_t i = 0; i < layers; i++){
+    for (size_t i = 0; i < layers - 1; i++){
         double** matrix = create_matrix_double(nodes_per_layer, nodes_per_layer);                     // creating the matrix of nodes x nodes
-        matrix = init_matrix_to_double_value(matrix, nodes_per_layer, nodes_per_layer, (double)1);    // initiating the matrix to value 1 to symbolise the connections
-
-        // security checks to identify problem in matrix creation{
-            int check = verify_matrix(matrix, nodes_per_layer);                                     // verifiyng that the matrix is valid
-            if (check < 0){ 
-                printf("\n verify_matrix returned an error: %d\n", check);
-                return(NULL);
-            }
-            check = check_if_all_elements_of_matrix_are_equal_to_value(matrix, nodes_per_layer, nodes_per_layer, (double)1);
-            if (check != RETURN_TRUE){
-                printf("\n check_if_all_elements_of_matrix_are_equal_to_value returned an error: %d \n", check);
-                return(NULL);
-            }
-        //}
+        if (matrix == NULL){
+            free_FF_model_matrices(matrices_vector, i, nodes_per_layer);                                // the i matrices created so far
+            return(NULL);
+        }
+        // create_matrix_double already checked every row, so a single pass sets the connections to 1 without rescanning the matrix.
+        // Trainable weights: create_FF_model_matrices_initialized / initialize_model_weights (initializer_functions.h)
+        init_matrix_to_double_value(matrix, (int)nodes_per_layer, (int)nodes_per_layer, (double)1);
 
         matrices_vector[i] = matrix;
-        // free_double_matrix(matrix, nodes_per_layer); THIS DOESN'T WORK: memory getting freed is memory containing the matrices, this line should not be uncommented
     }
     return(matrices_vector);
 }
 
+/**
+ * @brief Frees the vector of matrices created by create_FF_model_matrices (free_model does it for the matrices given to a model)
+ * 
+ * @param matrices_vector The vector of matrices
+ * @param number_of_matrices The number of matrices in the vector (layers - 1)
+ * @param nodes_per_layer The number of rows of every matrix
+ */
+void free_FF_model_matrices(double*** matrices_vector, size_t number_of_matrices, size_t nodes_per_layer){
+    if (matrices_vector == NULL){
+        return;
+    }
+    for (size_t i = 0; i < number_of_matrices; i++){
+        free_double_matrix(matrices_vector[i], (int)nodes_per_layer);
+    }
+    allocator_release(NULL, matrices_vector, ALLOCATOR_SUBSYSTEM_MATRIX);
+}
+
+/**
+ * @brief Prints the vector of matrices created by create_FF_model_matrices for the same number of layers
+ *
+ * @param layers The number of layers of the model, the vector holds layers - 1 matrices
+ */
 void print_matrix_vector_double(double*** matrices_vector, int layers, int nodes_per_layer){
-    for (int layer = 0; layer < layers; layer++){
+    for (int layer = 0; layer < layers - 1; layer++){
         print_matrix_double(matrices_vector[layer], nodes_per_layer, nodes_per_layer);
     }
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 double** create_adj_matrix_double_square(int layers, int nodes_per_layer);
 double*** create_FF_model_matrices(size_t layers, size_t nodes_per_layer);
+void free_FF_model_matrices(double*** matrices_vector, size_t number_of_matrices, size_t nodes_per_layer);
 void print_matrix_vector_double(double*** matrices_vector, int layers, int nodes_per_layer);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,12 @@
 #include "settings.h"
 #include "node_functions.h"
+#include "matrix_functions.h"
+#include "trace_functions.h"
+#include "metrics_functions.h"
+#include "kernel_functions.h"
+#include "compiler_functions.h"
+#include "cache_functions.h"
+#include "allocator_functions.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
@@ -21,6 +28,20 @@ double myThresholdFunc(double x) {
     return (x > 0.5) ? 1.0 : 0.0;
 }
 
+/**
+ * @brief Resolves an activation function to the kind the kernels know how to inline
+ * @return ActivationKind, ACTIVATION_CUSTOM if the function is not one of the library's
+ */
+ActivationKind activation_kind_of(activation_function activation){
+    if (activation == mySigmoid){
+        return ACTIVATION_SIGMOID;
+    }
+    if (activation == myThresholdFunc){
+        return ACTIVATION_THRESHOLD;
+    }
+    return ACTIVATION_CUSTOM;
+}
+
 /* -+-+-+-+-+-+-+-+-+-+-+- NODE -+-+-+-+-+-+-+-+-+-+-+- */
 
 /**
@@ -73,14 +94,14 @@ n.activation = mySigmoid; ???
 
 /* -+-+-+-+-+-+-+-+-+-+-+- LAYER -+-+-+-+-+-+-+-+-+-+-+- */
 /**
- * @brief Create a layer object
+ * @brief Create a layer object.
+ * The biases, deltas and outputs vectors are carved out of a single LAYER_ALIGNMENT aligned block, each vector starts on its own cache line.
+ * The block comes from the current allocator of the thread (see allocator_functions.h).
  *
- * @param num_nodes The number of nodes that will be in the layer
- * @param number_of_nodes_in_the_layer 
- * @param number_of_nodes_in_the_next_layer 
+ * @param number_of_nodes_in_the_layer The number of nodes that will be in the layer
  * @param activation The activation function that will be used in the nodes of the returned layer
  * @param threshold The threshold function that will be used in the nodes of the returned layer
- * @return Layer struct
+ * @return Layer struct, with NULL vectors if the allocation failed
  */
 Layer create_layer(size_t number_of_nodes_in_the_layer,
                    // size_t number_of_nodes_in_the_next_layer,
@@ -88,31 +109,89 @@ Layer create_layer(size_t number_of_nodes_in_the_layer,
                    threshold_function threshold){
     Layer layer;
     layer.number_of_nodes_in_the_layer = number_of_nodes_in_the_layer;
-    // layer.number_of_nodes_in_the_next_layer = number_of_nodes_in_the_next_layer;
-
-    // Allocate space for the nodes
-    layer.layer_array_of_nodes = malloc(number_of_nodes_in_the_layer * sizeof(Node));
-    if (layer.layer_array_of_nodes == NULL) {
+    layer.activation_kind = activation_kind_of(activation);
+    layer.activation = activation;
+    layer.threshold = threshold;
+    layer.kernel = NULL;        // the width of the previous layer is not known here, see bind_layer_kernels
+
+    // Every vector is padded to a whole number of cache lines so that the next one is aligned as well
+    const size_t doubles_per_line = LAYER_ALIGNMENT / sizeof(double);
+    const size_t stride = ((number_of_nodes_in_the_layer + doubles_per_line - 1) / doubles_per_line) * doubles_per_line;
+    const size_t bytes = (stride > 0 ? 3 * stride : doubles_per_line) * sizeof(double);
+    double* block = allocator_allocate(NULL, bytes, LAYER_ALIGNMENT, ALLOCATOR_SUBSYSTEM_LAYER);
+    if (block == NULL) {
         fprintf(stderr,
-            "Error in %s: Failed to allocate layer_array_of_nodes. 'layer.layer_array_of_nodes = %p'.\n",
-            __func__, (void*)layer.layer_array_of_nodes);
+            "Error in %s: Failed to allocate the layer vectors. 'block = %p'.\n",
+            __func__, (void*)block);
         Layer empty = {0};
         return empty;
     }
+    memset(block, 0, bytes);    // bias=0.0, delta=0.0 and output=0.0 for all nodes
 
-    // Initialize each node
-    for (size_t i = 0; i < number_of_nodes_in_the_layer; i++) {
-        // Example: bias=0.0 for all nodes
-        layer.layer_array_of_nodes[i] = create_node(
-            (int)i,            /* index */
-            0.0,               /* bias  */
-            activation,        /* activation  */
-            threshold          /* threshold   */
-        );
-    }
+    layer.biases = block;
+    layer.deltas = block + stride;
+    layer.outputs = block + 2 * stride;
 
     return layer;
 }
+
+/**
+ * @brief Compatibility accessor: builds a Node view of a node of the layer
+ *
+ * @param layer The layer
+ * @param index Position of the node in the layer, it becomes the index of the returned Node
+ * @return Node, a copy: changing it doesn't change the layer (use layer_set_node). A node of index -1 if the layer is NULL or index is out of range
+ */
+Node layer_get_node(const Layer* layer, size_t index){
+    if (layer == NULL || layer->biases == NULL || index >= layer->number_of_nodes_in_the_layer){
+        fprintf(stderr, "Error in %s: invalid layer or index %zu.\n", __func__, index);
+        return create_node(-1, 0.0, NULL, NULL);
+    }
+    Node node = create_node((int)index, layer->biases[index], layer->activation, layer->threshold);
+    node.output = layer->outputs[index];
+    node.delta = layer->deltas[index];
+    return node;
+}
+
+/**
+ * @brief Compatibility accessor: writes bias, output and delta of a Node in the layer vectors.
+ * The activation and threshold of the node are ignored, every node of a layer shares the layer's ones.
+ *
+ * @return ErrorCode, ERROR_NULL_POINTER_AS_PARAMETER if the layer is NULL, ERROR_INVALID_PARAMETER if index is out of range
+ */
+ErrorCode layer_set_node(Layer* layer, size_t index, Node node){
+    if (layer == NULL || layer->biases == NULL){
+        fprintf(stderr, "Error in %s: NULL layer or layer without vectors.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (index >= layer->number_of_nodes_in_the_layer){
+        fprintf(stderr, "Error in %s: index %zu out of a layer of %zu nodes.\n", __func__, index, layer->number_of_nodes_in_the_layer);
+        return ERROR_INVALID_PARAMETER;
+    }
+    layer->biases[index] = node.bias;
+    layer->outputs[index] = node.output;
+    layer->deltas[index] = node.delta;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Frees the vectors of the layer (one block, owned by biases) and leaves the layer empty. The Layer struct itself is not freed.
+ * The block is given back to the current allocator, which must be the one the layer was created with (free_model takes care of it).
+ * @return ErrorCode
+ */
+ErrorCode free_layer(Layer* layer){
+    if (layer == NULL){
+        fprintf(stderr, "Error in %s: argument passed as NULL pointer. 'layer = %p'.\n", __func__, (void*)layer);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    allocator_release(NULL, layer->biases, ALLOCATOR_SUBSYSTEM_LAYER);
+    layer->biases = NULL;
+    layer->deltas = NULL;
+    layer->outputs = NULL;
+    layer->number_of_nodes_in_the_layer = 0;
+    layer->kernel = NULL;
+    return NO_ERROR;
+}
 /*
 Layer init_layer(int layer_number, Node * array_of_nodes_present_in_the_layer, double*** vector_containing_the_matrices){
     //// TODO -> Make this function.
@@ -137,7 +216,8 @@ Layer init_layer(int layer_number, Node * array_of_nodes_present_in_the_layer, d
  */
 // PROBLEM IN FUNCTIONS (Layer* model_layers), MAKES NO SENSE AS A VARIABLE.
 Model* create_model(const char* name, Layer* model_layers, double*** model_weights) {
-    Model* model = malloc(sizeof(Model));
+    Allocator* allocator = allocator_get_current();
+    Model* model = allocator_allocate(allocator, sizeof(Model), 0, ALLOCATOR_SUBSYSTEM_MODEL);
     if (!model) {
         fprintf(stderr, "Allocation error\n");
         return NULL;
@@ -147,13 +227,18 @@ Model* create_model(const char* name, Layer* model_layers, double*** model_weigh
     model->model_layers = model_layers;
     model->model_weights = model_weights;
     // Allocate space for the name and copy it
-    model->model_name = malloc(strlen(name) + 1);
+    model->model_name = allocator_allocate(allocator, strlen(name) + 1, 0, ALLOCATOR_SUBSYSTEM_MODEL);
     if (!model->model_name) {
         fprintf(stderr, "Allocation error\n");
-        free(model);  // Clean up partially allocated model
+        allocator_release(allocator, model, ALLOCATOR_SUBSYSTEM_MODEL);  // Clean up partially allocated model
         return NULL;
     }
     strcpy(model->model_name, name);
+    model->metrics = create_model_metrics(model->model_name, model->number_of_layers_in_the_model);
+    model->compiled = NULL;
+    model->output_cache = NULL;
+    model->weights_version = 0;
+    model->allocator = allocator;
 
     return model;
 }
@@ -170,33 +255,154 @@ Model* init_model(const char* name, size_t number_of_layers_in_the_model, double
                     size_t number_of_nodes_in_the_layer,
                     activation_function activation,
                     threshold_function threshold) {
-    Model* model = malloc(sizeof(Model));
+    Allocator* allocator = allocator_get_current();
+    Model* model = allocator_allocate(allocator, sizeof(Model), 0, ALLOCATOR_SUBSYSTEM_MODEL);
     if (!model) {
         fprintf(stderr, "Allocation error\n");
         return NULL;
     }
     // Initialize fields
     model->number_of_layers_in_the_model = number_of_layers_in_the_model;
-    model->model_layers = calloc(number_of_layers_in_the_model, sizeof(Layer));
+    model->model_layers = allocator_allocate(allocator, number_of_layers_in_the_model * sizeof(Layer), 0, ALLOCATOR_SUBSYSTEM_MODEL);
+    if (!model->model_layers) {
+        fprintf(stderr, "Allocation error\n");
+        allocator_release(allocator, model, ALLOCATOR_SUBSYSTEM_MODEL);
+        return NULL;
+    }
+    memset(model->model_layers, 0, number_of_layers_in_the_model * sizeof(Layer));
     model->model_weights = model_weights;
 
     // Create the layers and put them in the model
+    int layers_created = TRUE;
     for (size_t i = 0; i < number_of_layers_in_the_model; i++){
         model->model_layers[i] = create_layer(number_of_nodes_in_the_layer, activation, threshold);
+        layers_created = layers_created && model->model_layers[i].biases != NULL;
     }
 
     // Allocate space for the name and copy it
-    model->model_name = malloc(strlen(name) + 1);
+    model->model_name = layers_created ? allocator_allocate(allocator, strlen(name) + 1, 0, ALLOCATOR_SUBSYSTEM_MODEL) : NULL;
     if (!model->model_name) {
         fprintf(stderr, "Allocation error\n");
-        free(model);  // Clean up partially allocated model
+        // Clean up the partially allocated model, the weights still belong to the caller
+        for (size_t i = 0; i < number_of_layers_in_the_model; i++){
+            if (model->model_layers[i].biases != NULL){
+                free_layer(&model->model_layers[i]);
+            }
+        }
+        allocator_release(allocator, model->model_layers, ALLOCATOR_SUBSYSTEM_MODEL);
+        allocator_release(allocator, model, ALLOCATOR_SUBSYSTEM_MODEL);
         return NULL;
     }
     strcpy(model->model_name, name);
+    model->metrics = create_model_metrics(model->model_name, model->number_of_layers_in_the_model);
+    model->compiled = NULL;
+    model->output_cache = NULL;
+    model->weights_version = 0;
+    model->allocator = allocator;
+    bind_layer_kernels(model);
 
     return model;
 }
 
+/**
+ * @brief Must be called after the weights or the biases of the model are modified: the weights version is incremented,
+ * the cached outputs become stale and a compiled model with baked weights no longer matches, so it is detached (the caller still owns it).
+ *
+ * @param model The model whose weights changed
+ */
+void model_weights_changed(Model* model){
+    if (model == NULL){
+        return;
+    }
+    model->weights_version++;
+    output_cache_invalidate(model->output_cache);
+    const CompiledModel* compiled = __atomic_load_n(&model->compiled, __ATOMIC_ACQUIRE);
+    if (compiled != NULL && compiled->weights_baked){
+        TRACE_WARNING(TRACE_CATEGORY_MODEL, "weights of model '%s' changed, detaching its baked compiled code", model->model_name);
+        __atomic_store_n(&model->compiled, NULL, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Frees the model and everything it owns: the layers, the weight matrices given to create_model / init_model,
+ * the name and the metrics counters. An attached compiled model or output cache belongs to the caller, it is only detached.
+ * Outputs calculated by the model must be freed before it (free_output reads the model).
+ * Everything is given back to the allocator the model was created with, the weights must come from it too.
+ *
+ * @param model The model, invalid after the call
+ * @return ErrorCode
+ */
+ErrorCode free_model(Model* model){
+    if (model == NULL){
+        fprintf(stderr, "Error in %s: argument passed as NULL pointer. 'model = %p'.\n", __func__, (void*)model);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    Allocator* allocator = (model->allocator != NULL) ? model->allocator : allocator_heap();
+    Allocator* previous = allocator_set_current(allocator);     // free_double_matrix and free_layer release through the current allocator
+    if (model->model_weights != NULL){
+        for (size_t i = 0; i + 1 < number_of_layers && model->model_layers != NULL; i++){
+            free_double_matrix(model->model_weights[i], (int)model->model_layers[i].number_of_nodes_in_the_layer);
+        }
+        allocator_release(allocator, model->model_weights, ALLOCATOR_SUBSYSTEM_MATRIX);
+    }
+    if (model->model_layers != NULL){
+        for (size_t i = 0; i < number_of_layers; i++){
+            free_layer(&model->model_layers[i]);
+        }
+        allocator_release(allocator, model->model_layers, ALLOCATOR_SUBSYSTEM_MODEL);
+    }
+    allocator_set_current(previous);
+    model->compiled = NULL;
+    model->output_cache = NULL;
+    free_model_metrics(model->metrics);     // before the name, the registry points to it
+    allocator_release(allocator, model->model_name, ALLOCATOR_SUBSYSTEM_MODEL);
+    allocator_release(allocator, model, ALLOCATOR_SUBSYSTEM_MODEL);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Reports the exact number of bytes the model owns, by category
+ *
+ * @param model The model
+ * @return ModelMemoryFootprint, all zeros if model is NULL
+ */
+ModelMemoryFootprint model_memory_footprint(const Model* model){
+    ModelMemoryFootprint footprint = {0};
+    if (model == NULL || model->model_layers == NULL){
+        return footprint;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    const size_t doubles_per_line = LAYER_ALIGNMENT / sizeof(double);
+    footprint.bookkeeping = sizeof(Model) + number_of_layers * sizeof(Layer) + (model->model_name ? strlen(model->model_name) + 1 : 0);
+    if (model->metrics != NULL){
+        footprint.bookkeeping += sizeof(ModelMetrics) + (number_of_layers > 0 ? number_of_layers : 1) * sizeof(LayerMetrics);
+    }
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        const size_t stride = ((nodes + doubles_per_line - 1) / doubles_per_line) * doubles_per_line;
+        // same layout as create_layer: biases, deltas and outputs, each padded to whole cache lines
+        if (model->model_layers[i].biases != NULL){
+            footprint.biases += (stride > 0 ? stride : doubles_per_line) * sizeof(double);
+            footprint.activations += 2 * stride * sizeof(double);
+        }
+        footprint.bytes_per_output += 2 * (sizeof(double*) + nodes * sizeof(double));
+        if (i + 1 < number_of_layers && model->model_weights != NULL){
+            footprint.weights += nodes * (sizeof(double*) + model->model_layers[i+1].number_of_nodes_in_the_layer * sizeof(double));
+        }
+    }
+    if (model->model_weights != NULL && number_of_layers > 1){
+        footprint.weights += (number_of_layers - 1) * sizeof(double**);
+    }
+    footprint.caches = output_cache_memory_bytes(model->output_cache);
+    if (model->compiled != NULL){
+        footprint.caches += sizeof(CompiledModel) + number_of_layers * sizeof(double*)
+                          + (model->compiled->library_path ? strlen(model->compiled->library_path) + 1 : 0);
+    }
+    footprint.total = footprint.weights + footprint.biases + footprint.activations + footprint.caches + footprint.bookkeeping;
+    return footprint;
+}
+
 /* -+-+-+-+-+-+-+-+-+-+-+- PROMPT -+-+-+-+-+-+-+-+-+-+-+- */
 
 /**
@@ -208,7 +414,13 @@ Model* init_model(const char* name, size_t number_of_layers_in_the_model, double
  */
 Prompt create_prompt(size_t length, double* tokens) {
     Prompt prompt;
-    prompt.data = (double*)malloc(length * sizeof(double));
+    prompt.allocator = allocator_get_current();
+    prompt.data = allocator_allocate(prompt.allocator, length * sizeof(double), 0, ALLOCATOR_SUBSYSTEM_PROMPT);
+    if (prompt.data == NULL) {
+        fprintf(stderr, "Error in %s: memory allocation error for %zu tokens.\n", __func__, length);
+        prompt.length = 0;
+        return prompt;
+    }
     prompt.length = length;
     for (size_t i = 0; i < length; i++) {
         prompt.data[i] = (double)tokens[i];
@@ -216,6 +428,21 @@ Prompt create_prompt(size_t length, double* tokens) {
     return prompt;
 }
 
+/**
+ * @brief Frees the tokens copied by create_prompt and empties the prompt
+ * @return ErrorCode
+ */
+ErrorCode free_prompt(Prompt* prompt){
+    if (prompt == NULL){
+        fprintf(stderr, "Error in %s: argument passed as NULL pointer. 'prompt = %p'.\n", __func__, (void*)prompt);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    allocator_release(prompt->allocator, prompt->data, ALLOCATOR_SUBSYSTEM_PROMPT);
+    prompt->data = NULL;
+    prompt->length = 0;
+    return NO_ERROR;
+}
+
 /* -+-+-+-+-+-+-+-+-+-+-+- OUTPUT -+-+-+-+-+-+-+-+-+-+-+- */
 
 /**
@@ -230,42 +457,84 @@ Output empty_output(){
     empty_output.length = 0;
     empty_output.layer_inputs = NULL;
     empty_output.layer_outputs = NULL;
+    empty_output.allocator = NULL;
     return(empty_output);
 }
 
+/**
+ * @brief Frees the per layer buffers of an output (data points into them) and marks it invalid.
+ * An output that is not valid owns nothing, freeing it is a no-op.
+ * @return ErrorCode
+ */
+ErrorCode free_output(Output* output){
+    if (output == NULL){
+        fprintf(stderr, "Error in %s: argument passed as NULL pointer. 'output = %p'.\n", __func__, (void*)output);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (output->is_valid == 1 && output->used_model != NULL){
+        for (size_t i = 0; i < output->used_model->number_of_layers_in_the_model; i++){
+            allocator_release(output->allocator, output->layer_inputs[i], ALLOCATOR_SUBSYSTEM_OUTPUT);
+            allocator_release(output->allocator, output->layer_outputs[i], ALLOCATOR_SUBSYSTEM_OUTPUT);
+        }
+        allocator_release(output->allocator, output->layer_inputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        allocator_release(output->allocator, output->layer_outputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    }
+    *output = empty_output();
+    return NO_ERROR;
+}
+
+/**
+ * @brief Frees the outputs returned by calculate_output_batch and the array itself
+ * @return ErrorCode
+ */
+ErrorCode free_output_batch(Output* outputs, size_t number_of_outputs){
+    if (outputs == NULL){
+        fprintf(stderr, "Error in %s: argument passed as NULL pointer. 'outputs = %p'.\n", __func__, (void*)outputs);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    Allocator* allocator = (number_of_outputs > 0) ? outputs[0].allocator : NULL;    // the array comes from the allocator of its outputs
+    for (size_t b = 0; b < number_of_outputs; b++){
+        free_output(&outputs[b]);
+    }
+    allocator_release(allocator, outputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    return NO_ERROR;
+}
+
 /* -+-+-+-+-+-+-+-+-+-+-+- NEURAL NETWORK OUTPUT -+-+-+-+-+-+-+-+-+-+-+- */
 
-Output calculate_output(Prompt* prompt, Model* model){
-    //                                  INPUT HEALTH CHECKS
-    #if DEBUG
-    fprintf(stderr, "\nStarted checks in %s function with\nprompt: %p\nmodel: %p\n", __func__, prompt, model);
-    #endif
+/**
+ * @brief Runs the input health checks shared by every inference entry point
+ * @return int 1 if the prompt can be given to the model, 0 otherwise (the reason is printed on stderr)
+ */
+static int check_prompt_and_model(const Prompt* prompt, const Model* model, const char* caller){
     if (prompt == NULL) {
-        fprintf(stderr, "Error in %s: 'prompt' is NULL.\n", __func__);
-        return empty_output();
+        fprintf(stderr, "Error in %s: 'prompt' is NULL.\n", caller);
+        return 0;
     }
     if (model == NULL) {
-        fprintf(stderr, "Error in %s: 'model' is NULL.\n", __func__);
-        return empty_output();
+        fprintf(stderr, "Error in %s: 'model' is NULL.\n", caller);
+        return 0;
     }
     if (prompt->data == NULL){
-        fprintf(stderr, "Error in %s: 'prompt data' is NULL.\n", __func__);
-        return empty_output();
+        fprintf(stderr, "Error in %s: 'prompt data' is NULL.\n", caller);
+        return 0;
     }
     if (model->model_layers == NULL){
-        fprintf(stderr, "Error in %s: 'model_layers' is NULL.\n", __func__);
-        return empty_output();
+        fprintf(stderr, "Error in %s: 'model_layers' is NULL.\n", caller);
+        return 0;
     }
     if (prompt->length != model->model_layers[0].number_of_nodes_in_the_layer){
-        fprintf(stderr, "Error in %s: prompt size (%zu) is different from the size of the first layer of model (%zu).\n", __func__, prompt->length, model->model_layers[0].number_of_nodes_in_the_layer);
-        return empty_output();
+        fprintf(stderr, "Error in %s: prompt size (%zu) is different from the size of the first layer of model (%zu).\n", caller, prompt->length, model->model_layers[0].number_of_nodes_in_the_layer);
+        return 0;
     }
-    #if DEBUG
-    fprintf(stderr, "Successfully exited checks in %s function with\nprompt: %p\nmodel: %p\n", __func__, prompt, model);
-    #endif
-    //                                  END INPUT HEALTH CHECKS
+    return 1;
+}
 
-    //                          INITIALIZATION OF RETURNED OUTPUT STRUCT
+/**
+ * @brief Allocates an Output with a layer_inputs and a layer_outputs array for every layer of the model and copies the prompt in layer_inputs[0]
+ * @return Output, is_valid != 1 if an allocation failed
+ */
+static Output allocate_output(const Prompt* prompt, Model* model){
     Output output;
     output.is_valid = 1;
     output.used_model = model;
@@ -274,103 +543,313 @@ Output calculate_output(Prompt* prompt, Model* model){
      * @note every layer has a vector of inputs and produces a vector as an output (dimension is the number of nodes), so we need an array of dimension number_of_layers * 2
      * @details this array is structured as follows: starts with the prompt input, follows with the output of the first layer (input-output)
      */
-    DEBUG_PRINT("Allocating space for output.layer_inputs for [%zu] layers in model\n", model->number_of_layers_in_the_model);
-    output.layer_inputs = malloc(model->number_of_layers_in_the_model * sizeof(double*));
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    output.allocator = allocator_get_current();
+    TRACE_DEBUG(TRACE_CATEGORY_MEMORY, "allocating output.layer_inputs for [%zu] layers in model", number_of_layers);
+    output.layer_inputs = allocator_allocate(output.allocator, number_of_layers * sizeof(double*), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
     if (output.layer_inputs == NULL){
         fprintf(stderr, "Error in %s: memory allocation error. 'output.layer_inputs_and_outputs' is NULL.\n", __func__);
         return empty_output();
     }
-    DEBUG_PRINT("Allocating space for output.layer_outputs for [%zu] layers in model\n", model->number_of_layers_in_the_model);
-    output.layer_outputs = malloc(model->number_of_layers_in_the_model * sizeof(double*));
+    TRACE_DEBUG(TRACE_CATEGORY_MEMORY, "allocating output.layer_outputs for [%zu] layers in model", number_of_layers);
+    output.layer_outputs = allocator_allocate(output.allocator, number_of_layers * sizeof(double*), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
     if (output.layer_outputs == NULL){
         fprintf(stderr, "Error in %s: memory allocation error. 'output.layer_inputs_and_outputs' is NULL.\n", __func__);
+        allocator_release(output.allocator, output.layer_inputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
         return empty_output();
     }
-    //                          END INITIALIZATION OF RETURNED OUTPUT STRUCT
+    memset(output.layer_inputs, 0, number_of_layers * sizeof(double*));
+    memset(output.layer_outputs, 0, number_of_layers * sizeof(double*));
+
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t number_of_nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        output.layer_inputs[i] = allocator_allocate(output.allocator, number_of_nodes * sizeof(double), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        output.layer_outputs[i] = allocator_allocate(output.allocator, number_of_nodes * sizeof(double), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        if (output.layer_inputs[i] == NULL || output.layer_outputs[i] == NULL){
+            fprintf(stderr, "Error in %s: memory allocation error. 'output.layer_inputs[%zu]' or 'output.layer_outputs[%zu]' is NULL.\n", __func__, i, i);
+            free_output(&output);   // releases the buffers allocated so far
+            return empty_output();
+        }
+    }
 
-    /** We copy the prompt into the layer_inputs_and_outputs first array in order for it to be registered for 
+    /** We copy the prompt into the layer_inputs first array in order for it to be registered for 
      * training purposes while also maintaining the main loop as straightforward as possible */
-    DEBUG_PRINT("Allocating space for first layer's output.layer_inputs[0] with a prompt->length = [%zu]\n", prompt->length);
-    output.layer_inputs[0] = malloc(prompt->length * sizeof(double*));
-    if (output.layer_inputs[0] == NULL){
-        fprintf(stderr, "Error in %s: memory allocation error. 'output.layer_inputs[%d]' is NULL.\n", __func__, 0);
-        return empty_output();
-    }
     for (size_t i = 0; i < prompt->length; i++){
         output.layer_inputs[0][i] = prompt->data[i];
     }
-    #if DEBUG ////////////////////////
-        printf("Prompt was copied into first input array. Copied values:\nInput array:\n 1) ");
+    #if TRACE_COMPILE_LEVEL >= TRACE_LEVEL_VERBOSE
+    if (trace_is_enabled(TRACE_LEVEL_VERBOSE, TRACE_CATEGORY_INFERENCE)){
         for (size_t i = 0; i < prompt->length; i++){
-            printf("%lf, ", output.layer_inputs[0][i]);
-        }
-            printf("\nPrompt array:\n2) ");
-        for (size_t i = 0; i < prompt->length; i++){
-            printf("%lf, ", prompt->data[i]);
+            TRACE_VERBOSE(TRACE_CATEGORY_INFERENCE, "prompt copied into first input array: input[%zu] = %lf (prompt[%zu] = %lf)", i, output.layer_inputs[0][i], i, prompt->data[i]);
         }
+    }
     #endif
 
-    //                                      MAIN CALCULATION LOOP
-    DEBUG_PRINT("Entering main loop... Stop value of i will be %zu\n", model->number_of_layers_in_the_model - 1);
-    for (size_t i = 0; i < model->number_of_layers_in_the_model - 1; i++){
-        DEBUG_PRINT("\nLoop at index [%zu]:\n", i); 
-        /** 1) pass the input trough each node */
-        output.layer_outputs[i] = malloc(model->model_layers[i].number_of_nodes_in_the_layer * sizeof(double));
-        if (output.layer_outputs[i] == NULL){
-            fprintf(stderr, "Error in %s: memory allocation error. 'output.layer_outputs[%zu]' is NULL.\n", __func__, i);
-            return empty_output();
+    const size_t k = model->number_of_layers_in_the_model - 1;
+    output.length = model->model_layers[k].number_of_nodes_in_the_layer;
+    output.data = output.layer_outputs[k];
+    return output;
+}
+
+/**
+ * @brief An Output of the model loaded with the prompt, with no layer computed yet (run them with calculate_output_layers)
+ * @return Output, is_valid != 1 if the checks or an allocation failed
+ */
+Output create_output(Prompt* prompt, Model* model){
+    if (!check_prompt_and_model(prompt, model, __func__)){
+        return empty_output();
+    }
+    return allocate_output(prompt, model);
+}
+
+/**
+ * @brief Bytes read and written by the fused kernel of layer i (weights, previous outputs, biases, pre-activations and activations)
+ */
+static uint64_t layer_bytes_touched(const Model* model, size_t i){
+    const uint64_t m = model->model_layers[i].number_of_nodes_in_the_layer;
+    const uint64_t n = (i == 0) ? 0 : model->model_layers[i - 1].number_of_nodes_in_the_layer;
+    return (n * m + n + 3 * m) * sizeof(double);
+}
+
+/**
+ * @brief Runs the layers [first_layer, end_layer) of the forward pass on an Output prepared by create_output.
+ * Layer first_layer reads output->layer_outputs[first_layer - 1], so the layers before it must have been run already (possibly by
+ * another thread: the pipeline of pipeline_functions.h hands the Output from stage to stage). Always runs the kernels, never compiled code.
+ *
+ * @param output An Output of model from create_output or calculate_output
+ * @param model The model used
+ * @param weights The weight matrices, same shapes as model->model_weights
+ * @param biases One bias vector per layer, NULL to use the biases of the model's layers
+ * @param first_layer First layer to run
+ * @param end_layer One past the last layer to run, at most the number of layers of the model
+ * @return ErrorCode
+ */
+ErrorCode calculate_output_layers(Output* output, Model* model, double*** weights, double* const* biases, size_t first_layer, size_t end_layer){
+    if (output == NULL || model == NULL || output->is_valid != 1 || output->used_model != model){
+        fprintf(stderr, "Error in %s: invalid output or model.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (first_layer > end_layer || end_layer > model->number_of_layers_in_the_model || (weights == NULL && end_layer > 1)){
+        fprintf(stderr, "Error in %s: invalid layer range [%zu, %zu) or NULL weights.\n", __func__, first_layer, end_layer);
+        return ERROR_INVALID_PARAMETER;
+    }
+    const int metered = metrics_enabled();
+    uint64_t layer_start_ns = metered ? metrics_now_ns() : 0;
+
+    /** 1) the input layer has no incoming weights, only bias and activation.
+     *  With external biases every layer is run through a copy of its descriptor pointing to them */
+    Layer layer;
+    if (first_layer == 0 && end_layer > 0){
+        layer = model->model_layers[0];
+        if (biases != NULL){
+            layer.biases = biases[0];
         }
-        for (size_t j; j < model->model_layers[i].number_of_nodes_in_the_layer; j++){
-            /** 2) register output of each node into the output array */
-            double input_to_node = output.layer_inputs[i][j] + model->model_layers[i].layer_array_of_nodes[j].bias; // variable to enhance code readability (input + bias)
-            output.layer_outputs[i][j] = model->model_layers[i].layer_array_of_nodes[j].activation(input_to_node);
-            DEBUG_PRINT("Passed values trough each node input_to_node[%zu] = %lf -> %lf (= output.layer_outputs[%zu][%zu])", j, input_to_node, output.layer_outputs[i][j], i, j);  
+        layer_activation_forward(output->layer_inputs[0], &layer, output->layer_outputs[0]);
+        if (metered){
+            const uint64_t layer_end_ns = metrics_now_ns();
+            metrics_record_layer_forward(model->metrics, 0, layer_end_ns - layer_start_ns, layer_bytes_touched(model, 0));
+            layer_start_ns = layer_end_ns;
         }
+    }
 
-        /** MATRIX MULTIPLICATION
-         * My layers output a vector in the form of V[n], where n is the number of nodes in the layer (also represented by the rows of the adj matrix)
-         *  while the matrix is M[n][m]; 
-         *  Row vector V[1][n] * M[n][m] is the operation to do.
-         * **/
-        // Allocate memory for the next layer's input vector.
-        // model->model_layers[i+1].number_of_nodes_in_the_layer represents the number of nodes (m) in the next layer.
-        output.layer_inputs[i+1] = malloc(model->model_layers[i+1].number_of_nodes_in_the_layer * sizeof(double));
-
-        // Iterate over each node in the next layer (each column of the weight matrix)
-        for (size_t column = 0; column < model->model_layers[i+1].number_of_nodes_in_the_layer; column++) {
-            double sum = 0.0;
-
-            // For each node in the current layer (each row of the weight matrix)
-            for (size_t row = 0; row < model->model_layers[i].number_of_nodes_in_the_layer; row++) {
-                // Multiply the output from the current layer's node (row index)
-                // by the weight connecting that node to the next layer's node (column index)
-                sum += output.layer_outputs[i][row] * model->model_weights[i][row][column];
+    //                                      MAIN CALCULATION LOOP
+    /** 2) every other layer: weighted sum of the previous outputs, bias and activation fused in one kernel
+     *  The previous layer outputs a row vector V[1][n] and the weights matrix is M[n][m], so layer_inputs[i] = V * M */
+    TRACE_DEBUG(TRACE_CATEGORY_INFERENCE, "entering main loop, stop value of i will be %zu", end_layer - 1);
+    for (size_t i = (first_layer > 0) ? first_layer : 1; i < end_layer; i++){
+        TRACE_DEBUG(TRACE_CATEGORY_LAYER, "loop at index [%zu]", i);
+        layer = model->model_layers[i];
+        if (biases != NULL){
+            layer.biases = biases[i];
+        }
+        const layer_kernel_function kernel = layer.kernel != NULL ? layer.kernel : fused_layer_forward;
+        kernel(output->layer_outputs[i-1], model->model_layers[i-1].number_of_nodes_in_the_layer, weights[i-1],
+            &layer, output->layer_inputs[i], output->layer_outputs[i]);
+
+        #if TRACE_COMPILE_LEVEL >= TRACE_LEVEL_VERBOSE
+        if (trace_is_enabled(TRACE_LEVEL_VERBOSE, TRACE_CATEGORY_LAYER)){
+            for (size_t j = 0; j < model->model_layers[i].number_of_nodes_in_the_layer; j++){
+                TRACE_VERBOSE(TRACE_CATEGORY_LAYER, "input_to_node[%zu] = %lf -> %lf (= output->layer_outputs[%zu][%zu])", j, output->layer_inputs[i][j], output->layer_outputs[i][j], i, j);
             }
-            // Store the computed sum into the next layer's input vector at the index corresponding to the node (column)
-            output.layer_inputs[i+1][column] = sum;
         }
+        #endif
 
+        if (metered){
+            const uint64_t layer_end_ns = metrics_now_ns();
+            metrics_record_layer_forward(model->metrics, i, layer_end_ns - layer_start_ns, layer_bytes_touched(model, i));
+            layer_start_ns = layer_end_ns;
+        }
     }
     //                                      END MAIN CALCULATION LOOP
+    return NO_ERROR;
+}
+
+/**
+ * @brief Calculates the output of the model for the given prompt (forward pass).
+ * The input layer applies bias and activation to the prompt, then each following layer is computed by fused_layer_forward
+ * (weighted sum, bias and activation in a single sweep). Every layer's inputs and outputs are kept in the returned Output for training.
+ *
+ * @param prompt The input of the model, its length must match the number of nodes of the first layer
+ * @param model The model used
+ * @return Output, is_valid != 1 if the checks or an allocation failed
+ */
+Output calculate_output(Prompt* prompt, Model* model){
+    if (model == NULL){
+        fprintf(stderr, "Error in %s: 'model' is NULL.\n", __func__);
+        return empty_output();
+    }
+    return calculate_output_with_weights(prompt, model, model->model_weights, NULL);
+}
 
-    /** 5) Handling last layer (output layer) */
-    size_t const k = model->number_of_layers_in_the_model - 1; // enhancing readability
-    output.length = model->model_layers[k].number_of_nodes_in_the_layer; // is this varible really useful? It can be obtained from model->model_layers[k].number_of_nodes_in_the_layer where k = model->number_of_layers_in_the_model - 1
-    /** 5.1) pass the input trough each node */
-    output.layer_outputs[k] = malloc(model->model_layers[k].number_of_nodes_in_the_layer * sizeof(double));
-    if (output.layer_outputs[k] == NULL)
-    {
-        fprintf(stderr, "Error in %s: memory allocation error. 'output.layer_outputs[%zu]' (last layer) is NULL.\n", __func__, k);
+/**
+ * @brief Same as calculate_output, but the weights and the biases are taken from the parameters instead of the model
+ * (e.g. an immutable snapshot, see snapshot_functions.h): the model only gives the topology, the activations and the kernels.
+ *
+ * @param prompt The input of the model
+ * @param model The model used
+ * @param weights The weight matrices, same shapes as model->model_weights
+ * @param biases One bias vector per layer, NULL to use the biases of the model's layers
+ * @return Output, is_valid != 1 if the checks or an allocation failed
+ */
+Output calculate_output_with_weights(Prompt* prompt, Model* model, double*** weights, double* const* biases){
+    //                                  INPUT HEALTH CHECKS
+    TRACE_DEBUG(TRACE_CATEGORY_INFERENCE, "started checks with prompt: %p model: %p", (void*)prompt, (void*)model);
+    if (!check_prompt_and_model(prompt, model, __func__)){
         return empty_output();
     }
-    for (size_t j; j < model->model_layers[k].number_of_nodes_in_the_layer; j++)
-    {
-        /** 5.2) register output of each node into the output array */
-        double input_to_node = output.layer_inputs[k][j] + model->model_layers[k].layer_array_of_nodes[j].bias;
-        output.layer_outputs[k][j] = model->model_layers[k].layer_array_of_nodes[j].activation(input_to_node);
+    if (weights == NULL && model->number_of_layers_in_the_model > 1){
+        fprintf(stderr, "Error in %s: 'weights' is NULL.\n", __func__);
+        return empty_output();
+    }
+    TRACE_DEBUG(TRACE_CATEGORY_INFERENCE, "successfully exited checks with prompt: %p model: %p", (void*)prompt, (void*)model);
+    //                                  END INPUT HEALTH CHECKS
+
+    // Timing is only paid for when the metrics are enabled
+    const int metered = metrics_enabled();
+    const uint64_t forward_start_ns = metered ? metrics_now_ns() : 0;
+
+    Output output = allocate_output(prompt, model);
+    if (output.is_valid != 1){
+        return output;
+    }
+
+    /** 0) a model compiled ahead of time runs its own specialized code (see compiler_functions.h), unless its baked weights are not the requested ones */
+    // loaded once: snapshot readers run concurrently with a writer that may detach it (model_weights_changed)
+    const CompiledModel* compiled = __atomic_load_n(&model->compiled, __ATOMIC_ACQUIRE);
+    const int own_weights = (weights == model->model_weights && biases == NULL);
+    if (compiled != NULL && (own_weights || !compiled->weights_baked)){
+        double* model_biases[COMPILER_MAX_LAYERS];
+        if (biases == NULL){
+            compiled_model_biases(model, model_biases);
+        }
+        compiled->forward(output.layer_inputs[0], output.layer_inputs, output.layer_outputs, weights,
+            biases != NULL ? biases : model_biases);
+        if (metered){
+            metrics_record_model_forward(model->metrics, metrics_now_ns() - forward_start_ns, 1);
+        }
+        return output;
+    }
+
+    /** 1) the layers, with the kernels selected at model creation */
+    calculate_output_layers(&output, model, weights, biases, 0, model->number_of_layers_in_the_model);
+
+    if (metered){
+        metrics_record_model_forward(model->metrics, metrics_now_ns() - forward_start_ns, 1);
     }
-    output.data = output.layer_outputs[k];
     return(output);
 }
 
+/**
+ * @brief Calculates the outputs of the model for a batch of prompts. It gives the same results as calling calculate_output on every prompt,
+ * but each layer is computed for the whole batch by fused_layer_forward_batch, so the weights are streamed from memory once per batch.
+ *
+ * @param prompts Array of number_of_prompts prompts
+ * @param number_of_prompts Size of the batch
+ * @param model The model used
+ * @return Output* An array of number_of_prompts outputs from allocator_allocate (free it with free_output_batch), or NULL if a check or an allocation failed
+ */
+Output* calculate_output_batch(Prompt* prompts, size_t number_of_prompts, Model* model){
+    if (prompts == NULL || number_of_prompts == 0){
+        fprintf(stderr, "Error in %s: empty batch 'prompts = %p', 'number_of_prompts = %zu'.\n", __func__, (void*)prompts, number_of_prompts);
+        return NULL;
+    }
+    for (size_t b = 0; b < number_of_prompts; b++){
+        if (!check_prompt_and_model(&prompts[b], model, __func__)){
+            return NULL;
+        }
+    }
+
+    const int metered = metrics_enabled();
+    const uint64_t forward_start_ns = metered ? metrics_now_ns() : 0;
+    uint64_t layer_start_ns = forward_start_ns;
+
+    Output* outputs = allocator_allocate(NULL, number_of_prompts * sizeof(Output), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    // The kernels take arrays of row pointers: one per sample for the previous outputs, the pre-activations and the activations
+    double** row_pointers = allocator_allocate(NULL, 3 * number_of_prompts * sizeof(double*), 0, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    if (outputs == NULL || row_pointers == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error for a batch of %zu prompts.\n", __func__, number_of_prompts);
+        allocator_release(NULL, outputs, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        allocator_release(NULL, row_pointers, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        return NULL;
+    }
+    const double** inputs = (const double**)row_pointers;
+    double** pre_activations = row_pointers + number_of_prompts;
+    double** activations = row_pointers + 2 * number_of_prompts;
+
+    const CompiledModel* compiled = __atomic_load_n(&model->compiled, __ATOMIC_ACQUIRE);
+    double* model_biases[COMPILER_MAX_LAYERS];
+    if (compiled != NULL){
+        compiled_model_biases(model, model_biases);
+    }
+    for (size_t b = 0; b < number_of_prompts; b++){
+        outputs[b] = allocate_output(&prompts[b], model);
+        if (outputs[b].is_valid != 1){
+            free_output_batch(outputs, b);
+            allocator_release(NULL, row_pointers, ALLOCATOR_SUBSYSTEM_OUTPUT);
+            return NULL;
+        }
+        if (compiled != NULL){
+            compiled->forward(outputs[b].layer_inputs[0], outputs[b].layer_inputs, outputs[b].layer_outputs, model->model_weights, model_biases);
+        } else {
+            layer_activation_forward(outputs[b].layer_inputs[0], &model->model_layers[0], outputs[b].layer_outputs[0]);
+        }
+    }
+    if (compiled != NULL){
+        allocator_release(NULL, row_pointers, ALLOCATOR_SUBSYSTEM_OUTPUT);
+        if (metered){
+            metrics_record_model_forward(model->metrics, metrics_now_ns() - forward_start_ns, number_of_prompts);
+        }
+        return outputs;
+    }
+    if (metered){
+        const uint64_t layer_end_ns = metrics_now_ns();
+        metrics_record_layer_forward(model->metrics, 0, layer_end_ns - layer_start_ns, number_of_prompts * layer_bytes_touched(model, 0));
+        layer_start_ns = layer_end_ns;
+    }
+
+    for (size_t i = 1; i < model->number_of_layers_in_the_model; i++){
+        TRACE_DEBUG(TRACE_CATEGORY_LAYER, "batch of %zu, layer [%zu]", number_of_prompts, i);
+        for (size_t b = 0; b < number_of_prompts; b++){
+            inputs[b] = outputs[b].layer_outputs[i-1];
+            pre_activations[b] = outputs[b].layer_inputs[i];
+            activations[b] = outputs[b].layer_outputs[i];
+        }
+        fused_layer_forward_batch(inputs, number_of_prompts, model->model_layers[i-1].number_of_nodes_in_the_layer, model->model_weights[i-1],
+            &model->model_layers[i], pre_activations, activations);
+
+        if (metered){
+            const uint64_t layer_end_ns = metrics_now_ns();
+            // The weights are read once for the whole batch, the activations once per sample
+            const uint64_t weights_bytes = (uint64_t)model->model_layers[i-1].number_of_nodes_in_the_layer * model->model_layers[i].number_of_nodes_in_the_layer * sizeof(double);
+            metrics_record_layer_forward(model->metrics, i, layer_end_ns - layer_start_ns,
+                weights_bytes + number_of_prompts * (layer_bytes_touched(model, i) - weights_bytes));
+            layer_start_ns = layer_end_ns;
+        }
+    }
 
+    allocator_release(NULL, row_pointers, ALLOCATOR_SUBSYSTEM_OUTPUT);
+    if (metered){
+        metrics_record_model_forward(model->metrics, metrics_now_ns() - forward_start_ns, number_of_prompts);
+    }
+    return outputs;
+}
@@ -7,6 +7,9 @@ typedef enum ErrorCode{
     NO_ERROR = 0,
     ERROR_NULL_POINTER_AS_PARAMETER = -1,
     ERROR_MALLOC_OUT_OF_MEMORY = -2,
+    ERROR_INVALID_PARAMETER = -3,       // A parameter has a value the function can't work with (sizes that don't match, out of range...)
+    ERROR_IO = -4,                      // A file, socket or external process operation failed
+    ERROR_UNSUPPORTED = -5,             // The model uses something the function doesn't support
     
 } ErrorCode;
 
@@ -16,9 +19,23 @@ typedef enum ErrorCode{
 typedef double (*activation_function)(double x);
 typedef double (*threshold_function)(double x);
 
+/**
+ * @brief The activation of a layer, resolved once when the layer is created so the kernels can inline it instead of calling a pointer per node
+ *
+ * @param ACTIVATION_SIGMOID: mySigmoid
+ * @param ACTIVATION_THRESHOLD: myThresholdFunc
+ * @param ACTIVATION_CUSTOM: any other function, called through Layer.activation
+ */
+typedef enum ActivationKind{
+    ACTIVATION_SIGMOID = 0,
+    ACTIVATION_THRESHOLD = 1,
+    ACTIVATION_CUSTOM = 2,
+} ActivationKind;
+
 //                                          FUNCTION PROTOTYPES
 double mySigmoid(double x);
 double myThresholdFunc(double x);
+ActivationKind activation_kind_of(activation_function activation);
 //                                         END FUNCTION PROTOTYPES
 
 /*          -+-+-+-+-+-+-+-+-+-+-+- END THRESHOLD AND ACTIVATION FUNCTIONS -+-+-+-+-+-+-+-+-+-+-+- */
@@ -58,23 +75,44 @@ Node create_node(int index, double bias,
 /*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT LAYER -+-+-+-+-+-+-+-+-+-+-+- */
 
 /**
- * @brief A layer is a series of nodes separated by ONE GAP in wich there are the edges. It contains the array of nodes in the layer (top to bottom, left to right).
- * 
+ * @brief A layer is a series of nodes separated by ONE GAP in wich there are the edges.
+ * The layer is stored as a structure of arrays: bias, delta and output of the nodes are contiguous vectors (index j = node j, top to bottom),
+ * all the nodes share the activation of the layer. The three vectors live in a single LAYER_ALIGNMENT aligned block owned by biases.
+ * Use layer_get_node / layer_set_node when a Node view of a single node is needed.
+ *
  * @param layer_number(int): The identifier of the layer, starts from 0 ATTENTION: If MORE macro is not active then this doesn't exist
- * @param layer_array_of_nodes(Node): An array of the nodes contained in the layer; the array goes top to bottom, left to right
- * @param rows_adj_matrix(__uint64_t): The number of rows the adj matrix has (The number of nodes at the left)
- * @param columns_adj_matrix(__uint64_t): The number of rows the adj matrix has (The number of nodes at the right)
+ * @param number_of_nodes_in_the_layer(size_t): The number of nodes, length of the vectors
+ * @param biases(double*): The bias of each node, start of the aligned block
+ * @param deltas(double*): The backpropagation "error" of each node
+ * @param outputs(double*): The last output of each node
+ * @param activation_kind(ActivationKind): The activation of every node of the layer, resolved from activation
+ * @param activation(activation_function): Pointer to the activation function (only called through the pointer for ACTIVATION_CUSTOM)
+ * @param threshold(threshold_function): Facultative function for the activation of the nodes
+ * @param kernel(layer_kernel_function): The kernel computing this layer from the previous one, bound by bind_layer_kernels (NULL = generic fused_layer_forward)
  */
+struct Layer;
+
+/* Signature of the forward kernels computing a layer from the outputs of the previous one, see kernel_functions.h */
+typedef void (*layer_kernel_function)(const double* input, size_t number_of_inputs, double* const* weights,
+    const struct Layer* layer, double* pre_activation, double* output);
+
 typedef struct Layer
 {
     #if MORE        // The layer number isn't really necessary since we already have an ordered array of Layers in the Model struct
     int layer_number;        // The identifier of the layer, starts from 0.
     #endif
-    Node* layer_array_of_nodes;
     size_t number_of_nodes_in_the_layer;
-    // size_t number_of_nodes_in_the_next_layer;
+    double* biases;
+    double* deltas;
+    double* outputs;
+    ActivationKind activation_kind;
+    activation_function activation;
+    threshold_function threshold;
+    layer_kernel_function kernel;
 }Layer;
 
+#define LAYER_ALIGNMENT 64      // bytes, a cache line (and a full AVX-512 register)
+
 //                                          FUNCTION PROTOTYPES
 Layer create_layer(
     // size_t num_nodes,
@@ -82,6 +120,9 @@ Layer create_layer(
     // size_t number_of_nodes_in_the_next_layer,
     activation_function activation,
     threshold_function threshold);
+Node layer_get_node(const Layer* layer, size_t index);
+ErrorCode layer_set_node(Layer* layer, size_t index, Node node);
+ErrorCode free_layer(Layer* layer);
 //                                         END FUNCTION PROTOTYPES
 
 /*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT LAYER -+-+-+-+-+-+-+-+-+-+-+- */
@@ -95,12 +136,23 @@ Layer create_layer(
  * @param number_of_layers_in_the_model(size_t): is the number of layers the model possesses.
  * @param model_layers(Layer): An ordered array containing the layers of the model, the first layer is the INPUT the last layer the OUTPUT while everything else the SECRET LAYER
  * @param model_weights(double***): An ordered array containing the pointer to the weights matrices. 
+ * @param metrics(ModelMetrics*): The counters of the model, registered in the global metrics registry when the model is created.
+ * @param compiled(CompiledModel*): Ahead-of-time compiled forward pass of the model, NULL unless attach_compiled_model was called; stored and loaded
+ * atomically, snapshot readers run while a writer may detach it.
+ * @param output_cache(OutputCache*): Memoized outputs used by calculate_output_cached, NULL unless attach_output_cache was called.
+ * @param weights_version(unsigned long): Incremented by model_weights_changed, lets the state derived from the weights detect it is stale.
+ * @param allocator(Allocator*): The allocator the model was created with (the thread's current one), free_model releases through it.
  */
 typedef struct Model{
     char* model_name;
     size_t number_of_layers_in_the_model;
     Layer* model_layers;
     double*** model_weights;
+    struct ModelMetrics* metrics;   // Per layer timing and counters, see metrics_functions.h
+    struct CompiledModel* compiled; // If not NULL calculate_output runs this compiled code, see compiler_functions.h
+    struct OutputCache* output_cache; // If not NULL calculate_output_cached memoizes through it, see cache_functions.h
+    unsigned long weights_version;
+    struct Allocator* allocator;
 
 }Model;
 
@@ -113,6 +165,34 @@ Model* init_model(const char* name, size_t number_of_layers_in_the_model, double
     size_t number_of_nodes_in_the_layer,
     activation_function activation,
     threshold_function threshold);
+
+void model_weights_changed(Model* model);
+ErrorCode free_model(Model* model);
+//                                         END FUNCTION PROTOTYPES
+
+/**
+ * @brief Bytes owned by a model, by category (see model_memory_footprint)
+ *
+ * @param weights(size_t): Weight matrices, row pointers and the matrices vector
+ * @param biases(size_t): Bias vectors of the layers (with their cache line padding)
+ * @param activations(size_t): Per layer outputs and deltas vectors kept in the layers (with their padding)
+ * @param caches(size_t): Attached output cache entries and tables, compiled model bookkeeping
+ * @param bookkeeping(size_t): Model and layer descriptors, name and metrics counters
+ * @param total(size_t): Sum of the categories above
+ * @param bytes_per_output(size_t): Bytes allocated by every calculate_output call, owned by the returned Output until free_output
+ */
+typedef struct ModelMemoryFootprint{
+    size_t weights;
+    size_t biases;
+    size_t activations;
+    size_t caches;
+    size_t bookkeeping;
+    size_t total;
+    size_t bytes_per_output;
+} ModelMemoryFootprint;
+
+//                                          FUNCTION PROTOTYPES
+ModelMemoryFootprint model_memory_footprint(const Model* model);
 //                                         END FUNCTION PROTOTYPES
 
 /*                      -+-+-+-+-+-+-+-+-+-+-+- END STRUCT MODEL -+-+-+-+-+-+-+-+-+-+-+- */
@@ -129,10 +209,12 @@ Model* init_model(const char* name, size_t number_of_layers_in_the_model, double
 typedef struct Prompt{
     double* data;   // Pointer to the array of input values
     size_t length;  // Number of input values
+    struct Allocator* allocator;    // Where create_prompt allocated data, NULL for prompts built by hand (not to be freed with free_prompt)
 } Prompt;
 
 //                                          FUNCTION PROTOTYPES
 Prompt create_prompt(size_t length, double* tokens);
+ErrorCode free_prompt(Prompt* prompt);
 //                                         END FUNCTION PROTOTYPES
 
 /*                     -+-+-+-+-+-+-+-+-+-+-+- END STRUCT PROMPT -+-+-+-+-+-+-+-+-+-+-+- */
@@ -158,11 +240,18 @@ typedef struct Output{
     /** @note To self: layer_inputs[i][j] -> i is the layer you want to take the input from; j is the specific input given to the j node */
     double** layer_inputs;
     double** layer_outputs;
+    struct Allocator* allocator;    // Where the buffers were allocated (the thread's current allocator at calculate_output time)
 } Output;
 
 //                                          FUNCTION PROTOTYPES
 Output empty_output(void);
+Output create_output(Prompt* prompt, Model* model);
 Output calculate_output(Prompt* prompt, Model* model);
+Output calculate_output_with_weights(Prompt* prompt, Model* model, double*** weights, double* const* biases);
+ErrorCode calculate_output_layers(Output* output, Model* model, double*** weights, double* const* biases, size_t first_layer, size_t end_layer);
+Output* calculate_output_batch(Prompt* prompts, size_t number_of_prompts, Model* model);
+ErrorCode free_output(Output* output);
+ErrorCode free_output_batch(Output* outputs, size_t number_of_outputs);
 //                                         END FUNCTION PROTOTYPES
 
 /*                     -+-+-+-+-+-+-+-+-+-+-+- END STRUCT OUTPUT -+-+-+-+-+-+-+-+-+-+-+- */
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE     // sched_getcpu, pthread_setaffinity_np, MAP_HUGETLB
+#include "settings.h"
+#include "numa_functions.h"
+#include "threadpool_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define NUMA_MPOL_BIND 2    // from <linux/mempolicy.h>, libnuma is not required
+
+/* -+-+-+-+-+-+-+-+-+-+-+- TOPOLOGY -+-+-+-+-+-+-+-+-+-+-+- */
+
+static NumaTopology topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Marks the CPUs of a sysfs cpulist ("0-3,8-11") as belonging to node
+ * @return int Number of CPUs read
+ */
+static int parse_cpulist(const char* list, int node){
+    int count = 0;
+    const char* cursor = list;
+    while (*cursor != '\0' && *cursor != '\n'){
+        char* end;
+        long first = strtol(cursor, &end, 10);
+        if (end == cursor){
+            break;
+        }
+        long last = first;
+        cursor = end;
+        if (*cursor == '-'){
+            last = strtol(cursor + 1, &end, 10);
+            cursor = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++){
+            topology.node_of_cpu[cpu] = node;
+            if (cpu + 1 > topology.number_of_cpus){
+                topology.number_of_cpus = (int)cpu + 1;
+            }
+            count++;
+        }
+        if (*cursor == ','){
+            cursor++;
+        }
+    }
+    return count;
+}
+
+static void read_topology(void){
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS; cpu++){
+        topology.node_of_cpu[cpu] = 0;
+    }
+    topology.number_of_nodes = 0;
+    topology.number_of_cpus = 0;
+    for (int id = 0; id < 4 * NUMA_MAX_NODES && topology.number_of_nodes < NUMA_MAX_NODES; id++){
+        char path[128];
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", NUMA_SYSFS_NODE_PATH, id);
+        FILE* file = fopen(path, "r");
+        if (file == NULL){
+            continue;       // node ids may have holes
+        }
+        char list[4096];
+        if (fgets(list, sizeof(list), file) != NULL){
+            const int index = topology.number_of_nodes;
+            topology.node_ids[index] = id;
+            topology.number_of_nodes++;
+            parse_cpulist(list, index);
+        }
+        fclose(file);
+    }
+    if (topology.number_of_nodes == 0){
+        // no sysfs NUMA information: a single node with every CPU
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        topology.number_of_nodes = 1;
+        topology.node_ids[0] = 0;
+        topology.number_of_cpus = (cpus > 0 && cpus < NUMA_MAX_CPUS) ? (int)cpus : 1;
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "NUMA topology: %d node(s), %d CPU(s)", topology.number_of_nodes, topology.number_of_cpus);
+}
+
+/**
+ * @brief The NUMA topology of the machine, read from sysfs on the first call
+ * @return const NumaTopology*
+ */
+const NumaTopology* numa_topology(void){
+    pthread_once(&topology_once, read_topology);
+    return &topology;
+}
+
+/**
+ * @brief Node (index in the topology) of a CPU, 0 for an unknown CPU
+ */
+int numa_node_of_cpu(int cpu){
+    const NumaTopology* current = numa_topology();
+    if (cpu < 0 || cpu >= current->number_of_cpus){
+        return 0;
+    }
+    return current->node_of_cpu[cpu];
+}
+
+/**
+ * @brief Node the calling thread runs on: the node of a pinned pool worker, or the node of the current CPU
+ */
+int numa_current_node(void){
+    const int worker_node = thread_pool_current_node();
+    if (worker_node >= 0){
+        return worker_node;
+    }
+    if (numa_topology()->number_of_nodes == 1){
+        return 0;
+    }
+    return numa_node_of_cpu(sched_getcpu());
+}
+
+/**
+ * @brief Restricts the calling thread to the CPUs of a node
+ * @return int 0 on success, -1 on error
+ */
+int numa_pin_thread_to_node(int node){
+    const NumaTopology* current = numa_topology();
+    if (node < 0 || node >= current->number_of_nodes){
+        fprintf(stderr, "Error in %s: node %d out of range.\n", __func__, node);
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < current->number_of_cpus; cpu++){
+        if (current->node_of_cpu[cpu] == node){
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0 || pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+        fprintf(stderr, "Error in %s: could not pin the thread to node %d.\n", __func__, node);
+        return -1;
+    }
+    return 0;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END TOPOLOGY -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* -+-+-+-+-+-+-+-+-+-+-+- REPLICAS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Bytes of the pointer tables of a replica (weight matrices, weight rows, bias vectors), padded to a cache line
+ */
+static size_t replica_pointer_bytes(const Model* model){
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    size_t number_of_rows = 0;
+    for (size_t i = 0; i + 1 < number_of_layers; i++){
+        number_of_rows += model->model_layers[i].number_of_nodes_in_the_layer;
+    }
+    const size_t bytes = (number_of_layers - 1) * sizeof(double**) + number_of_rows * sizeof(double*)
+                       + number_of_layers * sizeof(double*);
+    return (bytes + 63) / 64 * 64;
+}
+
+static size_t replica_value_bytes(const Model* model){
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    size_t number_of_values = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        number_of_values += nodes;
+        if (i + 1 < number_of_layers){
+            number_of_values += nodes * model->model_layers[i+1].number_of_nodes_in_the_layer;
+        }
+    }
+    return number_of_values * sizeof(double);
+}
+
+/**
+ * @brief Maps size bytes, with MAP_HUGETLB pages if asked and reserved, else advising transparent huge pages
+ * @return void* or NULL, *huge_pages and *mapped_bytes describe the mapping
+ */
+static void* map_slab(size_t bytes, int want_huge_pages, int* huge_pages, size_t* mapped_bytes){
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *huge_pages = 0;
+    if (want_huge_pages){
+        const size_t huge_bytes = (bytes + NUMA_HUGE_PAGE_SIZE - 1) / NUMA_HUGE_PAGE_SIZE * NUMA_HUGE_PAGE_SIZE;
+        void* slab = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED){
+            *huge_pages = 2;
+            *mapped_bytes = huge_bytes;
+            return slab;
+        }
+        TRACE_INFO(TRACE_CATEGORY_MEMORY, "MAP_HUGETLB unavailable (errno %d), falling back to transparent huge pages", errno);
+    }
+    *mapped_bytes = (bytes + page - 1) / page * page;
+    void* slab = mmap(NULL, *mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED){
+        fprintf(stderr, "Error in %s: mmap of %zu bytes failed.\n", __func__, *mapped_bytes);
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (want_huge_pages && madvise(slab, *mapped_bytes, MADV_HUGEPAGE) == 0){
+        *huge_pages = 1;
+    }
+#endif
+    return slab;
+}
+
+/**
+ * @brief Binds the pages of a slab to a node with the mbind system call
+ * @return int 1 if bound, 0 if the kernel refused (no NUMA support, no permission)
+ */
+static int bind_slab(void* slab, size_t bytes, int node){
+#ifdef SYS_mbind
+    const int node_id = numa_topology()->node_ids[node];
+    unsigned long mask[(4 * NUMA_MAX_NODES) / (8 * sizeof(unsigned long)) + 1] = { 0 };
+    mask[node_id / (8 * sizeof(unsigned long))] |= 1ul << (node_id % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, slab, bytes, NUMA_MPOL_BIND, mask, (unsigned long)(8 * sizeof(mask)), 0ul) == 0;
+#else
+    (void)slab; (void)bytes; (void)node;
+    return 0;
+#endif
+}
+
+/**
+ * @brief Builds the pointer tables of a replica and copies the model's weights and biases into its slab
+ */
+static void fill_replica(WeightReplica* replica, const Model* model){
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    char* cursor = replica->slab;
+    replica->weights = (double***)cursor;
+    cursor += (number_of_layers - 1) * sizeof(double**);
+    for (size_t i = 0; i + 1 < number_of_layers; i++){
+        replica->weights[i] = (double**)cursor;
+        cursor += model->model_layers[i].number_of_nodes_in_the_layer * sizeof(double*);
+    }
+    replica->biases = (double**)cursor;
+    double* values = (double*)((char*)replica->slab + replica_pointer_bytes(model));
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        replica->biases[i] = values;
+        memcpy(values, model->model_layers[i].biases, nodes * sizeof(double));
+        values += nodes;
+        if (i + 1 < number_of_layers){
+            const size_t next_nodes = model->model_layers[i+1].number_of_nodes_in_the_layer;
+            for (size_t r = 0; r < nodes; r++){
+                replica->weights[i][r] = values;
+                memcpy(values, model->model_weights[i][r], next_nodes * sizeof(double));
+                values += next_nodes;
+            }
+        }
+    }
+}
+
+typedef struct FillOnNode{
+    WeightReplica* replica;
+    const Model* model;
+} FillOnNode;
+
+static void* fill_on_node(void* argument){
+    FillOnNode* job = argument;
+    numa_pin_thread_to_node(job->replica->node);
+    fill_replica(job->replica, job->model);
+    return NULL;
+}
+
+/**
+ * @brief Copies the model into a replica already mapped: directly when the slab is bound (or on a single node),
+ * from a thread pinned to the replica's node otherwise, so that first-touch places the pages there
+ */
+static void place_replica(WeightReplica* replica, const Model* model){
+    if (replica->bound || numa_topology()->number_of_nodes == 1){
+        fill_replica(replica, model);
+        return;
+    }
+    FillOnNode job = { replica, model };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, fill_on_node, &job) != 0){
+        fill_replica(replica, model);
+        return;
+    }
+    pthread_join(thread, NULL);
+}
+
+/**
+ * @brief Creates the replicas of the weights of a model.
+ * With NUMA_REPLICATE_PER_NODE there is one replica per node of the machine; with NUMA_HUGE_PAGES the slabs are backed by huge pages.
+ * On a single node machine without NUMA_HUGE_PAGES this is a no-op: the single replica uses the model's own weights.
+ * The replicas are copies: after the weights of the model change, call refresh_model_replicas (with no reader running).
+ *
+ * @param model The model, must outlive the replicas
+ * @param flags NumaReplicaFlags
+ * @return ModelReplicas* or NULL on error
+ */
+ModelReplicas* create_model_replicas(Model* model, int flags){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0){
+        fprintf(stderr, "Error in %s: invalid model.\n", __func__);
+        return NULL;
+    }
+    ModelReplicas* replicas = calloc(1, sizeof(ModelReplicas));
+    if (replicas == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'replicas' is NULL.\n", __func__);
+        return NULL;
+    }
+    const NumaTopology* current = numa_topology();
+    replicas->model = model;
+    replicas->flags = flags;
+    replicas->number_of_replicas = (flags & NUMA_REPLICATE_PER_NODE) ? current->number_of_nodes : 1;
+
+    if (replicas->number_of_replicas == 1 && !(flags & NUMA_HUGE_PAGES)){
+        replicas->replicas[0].node = 0;
+        replicas->replicas[0].weights = model->model_weights;
+        replicas->replicas[0].biases = NULL;
+        TRACE_INFO(TRACE_CATEGORY_MODEL, "single node: replicas of model %p alias its weights", (void*)model);
+        return replicas;
+    }
+
+    const size_t bytes = replica_pointer_bytes(model) + replica_value_bytes(model);
+    for (int node = 0; node < replicas->number_of_replicas; node++){
+        WeightReplica* replica = &replicas->replicas[node];
+        replica->node = node;
+        replica->slab = map_slab(bytes, (flags & NUMA_HUGE_PAGES) != 0, &replica->huge_pages, &replica->slab_bytes);
+        if (replica->slab == NULL){
+            free_model_replicas(replicas);
+            return NULL;
+        }
+        replica->bound = (current->number_of_nodes > 1) ? bind_slab(replica->slab, replica->slab_bytes, node) : 0;
+        place_replica(replica, model);
+        TRACE_INFO(TRACE_CATEGORY_MEMORY, "replica for node %d: %zu bytes, huge pages: %d, bound: %d",
+                   current->node_ids[node], replica->slab_bytes, replica->huge_pages, replica->bound);
+    }
+    return replicas;
+}
+
+/**
+ * @brief Copies the current weights and biases of the model into every replica. Not safe while replicas are read
+ * (see snapshot_functions.h for updates concurrent with inference).
+ * @return ErrorCode
+ */
+ErrorCode refresh_model_replicas(ModelReplicas* replicas){
+    if (replicas == NULL || replicas->model == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    for (int node = 0; node < replicas->number_of_replicas; node++){
+        WeightReplica* replica = &replicas->replicas[node];
+        if (replica->slab == NULL){
+            replica->weights = replicas->model->model_weights;   // alias, nothing to copy
+            continue;
+        }
+        place_replica(replica, replicas->model);
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief The replica of the node the calling thread runs on
+ * @return const WeightReplica* or NULL if replicas is NULL
+ */
+const WeightReplica* local_model_replica(const ModelReplicas* replicas){
+    if (replicas == NULL){
+        return NULL;
+    }
+    int node = numa_current_node();
+    if (node < 0 || node >= replicas->number_of_replicas){
+        node = 0;
+    }
+    return &replicas->replicas[node];
+}
+
+/**
+ * @brief calculate_output reading the weights and biases of the caller's local replica
+ * @return Output, same as calculate_output
+ */
+Output numa_calculate_output(ModelReplicas* replicas, Prompt* prompt){
+    const WeightReplica* replica = local_model_replica(replicas);
+    if (replica == NULL){
+        fprintf(stderr, "Error in %s: 'replicas' is NULL.\n", __func__);
+        return empty_output();
+    }
+    return calculate_output_with_weights(prompt, replicas->model, replica->weights, replica->biases);
+}
+
+/**
+ * @brief Unmaps the slabs and frees the replicas, the model is untouched
+ */
+void free_model_replicas(ModelReplicas* replicas){
+    if (replicas == NULL){
+        return;
+    }
+    for (int node = 0; node < replicas->number_of_replicas; node++){
+        if (replicas->replicas[node].slab != NULL){
+            munmap(replicas->replicas[node].slab, replicas->replicas[node].slab_bytes);
+        }
+    }
+    free(replicas);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END REPLICAS -+-+-+-+-+-+-+-+-+-+-+- */
@@ -0,0 +1,88 @@
+#ifndef NUMA_FUNCTIONS_H
+#define NUMA_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+
+/**
+ * @brief NUMA-aware placement of the weights.
+ * The topology is read once from sysfs (/sys/devices/system/node), without libnuma. create_model_replicas copies the weights and biases
+ * of a model into one slab per NUMA node: the slab is mmap'd (optionally backed by huge pages), bound to its node with the mbind
+ * system call and, where mbind is not permitted, filled by a thread pinned to the node so first-touch places it there.
+ * A worker reads the replica of the node it runs on (thread pool workers know their node, other threads ask the kernel with sched_getcpu).
+ * On a single node machine without huge pages nothing is copied: the only replica points to the model's own weights.
+ */
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+#define NUMA_SYSFS_NODE_PATH "/sys/devices/system/node"
+#define NUMA_HUGE_PAGE_SIZE (2u << 20)
+
+/**
+ * @brief Options of create_model_replicas
+ */
+typedef enum NumaReplicaFlags{
+    NUMA_REPLICATE_PER_NODE = 1,    // one replica per node (a single one otherwise)
+    NUMA_HUGE_PAGES = 2,            // back the slabs with MAP_HUGETLB pages, or transparent huge pages when none are reserved
+} NumaReplicaFlags;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT NUMA TOPOLOGY -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief The NUMA nodes of the machine and their CPUs
+ *
+ * @param number_of_nodes(int): 1 when the machine (or the kernel) has no NUMA information
+ * @param node_ids(int[]): The id of every node, as named in sysfs
+ * @param number_of_cpus(int): Number of online CPUs listed
+ * @param node_of_cpu(int[]): Index (in node_ids) of the node of every CPU
+ */
+typedef struct NumaTopology{
+    int number_of_nodes;
+    int node_ids[NUMA_MAX_NODES];
+    int number_of_cpus;
+    int node_of_cpu[NUMA_MAX_CPUS];
+} NumaTopology;
+
+/**
+ * @brief The weights of a model placed on a node
+ *
+ * @param node(int): Index of the node in the topology
+ * @param slab(void*): The mmap'd memory holding pointers and values, NULL when the replica is the model's own weights
+ * @param slab_bytes(size_t): Size of the mapping
+ * @param huge_pages(int): 2 for MAP_HUGETLB, 1 for transparent huge pages advised, 0 for regular pages
+ * @param bound(int): != 0 if mbind placed the slab, 0 if it relies on first-touch
+ * @param weights(double***): Same shapes as model->model_weights
+ * @param biases(double**): One vector per layer
+ */
+typedef struct WeightReplica{
+    int node;
+    void* slab;
+    size_t slab_bytes;
+    int huge_pages;
+    int bound;
+    double*** weights;
+    double** biases;
+} WeightReplica;
+
+typedef struct ModelReplicas{
+    Model* model;
+    int flags;
+    int number_of_replicas;
+    WeightReplica replicas[NUMA_MAX_NODES];
+} ModelReplicas;
+
+//                                          FUNCTION PROTOTYPES
+const NumaTopology* numa_topology(void);
+int numa_node_of_cpu(int cpu);
+int numa_current_node(void);
+int numa_pin_thread_to_node(int node);
+ModelReplicas* create_model_replicas(Model* model, int flags);
+ErrorCode refresh_model_replicas(ModelReplicas* replicas);
+const WeightReplica* local_model_replica(const ModelReplicas* replicas);
+Output numa_calculate_output(ModelReplicas* replicas, Prompt* prompt);
+void free_model_replicas(ModelReplicas* replicas);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT NUMA TOPOLOGY -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // NUMA_FUNCTIONS_H
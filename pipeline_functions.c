@@ -0,0 +1,423 @@
+#define _GNU_SOURCE     // pthread_attr_setaffinity_np
+#include "settings.h"
+#include "pipeline_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define PIPELINE_SPINS_BEFORE_YIELD 64
+#define PIPELINE_YIELDS_BEFORE_SLEEP 64
+
+/* -+-+-+-+-+-+-+-+-+-+-+- SPSC QUEUE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Initializes an empty queue holding up to capacity pointers (rounded up to a power of two)
+ * @return ErrorCode
+ */
+ErrorCode spsc_init(SpscQueue* queue, size_t capacity){
+    if (queue == NULL || capacity == 0){
+        fprintf(stderr, "Error in %s: NULL queue or zero capacity.\n", __func__);
+        return ERROR_INVALID_PARAMETER;
+    }
+    size_t rounded = 1;
+    while (rounded < capacity){
+        rounded <<= 1;
+    }
+    queue->slots = malloc(rounded * sizeof(void*));
+    if (queue->slots == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'slots' is NULL.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    queue->capacity = rounded;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->event, 0);
+    atomic_init(&queue->sleepers, 0);
+    return NO_ERROR;
+}
+
+void spsc_destroy(SpscQueue* queue){
+    if (queue != NULL){
+        free(queue->slots);
+        queue->slots = NULL;
+    }
+}
+
+/**
+ * @brief Wakes the side of the queue sleeping in futex_wait, if any. The fence orders the head/tail store just made before the read of
+ * sleepers, it pairs with the one in wait_for: either the sleeper sees the new head/tail or this sees the sleeper
+ */
+static void wake_sleepers(SpscQueue* queue){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->sleepers, memory_order_relaxed) != 0){
+        atomic_fetch_add_explicit(&queue->event, 1, memory_order_release);
+        syscall(SYS_futex, &queue->event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief Appends an item, only called by the producer thread
+ * @return int 1 if pushed, 0 if the queue is full
+ */
+int spsc_push(SpscQueue* queue, void* item){
+    const size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == queue->capacity){
+        return 0;
+    }
+    queue->slots[tail & (queue->capacity - 1)] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    wake_sleepers(queue);
+    return 1;
+}
+
+/**
+ * @brief Removes the oldest item, only called by the consumer thread
+ * @return void* The item, NULL if the queue is empty
+ */
+void* spsc_pop(SpscQueue* queue){
+    const size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)){
+        return NULL;
+    }
+    void* item = queue->slots[head & (queue->capacity - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    wake_sleepers(queue);
+    return item;
+}
+
+/**
+ * @brief Busy waits a few rounds, then gives the CPU away a few times (the stages may share cores), then sleeps on the queue's futex
+ * until the other side pushes or pops, so an idle stage costs nothing
+ *
+ * @param try_once Pushes or pops, returns != 0 when it succeeded
+ */
+static void wait_for(SpscQueue* queue, int (*try_once)(SpscQueue*, void**), void** item){
+    for (unsigned spins = 0; !try_once(queue, item); spins++){
+        if (spins < PIPELINE_SPINS_BEFORE_YIELD){
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #endif
+        } else if (spins < PIPELINE_SPINS_BEFORE_YIELD + PIPELINE_YIELDS_BEFORE_SLEEP){
+            sched_yield();
+        } else {
+            const uint32_t event = atomic_load_explicit(&queue->event, memory_order_acquire);
+            atomic_fetch_add_explicit(&queue->sleepers, 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!try_once(queue, item)){
+                // returns at once if a push or pop bumped event since it was read
+                syscall(SYS_futex, &queue->event, FUTEX_WAIT_PRIVATE, event, NULL, NULL, 0);
+                atomic_fetch_sub_explicit(&queue->sleepers, 1, memory_order_relaxed);
+                continue;
+            }
+            atomic_fetch_sub_explicit(&queue->sleepers, 1, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+static int try_push(SpscQueue* queue, void** item){
+    return spsc_push(queue, *item);
+}
+
+static int try_pop(SpscQueue* queue, void** item){
+    return (*item = spsc_pop(queue)) != NULL;
+}
+
+static void push_waiting(SpscQueue* queue, void* item){
+    wait_for(queue, try_push, &item);
+}
+
+static void* pop_waiting(SpscQueue* queue){
+    void* item = NULL;
+    wait_for(queue, try_pop, &item);
+    return item;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END SPSC QUEUE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* -+-+-+-+-+-+-+-+-+-+-+- PARTITIONING -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Estimated floating point operations of a layer per request: a multiply-add per weight, a bias add and an activation per node
+ */
+double layer_flops(const Model* model, size_t layer){
+    const double nodes = (double)model->model_layers[layer].number_of_nodes_in_the_layer;
+    const double inputs = (layer == 0) ? 0.0 : (double)model->model_layers[layer - 1].number_of_nodes_in_the_layer;
+    return 2.0 * inputs * nodes + 2.0 * nodes;
+}
+
+/**
+ * @brief Splits the layers into contiguous stages minimizing the FLOPs of the most expensive stage (dynamic programming)
+ *
+ * @param model The model
+ * @param number_of_stages Wanted number of stages, reduced to the number of layers if bigger
+ * @param first_layers Filled with the first layer of every stage, followed by the number of layers (number_of_stages + 1 entries)
+ * @return size_t The number of stages used, 0 on error
+ */
+size_t partition_layers_by_flops(const Model* model, size_t number_of_stages, size_t* first_layers){
+    if (model == NULL || first_layers == NULL || number_of_stages == 0 || model->number_of_layers_in_the_model == 0){
+        fprintf(stderr, "Error in %s: invalid parameters.\n", __func__);
+        return 0;
+    }
+    const size_t L = model->number_of_layers_in_the_model;
+    const size_t S = (number_of_stages < L) ? number_of_stages : L;
+    double* prefix = malloc((L + 1) * sizeof(double));
+    double* cost = malloc((S + 1) * (L + 1) * sizeof(double));    // cost[s][j]: best max stage FLOPs of the first j layers in s stages
+    size_t* cut = malloc((S + 1) * (L + 1) * sizeof(size_t));     // start of the last stage for cost[s][j]
+    if (prefix == NULL || cost == NULL || cut == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error.\n", __func__);
+        free(prefix);
+        free(cost);
+        free(cut);
+        return 0;
+    }
+    prefix[0] = 0.0;
+    for (size_t i = 0; i < L; i++){
+        prefix[i + 1] = prefix[i] + layer_flops(model, i);
+    }
+    for (size_t j = 0; j <= L; j++){
+        cost[j] = (j == 0) ? 0.0 : -1.0;    // -1: impossible
+    }
+    for (size_t s = 1; s <= S; s++){
+        for (size_t j = 0; j <= L; j++){
+            double best = -1.0;
+            size_t best_cut = 0;
+            for (size_t k = s - 1; k < j; k++){
+                const double previous = cost[(s - 1) * (L + 1) + k];
+                if (previous < 0.0){
+                    continue;
+                }
+                const double stage = prefix[j] - prefix[k];
+                const double candidate = (stage > previous) ? stage : previous;
+                if (best < 0.0 || candidate < best){
+                    best = candidate;
+                    best_cut = k;
+                }
+            }
+            cost[s * (L + 1) + j] = best;
+            cut[s * (L + 1) + j] = best_cut;
+        }
+    }
+    first_layers[S] = L;
+    size_t j = L;
+    for (size_t s = S; s > 0; s--){
+        j = cut[s * (L + 1) + j];
+        first_layers[s - 1] = j;
+    }
+    free(prefix);
+    free(cost);
+    free(cut);
+    return S;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END PARTITIONING -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* -+-+-+-+-+-+-+-+-+-+-+- PIPELINE -+-+-+-+-+-+-+-+-+-+-+- */
+
+static PipelineItem stop_marker;    // flows through the stages to stop them
+
+static void* stage_main(void* argument){
+    PipelineStage* stage = argument;
+    Pipeline* pipeline = stage->pipeline;
+    SpscQueue* input = &pipeline->queues[stage->index];
+    SpscQueue* output = &pipeline->queues[stage->index + 1];
+    for (;;){
+        PipelineItem* item = pop_waiting(input);
+        if (item != &stop_marker){
+            calculate_output_layers(&item->output, pipeline->model, pipeline->model->model_weights, NULL, stage->first_layer, stage->end_layer);
+        }
+        push_waiting(output, item);
+        if (item == &stop_marker){
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Starts a pipeline of number_of_stages threads over the layers of the model, balanced by FLOPs
+ *
+ * @param model The model, its weights must not change while the pipeline runs
+ * @param number_of_stages Number of stages, reduced to the number of layers if bigger (at most PIPELINE_MAX_STAGES)
+ * @param queue_capacity Capacity of the queue in front of every stage, 0 for PIPELINE_DEFAULT_QUEUE_CAPACITY
+ * @return Pipeline* or NULL on error
+ */
+Pipeline* create_pipeline(Model* model, size_t number_of_stages, size_t queue_capacity){
+    if (model == NULL || model->model_layers == NULL || number_of_stages == 0 || number_of_stages > PIPELINE_MAX_STAGES){
+        fprintf(stderr, "Error in %s: invalid model or number of stages (%zu).\n", __func__, number_of_stages);
+        return NULL;
+    }
+    Pipeline* pipeline = calloc(1, sizeof(Pipeline));
+    if (pipeline == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'pipeline' is NULL.\n", __func__);
+        return NULL;
+    }
+    size_t first_layers[PIPELINE_MAX_STAGES + 1];
+    pipeline->model = model;
+    pipeline->number_of_stages = partition_layers_by_flops(model, number_of_stages, first_layers);
+    if (pipeline->number_of_stages == 0){
+        free(pipeline);
+        return NULL;
+    }
+    const size_t capacity = (queue_capacity == 0) ? PIPELINE_DEFAULT_QUEUE_CAPACITY : queue_capacity;
+    for (size_t q = 0; q <= pipeline->number_of_stages; q++){
+        if (spsc_init(&pipeline->queues[q], capacity) != NO_ERROR){
+            for (size_t k = 0; k < q; k++){
+                spsc_destroy(&pipeline->queues[k]);
+            }
+            free(pipeline);
+            return NULL;
+        }
+    }
+
+    // One CPU per stage when this thread may use enough of them (taskset, container cpuset), otherwise the scheduler places the stages
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const int pin = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+                    && (size_t)CPU_COUNT(&allowed) >= pipeline->number_of_stages && pipeline->number_of_stages > 1;
+    int next_cpu = 0;
+    for (size_t s = 0; s < pipeline->number_of_stages; s++){
+        PipelineStage* stage = &pipeline->stages[s];
+        stage->pipeline = pipeline;
+        stage->index = s;
+        stage->first_layer = first_layers[s];
+        stage->end_layer = first_layers[s + 1];
+        stage->flops = 0.0;
+        for (size_t i = stage->first_layer; i < stage->end_layer; i++){
+            stage->flops += layer_flops(model, i);
+        }
+        stage->cpu = -1;
+        while (pin && next_cpu < CPU_SETSIZE && stage->cpu < 0){
+            if (CPU_ISSET(next_cpu, &allowed)){
+                stage->cpu = next_cpu;
+            }
+            next_cpu++;
+        }
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        if (stage->cpu >= 0){
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(stage->cpu, &set);
+            pthread_attr_setaffinity_np(&attributes, sizeof(set), &set);
+        }
+        int error = pthread_create(&stage->thread, &attributes, stage_main, stage);
+        pthread_attr_destroy(&attributes);
+        if (error != 0 && stage->cpu >= 0){
+            TRACE_WARNING(TRACE_CATEGORY_MODEL, "pipeline stage %zu could not be pinned to CPU %d, it runs unpinned", s, stage->cpu);
+            stage->cpu = -1;
+            error = pthread_create(&stage->thread, NULL, stage_main, stage);
+        }
+        if (error != 0){
+            fprintf(stderr, "Error in %s: pthread_create failed for stage %zu.\n", __func__, s);
+            pipeline->number_of_stages = s;     // free_pipeline stops the stages started so far
+            free_pipeline(pipeline);
+            return NULL;
+        }
+        TRACE_INFO(TRACE_CATEGORY_MODEL, "pipeline stage %zu: layers [%zu, %zu), %.0lf FLOPs, cpu %d",
+                   s, stage->first_layer, stage->end_layer, stage->flops, stage->cpu);
+    }
+    return pipeline;
+}
+
+/**
+ * @brief Sends a prompt into the pipeline, waiting while the first queue is full. Only one thread may submit.
+ * The buffers of the request come from the submitting thread's current allocator.
+ *
+ * @param tag Anything, returned with the result
+ * @return ErrorCode
+ */
+ErrorCode pipeline_submit(Pipeline* pipeline, Prompt* prompt, void* tag){
+    if (pipeline == NULL){
+        fprintf(stderr, "Error in %s: 'pipeline' is NULL.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    PipelineItem* item = malloc(sizeof(PipelineItem));
+    if (item == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'item' is NULL.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    item->output = create_output(prompt, pipeline->model);
+    if (item->output.is_valid != 1){
+        free(item);
+        return ERROR_INVALID_PARAMETER;
+    }
+    item->tag = tag;
+    push_waiting(&pipeline->queues[0], item);
+    return NO_ERROR;
+}
+
+static void deliver(PipelineItem* item, Output* result, void** tag){
+    *result = item->output;
+    if (tag != NULL){
+        *tag = item->tag;
+    }
+    free(item);
+}
+
+/**
+ * @brief Waits for the oldest request still in the pipeline. Only one thread may receive.
+ * With a single thread submitting and receiving, receive before more than (stages + 1) * capacity requests are in flight.
+ *
+ * @param result The Output of the request (free it with free_output)
+ * @param tag If not NULL, the tag given to pipeline_submit
+ * @return ErrorCode
+ */
+ErrorCode pipeline_receive(Pipeline* pipeline, Output* result, void** tag){
+    if (pipeline == NULL || result == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    deliver(pop_waiting(&pipeline->queues[pipeline->number_of_stages]), result, tag);
+    return NO_ERROR;
+}
+
+/**
+ * @brief pipeline_receive without waiting
+ * @return int 1 if a result was received, 0 if none is ready
+ */
+int pipeline_try_receive(Pipeline* pipeline, Output* result, void** tag){
+    if (pipeline == NULL || result == NULL){
+        return 0;
+    }
+    PipelineItem* item = spsc_pop(&pipeline->queues[pipeline->number_of_stages]);
+    if (item == NULL){
+        return 0;
+    }
+    deliver(item, result, tag);
+    return 1;
+}
+
+/**
+ * @brief Stops the stages once the requests in flight went through, frees the results nobody received and the pipeline
+ */
+void free_pipeline(Pipeline* pipeline){
+    if (pipeline == NULL){
+        return;
+    }
+    if (pipeline->number_of_stages > 0){
+        push_waiting(&pipeline->queues[0], &stop_marker);
+        for (;;){
+            PipelineItem* item = pop_waiting(&pipeline->queues[pipeline->number_of_stages]);
+            if (item == &stop_marker){
+                break;
+            }
+            free_output(&item->output);
+            free(item);
+        }
+        for (size_t s = 0; s < pipeline->number_of_stages; s++){
+            pthread_join(pipeline->stages[s].thread, NULL);
+        }
+    }
+    for (size_t q = 0; q <= PIPELINE_MAX_STAGES; q++){
+        spsc_destroy(&pipeline->queues[q]);    // the queues never initialized have NULL slots
+    }
+    free(pipeline);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- END PIPELINE -+-+-+-+-+-+-+-+-+-+-+- */
@@ -0,0 +1,88 @@
+#ifndef PIPELINE_FUNCTIONS_H
+#define PIPELINE_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "node_functions.h"
+
+/**
+ * @brief Layer pipelined streaming inference.
+ * The layers of a model are split into contiguous stages with about the same number of floating point operations
+ * (partition_layers_by_flops), and every stage runs on its own thread, pinned to its own CPU when the process may use enough of them,
+ * so the weights of a stage stay in that core's cache. A request travels as an Output from stage to stage through bounded
+ * single producer / single consumer lock free queues: stage s fills layers [first_layer[s], first_layer[s+1]) and hands it over.
+ * One thread submits (pipeline_submit) and one thread receives (pipeline_receive), the results come out in submission order.
+ */
+
+#define PIPELINE_MAX_STAGES 64
+#define PIPELINE_DEFAULT_QUEUE_CAPACITY 64
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT PIPELINE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Bounded lock free single producer / single consumer ring of pointers.
+ * head is only written by the consumer and tail only by the producer, each on its own cache line.
+ * A side that found the queue empty (full) for a while sleeps on the event futex, the other side's next pop (push) wakes it.
+ */
+typedef struct SpscQueue{
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) size_t capacity;   // a power of two
+    void** slots;
+    _Atomic uint32_t event;         // futex word, bumped when a sleeper has to be woken
+    _Atomic uint32_t sleepers;      // threads sleeping (or about to) on event
+} SpscQueue;
+
+/**
+ * @brief A request in flight
+ */
+typedef struct PipelineItem{
+    Output output;
+    void* tag;          // given to pipeline_submit, returned by pipeline_receive
+} PipelineItem;
+
+typedef struct PipelineStage{
+    struct Pipeline* pipeline;
+    size_t index;
+    size_t first_layer;
+    size_t end_layer;
+    double flops;       // estimated floating point operations of the stage per request
+    int cpu;            // CPU the stage is pinned to, -1 if not pinned
+    pthread_t thread;
+} PipelineStage;
+
+/**
+ * @brief The pipeline
+ *
+ * @param model(Model*): The model, its weights must not change while the pipeline runs
+ * @param number_of_stages(size_t): Number of stage threads
+ * @param stages(PipelineStage[]): Layer range and thread of every stage
+ * @param queues(SpscQueue[]): queues[s] feeds stage s, queues[number_of_stages] holds the results
+ */
+typedef struct Pipeline{
+    Model* model;
+    size_t number_of_stages;
+    PipelineStage stages[PIPELINE_MAX_STAGES];
+    SpscQueue queues[PIPELINE_MAX_STAGES + 1];
+} Pipeline;
+
+//                                          FUNCTION PROTOTYPES
+ErrorCode spsc_init(SpscQueue* queue, size_t capacity);
+void spsc_destroy(SpscQueue* queue);
+int spsc_push(SpscQueue* queue, void* item);
+void* spsc_pop(SpscQueue* queue);
+
+double layer_flops(const Model* model, size_t layer);
+size_t partition_layers_by_flops(const Model* model, size_t number_of_stages, size_t* first_layers);
+Pipeline* create_pipeline(Model* model, size_t number_of_stages, size_t queue_capacity);
+ErrorCode pipeline_submit(Pipeline* pipeline, Prompt* prompt, void* tag);
+ErrorCode pipeline_receive(Pipeline* pipeline, Output* result, void** tag);
+int pipeline_try_receive(Pipeline* pipeline, Output* result, void** tag);
+void free_pipeline(Pipeline* pipeline);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT PIPELINE -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // PIPELINE_FUNCTIONS_H
@@ -0,0 +1,165 @@
+#include "settings.h"
+#include "plan_functions.h"
+#include "kernel_functions.h"
+#include "allocator_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLAN_ALIGNED_DOUBLES(n) (((n) + PLAN_ALIGNMENT / sizeof(double) - 1) / (PLAN_ALIGNMENT / sizeof(double)) * (PLAN_ALIGNMENT / sizeof(double)))
+
+/**
+ * @brief Checks everything the executor relies on, once
+ * @return int 1 if the model can be planned
+ */
+static int check_model_for_plan(const Model* model){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0){
+        fprintf(stderr, "Error in %s: NULL model, NULL layers or no layer.\n", __func__);
+        return 0;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    if (number_of_layers > 1 && model->model_weights == NULL){
+        fprintf(stderr, "Error in %s: 'model_weights' is NULL.\n", __func__);
+        return 0;
+    }
+    for (size_t i = 0; i < number_of_layers; i++){
+        const Layer* layer = &model->model_layers[i];
+        if (layer->number_of_nodes_in_the_layer == 0 || layer->biases == NULL){
+            fprintf(stderr, "Error in %s: layer %zu has no node or NULL biases.\n", __func__, i);
+            return 0;
+        }
+        if (layer->activation_kind == ACTIVATION_CUSTOM && layer->activation == NULL){
+            fprintf(stderr, "Error in %s: layer %zu has a custom activation but no function.\n", __func__, i);
+            return 0;
+        }
+        if (i == 0){
+            continue;
+        }
+        double** weights = model->model_weights[i-1];
+        if (weights == NULL){
+            fprintf(stderr, "Error in %s: weight matrix %zu is NULL.\n", __func__, i - 1);
+            return 0;
+        }
+        for (size_t r = 0; r < model->model_layers[i-1].number_of_nodes_in_the_layer; r++){
+            if (weights[r] == NULL){
+                fprintf(stderr, "Error in %s: row %zu of weight matrix %zu is NULL.\n", __func__, r, i - 1);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Validates the model and resolves its forward pass into a flat plan: widths, kernels, activations, weights, biases and the
+ * arena layout (the pre-activation and the output vector of every layer, each aligned to PLAN_ALIGNMENT)
+ *
+ * @param model(Model*): The model, it must outlive the plan
+ * @return ExecutionPlan* The plan (free it with free_plan), NULL if the model is not valid or out of memory
+ */
+ExecutionPlan* compile_plan(Model* model){
+    if (!check_model_for_plan(model)){
+        return NULL;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    ExecutionPlan* plan = malloc(sizeof(ExecutionPlan) + number_of_layers * sizeof(PlanStep));
+    if (plan == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return NULL;
+    }
+    plan->model = model;
+    plan->number_of_steps = number_of_layers;
+    plan->input_length = model->model_layers[0].number_of_nodes_in_the_layer;
+    plan->output_length = model->model_layers[number_of_layers - 1].number_of_nodes_in_the_layer;
+
+    size_t offset = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        PlanStep* step = &plan->steps[i];
+        step->layer = model->model_layers[i];
+        step->number_of_nodes = step->layer.number_of_nodes_in_the_layer;
+        step->number_of_inputs = (i == 0) ? 0 : model->model_layers[i-1].number_of_nodes_in_the_layer;
+        step->weights = (i == 0) ? NULL : model->model_weights[i-1];
+        step->input_offset = (i == 0) ? 0 : plan->steps[i-1].output_offset;
+        if (i > 0 && step->layer.kernel == NULL){
+            step->layer.kernel = select_layer_kernel(step->number_of_inputs, step->number_of_nodes);
+        }
+        step->pre_activation_offset = offset;
+        offset += PLAN_ALIGNED_DOUBLES(step->number_of_nodes);
+        step->output_offset = offset;
+        offset += PLAN_ALIGNED_DOUBLES(step->number_of_nodes);
+    }
+    plan->arena_doubles = offset;
+    plan->output_offset = plan->steps[number_of_layers - 1].output_offset;
+    TRACE_DEBUG(TRACE_CATEGORY_MODEL, "compiled a plan of %zu steps for model '%s', arena of %zu doubles", number_of_layers, model->model_name, offset);
+    return plan;
+}
+
+/**
+ * @brief Allocates an arena for plan_execute from the thread's current allocator, a thread reuses it for every call
+ * @return double* The arena, NULL if out of memory
+ */
+double* plan_create_arena(const ExecutionPlan* plan){
+    if (plan == NULL){
+        fprintf(stderr, "Error in %s: 'plan' is NULL.\n", __func__);
+        return NULL;
+    }
+    return allocator_allocate(NULL, plan->arena_doubles * sizeof(double), PLAN_ALIGNMENT, ALLOCATOR_SUBSYSTEM_OUTPUT);
+}
+
+void plan_free_arena(double* arena){
+    allocator_release(NULL, arena, ALLOCATOR_SUBSYSTEM_OUTPUT);
+}
+
+/**
+ * @brief The hot path: runs the forward pass of the plan in the arena, nothing is checked
+ *
+ * @param plan(const ExecutionPlan*): A plan from compile_plan
+ * @param input(const double*): plan->input_length values
+ * @param arena(double*): plan->arena_doubles values (plan_create_arena), afterwards it holds every layer's pre-activation and output
+ * @return const double* The plan->output_length outputs of the model, inside the arena
+ */
+const double* plan_execute(const ExecutionPlan* plan, const double* input, double* arena){
+    const PlanStep* step = plan->steps;
+    memcpy(arena + step->pre_activation_offset, input, step->number_of_nodes * sizeof(double));
+    layer_activation_forward(input, &step->layer, arena + step->output_offset);
+    const PlanStep* const end = plan->steps + plan->number_of_steps;
+    for (step++; step < end; step++){
+        step->layer.kernel(arena + step->input_offset, step->number_of_inputs, step->weights, &step->layer,
+            arena + step->pre_activation_offset, arena + step->output_offset);
+    }
+    return arena + plan->output_offset;
+}
+
+/**
+ * @brief Same result as calculate_output, computed from the plan: only the prompt length is checked
+ *
+ * @param plan(const ExecutionPlan*): A plan from compile_plan
+ * @param prompt(Prompt*): The input, plan->input_length values
+ * @return Output, owned by the caller (free_output), is_valid != 1 if the prompt does not fit or out of memory
+ */
+Output plan_calculate_output(const ExecutionPlan* plan, Prompt* prompt){
+    if (plan == NULL || prompt == NULL || prompt->data == NULL || prompt->length != plan->input_length){
+        fprintf(stderr, "Error in %s: NULL plan or prompt, or prompt size different from %zu.\n", __func__, plan ? plan->input_length : 0);
+        return empty_output();
+    }
+    // the plan has the layer widths of its model, create_output allocates the same buffers as calculate_output
+    const size_t number_of_layers = plan->number_of_steps;
+    Output output = create_output(prompt, (Model*)plan->model);
+    if (output.is_valid != 1){
+        return empty_output();
+    }
+
+    const PlanStep* step = plan->steps;
+    layer_activation_forward(output.layer_inputs[0], &step->layer, output.layer_outputs[0]);
+    for (size_t i = 1; i < number_of_layers; i++){
+        step = &plan->steps[i];
+        step->layer.kernel(output.layer_outputs[i-1], step->number_of_inputs, step->weights, &step->layer,
+            output.layer_inputs[i], output.layer_outputs[i]);
+    }
+    return output;
+}
+
+void free_plan(ExecutionPlan* plan){
+    free(plan);
+}
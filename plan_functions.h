@@ -0,0 +1,73 @@
+#ifndef PLAN_FUNCTIONS_H
+#define PLAN_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+
+/**
+ * @brief Validated, immutable execution plans.
+ * compile_plan checks a model once (layers, biases, weight rows, activations, prompt width) and resolves everything calculate_output
+ * looks up on every call: the layer widths, the kernel of every layer, the activation, the weight and bias pointers and the size and
+ * layout of the buffers. The executor then runs from the flat plan alone, with no checks, no trace and no metrics in its loop.
+ *
+ * The plan points to the model's weights and biases, so values updated in place (training, model_weights_changed) are seen.
+ * It must be compiled again if the layers, the weight matrices or the kernels of the model are replaced, and freed before the model.
+ * Compiled code attached to the model (compiler_functions.h) is not used by plans.
+ */
+
+#define PLAN_ALIGNMENT 64       // bytes, every buffer of the arena starts on a cache line
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT EXECUTION PLAN -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief One layer of the plan
+ *
+ * @param number_of_inputs(size_t): Width of the previous layer (0 for the input layer)
+ * @param number_of_nodes(size_t): Width of the layer
+ * @param input_offset(size_t): In the arena, the outputs of the previous layer this layer reads
+ * @param pre_activation_offset, output_offset(size_t): In the arena, where the layer writes (layer_inputs / layer_outputs of an Output)
+ * @param weights(double* const*): The incoming weight matrix, NULL for the input layer
+ * @param layer(Layer): Copy of the layer descriptor given to the kernel, its kernel field is resolved
+ */
+typedef struct PlanStep{
+    size_t number_of_inputs;
+    size_t number_of_nodes;
+    size_t input_offset;
+    size_t pre_activation_offset;
+    size_t output_offset;
+    double* const* weights;
+    Layer layer;
+} PlanStep;
+
+/**
+ * @brief The plan of a model
+ *
+ * @param model(const Model*): The model it was compiled from
+ * @param input_length, output_length(size_t): Width of the first and of the last layer
+ * @param arena_doubles(size_t): Size of the arena plan_execute works in, 2 aligned vectors per layer
+ * @param output_offset(size_t): In the arena, the outputs of the last layer
+ * @param number_of_steps(size_t): One per layer
+ * @param steps(PlanStep[]): The layers in execution order
+ */
+typedef struct ExecutionPlan{
+    const Model* model;
+    size_t input_length;
+    size_t output_length;
+    size_t arena_doubles;
+    size_t output_offset;
+    size_t number_of_steps;
+    PlanStep steps[];
+} ExecutionPlan;
+
+//                                          FUNCTION PROTOTYPES
+ExecutionPlan* compile_plan(Model* model);
+double* plan_create_arena(const ExecutionPlan* plan);
+void plan_free_arena(double* arena);
+const double* plan_execute(const ExecutionPlan* plan, const double* input, double* arena);
+Output plan_calculate_output(const ExecutionPlan* plan, Prompt* prompt);
+void free_plan(ExecutionPlan* plan);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT EXECUTION PLAN -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // PLAN_FUNCTIONS_H
@@ -0,0 +1,503 @@
+#include "settings.h"
+#include "registry_functions.h"
+#include "kernel_functions.h"
+#include "metrics_functions.h"
+#include "allocator_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REGISTRY_ALIGNED(bytes) (((bytes) + REGISTRY_DATA_ALIGNMENT - 1) / REGISTRY_DATA_ALIGNMENT * REGISTRY_DATA_ALIGNMENT)
+#define REGISTRY_ATTACH_ATTEMPTS 100
+
+/**
+ * @brief Layout of the data of a version: the layer widths (uint64_t) and activation kinds (uint32_t), then the biases of every
+ * layer and the weight matrices (rows of doubles back to back), each starting on REGISTRY_DATA_ALIGNMENT
+ *
+ * @param bias_offsets, weight_offsets(size_t*): Filled with the offsets if not NULL
+ * @return size_t The bytes of the data
+ */
+static size_t registry_layout(size_t number_of_layers, const uint64_t* widths, size_t* bias_offsets, size_t* weight_offsets){
+    size_t offset = REGISTRY_ALIGNED(number_of_layers * (sizeof(uint64_t) + sizeof(uint32_t)));
+    for (size_t i = 0; i < number_of_layers; i++){
+        if (bias_offsets != NULL){
+            bias_offsets[i] = offset;
+        }
+        offset += REGISTRY_ALIGNED(widths[i] * sizeof(double));
+    }
+    for (size_t i = 0; i + 1 < number_of_layers; i++){
+        if (weight_offsets != NULL){
+            weight_offsets[i] = offset;
+        }
+        offset += REGISTRY_ALIGNED(widths[i] * widths[i+1] * sizeof(double));
+    }
+    return offset;
+}
+
+static int segment_name(char* buffer, size_t size, const char* name, uint64_t version){
+    const int length = version ? snprintf(buffer, size, "/%s.v%llu", name, (unsigned long long)version) : snprintf(buffer, size, "/%s", name);
+    return length > 0 && (size_t)length < size;
+}
+
+static int valid_name(const char* name){
+    return name != NULL && name[0] != '\0' && strchr(name, '/') == NULL && strlen(name) + 32 < REGISTRY_NAME_LENGTH;
+}
+
+/**
+ * @brief Maps the control segment of a registry, creating it if create != 0 (a new segment is all zeros: no version published)
+ * @return RegistryControl* NULL if it does not exist or cannot be mapped
+ */
+static RegistryControl* open_control(const char* name, int create){
+    char path[REGISTRY_NAME_LENGTH];
+    if (!segment_name(path, sizeof(path), name, 0)){
+        return NULL;
+    }
+    const int fd = shm_open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+    if (fd < 0){
+        return NULL;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || ((size_t)status.st_size < sizeof(RegistryControl) && (!create || ftruncate(fd, sizeof(RegistryControl)) != 0))){
+        close(fd);
+        return NULL;
+    }
+    RegistryControl* control = mmap(NULL, sizeof(RegistryControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (control == MAP_FAILED){
+        return NULL;
+    }
+    if (create){
+        __atomic_store_n(&control->magic, REGISTRY_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) != REGISTRY_MAGIC){
+        munmap(control, sizeof(RegistryControl));
+        return NULL;
+    }
+    return control;
+}
+
+/**
+ * @brief Drops a reference of a mapped version, the last one unlinks the segment
+ */
+static void release_version(RegistryVersionHeader* header, const char* name){
+    if (atomic_fetch_sub(&header->references, 1) == 1){
+        char path[REGISTRY_NAME_LENGTH];
+        if (segment_name(path, sizeof(path), name, header->version)){
+            shm_unlink(path);
+        }
+        TRACE_DEBUG(TRACE_CATEGORY_MODEL, "registry '%s': version %llu released by its last reader", name, (unsigned long long)header->version);
+    }
+}
+
+/**
+ * @brief Drops the reference the registry held on a version that stopped being current
+ */
+static void release_replaced_version(const char* name, uint64_t version){
+    char path[REGISTRY_NAME_LENGTH];
+    if (!segment_name(path, sizeof(path), name, version)){
+        return;
+    }
+    const int fd = shm_open(path, O_RDWR, 0600);
+    if (fd < 0){
+        return;
+    }
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    RegistryVersionHeader* header = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED){
+        return;
+    }
+    release_version(header, name);
+    munmap(header, page);
+}
+
+/**
+ * @brief Copies the parameters of a model into a new version of the registry (created if needed) and makes it the current one
+ *
+ * @param name(const char*): The registry, a shared memory name without '/'
+ * @param model(const Model*): The model, only sigmoid and threshold activations
+ * @return uint64_t The version published, 0 on failure
+ */
+uint64_t registry_publish(const char* name, const Model* model){
+    if (!valid_name(name) || model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0
+        || (model->number_of_layers_in_the_model > 1 && model->model_weights == NULL)){
+        fprintf(stderr, "Error in %s: invalid name, NULL model or NULL weights.\n", __func__);
+        return 0;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    for (size_t i = 0; i < number_of_layers; i++){
+        if (model->model_layers[i].activation_kind == ACTIVATION_CUSTOM){
+            fprintf(stderr, "Error in %s: layer %zu has a custom activation, it cannot be shared with other processes.\n", __func__, i);
+            return 0;
+        }
+    }
+    uint64_t* widths = malloc(number_of_layers * sizeof(uint64_t));
+    size_t* offsets = malloc(2 * number_of_layers * sizeof(size_t));
+    RegistryControl* control = (widths && offsets) ? open_control(name, 1) : NULL;
+    if (control == NULL){
+        fprintf(stderr, "Error in %s: out of memory or cannot open the control segment of '%s'.\n", __func__, name);
+        free(widths);
+        free(offsets);
+        return 0;
+    }
+    for (size_t i = 0; i < number_of_layers; i++){
+        widths[i] = model->model_layers[i].number_of_nodes_in_the_layer;
+    }
+    size_t* bias_offsets = offsets;
+    size_t* weight_offsets = offsets + number_of_layers;
+    const size_t data_bytes = registry_layout(number_of_layers, widths, bias_offsets, weight_offsets);
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const uint64_t version = atomic_fetch_add(&control->next_version, 1) + 1;
+
+    char path[REGISTRY_NAME_LENGTH];
+    segment_name(path, sizeof(path), name, version);
+    const int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    void* header_page = MAP_FAILED;
+    void* data = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, (off_t)(page + data_bytes)) == 0){
+        header_page = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        data = mmap(NULL, data_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)page);
+    }
+    if (fd >= 0){
+        close(fd);
+    }
+    if (header_page == MAP_FAILED || data == MAP_FAILED){
+        fprintf(stderr, "Error in %s: cannot create the segment '%s' of %zu bytes.\n", __func__, path, page + data_bytes);
+        if (header_page != MAP_FAILED){
+            munmap(header_page, page);
+        }
+        if (data != MAP_FAILED){
+            munmap(data, data_bytes);
+        }
+        shm_unlink(path);
+        munmap(control, sizeof(RegistryControl));
+        free(widths);
+        free(offsets);
+        return 0;
+    }
+
+    unsigned char* bytes = data;
+    memcpy(bytes, widths, number_of_layers * sizeof(uint64_t));
+    uint32_t* kinds = (uint32_t*)(bytes + number_of_layers * sizeof(uint64_t));
+    for (size_t i = 0; i < number_of_layers; i++){
+        const Layer* layer = &model->model_layers[i];
+        kinds[i] = (uint32_t)layer->activation_kind;
+        memcpy(bytes + bias_offsets[i], layer->biases, widths[i] * sizeof(double));
+        if (i + 1 < number_of_layers){
+            double* matrix = (double*)(bytes + weight_offsets[i]);
+            for (size_t r = 0; r < widths[i]; r++){
+                memcpy(matrix + r * widths[i+1], model->model_weights[i][r], widths[i+1] * sizeof(double));
+            }
+        }
+    }
+    munmap(data, data_bytes);
+    RegistryVersionHeader* header = header_page;
+    header->magic = REGISTRY_MAGIC;
+    header->version = version;
+    header->number_of_layers = number_of_layers;
+    header->data_bytes = data_bytes;
+    atomic_store(&header->references, 1);      // the registry's, dropped when the version is replaced
+
+    // the swap: from here new attachments get this version, the previous one loses the registry's reference.
+    // Only a higher version is installed: if a concurrent publish with a later number got there first, this one is dropped at once
+    uint64_t previous = atomic_load(&control->current_version);
+    while (previous < version && !atomic_compare_exchange_weak(&control->current_version, &previous, version)){
+    }
+    if (previous > version){
+        release_version(header, name);
+    } else if (previous != 0){
+        release_replaced_version(name, previous);
+    }
+    munmap(header_page, page);
+    munmap(control, sizeof(RegistryControl));
+    free(widths);
+    free(offsets);
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "registry '%s': published version %llu of model '%s' (%zu bytes)", name, (unsigned long long)version,
+               model->model_name, data_bytes);
+    return version;
+}
+
+/**
+ * @brief The current version of a registry
+ * @return uint64_t 0 if the registry does not exist or has nothing published
+ */
+uint64_t registry_current_version(const char* name){
+    RegistryControl* control = valid_name(name) ? open_control(name, 0) : NULL;
+    if (control == NULL){
+        return 0;
+    }
+    const uint64_t version = atomic_load(&control->current_version);
+    munmap(control, sizeof(RegistryControl));
+    return version;
+}
+
+/**
+ * @brief Builds the private model of an attachment over its read-only data
+ */
+static Model* model_over_shared_weights(const char* name, const unsigned char* data, size_t data_bytes, size_t number_of_layers){
+    // the header comes from another process: nothing is read before it is known to fit in the data
+    if (number_of_layers == 0 || number_of_layers > data_bytes / (sizeof(uint64_t) + sizeof(uint32_t))){
+        fprintf(stderr, "Error in %s: %zu layers do not fit in the %zu bytes of registry '%s'.\n", __func__, number_of_layers, data_bytes, name);
+        return NULL;
+    }
+    uint64_t* widths = malloc(number_of_layers * sizeof(uint64_t));
+    size_t* offsets = malloc(2 * number_of_layers * sizeof(size_t));
+    if (widths == NULL || offsets == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        free(widths);
+        free(offsets);
+        return NULL;
+    }
+    memcpy(widths, data, number_of_layers * sizeof(uint64_t));
+    const uint32_t* kinds = (const uint32_t*)(data + number_of_layers * sizeof(uint64_t));
+    int valid = 1;
+    for (size_t i = 0; i < number_of_layers && valid; i++){
+        // every vector and every matrix fits in the data, so registry_layout cannot overflow
+        valid = widths[i] > 0 && widths[i] <= data_bytes / sizeof(double)
+                && (i + 1 == number_of_layers || widths[i+1] <= data_bytes / sizeof(double) / widths[i]);
+    }
+    size_t* bias_offsets = offsets;
+    size_t* weight_offsets = offsets + number_of_layers;
+    if (!valid || registry_layout(number_of_layers, widths, bias_offsets, weight_offsets) != data_bytes){
+        fprintf(stderr, "Error in %s: the layer widths of registry '%s' do not match its %zu bytes.\n", __func__, name, data_bytes);
+        free(widths);
+        free(offsets);
+        return NULL;
+    }
+
+    Layer* layers = allocator_allocate(NULL, number_of_layers * sizeof(Layer), 0, ALLOCATOR_SUBSYSTEM_MODEL);
+    double*** weights = (number_of_layers > 1) ? calloc(number_of_layers - 1, sizeof(double**)) : NULL;
+    if (layers == NULL || (number_of_layers > 1 && weights == NULL)){
+        allocator_release(NULL, layers, ALLOCATOR_SUBSYSTEM_MODEL);
+        free(weights);
+        free(widths);
+        free(offsets);
+        return NULL;
+    }
+    memset(layers, 0, number_of_layers * sizeof(Layer));
+    int failed = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        activation_function activation = (kinds[i] == ACTIVATION_THRESHOLD) ? myThresholdFunc : mySigmoid;
+        layers[i] = create_layer(widths[i], activation, activation);
+        failed |= layers[i].biases == NULL;
+        if (layers[i].biases != NULL){
+            memcpy(layers[i].biases, data + bias_offsets[i], widths[i] * sizeof(double));
+        }
+        if (i + 1 < number_of_layers){
+            weights[i] = malloc(widths[i] * sizeof(double*));
+            failed |= weights[i] == NULL;
+            for (size_t r = 0; weights[i] != NULL && r < widths[i]; r++){
+                weights[i][r] = (double*)(data + weight_offsets[i]) + r * widths[i+1];
+            }
+        }
+    }
+    Model* model = failed ? NULL : create_model(name, layers, weights);
+    free(widths);
+    free(offsets);
+    if (model == NULL){
+        for (size_t i = 0; i < number_of_layers; i++){
+            free_layer(&layers[i]);
+            if (i + 1 < number_of_layers){
+                free(weights[i]);
+            }
+        }
+        allocator_release(NULL, layers, ALLOCATOR_SUBSYSTEM_MODEL);
+        free(weights);
+        return NULL;
+    }
+    // create_model leaves the number of layers to the caller
+    model->number_of_layers_in_the_model = number_of_layers;
+    free_model_metrics(model->metrics);
+    model->metrics = create_model_metrics(model->model_name, number_of_layers);
+    bind_layer_kernels(model);
+    return model;
+}
+
+/**
+ * @brief Frees the private model of an attachment, leaving the shared weights alone
+ */
+static void free_model_over_shared_weights(Model* model){
+    if (model == NULL){
+        return;
+    }
+    for (size_t i = 0; model->model_weights != NULL && i + 1 < model->number_of_layers_in_the_model; i++){
+        free(model->model_weights[i]);      // the row pointers, the rows are in the shared mapping
+    }
+    free(model->model_weights);
+    model->model_weights = NULL;
+    free_model(model);
+}
+
+/**
+ * @brief Attaches one version, fails if it was unlinked meanwhile
+ * @return int 1 on success, 0 if the version is gone, -1 on another failure
+ */
+static int attach_version(RegistryAttachment* attachment, uint64_t version){
+    char path[REGISTRY_NAME_LENGTH];
+    segment_name(path, sizeof(path), attachment->name, version);
+    const int fd = shm_open(path, O_RDWR, 0600);
+    if (fd < 0){
+        return errno == ENOENT ? 0 : -1;
+    }
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    struct stat status;
+    RegistryVersionHeader* header = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && (size_t)status.st_size > page){
+        header = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (header == MAP_FAILED){
+        close(fd);
+        return 0;           // still being created (no size yet) or unusable, the caller retries
+    }
+    // a reference can only be taken while the version is alive: never from 0
+    int64_t references = atomic_load(&header->references);
+    while (references > 0 && !atomic_compare_exchange_weak(&header->references, &references, references + 1)){
+    }
+    if (references <= 0 || header->magic != REGISTRY_MAGIC || header->version != version
+        || page + header->data_bytes > (size_t)status.st_size){
+        if (references > 0){
+            release_version(header, attachment->name);
+        }
+        munmap(header, page);
+        close(fd);
+        return 0;
+    }
+    const size_t data_bytes = header->data_bytes;
+    const void* data = mmap(NULL, data_bytes, PROT_READ, MAP_SHARED, fd, (off_t)page);
+    close(fd);
+    Model* model = (data == MAP_FAILED) ? NULL : model_over_shared_weights(attachment->name, data, data_bytes, header->number_of_layers);
+    if (model == NULL){
+        if (data != MAP_FAILED){
+            munmap((void*)data, data_bytes);
+        }
+        release_version(header, attachment->name);
+        munmap(header, page);
+        return -1;
+    }
+    attachment->version = version;
+    attachment->header = header;
+    attachment->data = data;
+    attachment->data_bytes = data_bytes;
+    attachment->model = model;
+    return 1;
+}
+
+/**
+ * @brief Attaches the current version of a registry
+ *
+ * @param name(const char*): The registry
+ * @return RegistryAttachment* The attachment (registry_detach), NULL if nothing is published or on failure
+ */
+RegistryAttachment* registry_attach(const char* name){
+    if (!valid_name(name)){
+        fprintf(stderr, "Error in %s: invalid registry name.\n", __func__);
+        return NULL;
+    }
+    RegistryAttachment* attachment = calloc(1, sizeof(RegistryAttachment));
+    if (attachment == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return NULL;
+    }
+    snprintf(attachment->name, sizeof(attachment->name), "%s", name);
+    attachment->control = open_control(name, 0);
+    int attached = 0;
+    for (int attempt = 0; attachment->control != NULL && attempt < REGISTRY_ATTACH_ATTEMPTS && attached == 0; attempt++){
+        const uint64_t version = atomic_load(&attachment->control->current_version);
+        if (version == 0){
+            break;
+        }
+        attached = attach_version(attachment, version);     // 0: replaced and released meanwhile, read the new current version
+    }
+    if (attached != 1){
+        fprintf(stderr, "Error in %s: nothing published in registry '%s' or it cannot be attached.\n", __func__, name);
+        if (attachment->control != NULL){
+            munmap(attachment->control, sizeof(RegistryControl));
+        }
+        free(attachment);
+        return NULL;
+    }
+    return attachment;
+}
+
+/**
+ * @brief Releases the mapping and the reference of the version of an attachment (the attachment struct stays)
+ */
+static void detach_version(RegistryAttachment* attachment){
+    free_model_over_shared_weights(attachment->model);
+    munmap((void*)attachment->data, attachment->data_bytes);
+    release_version(attachment->header, attachment->name);
+    munmap(attachment->header, (size_t)sysconf(_SC_PAGESIZE));
+    attachment->model = NULL;
+    attachment->header = NULL;
+    attachment->data = NULL;
+}
+
+/**
+ * @brief Moves the attachment to the current version if a newer one was published (one atomic load when nothing changed).
+ * attachment->model is replaced: the Outputs of the old model must have been freed
+ *
+ * @return int 1 if the attachment moved, 0 if it already had the current version, -1 if the new version could not be attached
+ */
+int registry_refresh(RegistryAttachment* attachment){
+    if (attachment == NULL){
+        fprintf(stderr, "Error in %s: 'attachment' is NULL.\n", __func__);
+        return -1;
+    }
+    const uint64_t version = atomic_load(&attachment->control->current_version);
+    if (version == 0 || version == attachment->version){
+        return 0;
+    }
+    RegistryAttachment next = *attachment;
+    int attached = 0;
+    for (int attempt = 0; attempt < REGISTRY_ATTACH_ATTEMPTS && attached == 0; attempt++){
+        const uint64_t current = atomic_load(&attachment->control->current_version);
+        if (current == 0 || current == attachment->version){
+            return 0;
+        }
+        attached = attach_version(&next, current);
+    }
+    if (attached != 1){
+        return -1;
+    }
+    detach_version(attachment);
+    *attachment = next;
+    return 1;
+}
+
+/**
+ * @brief Detaches, the version segment goes away with its last reference
+ */
+void registry_detach(RegistryAttachment* attachment){
+    if (attachment == NULL){
+        return;
+    }
+    detach_version(attachment);
+    munmap(attachment->control, sizeof(RegistryControl));
+    free(attachment);
+}
+
+/**
+ * @brief Removes a registry: the current version loses the registry's reference and the control segment is unlinked.
+ * The attached versions stay valid until their last detach
+ * @return ErrorCode
+ */
+ErrorCode registry_unlink(const char* name){
+    RegistryControl* control = valid_name(name) ? open_control(name, 0) : NULL;
+    if (control == NULL){
+        fprintf(stderr, "Error in %s: no registry '%s'.\n", __func__, name ? name : "(null)");
+        return ERROR_INVALID_PARAMETER;
+    }
+    const uint64_t current = atomic_exchange(&control->current_version, 0);
+    if (current != 0){
+        release_replaced_version(name, current);
+    }
+    munmap(control, sizeof(RegistryControl));
+    char path[REGISTRY_NAME_LENGTH];
+    segment_name(path, sizeof(path), name, 0);
+    return shm_unlink(path) == 0 ? NO_ERROR : ERROR_IO;
+}
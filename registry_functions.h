@@ -0,0 +1,88 @@
+#ifndef REGISTRY_FUNCTIONS_H
+#define REGISTRY_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdatomic.h>
+#include "node_functions.h"
+
+/**
+ * @brief A host wide registry of models in POSIX shared memory, so N worker processes share one copy of the weights.
+ * A registry is a small control segment "/<name>" holding the current version. registry_publish copies the weights and biases of
+ * a model into a new segment "/<name>.v<version>" and then installs it as the current version with a compare and swap (never over
+ * a higher version published concurrently): a worker attaching afterwards gets the new version, the ones already attached keep
+ * theirs until they call registry_refresh.
+ * A version segment is reference counted (the registry holds one reference while the version is current, every attachment one):
+ * the last one to drop its reference unlinks it, so the memory of an old version goes away with its last reader.
+ * Workers map the weights PROT_READ, only the reference count page is writable. An attachment is a private Model (layers, biases,
+ * metrics, row pointers) whose weight rows point into the shared mapping: calculate_output works on it, training it is not possible.
+ * Only the sigmoid and threshold activations can be published (a function pointer means nothing in another process).
+ * The reference counts live in the segments, not in the kernel: a worker that dies while attached never drops its reference,
+ * so that version is never unlinked and stays in /dev/shm (as "<name>.v<version>") until it is removed by hand or the host reboots.
+ */
+
+#define REGISTRY_NAME_LENGTH 200
+#define REGISTRY_MAGIC 0x4646524547495354ull     // "FFREGIST"
+#define REGISTRY_DATA_ALIGNMENT 64
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT MODEL REGISTRY -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief The control segment of a registry
+ *
+ * @param current_version(uint64_t): The version given to the new attachments, 0 before the first publish
+ * @param next_version(uint64_t): The last version number handed out by registry_publish
+ */
+typedef struct RegistryControl{
+    uint64_t magic;
+    _Atomic uint64_t current_version;
+    _Atomic uint64_t next_version;
+} RegistryControl;
+
+/**
+ * @brief The first page of a version segment, the only writable one for the workers. The weights follow at the next page boundary
+ *
+ * @param references(int64_t): The registry's while the version is current, plus one per attachment; 0 once the segment is unlinked
+ * @param number_of_layers(uint64_t): Layers of the published model
+ * @param data_bytes(uint64_t): Bytes after the header page: layer widths, activation kinds, biases and weights
+ */
+typedef struct RegistryVersionHeader{
+    uint64_t magic;
+    uint64_t version;
+    _Atomic int64_t references;
+    uint64_t number_of_layers;
+    uint64_t data_bytes;
+} RegistryVersionHeader;
+
+/**
+ * @brief A version of a registry attached by a process
+ *
+ * @param name(char[]): The registry
+ * @param control(RegistryControl*): Its control segment, mapped for registry_refresh
+ * @param version(uint64_t): The version attached
+ * @param header(RegistryVersionHeader*): The writable header page
+ * @param data(const void*): The read-only mapping of the widths, biases and weights
+ * @param model(Model*): The private model over the shared weights, give it to calculate_output
+ */
+typedef struct RegistryAttachment{
+    char name[REGISTRY_NAME_LENGTH];
+    RegistryControl* control;
+    uint64_t version;
+    RegistryVersionHeader* header;
+    const void* data;
+    size_t data_bytes;
+    Model* model;
+} RegistryAttachment;
+
+//                                          FUNCTION PROTOTYPES
+uint64_t registry_publish(const char* name, const Model* model);
+uint64_t registry_current_version(const char* name);
+RegistryAttachment* registry_attach(const char* name);
+int registry_refresh(RegistryAttachment* attachment);
+void registry_detach(RegistryAttachment* attachment);
+ErrorCode registry_unlink(const char* name);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT MODEL REGISTRY -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // REGISTRY_FUNCTIONS_H
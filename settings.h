@@ -19,6 +19,14 @@
     #define DEBUG_PRINT(fmt, ...)
 #endif
 
+/* Compile-time ceiling of the tracing subsystem (trace_functions.h): trace points above this level are removed by the preprocessor.
+   0 = off, 1 = error, 2 = warning, 3 = info, 4 = debug, 5 = verbose (per node events). What is actually recorded is then chosen at runtime with trace_set_level */
+#ifdef DEBUG
+    #define TRACE_COMPILE_LEVEL 5
+#else
+    #define TRACE_COMPILE_LEVEL 3
+#endif
+
 
 #define VERBOSE  FALSE       // This variable will trigger *way more* debug messages if activated 
 #define autoMode TRUE      // This variable is in boolean logic, and is used for the choice between auto training and standard training.
@@ -0,0 +1,233 @@
+#include "settings.h"
+#include "snapshot_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- SNAPSHOTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Copies the current weights and biases of the model into a new snapshot (a single allocation)
+ * @return WeightSnapshot* or NULL on allocation error
+ */
+static WeightSnapshot* copy_model_parameters(const Model* model){
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    size_t number_of_rows = 0, number_of_values = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        number_of_values += nodes;
+        if (i + 1 < number_of_layers){
+            number_of_rows += nodes;
+            number_of_values += nodes * model->model_layers[i+1].number_of_nodes_in_the_layer;
+        }
+    }
+    const size_t pointers_bytes = sizeof(WeightSnapshot) + (number_of_layers - 1) * sizeof(double**)
+                                + number_of_rows * sizeof(double*) + number_of_layers * sizeof(double*);
+    const size_t values_offset = (pointers_bytes + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+    char* block = malloc(values_offset + number_of_values * sizeof(double));
+    if (block == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'block' is NULL.\n", __func__);
+        return NULL;
+    }
+
+    WeightSnapshot* snapshot = (WeightSnapshot*)block;
+    snapshot->version = 0;
+    snapshot->number_of_layers = number_of_layers;
+    snapshot->retire_epoch = 0;
+    snapshot->retired_next = NULL;
+    snapshot->weights = (double***)(snapshot + 1);
+    double** rows = (double**)(snapshot->weights + (number_of_layers - 1));
+    snapshot->biases = rows + number_of_rows;
+    double* values = (double*)(block + values_offset);
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        memcpy(values, model->model_layers[i].biases, nodes * sizeof(double));
+        snapshot->biases[i] = values;
+        values += nodes;
+        if (i + 1 < number_of_layers){
+            const size_t columns = model->model_layers[i+1].number_of_nodes_in_the_layer;
+            snapshot->weights[i] = rows;
+            for (size_t r = 0; r < nodes; r++){
+                memcpy(values, model->model_weights[i][r], columns * sizeof(double));
+                rows[r] = values;
+                values += columns;
+            }
+            rows += nodes;
+        }
+    }
+    return snapshot;
+}
+
+/**
+ * @brief Creates the snapshot domain of a model, with a first snapshot of its current parameters
+ * @return SnapshotDomain* or NULL on error, free it with free_snapshot_domain
+ */
+SnapshotDomain* create_snapshot_domain(Model* model){
+    if (model == NULL || model->model_layers == NULL || model->model_weights == NULL){
+        fprintf(stderr, "Error in %s: 'model' is NULL or not initialized.\n", __func__);
+        return NULL;
+    }
+    const size_t bytes = (sizeof(SnapshotDomain) + SNAPSHOT_CACHE_LINE - 1) / SNAPSHOT_CACHE_LINE * SNAPSHOT_CACHE_LINE;
+    SnapshotDomain* domain = aligned_alloc(SNAPSHOT_CACHE_LINE, bytes);
+    if (domain == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'domain' is NULL.\n", __func__);
+        return NULL;
+    }
+    memset(domain, 0, bytes);
+    WeightSnapshot* first = copy_model_parameters(model);
+    if (first == NULL){
+        free(domain);
+        return NULL;
+    }
+    first->version = 1;
+    domain->model = model;
+    for (size_t r = 0; r < SNAPSHOT_MAX_READERS; r++){
+        atomic_init(&domain->readers[r].epoch, 0);
+        atomic_init(&domain->readers[r].in_use, 0);
+    }
+    atomic_init(&domain->current, first);
+    atomic_init(&domain->global_epoch, 1);
+    pthread_mutex_init(&domain->writer_mutex, NULL);
+    return domain;
+}
+
+/**
+ * @brief Frees every snapshot and the domain, no reader may be inside a read section
+ */
+void free_snapshot_domain(SnapshotDomain* domain){
+    if (domain == NULL){
+        return;
+    }
+    WeightSnapshot* snapshot = domain->retired;
+    while (snapshot != NULL){
+        WeightSnapshot* next = snapshot->retired_next;
+        free(snapshot);
+        snapshot = next;
+    }
+    free(atomic_load(&domain->current));
+    pthread_mutex_destroy(&domain->writer_mutex);
+    free(domain);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- READERS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Claims a reader slot, every serving thread needs its own
+ * @return int The slot, -1 if all SNAPSHOT_MAX_READERS slots are taken
+ */
+int snapshot_register_reader(SnapshotDomain* domain){
+    for (int r = 0; r < SNAPSHOT_MAX_READERS; r++){
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&domain->readers[r].in_use, &expected, 1)){
+            atomic_store(&domain->readers[r].epoch, 0);
+            return r;
+        }
+    }
+    fprintf(stderr, "Error in %s: all the %d reader slots are in use.\n", __func__, SNAPSHOT_MAX_READERS);
+    return -1;
+}
+
+void snapshot_unregister_reader(SnapshotDomain* domain, int reader){
+    atomic_store(&domain->readers[reader].epoch, 0);
+    atomic_store(&domain->readers[reader].in_use, 0);
+}
+
+/**
+ * @brief Enters a read section and returns the current snapshot, valid until snapshot_read_end. Lock-free and wait-free.
+ * The epoch is announced before the snapshot is loaded (both sequentially consistent), so a writer that doesn't see
+ * the announcement has already swapped the pointer and this reader can only load the new snapshot.
+ */
+const WeightSnapshot* snapshot_read_begin(SnapshotDomain* domain, int reader){
+    atomic_store(&domain->readers[reader].epoch, atomic_load(&domain->global_epoch));
+    return atomic_load(&domain->current);
+}
+
+void snapshot_read_end(SnapshotDomain* domain, int reader){
+    atomic_store_explicit(&domain->readers[reader].epoch, 0, memory_order_release);
+}
+
+/**
+ * @brief Forward pass on the current snapshot, inside a read section
+ *
+ * @param domain The snapshot domain of the model
+ * @param reader The slot of the calling thread
+ * @param prompt The input of the model
+ * @return Output, see calculate_output_with_weights
+ */
+Output snapshot_calculate_output(SnapshotDomain* domain, int reader, Prompt* prompt){
+    const WeightSnapshot* snapshot = snapshot_read_begin(domain, reader);
+    Output output = calculate_output_with_weights(prompt, domain->model, snapshot->weights, snapshot->biases);
+    snapshot_read_end(domain, reader);
+    return output;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- WRITER -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* Frees the retired snapshots no reader can still hold, writer_mutex held */
+static size_t reclaim_locked(SnapshotDomain* domain){
+    uint64_t oldest_active = UINT64_MAX;
+    for (size_t r = 0; r < SNAPSHOT_MAX_READERS; r++){
+        const uint64_t epoch = atomic_load(&domain->readers[r].epoch);
+        if (epoch != 0 && epoch < oldest_active){
+            oldest_active = epoch;
+        }
+    }
+    size_t freed = 0;
+    WeightSnapshot** link = &domain->retired;
+    while (*link != NULL){
+        WeightSnapshot* snapshot = *link;
+        // readers that entered at an epoch > retire_epoch loaded the pointer after the swap
+        if (snapshot->retire_epoch < oldest_active){
+            *link = snapshot->retired_next;
+            free(snapshot);
+            freed++;
+        } else {
+            link = &snapshot->retired_next;
+        }
+    }
+    domain->number_of_retired -= freed;
+    return freed;
+}
+
+/**
+ * @brief Publishes the current parameters of the model (model_weights and layer biases) as the new snapshot.
+ * The previous snapshot is retired and freed as soon as its last reader leaves (at this or at a later publish / reclaim).
+ * @return ErrorCode
+ */
+ErrorCode snapshot_publish(SnapshotDomain* domain){
+    if (domain == NULL){
+        fprintf(stderr, "Error in %s: 'domain' is NULL.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    WeightSnapshot* next = copy_model_parameters(domain->model);
+    if (next == NULL){
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    pthread_mutex_lock(&domain->writer_mutex);
+    WeightSnapshot* previous = atomic_load(&domain->current);
+    next->version = previous->version + 1;
+    atomic_store(&domain->current, next);
+    previous->retire_epoch = atomic_fetch_add(&domain->global_epoch, 1);
+    previous->retired_next = domain->retired;
+    domain->retired = previous;
+    domain->number_of_retired++;
+    reclaim_locked(domain);
+    pthread_mutex_unlock(&domain->writer_mutex);
+    TRACE_DEBUG(TRACE_CATEGORY_MODEL, "published snapshot %lu of model '%s'", next->version, domain->model->model_name);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Frees the retired snapshots that no reader holds anymore
+ * @return size_t The number of freed snapshots
+ */
+size_t snapshot_reclaim(SnapshotDomain* domain){
+    if (domain == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&domain->writer_mutex);
+    const size_t freed = reclaim_locked(domain);
+    pthread_mutex_unlock(&domain->writer_mutex);
+    return freed;
+}
@@ -0,0 +1,86 @@
+#ifndef SNAPSHOT_FUNCTIONS_H
+#define SNAPSHOT_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "node_functions.h"
+
+/**
+ * @brief Versioned, immutable weight snapshots (read-copy-update) so a model can be trained and served by the same process.
+ * The trainer keeps updating model->model_weights and the layer biases, which the serving threads never read:
+ * snapshot_publish copies them into a new immutable WeightSnapshot and swaps the current snapshot pointer atomically.
+ * A reader enters a read section (one store of the global epoch in its slot and one atomic load of the current snapshot),
+ * runs its forward pass on the snapshot without any lock, and leaves the section. Old snapshots are reclaimed with
+ * epoch-based reclamation: a retired snapshot is freed once no reader is inside a section that started before it was retired.
+ * Readers never wait for the writer and the writer never waits for readers (it only defers the frees).
+ */
+
+#define SNAPSHOT_MAX_READERS 64
+#define SNAPSHOT_CACHE_LINE 64
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT WEIGHT SNAPSHOT -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief An immutable copy of the parameters of a model, pointers and values live in one allocation
+ *
+ * @param version(unsigned long): 1 for the first snapshot of a domain, incremented by every publish
+ * @param weights(double***): number_of_layers - 1 matrices, same shapes as model->model_weights
+ * @param biases(double**): number_of_layers vectors
+ * @param retire_epoch(uint64_t): Global epoch at which the snapshot was replaced
+ * @param retired_next(WeightSnapshot*): Next snapshot waiting to be reclaimed
+ */
+typedef struct WeightSnapshot{
+    unsigned long version;
+    size_t number_of_layers;
+    double*** weights;
+    double** biases;
+    uint64_t retire_epoch;
+    struct WeightSnapshot* retired_next;
+} WeightSnapshot;
+
+/**
+ * @brief The epoch announced by a reader, 0 while it is outside a read section. One cache line per reader so they don't share lines.
+ */
+typedef struct SnapshotReaderSlot{
+    _Alignas(SNAPSHOT_CACHE_LINE) _Atomic uint64_t epoch;
+    _Atomic int in_use;
+} SnapshotReaderSlot;
+
+/**
+ * @brief The snapshots of a model
+ *
+ * @param model(Model*): The model, gives the topology and the activations and is the source of the published parameters
+ * @param current(WeightSnapshot*): The snapshot given to new readers
+ * @param global_epoch(uint64_t): Incremented every time a snapshot is retired, starts at 1
+ * @param readers(SnapshotReaderSlot[]): The reader slots
+ * @param writer_mutex(pthread_mutex_t): Serializes the writers (publish and reclaim), never taken by the readers
+ * @param retired(WeightSnapshot*): Replaced snapshots that may still be read
+ * @param number_of_retired(size_t): Length of the retired list
+ */
+typedef struct SnapshotDomain{
+    SnapshotReaderSlot readers[SNAPSHOT_MAX_READERS];
+    Model* model;
+    _Atomic(WeightSnapshot*) current;
+    _Atomic uint64_t global_epoch;
+    pthread_mutex_t writer_mutex;
+    WeightSnapshot* retired;
+    size_t number_of_retired;
+} SnapshotDomain;
+
+//                                          FUNCTION PROTOTYPES
+SnapshotDomain* create_snapshot_domain(Model* model);
+void free_snapshot_domain(SnapshotDomain* domain);
+int snapshot_register_reader(SnapshotDomain* domain);
+void snapshot_unregister_reader(SnapshotDomain* domain, int reader);
+const WeightSnapshot* snapshot_read_begin(SnapshotDomain* domain, int reader);
+void snapshot_read_end(SnapshotDomain* domain, int reader);
+Output snapshot_calculate_output(SnapshotDomain* domain, int reader, Prompt* prompt);
+ErrorCode snapshot_publish(SnapshotDomain* domain);
+size_t snapshot_reclaim(SnapshotDomain* domain);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT WEIGHT SNAPSHOT -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // SNAPSHOT_FUNCTIONS_H
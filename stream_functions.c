@@ -0,0 +1,494 @@
+#include "settings.h"
+#include "stream_functions.h"
+#include "kernel_functions.h"
+#include "metrics_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STREAM_ALIGNED(offset) (((offset) + STREAM_FILE_ALIGNMENT - 1) / STREAM_FILE_ALIGNMENT * STREAM_FILE_ALIGNMENT)
+#define STREAM_SLOT_FREE ((size_t)-1)
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- MODEL FILE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Writes zeros until the file position reaches offset
+ */
+static int pad_to(FILE* file, uint64_t* position, uint64_t offset){
+    static const char zeros[256] = {0};
+    while (*position < offset){
+        const size_t chunk = (offset - *position < sizeof(zeros)) ? (size_t)(offset - *position) : sizeof(zeros);
+        if (fwrite(zeros, 1, chunk, file) != chunk){
+            return 0;
+        }
+        *position += chunk;
+    }
+    return 1;
+}
+
+/**
+ * @brief Writes a model in the streamable file format (see stream_functions.h), through a temporary file renamed at the end
+ *
+ * @param model(const Model*): The model, only sigmoid and threshold activations
+ * @param path(const char*): The model file
+ * @return ErrorCode
+ */
+ErrorCode save_streamable_model(const Model* model, const char* path){
+    if (model == NULL || path == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0
+        || (model->number_of_layers_in_the_model > 1 && model->model_weights == NULL)){
+        fprintf(stderr, "Error in %s: NULL model, weights or path.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    for (size_t i = 0; i < number_of_layers; i++){
+        if (model->model_layers[i].activation_kind == ACTIVATION_CUSTOM){
+            fprintf(stderr, "Error in %s: layer %zu has a custom activation, it cannot be saved.\n", __func__, i);
+            return ERROR_UNSUPPORTED;
+        }
+    }
+    StreamFileLayer* entries = calloc(number_of_layers, sizeof(StreamFileLayer));
+    if (entries == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    uint64_t offset = sizeof(StreamFileHeader) + number_of_layers * sizeof(StreamFileLayer);
+    for (size_t i = 0; i < number_of_layers; i++){
+        entries[i].number_of_nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        entries[i].activation_kind = (uint32_t)model->model_layers[i].activation_kind;
+        entries[i].biases_offset = offset;
+        offset += entries[i].number_of_nodes * sizeof(double);
+    }
+    for (size_t i = 1; i < number_of_layers; i++){
+        offset = STREAM_ALIGNED(offset);
+        entries[i].weights_offset = offset;
+        entries[i].weights_bytes = entries[i-1].number_of_nodes * entries[i].number_of_nodes * sizeof(double);
+        offset += entries[i].weights_bytes;
+    }
+    const StreamFileHeader header = { .magic = STREAM_FILE_MAGIC, .version = STREAM_FILE_VERSION, .alignment = STREAM_FILE_ALIGNMENT,
+                                      .number_of_layers = number_of_layers, .file_bytes = STREAM_ALIGNED(offset) };
+
+    char temporary[4096];
+    if (snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(temporary)){
+        fprintf(stderr, "Error in %s: path too long.\n", __func__);
+        free(entries);
+        return ERROR_INVALID_PARAMETER;
+    }
+    FILE* file = fopen(temporary, "wb");
+    if (file == NULL){
+        fprintf(stderr, "Error in %s: cannot write '%s'.\n", __func__, temporary);
+        free(entries);
+        return ERROR_IO;
+    }
+    uint64_t position = sizeof(StreamFileHeader) + number_of_layers * sizeof(StreamFileLayer);
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(entries, sizeof(StreamFileLayer), number_of_layers, file) != number_of_layers;
+    for (size_t i = 0; i < number_of_layers && !failed; i++){
+        failed = fwrite(model->model_layers[i].biases, sizeof(double), entries[i].number_of_nodes, file) != entries[i].number_of_nodes;
+        position += entries[i].number_of_nodes * sizeof(double);
+    }
+    for (size_t i = 1; i < number_of_layers && !failed; i++){
+        failed = !pad_to(file, &position, entries[i].weights_offset);
+        for (size_t r = 0; r < entries[i-1].number_of_nodes && !failed; r++){
+            failed = fwrite(model->model_weights[i-1][r], sizeof(double), entries[i].number_of_nodes, file) != entries[i].number_of_nodes;
+        }
+        position += entries[i].weights_bytes;
+    }
+    failed |= !pad_to(file, &position, header.file_bytes);
+    failed |= fclose(file) != 0;
+    free(entries);
+    if (failed || rename(temporary, path) != 0){
+        fprintf(stderr, "Error in %s: cannot write '%s'.\n", __func__, path);
+        remove(temporary);
+        return ERROR_IO;
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "model '%s' saved for streaming to '%s' (%llu bytes)", model->model_name, path,
+               (unsigned long long)header.file_bytes);
+    return NO_ERROR;
+}
+
+/**
+ * @brief pread of exactly bytes bytes, in chunks of at most STREAM_READ_CHUNK
+ */
+static ErrorCode read_exactly(int fd, void* destination, size_t bytes, uint64_t offset){
+    unsigned char* cursor = destination;
+    while (bytes > 0){
+        const size_t chunk = bytes < STREAM_READ_CHUNK ? bytes : STREAM_READ_CHUNK;
+        const ssize_t got = pread(fd, cursor, chunk, (off_t)offset);
+        if (got < 0 && errno == EINTR){
+            continue;
+        }
+        if (got <= 0){
+            return ERROR_IO;
+        }
+        cursor += got;
+        offset += (uint64_t)got;
+        bytes -= (size_t)got;
+    }
+    return NO_ERROR;
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- I/O THREAD -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A page aligned range of the mapping for the matrix of a layer
+ *
+ * @param inside(int): != 0 for the pages lying entirely inside the matrix (possibly none), 0 for every page the matrix touches.
+ * The file aligns the matrices on STREAM_FILE_ALIGNMENT only: with larger system pages a page is shared with the next matrix
+ */
+static void matrix_pages(const StreamedModel* streamed, size_t layer, int inside, unsigned char** start, size_t* length){
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const uint64_t begin = streamed->entries[layer].weights_offset;
+    const uint64_t end = begin + streamed->entries[layer].weights_bytes;
+    const uint64_t first = inside ? (begin + page - 1) / page * page : begin / page * page;
+    const uint64_t last = inside ? end / page * page : end;
+    *start = (unsigned char*)streamed->mapping + first;
+    *length = (last > first) ? (size_t)(last - first) : 0;
+}
+
+/**
+ * @brief Makes the matrix of a layer resident in a slot: pread into the slot's buffer, or prefetch of the mapped pages
+ */
+static ErrorCode load_matrix(StreamedModel* streamed, size_t layer, int slot){
+    const StreamFileLayer* entry = &streamed->entries[layer];
+    const size_t rows = streamed->entries[layer-1].number_of_nodes;
+    const size_t columns = entry->number_of_nodes;
+    double* base;
+    if (streamed->mode == STREAM_MODE_PREAD){
+        base = streamed->buffers[slot];
+        const ErrorCode error = read_exactly(streamed->fd, base, entry->weights_bytes, entry->weights_offset);
+        if (error != NO_ERROR){
+            return error;
+        }
+    } else {
+        unsigned char* start;
+        size_t length;
+        matrix_pages(streamed, layer, 0, &start, &length);
+        madvise(start, length, MADV_WILLNEED);
+        // the advice starts the reads, touching the pages waits for them here instead of in the computation
+        const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        volatile unsigned char sink = 0;
+        for (size_t o = 0; o < length; o += page){
+            sink ^= ((volatile const unsigned char*)start)[o];
+        }
+        (void)sink;
+        base = (double*)((unsigned char*)streamed->mapping + entry->weights_offset);
+    }
+    for (size_t r = 0; r < rows; r++){
+        streamed->rows[slot][r] = base + r * columns;
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Gives back the pages of a computed layer: the mapped ones and the page cache of the file range
+ */
+static void release_matrix(StreamedModel* streamed, size_t layer){
+    const StreamFileLayer* entry = &streamed->entries[layer];
+    if (streamed->mode == STREAM_MODE_MMAP){
+        unsigned char* start;
+        size_t length;
+        // only the pages of this matrix alone: the ones it shares hold the beginning of the next matrix, maybe prefetched already
+        matrix_pages(streamed, layer, 1, &start, &length);
+        if (length > 0){
+            madvise(start, length, MADV_DONTNEED);
+        }
+    }
+    posix_fadvise(streamed->fd, (off_t)entry->weights_offset, (off_t)entry->weights_bytes, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @brief Loads the matrices of a pass in order, each in slot layer % 2 once the computation has freed it: at most one matrix ahead
+ */
+static void* stream_io_main(void* argument){
+    StreamedModel* streamed = argument;
+    pthread_mutex_lock(&streamed->mutex);
+    for (;;){
+        while (!streamed->stop && streamed->pass_layers == 0){
+            pthread_cond_wait(&streamed->changed, &streamed->mutex);
+        }
+        if (streamed->stop){
+            break;
+        }
+        for (size_t i = 1; i < streamed->pass_layers && !streamed->stop; i++){
+            const int slot = (int)(i % 2);
+            while (!streamed->stop && streamed->slot_layer[slot] != STREAM_SLOT_FREE){
+                pthread_cond_wait(&streamed->changed, &streamed->mutex);
+            }
+            if (streamed->stop){
+                break;
+            }
+            pthread_mutex_unlock(&streamed->mutex);
+            const ErrorCode error = load_matrix(streamed, i, slot);
+            pthread_mutex_lock(&streamed->mutex);
+            if (error != NO_ERROR){
+                streamed->io_error = error;
+            }
+            streamed->bytes_loaded += streamed->entries[i].weights_bytes;
+            streamed->slot_layer[slot] = i;
+            pthread_cond_broadcast(&streamed->changed);
+        }
+        streamed->pass_layers = 0;
+        pthread_cond_broadcast(&streamed->changed);
+    }
+    pthread_mutex_unlock(&streamed->mutex);
+    return NULL;
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STREAMED MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Opens a model file for streamed inference: reads the header and the biases and starts the I/O thread
+ *
+ * @param path(const char*): A file written by save_streamable_model
+ * @param mode(StreamMode): pread into two buffers or prefetch of a mapping
+ * @return StreamedModel* NULL if the file is invalid or on failure
+ */
+StreamedModel* open_streamed_model(const char* path, StreamMode mode){
+    if (path == NULL || (mode != STREAM_MODE_PREAD && mode != STREAM_MODE_MMAP)){
+        fprintf(stderr, "Error in %s: NULL path or invalid mode.\n", __func__);
+        return NULL;
+    }
+    StreamedModel* streamed = calloc(1, sizeof(StreamedModel));
+    if (streamed == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return NULL;
+    }
+    streamed->mode = mode;
+    streamed->fd = open(path, O_RDONLY);
+    StreamFileHeader header;
+    struct stat status;
+    if (streamed->fd < 0 || read_exactly(streamed->fd, &header, sizeof(header), 0) != NO_ERROR || fstat(streamed->fd, &status) != 0
+        || header.magic != STREAM_FILE_MAGIC || header.version != STREAM_FILE_VERSION || header.number_of_layers == 0
+        || header.alignment != STREAM_FILE_ALIGNMENT || (uint64_t)status.st_size != header.file_bytes
+        || header.number_of_layers > (header.file_bytes - sizeof(header)) / sizeof(StreamFileLayer)){
+        fprintf(stderr, "Error in %s: '%s' is not a complete streamable model file.\n", __func__, path);
+        if (streamed->fd >= 0){
+            close(streamed->fd);
+        }
+        free(streamed);
+        return NULL;
+    }
+    const size_t number_of_layers = (size_t)header.number_of_layers;
+    streamed->number_of_layers = number_of_layers;
+    streamed->entries = malloc(number_of_layers * sizeof(StreamFileLayer));
+    streamed->layers = calloc(number_of_layers, sizeof(Layer));
+    int valid = streamed->entries != NULL && streamed->layers != NULL
+                && read_exactly(streamed->fd, streamed->entries, number_of_layers * sizeof(StreamFileLayer), sizeof(header)) == NO_ERROR;
+    for (size_t i = 0; valid && i < number_of_layers; i++){
+        const StreamFileLayer* entry = &streamed->entries[i];
+        // the table comes from the file: every product and every end offset is checked before it is trusted
+        uint64_t biases_bytes = 0, expected_weights = 0;
+        valid = entry->number_of_nodes > 0 && entry->activation_kind <= ACTIVATION_THRESHOLD
+                && !__builtin_mul_overflow(entry->number_of_nodes, (uint64_t)sizeof(double), &biases_bytes)
+                && (i == 0 || !__builtin_mul_overflow(streamed->entries[i-1].number_of_nodes * sizeof(double), entry->number_of_nodes, &expected_weights))
+                && entry->weights_bytes == expected_weights
+                && biases_bytes <= header.file_bytes && entry->biases_offset <= header.file_bytes - biases_bytes
+                && entry->weights_offset % STREAM_FILE_ALIGNMENT == 0
+                && entry->weights_bytes <= header.file_bytes && entry->weights_offset <= header.file_bytes - entry->weights_bytes;
+        if (!valid){
+            break;
+        }
+        activation_function activation = (entry->activation_kind == ACTIVATION_THRESHOLD) ? myThresholdFunc : mySigmoid;
+        streamed->layers[i] = create_layer((size_t)entry->number_of_nodes, activation, activation);
+        valid = streamed->layers[i].biases != NULL
+                && read_exactly(streamed->fd, streamed->layers[i].biases, entry->number_of_nodes * sizeof(double), entry->biases_offset) == NO_ERROR;
+        if (entry->number_of_nodes > streamed->max_width){
+            streamed->max_width = (size_t)entry->number_of_nodes;
+        }
+        if (entry->weights_bytes > streamed->max_weights_bytes){
+            streamed->max_weights_bytes = (size_t)entry->weights_bytes;
+        }
+    }
+    if (!valid){
+        fprintf(stderr, "Error in %s: invalid layer table in '%s' or out of memory.\n", __func__, path);
+        close_streamed_model(streamed);
+        return NULL;
+    }
+    for (int slot = 0; slot < 2; slot++){
+        streamed->slot_layer[slot] = STREAM_SLOT_FREE;
+        streamed->rows[slot] = malloc(streamed->max_width * sizeof(double*));
+        if (mode == STREAM_MODE_PREAD){
+            streamed->buffers[slot] = aligned_alloc(STREAM_FILE_ALIGNMENT, STREAM_ALIGNED(streamed->max_weights_bytes ? streamed->max_weights_bytes : 1));
+        }
+        valid &= streamed->rows[slot] != NULL && (mode != STREAM_MODE_PREAD || streamed->buffers[slot] != NULL);
+    }
+    if (valid && mode == STREAM_MODE_MMAP){
+        streamed->mapping = mmap(NULL, (size_t)header.file_bytes, PROT_READ, MAP_SHARED, streamed->fd, 0);
+        streamed->mapping_bytes = (size_t)header.file_bytes;
+        if (streamed->mapping == MAP_FAILED){
+            streamed->mapping = NULL;
+            valid = 0;
+        } else {
+            madvise(streamed->mapping, streamed->mapping_bytes, MADV_RANDOM);     // the I/O thread decides what is read ahead
+        }
+    }
+    pthread_mutex_init(&streamed->mutex, NULL);
+    pthread_cond_init(&streamed->changed, NULL);
+    if (!valid || pthread_create(&streamed->io_thread, NULL, stream_io_main, streamed) != 0){
+        fprintf(stderr, "Error in %s: cannot set up the buffers, the mapping or the I/O thread of '%s'.\n", __func__, path);
+        pthread_mutex_destroy(&streamed->mutex);
+        pthread_cond_destroy(&streamed->changed);
+        streamed->io_thread = 0;
+        close_streamed_model(streamed);
+        return NULL;
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "streaming '%s' (%zu layers, largest matrix %zu bytes) with %s", path, number_of_layers,
+               streamed->max_weights_bytes, mode == STREAM_MODE_PREAD ? "pread" : "mmap");
+    return streamed;
+}
+
+/**
+ * @brief Forward pass of a batch with the weights streamed from the file: each matrix is loaded once for the whole batch, the next one
+ * is loaded by the I/O thread meanwhile. The outputs are the ones of calculate_output_batch
+ *
+ * @param streamed(StreamedModel*): From open_streamed_model
+ * @param prompts(Prompt*): number_of_prompts prompts, as long as the first layer
+ * @param outputs(double* const*): outputs[b] receives the width of the last layer values of prompt b
+ * @return ErrorCode
+ */
+ErrorCode streamed_calculate_output_batch(StreamedModel* streamed, Prompt* prompts, size_t number_of_prompts, double* const* outputs){
+    if (streamed == NULL || prompts == NULL || outputs == NULL || number_of_prompts == 0){
+        fprintf(stderr, "Error in %s: NULL parameter or empty batch.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    const size_t input_length = streamed->layers[0].number_of_nodes_in_the_layer;
+    for (size_t b = 0; b < number_of_prompts; b++){
+        if (prompts[b].data == NULL || prompts[b].length != input_length){
+            fprintf(stderr, "Error in %s: prompt %zu does not match the input layer (%zu values).\n", __func__, b, input_length);
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+    // two generations of pre-activations and activations per sample, and the row pointers the batched kernel takes
+    const size_t width = streamed->max_width;
+    double* activations = malloc(4 * number_of_prompts * width * sizeof(double));
+    double** pointers = malloc(5 * number_of_prompts * sizeof(double*));
+    if (activations == NULL || pointers == NULL){
+        fprintf(stderr, "Error in %s: out of memory for a batch of %zu prompts.\n", __func__, number_of_prompts);
+        free(activations);
+        free(pointers);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    double** generation[2][2] = {{pointers, pointers + number_of_prompts}, {pointers + 2 * number_of_prompts, pointers + 3 * number_of_prompts}};
+    const double** inputs = (const double**)(pointers + 4 * number_of_prompts);
+    for (size_t b = 0; b < number_of_prompts; b++){
+        for (int g = 0; g < 2; g++){
+            generation[g][0][b] = activations + ((size_t)(2 * g) * number_of_prompts + b) * width;
+            generation[g][1][b] = activations + ((size_t)(2 * g + 1) * number_of_prompts + b) * width;
+        }
+        layer_activation_forward(prompts[b].data, &streamed->layers[0], generation[0][1][b]);
+    }
+
+    pthread_mutex_lock(&streamed->mutex);
+    while (streamed->pass_layers != 0){
+        pthread_cond_wait(&streamed->changed, &streamed->mutex);
+    }
+    streamed->io_error = NO_ERROR;
+    streamed->pass_layers = streamed->number_of_layers;
+    pthread_cond_broadcast(&streamed->changed);
+    pthread_mutex_unlock(&streamed->mutex);
+
+    ErrorCode error = NO_ERROR;
+    for (size_t i = 1; i < streamed->number_of_layers; i++){
+        const int slot = (int)(i % 2);
+        const uint64_t wait_start_ns = metrics_now_ns();
+        pthread_mutex_lock(&streamed->mutex);
+        while (streamed->slot_layer[slot] != i){
+            pthread_cond_wait(&streamed->changed, &streamed->mutex);
+        }
+        if (error == NO_ERROR){
+            error = streamed->io_error;
+        }
+        streamed->io_wait_ns += metrics_now_ns() - wait_start_ns;
+        pthread_mutex_unlock(&streamed->mutex);
+
+        // after an I/O error the rest of the pass is only drained, so the I/O thread ends it
+        if (error == NO_ERROR){
+            const int from = (int)((i - 1) % 2), to = (int)(i % 2);
+            for (size_t b = 0; b < number_of_prompts; b++){
+                inputs[b] = generation[from][1][b];
+            }
+            fused_layer_forward_batch(inputs, number_of_prompts, streamed->layers[i-1].number_of_nodes_in_the_layer, streamed->rows[slot],
+                                      &streamed->layers[i], generation[to][0], generation[to][1]);
+        }
+        release_matrix(streamed, i);
+        pthread_mutex_lock(&streamed->mutex);
+        streamed->slot_layer[slot] = STREAM_SLOT_FREE;
+        pthread_cond_broadcast(&streamed->changed);
+        pthread_mutex_unlock(&streamed->mutex);
+    }
+    if (error == NO_ERROR){
+        const size_t last = streamed->number_of_layers - 1;
+        for (size_t b = 0; b < number_of_prompts; b++){
+            memcpy(outputs[b], generation[last % 2][1][b], streamed->layers[last].number_of_nodes_in_the_layer * sizeof(double));
+        }
+    } else {
+        fprintf(stderr, "Error in %s: the weights could not be read (error %d).\n", __func__, error);
+    }
+    free(activations);
+    free(pointers);
+    return error;
+}
+
+/**
+ * @brief Weight bytes held in memory: the two buffers with pread, the pages of the mapping currently resident with mmap
+ */
+size_t streamed_resident_weight_bytes(const StreamedModel* streamed){
+    if (streamed == NULL){
+        return 0;
+    }
+    if (streamed->mode == STREAM_MODE_PREAD){
+        return 2 * STREAM_ALIGNED(streamed->max_weights_bytes);
+    }
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t pages = (streamed->mapping_bytes + page - 1) / page;
+    unsigned char* resident = malloc(pages ? pages : 1);
+    size_t bytes = 0;
+    if (resident != NULL && mincore(streamed->mapping, streamed->mapping_bytes, resident) == 0){
+        for (size_t p = 0; p < pages; p++){
+            bytes += (resident[p] & 1) ? page : 0;
+        }
+    }
+    free(resident);
+    return bytes;
+}
+
+/**
+ * @brief Stops the I/O thread and releases the buffers, the mapping and the file
+ */
+void close_streamed_model(StreamedModel* streamed){
+    if (streamed == NULL){
+        return;
+    }
+    if (streamed->io_thread != 0){
+        pthread_mutex_lock(&streamed->mutex);
+        streamed->stop = 1;
+        pthread_cond_broadcast(&streamed->changed);
+        pthread_mutex_unlock(&streamed->mutex);
+        pthread_join(streamed->io_thread, NULL);
+        pthread_mutex_destroy(&streamed->mutex);
+        pthread_cond_destroy(&streamed->changed);
+    }
+    for (size_t i = 0; streamed->layers != NULL && i < streamed->number_of_layers; i++){
+        if (streamed->layers[i].biases != NULL){
+            free_layer(&streamed->layers[i]);
+        }
+    }
+    for (int slot = 0; slot < 2; slot++){
+        free(streamed->buffers[slot]);
+        free(streamed->rows[slot]);
+    }
+    if (streamed->mapping != NULL){
+        munmap(streamed->mapping, streamed->mapping_bytes);
+    }
+    if (streamed->fd >= 0){
+        close(streamed->fd);
+    }
+    free(streamed->layers);
+    free(streamed->entries);
+    free(streamed);
+}
@@ -0,0 +1,109 @@
+#ifndef STREAM_FUNCTIONS_H
+#define STREAM_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "node_functions.h"
+
+/**
+ * @brief Out-of-core inference: the weights stay in the model file and are paged in one matrix at a time.
+ * save_streamable_model writes a model as a header page (StreamFileHeader, one StreamFileLayer per layer), the biases, and every weight
+ * matrix (rows back to back) starting on a STREAM_FILE_ALIGNMENT boundary. open_streamed_model keeps only the header and the biases in
+ * memory. streamed_calculate_output_batch computes a batch layer by layer while an I/O thread prepares the next matrix in the other of
+ * two slots, so only two matrices are resident at a time and one read of the weights serves the whole batch:
+ *  - STREAM_MODE_PREAD: the matrix is read with pread into the slot's buffer (2 x the largest matrix of memory),
+ *  - STREAM_MODE_MMAP: the file is mapped, the I/O thread issues madvise(MADV_WILLNEED) on the matrix and touches a byte per page
+ *    so it is resident when the compute reaches it.
+ * Once a layer is computed its pages are released (madvise(MADV_DONTNEED) on the mapping, posix_fadvise(POSIX_FADV_DONTNEED) on
+ * the file), so the page cache does not keep the whole model either. Only the pages lying entirely inside the matrix are dropped:
+ * with system pages larger than STREAM_FILE_ALIGNMENT the last one also holds the start of the next matrix, maybe prefetched already.
+ * A StreamedModel serves one batch at a time. Only the sigmoid and threshold activations can be saved.
+ */
+
+#define STREAM_FILE_MAGIC 0x4d5254534e4e4646ull      // "FFNNSTRM"
+#define STREAM_FILE_VERSION 1
+#define STREAM_FILE_ALIGNMENT 4096
+#define STREAM_READ_CHUNK (8u << 20)                // largest single pread
+
+typedef enum StreamMode{
+    STREAM_MODE_PREAD = 0,
+    STREAM_MODE_MMAP,
+} StreamMode;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT STREAMED MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief The first bytes of a model file, followed by number_of_layers StreamFileLayer
+ *
+ * @param alignment(uint32_t): Alignment of the weight matrices in the file
+ * @param file_bytes(uint64_t): Size of the file, to detect a truncated one
+ */
+typedef struct StreamFileHeader{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t alignment;
+    uint64_t number_of_layers;
+    uint64_t file_bytes;
+} StreamFileHeader;
+
+/**
+ * @brief A layer in the model file
+ *
+ * @param biases_offset(uint64_t): Offset of the number_of_nodes biases
+ * @param weights_offset, weights_bytes(uint64_t): The incoming matrix (previous width x number_of_nodes, row major), 0 for layer 0
+ */
+typedef struct StreamFileLayer{
+    uint64_t number_of_nodes;
+    uint32_t activation_kind;
+    uint32_t reserved;
+    uint64_t biases_offset;
+    uint64_t weights_offset;
+    uint64_t weights_bytes;
+} StreamFileLayer;
+
+/**
+ * @brief A model served from its file
+ *
+ * @param layers(Layer*): The layers with their biases and activations, the only parameters in memory
+ * @param buffers(double*[2]): STREAM_MODE_PREAD: the two slots, max_weights_bytes each
+ * @param rows(double**[2]): Row pointers of the matrix in each slot (into buffers or into mapping)
+ * @param slot_layer(size_t[2]): The layer whose matrix is ready in the slot, SIZE_MAX if the slot is free
+ * @param pass_layers(size_t): Layers of the pass the I/O thread is loading, 0 when idle
+ * @param bytes_loaded(uint64_t): Weight bytes read or prefetched since the model was opened
+ * @param io_wait_ns(uint64_t): Time the computation waited for the I/O thread
+ */
+typedef struct StreamedModel{
+    int fd;
+    StreamMode mode;
+    size_t number_of_layers;
+    StreamFileLayer* entries;
+    Layer* layers;
+    size_t max_width;
+    size_t max_weights_bytes;
+    void* mapping;
+    size_t mapping_bytes;
+    double* buffers[2];
+    double** rows[2];
+    size_t slot_layer[2];
+    pthread_t io_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    size_t pass_layers;
+    int stop;
+    ErrorCode io_error;
+    uint64_t bytes_loaded;
+    uint64_t io_wait_ns;
+} StreamedModel;
+
+//                                          FUNCTION PROTOTYPES
+ErrorCode save_streamable_model(const Model* model, const char* path);
+StreamedModel* open_streamed_model(const char* path, StreamMode mode);
+ErrorCode streamed_calculate_output_batch(StreamedModel* streamed, Prompt* prompts, size_t number_of_prompts, double* const* outputs);
+size_t streamed_resident_weight_bytes(const StreamedModel* streamed);
+void close_streamed_model(StreamedModel* streamed);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT STREAMED MODEL -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // STREAM_FUNCTIONS_H
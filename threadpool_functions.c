@@ -0,0 +1,241 @@
+#define _GNU_SOURCE     // pthread_setaffinity_np
+#include "settings.h"
+#include "threadpool_functions.h"
+#include "numa_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+
+static _Thread_local int current_worker = -1;
+static _Thread_local int current_worker_node = -1;
+
+typedef struct WorkerStart{
+    ThreadPool* pool;
+    int index;
+} WorkerStart;
+
+static void* worker_main(void* argument){
+    WorkerStart start = *(WorkerStart*)argument;
+    free(argument);
+    ThreadPool* pool = start.pool;
+    current_worker = start.index;
+    current_worker_node = pool->worker_nodes[start.index];
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;){
+        while (pool->head == NULL && !pool->stopping){
+            pthread_cond_wait(&pool->task_available, &pool->mutex);
+        }
+        if (pool->head == NULL){
+            break;      // stopping and nothing left
+        }
+        ThreadPoolTask* task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL){
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        task->function(task->argument);
+        free(task);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->unfinished == 0){
+            pthread_cond_broadcast(&pool->all_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/**
+ * @brief Picks the CPU of worker index among the allowed ones: the workers go round robin over the nodes, and over the CPUs of each node.
+ * A node without allowed CPUs (CPU-less, or outside the cpuset of the process) hands the worker to the next node.
+ * @return int The CPU, -1 (and node -1) if no CPU of the topology is allowed
+ */
+static int worker_cpu(const NumaTopology* topology, const cpu_set_t* allowed, int index, int* node){
+    const int rank = index / topology->number_of_nodes;
+    for (int n = 0; n < topology->number_of_nodes; n++){
+        *node = (index + n) % topology->number_of_nodes;
+        int count = 0;
+        for (int cpu = 0; cpu < topology->number_of_cpus; cpu++){
+            count += (topology->node_of_cpu[cpu] == *node && CPU_ISSET(cpu, allowed));
+        }
+        if (count == 0){
+            continue;
+        }
+        int wanted = rank % count;
+        for (int cpu = 0; cpu < topology->number_of_cpus; cpu++){
+            if (topology->node_of_cpu[cpu] == *node && CPU_ISSET(cpu, allowed) && wanted-- == 0){
+                return cpu;
+            }
+        }
+    }
+    *node = -1;
+    return -1;
+}
+
+/**
+ * @brief Starts a pool of worker threads
+ *
+ * @param number_of_threads Number of workers, 0 for one per online CPU
+ * @param pin_workers != 0 to bind every worker to a CPU, spreading them over the NUMA nodes
+ * @return ThreadPool* or NULL on error
+ */
+ThreadPool* create_thread_pool(size_t number_of_threads, int pin_workers){
+    // the CPUs this thread may run on (taskset, container cpuset): workers are only pinned inside them
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const int allowed_known = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0;
+    if (number_of_threads == 0){
+        const long cpus = allowed_known ? CPU_COUNT(&allowed) : sysconf(_SC_NPROCESSORS_ONLN);
+        number_of_threads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'pool' is NULL.\n", __func__);
+        return NULL;
+    }
+    pool->threads = calloc(number_of_threads, sizeof(pthread_t));
+    pool->worker_nodes = malloc(number_of_threads * sizeof(int));
+    pool->worker_cpus = malloc(number_of_threads * sizeof(int));
+    if (pool->threads == NULL || pool->worker_nodes == NULL || pool->worker_cpus == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error.\n", __func__);
+        free(pool->threads);
+        free(pool->worker_nodes);
+        free(pool->worker_cpus);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->task_available, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+
+    const NumaTopology* topology = numa_topology();
+    for (size_t i = 0; i < number_of_threads; i++){
+        int node = -1;
+        int cpu = (pin_workers && allowed_known) ? worker_cpu(topology, &allowed, (int)i, &node) : -1;
+        pool->worker_nodes[i] = (cpu >= 0) ? node : -1;     // an unpinned worker has no node
+        pool->worker_cpus[i] = cpu;
+
+        WorkerStart* start = malloc(sizeof(WorkerStart));
+        if (start == NULL){
+            fprintf(stderr, "Error in %s: memory allocation error for worker %zu.\n", __func__, i);
+            break;
+        }
+        start->pool = pool;
+        start->index = (int)i;
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        if (cpu >= 0){
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_attr_setaffinity_np(&attributes, sizeof(set), &set);
+        }
+        int error = pthread_create(&pool->threads[i], &attributes, worker_main, start);
+        pthread_attr_destroy(&attributes);
+        if (error != 0 && cpu >= 0){
+            // the CPU was refused after all (the cpuset changed): the worker runs unpinned rather than missing
+            TRACE_WARNING(TRACE_CATEGORY_MODEL, "worker %zu could not be pinned to CPU %d, it runs unpinned", i, cpu);
+            pool->worker_nodes[i] = -1;
+            pool->worker_cpus[i] = -1;
+            error = pthread_create(&pool->threads[i], NULL, worker_main, start);
+        }
+        if (error != 0){
+            fprintf(stderr, "Error in %s: pthread_create failed for worker %zu.\n", __func__, i);
+            free(start);
+            break;
+        }
+        pool->number_of_threads = i + 1;
+    }
+    if (pool->number_of_threads == 0){
+        free_thread_pool(pool);
+        return NULL;
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "thread pool started with %zu workers (pinned: %d)", pool->number_of_threads, pin_workers);
+    return pool;
+}
+
+/**
+ * @brief Queues a task, it runs on the first idle worker
+ * @return ErrorCode
+ */
+ErrorCode thread_pool_submit(ThreadPool* pool, thread_pool_task function, void* argument){
+    if (pool == NULL || function == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    ThreadPoolTask* task = malloc(sizeof(ThreadPoolTask));
+    if (task == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'task' is NULL.\n", __func__);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    task->function = function;
+    task->argument = argument;
+    task->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail != NULL){
+        pool->tail->next = task;
+    } else {
+        pool->head = task;
+    }
+    pool->tail = task;
+    pool->unfinished++;
+    pthread_cond_signal(&pool->task_available);
+    pthread_mutex_unlock(&pool->mutex);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Waits until every submitted task has completed
+ */
+void thread_pool_wait(ThreadPool* pool){
+    if (pool == NULL){
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->unfinished > 0){
+        pthread_cond_wait(&pool->all_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Runs the queued tasks to completion, stops the workers and frees the pool
+ */
+void free_thread_pool(ThreadPool* pool){
+    if (pool == NULL){
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->task_available);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 0; i < pool->number_of_threads; i++){
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->all_done);
+    pthread_cond_destroy(&pool->task_available);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool->worker_nodes);
+    free(pool->worker_cpus);
+    free(pool);
+}
+
+/**
+ * @brief Index of the calling worker in its pool, -1 if the caller is not a pool worker
+ */
+int thread_pool_current_worker(void){
+    return current_worker;
+}
+
+/**
+ * @brief NUMA node the calling worker is pinned to, -1 if the caller is not a pinned pool worker
+ */
+int thread_pool_current_node(void){
+    return current_worker_node;
+}
@@ -0,0 +1,60 @@
+#ifndef THREADPOOL_FUNCTIONS_H
+#define THREADPOOL_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <pthread.h>
+#include "node_functions.h"
+
+/**
+ * @brief A fixed size pool of worker threads consuming a FIFO of tasks.
+ * When pinning is requested every worker is bound to one CPU, spreading the workers over the NUMA nodes in turn
+ * (worker i runs on node i % number_of_nodes), so per node data (see numa_functions.h) is read locally.
+ */
+
+typedef void (*thread_pool_task)(void* argument);
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT THREAD POOL -+-+-+-+-+-+-+-+-+-+-+- */
+
+typedef struct ThreadPoolTask{
+    thread_pool_task function;
+    void* argument;
+    struct ThreadPoolTask* next;
+} ThreadPoolTask;
+
+/**
+ * @brief The pool
+ *
+ * @param threads(pthread_t*): The workers
+ * @param number_of_threads(size_t): Number of workers
+ * @param worker_nodes(int*): NUMA node (index in the topology) of every worker, -1 if not pinned
+ * @param worker_cpus(int*): CPU of every worker, -1 if not pinned
+ * @param head, tail(ThreadPoolTask*): The queue of the tasks not started yet
+ * @param unfinished(size_t): Tasks submitted and not completed, thread_pool_wait waits for 0
+ * @param stopping(int): Set by free_thread_pool, the workers exit once the queue is empty
+ */
+typedef struct ThreadPool{
+    pthread_t* threads;
+    size_t number_of_threads;
+    int* worker_nodes;
+    int* worker_cpus;
+    pthread_mutex_t mutex;
+    pthread_cond_t task_available;
+    pthread_cond_t all_done;
+    ThreadPoolTask* head;
+    ThreadPoolTask* tail;
+    size_t unfinished;
+    int stopping;
+} ThreadPool;
+
+//                                          FUNCTION PROTOTYPES
+ThreadPool* create_thread_pool(size_t number_of_threads, int pin_workers);
+ErrorCode thread_pool_submit(ThreadPool* pool, thread_pool_task function, void* argument);
+void thread_pool_wait(ThreadPool* pool);
+void free_thread_pool(ThreadPool* pool);
+int thread_pool_current_worker(void);
+int thread_pool_current_node(void);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT THREAD POOL -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // THREADPOOL_FUNCTIONS_H
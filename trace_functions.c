@@ -0,0 +1,306 @@
+#include "settings.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- RUNTIME FILTER -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* Errors are recorded by default, everything else has to be turned on at runtime */
+_Atomic int trace_runtime_level = TRACE_LEVEL_ERROR;
+_Atomic uint32_t trace_runtime_categories = TRACE_CATEGORY_ALL;
+
+/**
+ * @brief Sets the maximum level that gets recorded (TRACE_LEVEL_OFF disables the recording of every trace point)
+ *
+ * @param level One of the TRACE_LEVEL_* macros, levels above TRACE_COMPILE_LEVEL can't be recorded since they were never compiled
+ */
+void trace_set_level(int level){
+    atomic_store_explicit(&trace_runtime_level, level, memory_order_relaxed);
+}
+
+/**
+ * @brief Sets the categories that get recorded
+ *
+ * @param category_mask a bitwise or of TraceCategory values
+ */
+void trace_set_categories(uint32_t category_mask){
+    atomic_store_explicit(&trace_runtime_categories, category_mask, memory_order_relaxed);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- PER THREAD RING -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Single producer (the owning thread) single consumer (whoever holds trace_dump_mutex) ring of events.
+ * head is only written by the producer, tail only by the consumer, so no locks are needed on either side.
+ * When its thread exits the ring is given back (owned = 0) and the next new thread takes it over, so the number of rings is bounded by
+ * the number of threads alive at the same time and not by the number of threads ever created.
+ */
+typedef struct TraceRing{
+    _Atomic size_t head;            // next slot the owner will write
+    _Atomic size_t tail;            // next slot the consumer will read
+    _Atomic size_t dropped;         // events lost because the ring was full
+    _Atomic int owned;              // != 0 while a live thread records in the ring
+    unsigned int thread_number;     // sequential id of the owning thread, easier to read than a pthread_t
+    struct TraceRing* next;         // rings are linked in trace_rings and never unlinked before trace_shutdown
+    TraceEvent events[TRACE_RING_CAPACITY];
+} TraceRing;
+
+static _Atomic(TraceRing*) trace_rings = NULL;             // lock-free stack of every ring ever created
+static _Atomic unsigned int trace_thread_counter = 0;
+static _Atomic unsigned int trace_generation = 0;          // incremented by trace_shutdown, rings of older generations are gone
+static _Thread_local TraceRing* trace_thread_ring = NULL;
+static _Thread_local unsigned int trace_thread_generation = 0;
+static pthread_key_t trace_ring_key;                        // its destructor gives the ring back when the thread exits
+static pthread_once_t trace_ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t trace_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Destructor of trace_ring_key: the exiting thread gives its ring back, the events it still holds are dumped as usual
+ */
+static void trace_release_thread_ring(void* ring){
+    (void)ring;     // the thread local copy tells whether the ring survived a trace_shutdown
+    if (trace_thread_ring != NULL && trace_thread_generation == atomic_load_explicit(&trace_generation, memory_order_acquire)){
+        atomic_store_explicit(&trace_thread_ring->owned, 0, memory_order_release);
+    }
+    trace_thread_ring = NULL;
+}
+
+static void trace_create_ring_key(void){
+    pthread_key_create(&trace_ring_key, trace_release_thread_ring);
+}
+
+/**
+ * @brief Returns the ring of the calling thread: the first time the thread records something it takes over the ring of an exited
+ * thread, or creates and publishes a new one
+ * @return TraceRing* or NULL if the allocation failed
+ */
+static TraceRing* trace_get_thread_ring(void){
+    const unsigned int generation = atomic_load_explicit(&trace_generation, memory_order_acquire);
+    if (trace_thread_ring != NULL && trace_thread_generation == generation){
+        return trace_thread_ring;
+    }
+    pthread_once(&trace_ring_key_once, trace_create_ring_key);
+    TraceRing* ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+    for (; ring != NULL; ring = ring->next){
+        int expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&ring->owned, &expected, 1, memory_order_acquire, memory_order_relaxed)){
+            break;
+        }
+    }
+    if (ring == NULL){
+        ring = calloc(1, sizeof(TraceRing));
+        if (ring == NULL){
+            return NULL;    // can't even report it without doing I/O on the hot path, the event is simply lost
+        }
+        atomic_init(&ring->owned, 1);
+
+        // Push the ring on the global stack
+        TraceRing* old_head = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+        do {
+            ring->next = old_head;
+        } while (!atomic_compare_exchange_weak_explicit(&trace_rings, &old_head, ring, memory_order_release, memory_order_relaxed));
+    }
+    ring->thread_number = atomic_fetch_add_explicit(&trace_thread_counter, 1, memory_order_relaxed);
+
+    trace_thread_ring = ring;
+    trace_thread_generation = generation;
+    pthread_setspecific(trace_ring_key, ring);
+    return ring;
+}
+
+/**
+ * @brief Records an event in the ring of the calling thread. Use the TRACE_* macros instead of calling this directly,
+ * they take care of the compile-time and runtime filters and fill in file, line and function.
+ * If the ring is full the event is dropped and counted (see trace_dropped_events), the caller is never blocked.
+ */
+void trace_record(int level, TraceCategory category, const char* file, int line, const char* function, const char* fmt, ...){
+    TraceRing* ring = trace_get_thread_ring();
+    if (ring == NULL){
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING_CAPACITY){
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent* event = &ring->events[head & (TRACE_RING_CAPACITY - 1)];
+    event->timestamp_ns = trace_now_ns();
+    event->file = file;
+    event->function = function;
+    event->line = line;
+    event->level = level;
+    event->category = category;
+    event->thread_number = ring->thread_number;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(event->message, TRACE_MESSAGE_LENGTH, fmt, args);
+    va_end(args);
+
+    // Publish the event to the consumer
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- DUMP -+-+-+-+-+-+-+-+-+-+-+- */
+
+static const char* trace_level_name(int level){
+    switch (level){
+        case TRACE_LEVEL_ERROR:   return "ERROR";
+        case TRACE_LEVEL_WARNING: return "WARNING";
+        case TRACE_LEVEL_INFO:    return "INFO";
+        case TRACE_LEVEL_DEBUG:   return "DEBUG";
+        case TRACE_LEVEL_VERBOSE: return "VERBOSE";
+        default:                  return "?";
+    }
+}
+
+static const char* trace_category_name(TraceCategory category){
+    switch (category){
+        case TRACE_CATEGORY_MODEL:     return "model";
+        case TRACE_CATEGORY_LAYER:     return "layer";
+        case TRACE_CATEGORY_MATRIX:    return "matrix";
+        case TRACE_CATEGORY_MEMORY:    return "memory";
+        case TRACE_CATEGORY_INFERENCE: return "inference";
+        default:                       return "other";
+    }
+}
+
+/**
+ * @brief Drains every per thread ring and writes the events to the given stream, one line per event.
+ * Events of the same thread are written in order, events of different threads are grouped by thread (sort by timestamp if you need a global order).
+ * It can be called from any thread, at any moment, concurrently with the threads that are recording.
+ *
+ * @param stream Where to write the events
+ * @return size_t The number of events that were written
+ */
+size_t trace_dump(FILE* stream){
+    if (stream == NULL){
+        fprintf(stderr, "Error in %s: 'stream' is NULL.\n", __func__);
+        return 0;
+    }
+    size_t written = 0;
+
+    pthread_mutex_lock(&trace_dump_mutex);
+    for (TraceRing* ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring != NULL; ring = ring->next){
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++){
+            const TraceEvent* event = &ring->events[tail & (TRACE_RING_CAPACITY - 1)];
+            fprintf(stream, "[%llu.%09llu] [T%u] %-7s %-9s %s:%d %s: %s\n",
+                (unsigned long long)(event->timestamp_ns / 1000000000ull),
+                (unsigned long long)(event->timestamp_ns % 1000000000ull),
+                event->thread_number,
+                trace_level_name(event->level),
+                trace_category_name(event->category),
+                event->file, event->line, event->function, event->message);
+            written++;
+        }
+        // Give the slots back to the producer
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    pthread_mutex_unlock(&trace_dump_mutex);
+
+    fflush(stream);
+    return written;
+}
+
+/**
+ * @brief The number of events that were lost (in every thread) because a ring was full when they were recorded
+ */
+size_t trace_dropped_events(void){
+    size_t dropped = 0;
+    for (TraceRing* ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring != NULL; ring = ring->next){
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- BACKGROUND FLUSHER -+-+-+-+-+-+-+-+-+-+-+- */
+
+static pthread_t trace_flusher_thread;
+static _Atomic int trace_flusher_running = 0;
+static FILE* trace_flusher_stream = NULL;
+static unsigned int trace_flusher_interval_ms = 0;
+
+static void* trace_flusher_loop(void* argument){
+    (void)argument;
+    struct timespec interval;
+    interval.tv_sec = trace_flusher_interval_ms / 1000;
+    interval.tv_nsec = (long)(trace_flusher_interval_ms % 1000) * 1000000L;
+
+    while (atomic_load_explicit(&trace_flusher_running, memory_order_acquire)){
+        nanosleep(&interval, NULL);
+        trace_dump(trace_flusher_stream);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts a background thread that drains the rings into stream every interval_ms milliseconds
+ *
+ * @param stream Where to write the events
+ * @param interval_ms Time between two drains, must be > 0
+ * @return int 0 on success, -1 if the flusher is already running or the parameters/thread creation are invalid
+ */
+int trace_start_flusher(FILE* stream, unsigned int interval_ms){
+    if (stream == NULL || interval_ms == 0){
+        fprintf(stderr, "Error in %s: invalid parameters 'stream = %p', 'interval_ms = %u'.\n", __func__, (void*)stream, interval_ms);
+        return -1;
+    }
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&trace_flusher_running, &expected, 1)){
+        fprintf(stderr, "Error in %s: the flusher is already running.\n", __func__);
+        return -1;
+    }
+    trace_flusher_stream = stream;
+    trace_flusher_interval_ms = interval_ms;
+    if (pthread_create(&trace_flusher_thread, NULL, trace_flusher_loop, NULL) != 0){
+        fprintf(stderr, "Error in %s: pthread_create failed.\n", __func__);
+        atomic_store(&trace_flusher_running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stops the background flusher (if running) and drains the rings one last time
+ */
+void trace_stop_flusher(void){
+    int expected = 1;
+    if (!atomic_compare_exchange_strong(&trace_flusher_running, &expected, 0)){
+        return;
+    }
+    pthread_join(trace_flusher_thread, NULL);
+    trace_dump(trace_flusher_stream);
+}
+
+/**
+ * @brief Stops the flusher and frees every ring.
+ * @attention No other thread may record events while (or after) this runs, it is meant for the end of the program
+ */
+void trace_shutdown(void){
+    trace_stop_flusher();
+    pthread_mutex_lock(&trace_dump_mutex);
+    atomic_fetch_add_explicit(&trace_generation, 1, memory_order_release);    // threads exiting later must not give back a freed ring
+    TraceRing* ring = atomic_exchange(&trace_rings, NULL);
+    while (ring != NULL){
+        TraceRing* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    trace_thread_ring = NULL;
+    pthread_mutex_unlock(&trace_dump_mutex);
+}
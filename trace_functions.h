@@ -0,0 +1,135 @@
+#ifndef TRACE_FUNCTIONS_H
+#define TRACE_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "settings.h"
+
+/**
+ * @brief Structured tracing for the library.
+ * Trace points are compiled in or out with TRACE_COMPILE_LEVEL (see settings.h), so a trace point above that level costs nothing at all.
+ * Trace points that are compiled in are filtered at runtime by level and category with a single relaxed atomic load,
+ * and accepted events are formatted into a per-thread lock-free ring buffer: no I/O ever happens on the calling thread.
+ * The rings are drained to a FILE* either on demand (trace_dump) or periodically by a background flusher thread (trace_start_flusher).
+ */
+
+/*          -+-+-+-+-+-+-+-+-+-+-+- LEVELS AND CATEGORIES -+-+-+-+-+-+-+-+-+-+-+- */
+
+/* The levels are macros (and not an enum) because the preprocessor needs them to remove the trace points */
+#define TRACE_LEVEL_OFF      0
+#define TRACE_LEVEL_ERROR    1
+#define TRACE_LEVEL_WARNING  2
+#define TRACE_LEVEL_INFO     3
+#define TRACE_LEVEL_DEBUG    4
+#define TRACE_LEVEL_VERBOSE  5   // per node / per element events, they will flood the rings if enabled
+
+/**
+ * @brief Categories are bit flags, the runtime filter is a mask of the categories that should be recorded
+ */
+typedef enum TraceCategory{
+    TRACE_CATEGORY_MODEL     = 1u << 0,  // model creation and management
+    TRACE_CATEGORY_LAYER     = 1u << 1,  // layer creation and per layer steps of the forward pass
+    TRACE_CATEGORY_MATRIX    = 1u << 2,  // matrix creation and checks
+    TRACE_CATEGORY_MEMORY    = 1u << 3,  // allocations
+    TRACE_CATEGORY_INFERENCE = 1u << 4,  // calculate_output and the other inference entry points
+    TRACE_CATEGORY_ALL       = 0xFFFFFFFFu,
+} TraceCategory;
+
+/*          -+-+-+-+-+-+-+-+-+-+-+- END LEVELS AND CATEGORIES -+-+-+-+-+-+-+-+-+-+-+- */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT TRACE EVENT -+-+-+-+-+-+-+-+-+-+-+- */
+
+#define TRACE_MESSAGE_LENGTH 96     // Longer messages get truncated
+#define TRACE_RING_CAPACITY  1024   // Events per thread, MUST be a power of two
+
+/**
+ * @brief A single recorded event
+ *
+ * @param timestamp_ns(uint64_t): CLOCK_MONOTONIC time of the event in nanoseconds
+ * @param file(const char*): __FILE__ of the trace point (string literal, never copied)
+ * @param function(const char*): __func__ of the trace point
+ * @param line(int): __LINE__ of the trace point
+ * @param level(int): one of the TRACE_LEVEL_* macros
+ * @param category(TraceCategory): the category of the trace point
+ * @param thread_number(unsigned int): sequential id of the recording thread
+ * @param message(char[]): the already formatted message
+ */
+typedef struct TraceEvent{
+    uint64_t timestamp_ns;
+    const char* file;
+    const char* function;
+    int line;
+    int level;
+    TraceCategory category;
+    unsigned int thread_number;
+    char message[TRACE_MESSAGE_LENGTH];
+} TraceEvent;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- END STRUCT TRACE EVENT -+-+-+-+-+-+-+-+-+-+-+- */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- RUNTIME FILTER -+-+-+-+-+-+-+-+-+-+-+- */
+
+extern _Atomic int trace_runtime_level;
+extern _Atomic uint32_t trace_runtime_categories;
+
+/**
+ * @brief Checks the runtime filter, this is the only cost paid by a compiled in trace point that is not recorded
+ */
+static inline int trace_is_enabled(int level, TraceCategory category){
+    return level <= atomic_load_explicit(&trace_runtime_level, memory_order_relaxed)
+        && (atomic_load_explicit(&trace_runtime_categories, memory_order_relaxed) & (uint32_t)category) != 0;
+}
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END RUNTIME FILTER -+-+-+-+-+-+-+-+-+-+-+- */
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- TRACE POINTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+#define TRACE_POINT(level, category, fmt, ...) \
+    do { \
+        if (trace_is_enabled((level), (category))) \
+            trace_record((level), (category), __FILE__, __LINE__, __func__, fmt, ##__VA_ARGS__); \
+    } while (0)
+
+#if TRACE_COMPILE_LEVEL >= TRACE_LEVEL_ERROR
+    #define TRACE_ERROR(category, fmt, ...)   TRACE_POINT(TRACE_LEVEL_ERROR, category, fmt, ##__VA_ARGS__)
+#else
+    #define TRACE_ERROR(category, fmt, ...)   ((void)0)
+#endif
+#if TRACE_COMPILE_LEVEL >= TRACE_LEVEL_WARNING
+    #define TRACE_WARNING(category, fmt, ...) TRACE_POINT(TRACE_LEVEL_WARNING, category, fmt, ##__VA_ARGS__)
+#else
+    #define TRACE_WARNING(category, fmt, ...) ((void)0)
+#endif
+#if TRACE_COMPILE_LEVEL >= TRACE_LEVEL_INFO
+    #define TRACE_INFO(category, fmt, ...)    TRACE_POINT(TRACE_LEVEL_INFO, category, fmt, ##__VA_ARGS__)
+#else
+    #define TRACE_INFO(category, fmt, ...)    ((void)0)
+#endif
+#if TRACE_COMPILE_LEVEL >= TRACE_LEVEL_DEBUG
+    #define TRACE_DEBUG(category, fmt, ...)   TRACE_POINT(TRACE_LEVEL_DEBUG, category, fmt, ##__VA_ARGS__)
+#else
+    #define TRACE_DEBUG(category, fmt, ...)   ((void)0)
+#endif
+#if TRACE_COMPILE_LEVEL >= TRACE_LEVEL_VERBOSE
+    #define TRACE_VERBOSE(category, fmt, ...) TRACE_POINT(TRACE_LEVEL_VERBOSE, category, fmt, ##__VA_ARGS__)
+#else
+    #define TRACE_VERBOSE(category, fmt, ...) ((void)0)
+#endif
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END TRACE POINTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+//                                          FUNCTION PROTOTYPES
+void trace_set_level(int level);
+void trace_set_categories(uint32_t category_mask);
+void trace_record(int level, TraceCategory category, const char* file, int line, const char* function, const char* fmt, ...)
+    __attribute__((format(printf, 6, 7)));
+size_t trace_dump(FILE* stream);
+size_t trace_dropped_events(void);
+int trace_start_flusher(FILE* stream, unsigned int interval_ms);
+void trace_stop_flusher(void);
+void trace_shutdown(void);
+//                                         END FUNCTION PROTOTYPES
+
+#endif // TRACE_FUNCTIONS_H
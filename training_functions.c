@@ -0,0 +1,267 @@
+#include "settings.h"
+#include "training_functions.h"
+#include "kernel_functions.h"
+#include "metrics_functions.h"
+#include "trace_functions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* -+-+-+-+-+-+-+-+-+-+-+- GRADIENTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Number of trainable parameters of the model (weights and biases), the length of the values of a ModelGradients
+ */
+size_t model_parameter_count(const Model* model){
+    if (model == NULL || model->model_layers == NULL){
+        return 0;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < model->number_of_layers_in_the_model; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        count += nodes;
+        if (i + 1 < model->number_of_layers_in_the_model){
+            count += nodes * model->model_layers[i+1].number_of_nodes_in_the_layer;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Allocates zeroed gradients for the model: a single block holds the pointers and the values
+ * @return ModelGradients* or NULL on error, free it with free_model_gradients
+ */
+ModelGradients* create_model_gradients(const Model* model){
+    if (model == NULL || model->model_layers == NULL || model->number_of_layers_in_the_model == 0){
+        fprintf(stderr, "Error in %s: 'model' is NULL or has no layers.\n", __func__);
+        return NULL;
+    }
+    const size_t number_of_layers = model->number_of_layers_in_the_model;
+    size_t number_of_rows = 0, number_of_values = 0;
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        number_of_values += nodes;
+        if (i + 1 < number_of_layers){
+            number_of_rows += nodes;
+            number_of_values += nodes * model->model_layers[i+1].number_of_nodes_in_the_layer;
+        }
+    }
+    const size_t pointers_bytes = sizeof(ModelGradients) + (number_of_layers - 1) * sizeof(double**)
+                                + number_of_rows * sizeof(double*) + number_of_layers * sizeof(double*);
+    const size_t values_offset = (pointers_bytes + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+    char* block = calloc(1, values_offset + number_of_values * sizeof(double));
+    if (block == NULL){
+        fprintf(stderr, "Error in %s: memory allocation error. 'block' is NULL.\n", __func__);
+        return NULL;
+    }
+
+    ModelGradients* gradients = (ModelGradients*)block;
+    gradients->number_of_layers = number_of_layers;
+    gradients->weights = (double***)(gradients + 1);
+    double** rows = (double**)(gradients->weights + (number_of_layers - 1));
+    gradients->biases = rows + number_of_rows;
+    double* values = (double*)(block + values_offset);
+    for (size_t i = 0; i < number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        gradients->biases[i] = values;
+        values += nodes;
+        if (i + 1 < number_of_layers){
+            const size_t columns = model->model_layers[i+1].number_of_nodes_in_the_layer;
+            gradients->weights[i] = rows;
+            for (size_t r = 0; r < nodes; r++){
+                rows[r] = values;
+                values += columns;
+            }
+            rows += nodes;
+        }
+    }
+    return gradients;
+}
+
+void free_model_gradients(ModelGradients* gradients){
+    free(gradients);
+}
+
+/**
+ * @brief Sets every gradient to 0 (call it after apply_gradients to start a new batch)
+ */
+void zero_model_gradients(ModelGradients* gradients, const Model* model){
+    if (gradients == NULL || model == NULL){
+        return;
+    }
+    for (size_t i = 0; i < gradients->number_of_layers; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        memset(gradients->biases[i], 0, nodes * sizeof(double));
+        if (i + 1 < gradients->number_of_layers){
+            // the rows of a matrix are contiguous in the block
+            memset(gradients->weights[i][0], 0, nodes * model->model_layers[i+1].number_of_nodes_in_the_layer * sizeof(double));
+        }
+    }
+}
+
+/* -+-+-+-+-+-+-+-+-+-+-+- BACKWARD -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Errors of the output layer, dL/dout = output - target, left in its deltas
+ *
+ * @param layer_inputs, layer_outputs(const double*): Pre-activations and activations of the last layer
+ * @return double The sum of the squared errors
+ */
+double output_layer_deltas(Model* model, const double* layer_inputs, const double* layer_outputs, const double* target){
+    const Layer* output_layer = &model->model_layers[model->number_of_layers_in_the_model - 1];
+    double squared_error = 0.0;
+    for (size_t c = 0; c < output_layer->number_of_nodes_in_the_layer; c++){
+        const double error = layer_outputs[c] - target[c];
+        squared_error += error * error;
+        output_layer->deltas[c] = error * activation_derivative(output_layer->activation_kind, output_layer->activation, layer_inputs[c] + output_layer->biases[c], layer_outputs[c]);
+    }
+    return squared_error;
+}
+
+/**
+ * @brief One step of backpropagation: from the deltas of layer (> 0) accumulates the gradients of its biases and of its incoming
+ * matrix, and leaves the errors of the previous layer in its deltas
+ *
+ * @param previous_inputs, previous_outputs(const double*): Pre-activations and activations of layer - 1 in the forward pass
+ */
+void backward_layer(Model* model, size_t layer_index, const double* previous_inputs, const double* previous_outputs, ModelGradients* gradients){
+    const Layer* layer = &model->model_layers[layer_index];
+    const Layer* previous = &model->model_layers[layer_index-1];
+    const size_t columns = layer->number_of_nodes_in_the_layer;
+    const double* delta = layer->deltas;
+    for (size_t c = 0; c < columns; c++){
+        gradients->biases[layer_index][c] += delta[c];
+    }
+    // gradient of weights[r][c] = out_{i-1}[r] * delta[c];  error of node r of the previous layer = sum_c weights[r][c] * delta[c]
+    for (size_t r = 0; r < previous->number_of_nodes_in_the_layer; r++){
+        const double x = previous_outputs[r];
+        const double* w = model->model_weights[layer_index-1][r];
+        double* g = gradients->weights[layer_index-1][r];
+        double error = 0.0;
+        for (size_t c = 0; c < columns; c++){
+            g[c] += x * delta[c];
+            error += w[c] * delta[c];
+        }
+        previous->deltas[r] = error * activation_derivative(previous->activation_kind, previous->activation, previous_inputs[r] + previous->biases[r], x);
+    }
+}
+
+/**
+ * @brief Backpropagates the error of an output and accumulates the gradients. The error of every node is left in layer->deltas.
+ *
+ * @param model The model that produced the output (its weights must not have changed since)
+ * @param output The Output of calculate_output, every layer's inputs and outputs are used
+ * @param target The expected output (last layer width values)
+ * @param gradients Where the gradients are added
+ * @param loss If not NULL receives 0.5 * sum (output - target)^2
+ * @return ErrorCode
+ */
+ErrorCode backward_pass(Model* model, const Output* output, const double* target, ModelGradients* gradients, double* loss){
+    return backward_pass_hooked(model, output, target, gradients, loss, NULL, NULL);
+}
+
+/**
+ * @brief backward_pass calling hook as soon as the gradients of each layer are final, so they can be sent (see distributed_functions.h)
+ * while the earlier layers are still being backpropagated
+ *
+ * @param hook Called once per layer, from the last to the first, NULL for none
+ * @param user_data Given to hook
+ * @return ErrorCode
+ */
+ErrorCode backward_pass_hooked(Model* model, const Output* output, const double* target, ModelGradients* gradients, double* loss,
+                               gradient_ready_hook hook, void* user_data){
+    if (model == NULL || output == NULL || output->is_valid != 1 || target == NULL || gradients == NULL){
+        fprintf(stderr, "Error in %s: NULL or invalid parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (gradients->number_of_layers != model->number_of_layers_in_the_model){
+        fprintf(stderr, "Error in %s: the gradients don't match model '%s'.\n", __func__, model->model_name);
+        return ERROR_INVALID_PARAMETER;
+    }
+    const int metered = metrics_enabled();
+    uint64_t layer_start_ns = metered ? metrics_now_ns() : 0;
+    const size_t last = model->number_of_layers_in_the_model - 1;
+
+    const double squared_error = output_layer_deltas(model, output->layer_inputs[last], output->layer_outputs[last], target);
+    for (size_t i = last; i > 0; i--){
+        const size_t columns = model->model_layers[i].number_of_nodes_in_the_layer;
+        const Layer* previous = &model->model_layers[i-1];
+        backward_layer(model, i, output->layer_inputs[i-1], output->layer_outputs[i-1], gradients);
+        if (hook != NULL){
+            // weights[i-1] is followed by biases[i] in the block
+            hook(i, gradients->weights[i-1][0], previous->number_of_nodes_in_the_layer * columns + columns, user_data);
+        }
+        if (metered){
+            const uint64_t layer_end_ns = metrics_now_ns();
+            metrics_record_layer_backward(model->metrics, i, layer_end_ns - layer_start_ns,
+                (2 * previous->number_of_nodes_in_the_layer * columns + 2 * previous->number_of_nodes_in_the_layer + 2 * columns) * sizeof(double));
+            layer_start_ns = layer_end_ns;
+        }
+    }
+    for (size_t c = 0; c < model->model_layers[0].number_of_nodes_in_the_layer; c++){
+        gradients->biases[0][c] += model->model_layers[0].deltas[c];
+    }
+    if (hook != NULL){
+        hook(0, gradients->biases[0], model->model_layers[0].number_of_nodes_in_the_layer, user_data);
+    }
+
+    if (loss != NULL){
+        *loss = 0.5 * squared_error;
+    }
+    TRACE_DEBUG(TRACE_CATEGORY_LAYER, "backward pass of model '%s', loss %lf", model->model_name, 0.5 * squared_error);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Gradient descent step: parameter -= learning_rate * gradient, then model_weights_changed is called
+ * @return ErrorCode
+ */
+ErrorCode apply_gradients(Model* model, const ModelGradients* gradients, double learning_rate){
+    if (model == NULL || gradients == NULL){
+        fprintf(stderr, "Error in %s: NULL parameter.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    for (size_t i = 0; i < model->number_of_layers_in_the_model; i++){
+        const size_t nodes = model->model_layers[i].number_of_nodes_in_the_layer;
+        for (size_t c = 0; c < nodes; c++){
+            model->model_layers[i].biases[c] -= learning_rate * gradients->biases[i][c];
+        }
+        if (i + 1 < model->number_of_layers_in_the_model){
+            const size_t columns = model->model_layers[i+1].number_of_nodes_in_the_layer;
+            for (size_t r = 0; r < nodes; r++){
+                double* w = model->model_weights[i][r];
+                const double* g = gradients->weights[i][r];
+                for (size_t c = 0; c < columns; c++){
+                    w[c] -= learning_rate * g[c];
+                }
+            }
+        }
+    }
+    model_weights_changed(model);
+    return NO_ERROR;
+}
+
+/**
+ * @brief One stochastic gradient descent step on a single sample: forward, backward, update
+ *
+ * @param model The trained model
+ * @param prompt The input of the sample
+ * @param target The expected output of the sample
+ * @param learning_rate Step size
+ * @param gradients Scratch gradients of the model (zeroed by the step)
+ * @param loss If not NULL receives the loss of the sample before the update
+ * @return ErrorCode
+ */
+ErrorCode train_step(Model* model, Prompt* prompt, const double* target, double learning_rate, ModelGradients* gradients, double* loss){
+    Output output = calculate_output(prompt, model);
+    if (output.is_valid != 1){
+        return ERROR_INVALID_PARAMETER;
+    }
+    zero_model_gradients(gradients, model);
+    ErrorCode error = backward_pass(model, &output, target, gradients, loss);
+    if (error == NO_ERROR){
+        error = apply_gradients(model, gradients, learning_rate);
+    }
+    free_output(&output);
+    return error;
+}
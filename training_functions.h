@@ -0,0 +1,72 @@
+#ifndef TRAINING_FUNCTIONS_H
+#define TRAINING_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include "node_functions.h"
+
+/**
+ * @brief Backpropagation for the feed forward models.
+ * The loss is the squared error 0.5 * sum (output - target)^2. The error of every node is stored in the deltas of its layer,
+ * the gradients are accumulated in a ModelGradients (so a batch is the sum of several backward_pass calls) and applied by apply_gradients.
+ * Derivatives: the sigmoid uses s * (1 - s), the threshold is not differentiable and passes the error straight through,
+ * a custom activation is differentiated numerically.
+ */
+
+#define TRAINING_NUMERICAL_DERIVATIVE_STEP 1e-6
+
+/**
+ * @brief Derivative of an activation, given the activation input (pre-activation + bias) and the activation output.
+ * Shared by the backward passes of the models and of the bundles (see bundle_functions.h).
+ */
+static inline double activation_derivative(ActivationKind kind, activation_function activation, double x, double output){
+    switch (kind){
+        case ACTIVATION_SIGMOID:   return output * (1.0 - output);
+        case ACTIVATION_THRESHOLD: return 1.0;  // straight-through estimator
+        default:{
+            const double h = TRAINING_NUMERICAL_DERIVATIVE_STEP;
+            return (activation(x + h) - activation(x - h)) / (2.0 * h);
+        }
+    }
+}
+
+/**
+ * @brief Called by backward_pass_hooked as soon as the gradients of a layer are final: for layer i > 0 the weights of
+ * its incoming matrix followed by its biases, for layer 0 its biases. values is contiguous (see create_model_gradients),
+ * the layers come from the last to the first, and backward_pass_hooked never touches values again.
+ */
+typedef void (*gradient_ready_hook)(size_t layer, double* values, size_t count, void* user_data);
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT MODEL GRADIENTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Gradients of the loss, same shapes as the parameters of the model
+ *
+ * @param number_of_layers(size_t): Number of layers of the model
+ * @param weights(double***): number_of_layers - 1 matrices, weights[i][r][c] is the gradient of model_weights[i][r][c]
+ * @param biases(double**): number_of_layers vectors, biases[i][c] is the gradient of the bias of node c of layer i
+ * The values are one contiguous array ordered biases[0], weights[0], biases[1], weights[1], ..., biases[L-1]:
+ * it starts at biases[0] and holds model_parameter_count values.
+ */
+typedef struct ModelGradients{
+    size_t number_of_layers;
+    double*** weights;
+    double** biases;
+} ModelGradients;
+
+//                                          FUNCTION PROTOTYPES
+ModelGradients* create_model_gradients(const Model* model);
+void free_model_gradients(ModelGradients* gradients);
+void zero_model_gradients(ModelGradients* gradients, const Model* model);
+size_t model_parameter_count(const Model* model);
+double output_layer_deltas(Model* model, const double* layer_inputs, const double* layer_outputs, const double* target);
+void backward_layer(Model* model, size_t layer_index, const double* previous_inputs, const double* previous_outputs, ModelGradients* gradients);
+ErrorCode backward_pass(Model* model, const Output* output, const double* target, ModelGradients* gradients, double* loss);
+ErrorCode backward_pass_hooked(Model* model, const Output* output, const double* target, ModelGradients* gradients, double* loss,
+                               gradient_ready_hook hook, void* user_data);
+ErrorCode apply_gradients(Model* model, const ModelGradients* gradients, double learning_rate);
+ErrorCode train_step(Model* model, Prompt* prompt, const double* target, double learning_rate, ModelGradients* gradients, double* loss);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT MODEL GRADIENTS -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // TRAINING_FUNCTIONS_H
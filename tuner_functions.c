@@ -0,0 +1,351 @@
+#include "settings.h"
+#include "tuner_functions.h"
+#include "kernel_functions.h"
+#include "metrics_functions.h"
+#include "trace_functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char* const variant_names[KERNEL_VARIANT_COUNT] = { "blocked", "row_stream", "fixed_width" };
+
+static char cpu_model[TUNER_CPU_MODEL_LENGTH];
+static pthread_once_t cpu_model_once = PTHREAD_ONCE_INIT;
+
+static void read_cpu_model(void){
+    snprintf(cpu_model, sizeof(cpu_model), "unknown");
+    FILE* file = fopen("/proc/cpuinfo", "r");
+    if (file == NULL){
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL){
+        if (strncmp(line, "model name", 10) != 0){
+            continue;
+        }
+        const char* value = strchr(line, ':');
+        if (value == NULL){
+            continue;
+        }
+        value++;
+        while (*value == ' '){
+            value++;
+        }
+        snprintf(cpu_model, sizeof(cpu_model), "%s", value);
+        break;
+    }
+    fclose(file);
+    // the name is a field of the cache file: no tab or end of line in it
+    for (char* c = cpu_model; *c != '\0'; c++){
+        if (*c == '\n' || *c == '\r'){
+            *c = '\0';
+            break;
+        }
+        if (*c == '\t'){
+            *c = ' ';
+        }
+    }
+}
+
+/**
+ * @brief The "model name" of the first CPU in /proc/cpuinfo, "unknown" if there is none
+ */
+const char* tuner_cpu_model(void){
+    pthread_once(&cpu_model_once, read_cpu_model);
+    return cpu_model;
+}
+
+/**
+ * @brief The kernel of a variant for a shape
+ * @return layer_kernel_function NULL if the variant does not exist for this shape
+ */
+layer_kernel_function kernel_variant_function(KernelVariant variant, size_t number_of_inputs, size_t number_of_nodes){
+    switch (variant){
+        case KERNEL_VARIANT_BLOCKED:    return fused_layer_forward;
+        case KERNEL_VARIANT_ROW_STREAM: return row_stream_layer_forward;
+        case KERNEL_VARIANT_FIXED_WIDTH:{
+            const layer_kernel_function fixed = select_layer_kernel(number_of_inputs, number_of_nodes);
+            return fixed != fused_layer_forward ? fixed : NULL;
+        }
+        default:                        return NULL;
+    }
+}
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- CACHE -+-+-+-+-+-+-+-+-+-+-+- */
+
+static TuningCache* create_tuning_cache(void){
+    TuningCache* cache = calloc(1, sizeof(TuningCache));
+    if (cache == NULL){
+        return NULL;
+    }
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+static TuningEntry* find_entry(TuningCache* cache, const char* cpu, size_t number_of_inputs, size_t number_of_nodes, ActivationKind kind){
+    for (size_t e = 0; e < cache->number_of_entries; e++){
+        TuningEntry* entry = &cache->entries[e];
+        if (entry->number_of_inputs == number_of_inputs && entry->number_of_nodes == number_of_nodes && entry->activation_kind == kind
+            && strcmp(entry->cpu_model, cpu) == 0){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static ErrorCode add_entry(TuningCache* cache, const TuningEntry* entry){
+    if (cache->number_of_entries == cache->capacity){
+        const size_t capacity = cache->capacity ? 2 * cache->capacity : 16;
+        TuningEntry* entries = realloc(cache->entries, capacity * sizeof(TuningEntry));
+        if (entries == NULL){
+            return ERROR_MALLOC_OUT_OF_MEMORY;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    cache->entries[cache->number_of_entries++] = *entry;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Reads a tuning cache file, a missing file gives an empty cache (the first start of a host)
+ *
+ * @param path(const char*): The file, NULL for an empty cache that is only kept in memory
+ * @return TuningCache* The cache (free_tuning_cache), NULL if out of memory. Malformed lines are skipped
+ */
+TuningCache* load_tuning_cache(const char* path){
+    TuningCache* cache = create_tuning_cache();
+    if (cache == NULL){
+        fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+        return NULL;
+    }
+    FILE* file = path ? fopen(path, "r") : NULL;
+    if (file == NULL){
+        return cache;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL){
+        TuningEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        char* tab = strchr(line, '\t');
+        if (tab == NULL || (size_t)(tab - line) >= TUNER_CPU_MODEL_LENGTH){
+            continue;
+        }
+        memcpy(entry.cpu_model, line, (size_t)(tab - line));
+        int kind, variant;
+        if (sscanf(tab + 1, "%zu\t%zu\t%d\t%d\t%lf", &entry.number_of_inputs, &entry.number_of_nodes, &kind, &variant, &entry.nanoseconds) != 5
+            || variant < 0 || variant >= KERNEL_VARIANT_COUNT || kind < ACTIVATION_SIGMOID || kind > ACTIVATION_CUSTOM){
+            TRACE_WARNING(TRACE_CATEGORY_MODEL, "skipping a malformed line of tuning cache '%s'", path);
+            continue;
+        }
+        entry.activation_kind = (ActivationKind)kind;
+        entry.variant = (KernelVariant)variant;
+        if (find_entry(cache, entry.cpu_model, entry.number_of_inputs, entry.number_of_nodes, entry.activation_kind) == NULL
+            && add_entry(cache, &entry) != NO_ERROR){
+            fprintf(stderr, "Error in %s: out of memory.\n", __func__);
+            break;
+        }
+    }
+    fclose(file);
+    return cache;
+}
+
+/**
+ * @brief Writes the cache (every CPU model) to path through a temporary file renamed over it, so a reader never sees half a file
+ * @return ErrorCode
+ */
+ErrorCode save_tuning_cache(TuningCache* cache, const char* path){
+    if (cache == NULL || path == NULL){
+        fprintf(stderr, "Error in %s: NULL cache or path.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    char temporary[4096];
+    if (snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(temporary)){
+        fprintf(stderr, "Error in %s: path too long.\n", __func__);
+        return ERROR_INVALID_PARAMETER;
+    }
+    FILE* file = fopen(temporary, "w");
+    if (file == NULL){
+        fprintf(stderr, "Error in %s: cannot write '%s'.\n", __func__, temporary);
+        return ERROR_IO;
+    }
+    pthread_mutex_lock(&cache->mutex);
+    int failed = 0;
+    for (size_t e = 0; e < cache->number_of_entries; e++){
+        const TuningEntry* entry = &cache->entries[e];
+        failed |= fprintf(file, "%s\t%zu\t%zu\t%d\t%d\t%.1lf\n", entry->cpu_model, entry->number_of_inputs, entry->number_of_nodes,
+                          (int)entry->activation_kind, (int)entry->variant, entry->nanoseconds) < 0;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    failed |= fclose(file) != 0;
+    if (failed || rename(temporary, path) != 0){
+        fprintf(stderr, "Error in %s: cannot write '%s'.\n", __func__, path);
+        remove(temporary);
+        return ERROR_IO;
+    }
+    pthread_mutex_lock(&cache->mutex);
+    cache->dirty = 0;
+    pthread_mutex_unlock(&cache->mutex);
+    return NO_ERROR;
+}
+
+void free_tuning_cache(TuningCache* cache){
+    if (cache == NULL){
+        return;
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->entries);
+    free(cache);
+}
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END CACHE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief Times a kernel on the scratch layer: calls are repeated until TUNER_MIN_SAMPLE_NS passed, the best of TUNER_SAMPLES averages
+ * @return double Nanoseconds per call
+ */
+static double time_kernel(layer_kernel_function kernel, const double* input, size_t number_of_inputs, double* const* weights,
+                          const Layer* layer, double* pre_activation, double* output){
+    kernel(input, number_of_inputs, weights, layer, pre_activation, output);       // warm up the caches
+    double best = -1.0;
+    for (int sample = 0; sample < TUNER_SAMPLES; sample++){
+        uint64_t calls = 0;
+        const uint64_t start = metrics_now_ns();
+        uint64_t elapsed;
+        do {
+            for (int repeat = 0; repeat < 8; repeat++){
+                kernel(input, number_of_inputs, weights, layer, pre_activation, output);
+            }
+            calls += 8;
+            elapsed = metrics_now_ns() - start;
+        } while (elapsed < TUNER_MIN_SAMPLE_NS);
+        const double per_call = (double)elapsed / (double)calls;
+        if (best < 0 || per_call < best){
+            best = per_call;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Measures every candidate kernel of a shape, fills entry with the fastest
+ */
+static ErrorCode measure_shape(TuningEntry* entry, activation_function activation){
+    const size_t rows = entry->number_of_inputs, columns = entry->number_of_nodes;
+    double* values = malloc((rows + rows * columns + 3 * columns) * sizeof(double));
+    double** weights = malloc(rows * sizeof(double*));
+    if (values == NULL || weights == NULL){
+        free(values);
+        free(weights);
+        return ERROR_MALLOC_OUT_OF_MEMORY;
+    }
+    double* input = values;
+    for (size_t r = 0; r < rows; r++){
+        weights[r] = values + rows + r * columns;
+    }
+    double* biases = values + rows + rows * columns;
+    for (size_t v = 0; v < rows + rows * columns + 3 * columns; v++){
+        values[v] = (double)((v * 2654435761u) % 1000) / 1000.0 - 0.5;
+    }
+    Layer layer;
+    memset(&layer, 0, sizeof(layer));
+    layer.number_of_nodes_in_the_layer = columns;
+    layer.biases = biases;
+    layer.activation_kind = entry->activation_kind;
+    layer.activation = activation;
+
+    entry->nanoseconds = -1.0;
+    for (int variant = 0; variant < KERNEL_VARIANT_COUNT; variant++){
+        const layer_kernel_function kernel = kernel_variant_function((KernelVariant)variant, rows, columns);
+        if (kernel == NULL){
+            continue;
+        }
+        const double nanoseconds = time_kernel(kernel, input, rows, weights, &layer, biases + columns, biases + 2 * columns);
+        TRACE_DEBUG(TRACE_CATEGORY_MODEL, "tuning %zu x %zu: %s %.1lf ns", rows, columns, variant_names[variant], nanoseconds);
+        if (entry->nanoseconds < 0 || nanoseconds < entry->nanoseconds){
+            entry->nanoseconds = nanoseconds;
+            entry->variant = (KernelVariant)variant;
+        }
+    }
+    free(values);
+    free(weights);
+    return NO_ERROR;
+}
+
+/**
+ * @brief The fastest kernel of a shape on this CPU: read from the cache, or measured and added to it
+ *
+ * @param cache(TuningCache*): The cache, NULL to always measure
+ * @param activation(activation_function): Used for the measurement of ACTIVATION_CUSTOM layers
+ * @return KernelVariant The winner, KERNEL_VARIANT_BLOCKED if the shape could not be measured
+ */
+KernelVariant tune_layer_shape(TuningCache* cache, size_t number_of_inputs, size_t number_of_nodes, ActivationKind activation_kind,
+                               activation_function activation){
+    const char* cpu = tuner_cpu_model();
+    if (number_of_inputs == 0 || number_of_nodes == 0 || (activation_kind == ACTIVATION_CUSTOM && activation == NULL)){
+        return KERNEL_VARIANT_BLOCKED;
+    }
+    if (cache != NULL){
+        pthread_mutex_lock(&cache->mutex);
+        const TuningEntry* cached = find_entry(cache, cpu, number_of_inputs, number_of_nodes, activation_kind);
+        if (cached != NULL){
+            const KernelVariant variant = cached->variant;
+            cache->hits++;
+            pthread_mutex_unlock(&cache->mutex);
+            return variant;
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    TuningEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    snprintf(entry.cpu_model, sizeof(entry.cpu_model), "%s", cpu);
+    entry.number_of_inputs = number_of_inputs;
+    entry.number_of_nodes = number_of_nodes;
+    entry.activation_kind = activation_kind;
+    if (measure_shape(&entry, activation) != NO_ERROR){
+        fprintf(stderr, "Error in %s: out of memory, %zu x %zu not tuned.\n", __func__, number_of_inputs, number_of_nodes);
+        return KERNEL_VARIANT_BLOCKED;
+    }
+    if (cache != NULL){
+        pthread_mutex_lock(&cache->mutex);
+        cache->tunings++;
+        // another thread may have tuned the same shape meanwhile, the first result stays
+        if (find_entry(cache, cpu, number_of_inputs, number_of_nodes, activation_kind) == NULL && add_entry(cache, &entry) == NO_ERROR){
+            cache->dirty = 1;
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    TRACE_INFO(TRACE_CATEGORY_MODEL, "tuned %zu x %zu: %s (%.1lf ns)", number_of_inputs, number_of_nodes, variant_names[entry.variant], entry.nanoseconds);
+    return entry.variant;
+}
+
+/**
+ * @brief Binds the fastest kernel of its shape to every layer of the model (the layers of the same shape are tuned once)
+ *
+ * @param model(Model*): The model
+ * @param cache(TuningCache*): Where the choices are looked up and added, NULL for a cache that only lives during the call
+ * @return ErrorCode
+ */
+ErrorCode autotune_model(Model* model, TuningCache* cache){
+    if (model == NULL || model->model_layers == NULL){
+        fprintf(stderr, "Error in %s: NULL model or layers.\n", __func__);
+        return ERROR_NULL_POINTER_AS_PARAMETER;
+    }
+    if (cache == NULL){
+        TuningCache* local = load_tuning_cache(NULL);
+        if (local == NULL){
+            return ERROR_MALLOC_OUT_OF_MEMORY;
+        }
+        const ErrorCode error = autotune_model(model, local);
+        free_tuning_cache(local);
+        return error;
+    }
+    for (size_t i = 1; i < model->number_of_layers_in_the_model; i++){
+        Layer* layer = &model->model_layers[i];
+        const size_t inputs = model->model_layers[i-1].number_of_nodes_in_the_layer;
+        const KernelVariant variant = tune_layer_shape(cache, inputs, layer->number_of_nodes_in_the_layer, layer->activation_kind, layer->activation);
+        layer->kernel = kernel_variant_function(variant, inputs, layer->number_of_nodes_in_the_layer);
+    }
+    return NO_ERROR;
+}
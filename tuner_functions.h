@@ -0,0 +1,81 @@
+#ifndef TUNER_FUNCTIONS_H
+#define TUNER_FUNCTIONS_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "node_functions.h"
+
+/**
+ * @brief Per shape kernel autotuning.
+ * Several forward kernels compute the same layer (kernel_functions.h): the blocked fused kernel, the row streaming one and, for the
+ * square widths of KERNEL_FIXED_WIDTHS, the fixed width ones. Which is fastest depends on the shape and on the CPU, so
+ * autotune_model times every candidate on a scratch layer of each shape of the model and binds the winner to the layer (Layer.kernel,
+ * which calculate_output and compile_plan use). The choices are kept in a TuningCache keyed by CPU model (the "model name" of
+ * /proc/cpuinfo), layer shape and activation, saved as a text file: the next start on the same CPU reads the choice instead of tuning.
+ * A cache file can be shared by different hosts, the entries of the other CPU models are kept untouched.
+ *
+ * File format, one entry per line:   <cpu model>\t<inputs>\t<nodes>\t<activation kind>\t<variant>\t<ns per call>
+ */
+
+#define TUNER_CPU_MODEL_LENGTH 128
+#define TUNER_MIN_SAMPLE_NS 200000      // a candidate is timed over at least this long, best of TUNER_SAMPLES
+#define TUNER_SAMPLES 3
+
+typedef enum KernelVariant{
+    KERNEL_VARIANT_BLOCKED = 0,         // fused_layer_forward
+    KERNEL_VARIANT_ROW_STREAM,          // row_stream_layer_forward
+    KERNEL_VARIANT_FIXED_WIDTH,         // fused_layer_forward_w<W>, square layers of KERNEL_FIXED_WIDTHS only
+    KERNEL_VARIANT_COUNT
+} KernelVariant;
+
+/*                      -+-+-+-+-+-+-+-+-+-+-+- STRUCT TUNING CACHE -+-+-+-+-+-+-+-+-+-+-+- */
+
+/**
+ * @brief A tuned shape
+ *
+ * @param cpu_model(char[]): The CPU the choice was measured on
+ * @param number_of_inputs, number_of_nodes(size_t), activation_kind(ActivationKind): The shape
+ * @param variant(KernelVariant): The fastest kernel
+ * @param nanoseconds(double): Its time per call
+ */
+typedef struct TuningEntry{
+    char cpu_model[TUNER_CPU_MODEL_LENGTH];
+    size_t number_of_inputs;
+    size_t number_of_nodes;
+    ActivationKind activation_kind;
+    KernelVariant variant;
+    double nanoseconds;
+} TuningEntry;
+
+/**
+ * @brief The tuning cache, thread safe
+ *
+ * @param entries(TuningEntry*): number_of_entries entries, all the CPU models
+ * @param hits, tunings(size_t): Shapes read from the cache and shapes measured since it was loaded
+ * @param dirty(int): != 0 if an entry was added since the last load or save
+ */
+typedef struct TuningCache{
+    TuningEntry* entries;
+    size_t number_of_entries;
+    size_t capacity;
+    size_t hits;
+    size_t tunings;
+    int dirty;
+    pthread_mutex_t mutex;
+} TuningCache;
+
+//                                          FUNCTION PROTOTYPES
+const char* tuner_cpu_model(void);
+layer_kernel_function kernel_variant_function(KernelVariant variant, size_t number_of_inputs, size_t number_of_nodes);
+TuningCache* load_tuning_cache(const char* path);
+ErrorCode save_tuning_cache(TuningCache* cache, const char* path);
+KernelVariant tune_layer_shape(TuningCache* cache, size_t number_of_inputs, size_t number_of_nodes, ActivationKind activation_kind,
+                               activation_function activation);
+ErrorCode autotune_model(Model* model, TuningCache* cache);
+void free_tuning_cache(TuningCache* cache);
+//                                         END FUNCTION PROTOTYPES
+
+/*                    -+-+-+-+-+-+-+-+-+-+-+- END STRUCT TUNING CACHE -+-+-+-+-+-+-+-+-+-+-+- */
+
+#endif // TUNER_FUNCTIONS_H